@@ -4,8 +4,91 @@
 #include <argp.h>
 #include <stdbool.h>
 
+#include "attr.h"
+#include "cachemode.h"
+#include "cipher.h"
+#include "cryptpool.h"
+#include "hash.h"
+#include "keystore.h"
+#include "replica.h"
+
+// Keys for long-only options, kept above the printable range used by short options
+enum deffs_option_keys {
+    OPT_FANOUT_DEPTH = 256,
+    OPT_FANOUT_WIDTH,
+    OPT_SEGMENTS,
+    OPT_SEGMENT_SIZE,
+    OPT_GC_RATIO,
+    OPT_GC_RATE,
+    OPT_INLINE_THRESHOLD,
+    OPT_KEY_TARGET,
+    OPT_KEY_SHARES,
+    OPT_KEY_THRESHOLD,
+    OPT_KEY_CACHE,
+    OPT_CRYPTO_WORKERS,
+    OPT_CRYPTO_CHUNK,
+    OPT_BUFFER_CACHE,
+    OPT_STREAM_WINDOW,
+    OPT_SCRUB_RATE,
+    OPT_SCRUB_INTERVAL,
+    OPT_SCRUB_SHARE,
+    OPT_INDEX_THREADS,
+    OPT_RECLAIM_RATE,
+    OPT_CAPACITY_TIER,
+    OPT_TIER_FAST_SIZE,
+    OPT_TIER_COLD_AGE,
+    OPT_TIER_RATE,
+    OPT_REPLICA_TARGET,
+    OPT_DURABILITY,
+    OPT_REPLICA_QUEUE,
+    OPT_LEASE_LISTEN,
+    OPT_LEASE_SERVER,
+    OPT_CACHE_MODE,
+    OPT_HASH_ENGINE,
+    OPT_CIPHER,
+    OPT_ALLOW_PLAINTEXT,
+    OPT_TRACE,
+};
+
 struct arguments {
     char *points[2];
+    int fanout_depth;
+    int fanout_width;
+    int fanout_given;
+    int segments;
+    long segment_size;
+    double gc_ratio;
+    long gc_rate;
+    long inline_threshold;
+    char *key_targets[KEYSTORE_MAX_TARGETS];
+    int n_key_targets;
+    int key_shares;
+    int key_threshold;
+    long key_cache;
+    int crypto_workers;
+    long crypto_chunk;
+    long buffer_cache;
+    long stream_window;
+    long scrub_rate;
+    long scrub_interval;
+    int scrub_share;
+    int index_threads;
+    long reclaim_rate;
+    char *capacity_tier;
+    long tier_fast_size;
+    long tier_cold_age;
+    long tier_rate;
+    char *replica_targets[DEFFS_REPLICA_MAX_TARGETS];
+    int n_replica_targets;
+    int durability;
+    long replica_queue;
+    char *lease_listen;
+    char *lease_server;
+    int cache_mode;
+    int hash_engine;
+    int cipher;
+    int allow_plaintext;
+    char *trace;
 };
 
 error_t parse_opt(int key, char *arg, struct argp_state *state);
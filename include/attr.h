@@ -2,10 +2,32 @@
 #define ATTR_H
 
 #include <fuse.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "deffs.h"
+#include "header.h"
+#include "lease.h"
+#include "metastore.h"
+
+#define INDEX_MAX_THREADS 64
+
+extern int index_threads;
+
+int attr_index(const char path[], struct stat *stbuf);
+int attr_index_fd(const char path[], int fd, uint64_t size);
+int attr_index_new_dir(const char path[]);
+int attr_index_parent(const char path[]);
+int attr_index_dir(const char path[], DIR *dp);
+int attr_complete(const char path[]);
+int attr_forget(const char path[]);
+int attr_move(const char from[], const char to[]);
+void attr_lease(const char path[], int mode);
+void attr_lease_parent(const char path[], int mode);
+int attr_rebuild(void);
 
 int deffs_getattr(const char *path, struct stat *stbuf);
 int deffs_fgetattr(const char *path, struct stat *stbuf,
@@ -0,0 +1,68 @@
+#ifndef BLOCKMAP_H
+#define BLOCKMAP_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crypto.h"
+#include "header.h"
+
+#define DEFFS_BLOCK_SIZE 4096
+
+// The map is a flat binary tree of slots kept in the header file after the inline payload
+// area. Block b is the leaf at slot 2b, and the interior nodes sit in the odd slots between
+#define BLOCKMAP_OFFSET (sizeof(struct deffs_header) + HEADER_INLINE_MAX)
+
+// Never written, reads as zeros and has no ciphertext behind it
+#define BLOCK_HOLE 0
+// Holds ciphertext in the file's shard
+#define BLOCK_DATA 1
+// Reserved by fallocate in the shard but not written yet, reads as zeros
+#define BLOCK_ALLOCATED 2
+// BLOCK_BASE + i holds ciphertext in the header's i-th base shard
+#define BLOCK_BASE 3
+
+// A block's state, nonce and tag, or the hash of an interior node whose state and nonce are
+// unused
+struct blockmap_slot {
+    uint8_t state;
+    unsigned char nonce[FILE_KEY_NONCE_LEN];
+    unsigned char node[FILE_KEY_TAG_LEN];
+};
+
+#define BLOCKMAP_SLOT_LEN sizeof(struct blockmap_slot)
+
+static inline uint64_t block_of(uint64_t offset)
+{
+    return offset / DEFFS_BLOCK_SIZE;
+}
+
+static inline uint64_t blocks_for(uint64_t size)
+{
+    return (size + DEFFS_BLOCK_SIZE - 1) / DEFFS_BLOCK_SIZE;
+}
+
+static inline uint64_t blockmap_node(int level, uint64_t index)
+{
+    // Slot of the index-th node at the given height, leaves being at height 0
+    return (index << (level + 1)) | ((UINT64_C(1) << level) - 1);
+}
+
+int blockmap_read_slots(int fd, uint64_t first_slot, size_t n_slots, struct blockmap_slot slots[]);
+int blockmap_write_slots(int fd, uint64_t first_slot, size_t n_slots,
+                         const struct blockmap_slot slots[]);
+int blockmap_leaves(int fd, uint64_t *n_blocks);
+
+int blockmap_read(int fd, uint64_t first_block, size_t n_blocks, uint8_t states[],
+                  unsigned char (*nonces)[FILE_KEY_NONCE_LEN]);
+int blockmap_set(int fd, uint64_t first_block, uint64_t n_blocks, uint8_t state);
+int blockmap_set_tags(int fd, uint64_t first_block, size_t n_blocks,
+                      unsigned char (*nonces)[FILE_KEY_NONCE_LEN],
+                      unsigned char (*tags)[FILE_KEY_TAG_LEN]);
+int blockmap_truncate(int fd, uint64_t n_blocks);
+int blockmap_remap(int fd, uint64_t n_blocks, const uint8_t remap[256]);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Size classes are powers of two from 4 KiB to 64 MiB, larger requests bypass the pool
+#define BUFPOOL_MIN_SHIFT 12
+#define BUFPOOL_MAX_SHIFT 26
+#define BUFPOOL_N_CLASSES (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+
+// Buffers are page aligned so they can be handed to O_DIRECT or splice as they are
+#define BUFPOOL_ALIGN 4096
+
+// Data moves through buffers of at most this size, bounding the memory of every request
+#define STREAM_WINDOW_MIN (64 * 1024)
+
+extern size_t bufpool_thread_limit;
+extern size_t stream_window_size;
+
+void *bufpool_get(size_t size);
+void bufpool_put(void *buf, size_t size);
+void bufpool_trim(void);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CACHEMODE_H
+#define CACHEMODE_H
+
+#include <string.h>
+#include <sys/ioctl.h>
+
+// Take the mode of the nearest directory above that has one, or the mount's
+#define DEFFS_CACHE_INHERIT 0
+// The kernel drops its pages of a file every time it is opened
+#define DEFFS_CACHE_NONE 1
+// The kernel keeps its pages of a file between opens until the file changes
+#define DEFFS_CACHE_KEEP 2
+// Reads and writes bypass the kernel's page cache. Such files cannot be mapped into memory
+#define DEFFS_CACHE_DIRECT 3
+
+static inline int cache_mode_value(const char name[])
+{
+    // Returns -1 for a name that is not a mode
+    const char *names[] = {"inherit", "none", "keep", "direct"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static inline const char *cache_mode_name(int mode)
+{
+    const char *names[] = {"inherit", "none", "keep", "direct"};
+
+    return mode >= 0 && mode < 4 ? names[mode] : "unknown";
+}
+
+// Set the cache mode of a directory, DEFFS_CACHE_INHERIT to clear it
+#define DEFFS_IOC_SET_CACHE_MODE _IOW('D', 7, int)
+// Read the cache mode that applies to a file or directory
+#define DEFFS_IOC_GET_CACHE_MODE _IOR('D', 8, int)
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <string.h>
+#include <sys/ioctl.h>
+
+// Take the cipher of the nearest directory above that has one, or the mount's
+#define DEFFS_CIPHER_INHERIT 0
+// AES-128 in counter mode, the fastest wherever the CPU has AES instructions
+#define DEFFS_CIPHER_AES 1
+// ChaCha20, which is faster than AES in software on CPUs without them
+#define DEFFS_CIPHER_CHACHA20 2
+// Contents are stored as they are, only authenticated by their block tags
+#define DEFFS_CIPHER_NONE 3
+
+static inline int cipher_value(const char name[])
+{
+    // Returns -1 for a name that is not a cipher
+    const char *names[] = {"inherit", "aes", "chacha20", "none"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static inline const char *cipher_name(int cipher)
+{
+    const char *names[] = {"inherit", "aes", "chacha20", "none"};
+
+    return cipher >= 0 && cipher < 4 ? names[cipher] : "unknown";
+}
+
+// Set the cipher of a directory, DEFFS_CIPHER_INHERIT to clear it
+#define DEFFS_IOC_SET_CIPHER _IOW('D', 9, int)
+// Read the cipher a file is stored under, or that new files in a directory get
+#define DEFFS_IOC_GET_CIPHER _IOR('D', 10, int)
+
+#endif
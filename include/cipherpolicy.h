@@ -0,0 +1,24 @@
+#ifndef CIPHERPOLICY_H
+#define CIPHERPOLICY_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cipher.h"
+#include "deffs.h"
+#include "dirpolicy.h"
+
+// Extended attribute of a storepoint directory that holds the cipher of new files below it
+#define CIPHER_POLICY_XATTR "user.deffs.cipher"
+
+extern int file_cipher;
+extern int cipher_none_allowed;
+
+int cipher_fastest(void);
+
+int cipher_policy_file(const char path[]);
+int cipher_policy_dir(const char path[]);
+int cipher_policy_set(const char path[], int cipher);
+void cipher_policy_forget(void);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef CLONE_H
+#define CLONE_H
+
+#include <limits.h>
+#include <sys/ioctl.h>
+
+// Argument of DEFFS_IOC_CLONE, issued on the open destination file
+struct deffs_clone_args {
+    // Source file, relative to the root of the mount
+    char source[PATH_MAX];
+};
+
+// Make the destination a copy of the source that shares its shards
+#define DEFFS_IOC_CLONE _IOW('D', 1, struct deffs_clone_args)
+
+#endif
@@ -4,11 +4,16 @@
 #include <openssl/evp.h>
 #include <openssl/aes.h>
 #include <openssl/err.h>
-#include <openssl/sha.h>
+#include <openssl/modes.h>
 #include <openssl/rand.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "cipher.h"
+#include "hash.h"
 #include "utils.h"
 
 typedef struct EncryptionData {
@@ -17,11 +22,51 @@ typedef struct EncryptionData {
     unsigned char *ciphertext;
 } EncryptionData;
 
+// File keys are 128 bits of random data
+#define FILE_KEY_LEN 16
+
+// Block tags are HMAC-SHA256 under a key derived from the file key
+#define FILE_KEY_TAG_LEN HASH_LEN
+
+// Tag index of an inline payload, which is never a block index
+#define FILE_KEY_TAG_INLINE UINT64_MAX
+// Tag index sealing the root of a file's block tree
+#define FILE_KEY_TAG_ROOT (UINT64_MAX - 1)
+
+// ChaCha20 takes a 256-bit key, which is derived from the 128-bit file key
+#define FILE_KEY_CHACHA_LEN 32
+
+// Every block is encrypted under a random 96-bit nonce drawn each time it is written
+#define FILE_KEY_NONCE_LEN 12
+
+// A per-file key together with the cipher its file is stored under and its tag key
+typedef struct FileKey {
+    unsigned char key[FILE_KEY_LEN + 1];
+    int cipher;
+    unsigned char chacha_key[FILE_KEY_CHACHA_LEN];
+    struct hash_ctx tag_inner;
+    struct hash_ctx tag_outer;
+} FileKey;
+
 struct EncryptionData *get_ciphertext(char plaintext[]);
 struct EncryptionData *get_plaintext(char ciphertext[], unsigned char key[16]);
 struct EncryptionData *get_ciphertext_with_key(char *plaintext, unsigned char key[16]);
+void free_encryption_data(struct EncryptionData *data);
+
+int generate_file_key(struct FileKey *file_key);
+void expand_file_key(struct FileKey *file_key);
+int file_key_nonces(unsigned char (*nonces)[FILE_KEY_NONCE_LEN], size_t n_nonces);
+int file_key_crypt(const struct FileKey *file_key, const unsigned char *in, unsigned char *out,
+                   size_t len, uint64_t offset, const unsigned char nonce[FILE_KEY_NONCE_LEN]);
+void file_key_tag(const struct FileKey *file_key, uint64_t index,
+                  const unsigned char nonce[FILE_KEY_NONCE_LEN], const unsigned char *data,
+                  size_t len, unsigned char tag[FILE_KEY_TAG_LEN]);
+void file_key_tag_many(const struct FileKey *file_key, uint64_t first_index,
+                       unsigned char (*nonces)[FILE_KEY_NONCE_LEN],
+                       const unsigned char *data, size_t unit_len, size_t n_units,
+                       unsigned char (*tags)[FILE_KEY_TAG_LEN]);
 
 struct EncryptionData *get_encrypted_shards(char *plaintext);
-void get_sha256_hash(char *plaintext, char *obuf);
+void get_sha256_hash(const char *data, size_t len, char *obuf);
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef CRYPTPOOL_H
+#define CRYPTPOOL_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blockmap.h"
+#include "bufpool.h"
+#include "crypto.h"
+
+#define CRYPTO_POOL_MAX_WORKERS 64
+
+extern int crypto_workers;
+extern size_t crypto_chunk_size;
+
+int crypto_pool_start(void);
+void crypto_pool_stop(void);
+
+int crypto_pool_crypt(const struct FileKey *file_key, const char *in, char *out, size_t len,
+                       uint64_t offset, unsigned char (*nonces)[FILE_KEY_NONCE_LEN]);
+void crypto_pool_tag(const struct FileKey *file_key, const char *in, size_t unit_len,
+                     uint64_t first_index, size_t n_units,
+                     unsigned char (*nonces)[FILE_KEY_NONCE_LEN],
+                     unsigned char (*tags)[FILE_KEY_TAG_LEN]);
+
+#endif
@@ -18,7 +18,6 @@ extern char *storepoint;
 extern char *shardpoint;
 
 #define SHARD_FN_LEN 64
-#define SHARD_KEY_LEN 17
 
 struct deffs_dirp {
     DIR *dp;
@@ -32,5 +31,6 @@ static inline struct deffs_dirp *get_dirp(struct fuse_file_info *fi)
 }
 
 void *deffs_init(struct fuse_conn_info *conn);
+void deffs_destroy(void *private_data);
 
 #endif
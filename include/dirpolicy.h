@@ -0,0 +1,49 @@
+#ifndef DIRPOLICY_H
+#define DIRPOLICY_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "deffs.h"
+#include "utils.h"
+
+// Value of a directory without a setting of its own
+#define DIRPOLICY_INHERIT 0
+// Directories whose setting is remembered before the cache starts over
+#define DIRPOLICY_CACHE 4096
+
+struct dirpolicy_entry {
+    char *path;
+    int value;
+};
+
+// A setting a directory holds for everything below it, kept by name in an extended attribute of
+// the directory in the storepoint. Values run from DIRPOLICY_INHERIT to max
+struct dirpolicy {
+    const char *xattr;
+    int max;
+    const char *(*name)(int value);
+    // Returns -1 for a name that is not a value
+    int (*value)(const char name[]);
+    // Applies where no directory up to the root has a setting
+    const int *fallback;
+    // Settings of directories, by path relative to the storepoint
+    pthread_mutex_t lock;
+    struct dirpolicy_entry *cache;
+    size_t count;
+};
+
+#define DIRPOLICY_INIT(xattr, max, name, value, fallback)                                          \
+    {(xattr), (max), (name), (value), (fallback), PTHREAD_MUTEX_INITIALIZER, NULL, 0}
+
+int dirpolicy_file(struct dirpolicy *policy, const char path[]);
+int dirpolicy_dir(struct dirpolicy *policy, const char path[]);
+int dirpolicy_set(struct dirpolicy *policy, const char path[], int value);
+void dirpolicy_forget(struct dirpolicy *policy);
+
+#endif
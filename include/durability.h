@@ -0,0 +1,70 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+// Take the level of the nearest directory above that has one, or the mount's
+#define DEFFS_DURABILITY_INHERIT 0
+// Acknowledge once the shardpoint has the data, replicas catch up in the background
+#define DEFFS_DURABILITY_LOCAL 1
+// Acknowledge once a majority of the shardpoint and the replica targets have the data
+#define DEFFS_DURABILITY_QUORUM 2
+// Acknowledge once every replica target has the data
+#define DEFFS_DURABILITY_ALL 3
+
+#define DEFFS_REPLICA_MAX_TARGETS 8
+
+static inline int durability_level(const char name[])
+{
+    // Returns -1 for a name that is not a level
+    const char *names[] = {"inherit", "local", "quorum", "all"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static inline const char *durability_name(int level)
+{
+    const char *names[] = {"inherit", "local", "quorum", "all"};
+
+    return level >= 0 && level < 4 ? names[level] : "unknown";
+}
+
+// Replication state of one replica target
+struct deffs_replica_target_stats {
+    // Changes waiting for the target, their payload bytes, and how long the oldest has waited
+    uint64_t queued;
+    uint64_t queued_bytes;
+    uint64_t lag_ms;
+    // Changes applied to the target, their payload bytes, and the ones that failed
+    uint64_t applied;
+    uint64_t applied_bytes;
+    uint64_t failed;
+};
+
+// Replication counters, kept since the mount
+struct deffs_replica_stats {
+    uint32_t n_targets;
+    uint32_t durability;
+    // Writes that waited for room in the replication queue, and for how long in total
+    uint64_t stalls;
+    uint64_t stall_ms;
+    // Writes that waited for replicas to acknowledge, and for how long in total
+    uint64_t sync_waits;
+    uint64_t sync_ms;
+    struct deffs_replica_target_stats targets[DEFFS_REPLICA_MAX_TARGETS];
+};
+
+// Set the level of a directory, DEFFS_DURABILITY_INHERIT to clear it
+#define DEFFS_IOC_SET_DURABILITY _IOW('D', 4, int)
+// Read the level that applies to a file or directory
+#define DEFFS_IOC_GET_DURABILITY _IOR('D', 5, int)
+// Read the replication counters, issued on any file or directory in the mount
+#define DEFFS_IOC_REPLICA_STATS _IOR('D', 6, struct deffs_replica_stats)
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// SHA-256 digests and the blocks they are computed over
+#define HASH_LEN 32
+#define HASH_BLOCK_LEN 64
+// Messages the vector engine hashes side by side
+#define HASH_LANES 8
+
+// Hash engines, each a fallback for the ones after it
+#define HASH_ENGINE_AUTO 0
+#define HASH_ENGINE_GENERIC 1
+#define HASH_ENGINE_AVX2 2
+#define HASH_ENGINE_SHA_NI 3
+
+// A message being hashed. It can be copied to hash several messages that share a prefix
+struct hash_ctx {
+    uint32_t state[8];
+    uint64_t len;
+    unsigned char buf[HASH_BLOCK_LEN];
+};
+
+extern int hash_engine;
+
+static inline int hash_engine_value(const char name[])
+{
+    // Returns -1 for a name that is not an engine
+    const char *names[] = {"auto", "generic", "avx2", "sha-ni"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int hash_engine_supported(int engine);
+
+void hash_init(struct hash_ctx *ctx);
+void hash_update(struct hash_ctx *ctx, const void *data, size_t len);
+void hash_final(struct hash_ctx *ctx, unsigned char digest[HASH_LEN]);
+void hash_digest(const void *data, size_t len, unsigned char digest[HASH_LEN]);
+
+void hash_update_many(struct hash_ctx ctxs[], const unsigned char *const data[], size_t len,
+                      size_t n);
+void hash_final_many(struct hash_ctx ctxs[], size_t n, unsigned char (*digests)[HASH_LEN]);
+void hash_digest_many(const unsigned char *data, size_t len, size_t n,
+                      unsigned char (*digests)[HASH_LEN]);
+
+void hash_hex(const unsigned char *bytes, size_t len, char hex[]);
+
+#endif
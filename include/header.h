@@ -0,0 +1,63 @@
+#ifndef HEADER_H
+#define HEADER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "deffs.h"
+
+#define HEADER_MAGIC "DEFH"
+#define HEADER_MAGIC_LEN 4
+
+// The ciphertext follows the header instead of living in a shard
+#define HEADER_FLAG_INLINE 1
+// A snapshot names the same shards, the file moves to a new shard before its next change
+#define HEADER_FLAG_SHARED 2
+// The cipher the file's contents are stored under is kept in the second byte of the flags.
+// Headers written before files could choose have none there and are under AES
+#define HEADER_CIPHER_SHIFT 8
+#define HEADER_CIPHER_MASK (0xffu << HEADER_CIPHER_SHIFT)
+
+#define HEADER_INLINE_MAX 4096
+
+// Older shards of a file whose unchanged blocks are still read from there after snapshots
+#define HEADER_MAX_BASES 4
+
+// Record stored in the header file that mirrors each logical file under the storepoint
+struct deffs_header {
+    char magic[HEADER_MAGIC_LEN];
+    uint32_t flags;
+    uint64_t size;
+    char hash[SHARD_FN_LEN + 1];
+    uint32_t payload_len;
+    uint32_t n_bases;
+    char bases[HEADER_MAX_BASES][SHARD_FN_LEN + 1];
+    // Nonce the inline payload is encrypted under, drawn again whenever it changes
+    unsigned char nonce[FILE_KEY_NONCE_LEN];
+    // Sealed root of the block tree, or the tag of the inline payload
+    unsigned char root[FILE_KEY_TAG_LEN];
+};
+
+extern size_t inline_threshold;
+
+static inline int header_cipher(const struct deffs_header *header)
+{
+    int cipher = (header->flags & HEADER_CIPHER_MASK) >> HEADER_CIPHER_SHIFT;
+
+    return cipher != DEFFS_CIPHER_INHERIT ? cipher : DEFFS_CIPHER_AES;
+}
+
+static inline void header_set_cipher(struct deffs_header *header, int cipher)
+{
+    header->flags = (header->flags & ~HEADER_CIPHER_MASK) | (uint32_t)cipher << HEADER_CIPHER_SHIFT;
+}
+
+ssize_t header_read(int fd, struct deffs_header *header, char *payload);
+int header_write(int fd, struct deffs_header *header, const char *payload);
+int header_read_path(const char path[], struct deffs_header *header, char *payload);
+
+#endif
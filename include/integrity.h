@@ -0,0 +1,25 @@
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+
+#include <errno.h>
+#include <openssl/crypto.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "blockmap.h"
+#include "bufpool.h"
+#include "crypto.h"
+
+void integrity_seal(const struct FileKey *file_key, const unsigned char tree_root[FILE_KEY_TAG_LEN],
+                    unsigned char root[FILE_KEY_TAG_LEN]);
+
+int integrity_rehash(int fd, const struct FileKey *file_key, uint64_t first_block,
+                     uint64_t n_blocks, unsigned char root[FILE_KEY_TAG_LEN]);
+int integrity_verify(int fd, const struct FileKey *file_key, uint64_t first_block, size_t n_blocks,
+                     unsigned char (*tags)[FILE_KEY_TAG_LEN],
+                     const unsigned char root[FILE_KEY_TAG_LEN]);
+int integrity_check_root(int fd, const struct FileKey *file_key,
+                         const unsigned char root[FILE_KEY_TAG_LEN]);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crypto.h"
+#include "deffs.h"
+#include "shamir.h"
+#include "shards.h"
+#include "utils.h"
+
+#define KEYSTORE_MAX_TARGETS 16
+#define KEYSTORE_MAX_SHARES 16
+
+// A 128-bit key does not fit the 61-bit Shamir field, so it is split in 48-bit parts
+#define KEY_SECRET_PARTS 3
+#define KEY_PART_BYTES 6
+
+#define KEY_SHARE_MAGIC 0x4445464b // "DEFK"
+
+// One share of a file key, as stored on a key target
+struct key_share_record {
+    uint32_t magic;
+    uint32_t x;
+    uint64_t y[KEY_SECRET_PARTS];
+};
+
+// Accepts a candidate file key by returning 0, for instance by checking a tag made with it
+typedef int (*keystore_check_fn)(const struct FileKey *file_key, void *ctx);
+
+extern char *key_targets[KEYSTORE_MAX_TARGETS];
+extern int n_key_targets;
+extern int key_shares;
+extern int key_shares_required;
+extern size_t key_cache_capacity;
+
+int keystore_open(void);
+void keystore_close(void);
+
+int keystore_store(const char hash[], const struct FileKey *file_key);
+int keystore_load(const char hash[], struct FileKey *file_key);
+int keystore_remove(const char hash[]);
+int keystore_list(time_t before, shard_list_fn fn, void *ctx);
+int keystore_repair(const char hash[], keystore_check_fn check, void *ctx);
+
+#endif
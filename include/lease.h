@@ -0,0 +1,64 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deffs.h"
+#include "utils.h"
+
+// Lease modes, each allowing everything the ones before it do
+#define LEASE_NONE 0
+#define LEASE_READ 1
+#define LEASE_WRITE 2
+
+// Messages between a mount and the lease manager
+#define LEASE_MSG_ACQUIRE 1
+#define LEASE_MSG_GRANT 2
+#define LEASE_MSG_REVOKE 3
+#define LEASE_MSG_RELEASE 4
+
+// Seconds an operation waits for a lease before going on without caching
+#define LEASE_WAIT 10
+// Seconds a mount has to give back a revoked lease before the manager drops the mount
+#define LEASE_REVOKE_TIMEOUT 5
+// Mounts one manager serves
+#define LEASE_MAX_CLIENTS 64
+// Buckets of the tables of leased paths, a power of two
+#define LEASE_BUCKETS 4096
+
+// Sent ahead of path_len bytes of path
+struct lease_msg {
+    uint8_t type;
+    uint8_t mode;
+    // Network byte order
+    uint16_t path_len;
+};
+
+extern char *lease_server;
+extern char *lease_listen;
+
+int lease_connect(const char address[], int do_listen);
+int lease_send(int fd, int type, int mode, const char path[]);
+int lease_recv(int fd, struct lease_msg *msg, char path[]);
+
+int lease_start(void);
+void lease_stop(void);
+
+int lease_begin(const char path[], int mode);
+int lease_lost(char path[], int *mode);
+void lease_end(void);
+int lease_keep_cache(const char path[]);
+void lease_uncache(const char path[]);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef LEASEMGR_H
+#define LEASEMGR_H
+
+#include <poll.h>
+
+#include "lease.h"
+
+int leasemgr_start(void);
+void leasemgr_stop(void);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef LIBDEFFS_H
+#define LIBDEFFS_H
+
+#include <sys/stat.h>
+
+#include "deffs.h"
+
+// The filesystem's calls, as FUSE makes them on a mount. Paths are relative to the root of the
+// filesystem, and calls come from one thread at a time as on a mount served with -s
+extern struct fuse_operations deffs_oper;
+
+void libdeffs_set_store(char *store);
+
+// Opens the store set with libdeffs_set_store and starts the background threads, as FUSE's
+// init does for a mount. Returns a negative errno, with nothing left running, if it cannot
+int libdeffs_start(void);
+int libdeffs_running(void);
+
+int libdeffs_open(char *store);
+void libdeffs_close(void);
+
+#endif
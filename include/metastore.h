@@ -0,0 +1,46 @@
+#ifndef METASTORE_H
+#define METASTORE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "deffs.h"
+#include "utils.h"
+
+// Every child of this directory is indexed, so a name missing from it does not exist
+#define METASTORE_COMPLETE 1
+// A regular file with more than one name, whose size has to come from its header record
+#define METASTORE_LINKED 2
+
+// Longest name of the directory under the shardpoint that holds the store
+#define METASTORE_NAME_MAX 32
+
+extern char metastore_name[METASTORE_NAME_MAX];
+
+// Called for each child of a directory, in name order. A nonzero return stops the listing
+typedef int (*metastore_list_fn)(const char name[], const struct stat *st, uint32_t flags,
+                                 void *ctx);
+
+int metastore_open(void);
+void metastore_close(void);
+
+void metastore_load_begin(void);
+int metastore_load_end(void);
+
+int metastore_get(const char path[], struct stat *st, uint32_t *flags);
+int metastore_put(const char path[], const struct stat *st, uint32_t flags);
+int metastore_remove(const char path[]);
+int metastore_move(const char from[], const char to[]);
+int metastore_list(const char dir[], metastore_list_fn fn, void *ctx);
+
+#endif
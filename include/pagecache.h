@@ -0,0 +1,31 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "cachemode.h"
+#include "deffs.h"
+#include "dirpolicy.h"
+#include "lease.h"
+#include "utils.h"
+
+// Extended attribute of a storepoint directory that holds its cache mode
+#define PAGECACHE_MODE_XATTR "user.deffs.cache"
+// Files whose state at their last open is remembered before the table starts over
+#define PAGECACHE_STAMPS 16384
+
+extern int cache_mode;
+
+int pagecache_mode(const char path[]);
+int pagecache_dir_mode(const char path[]);
+int pagecache_set_mode(const char path[], int mode);
+void pagecache_forget_modes(void);
+
+void pagecache_open(const char path[], int fd, struct fuse_file_info *fi);
+
+#endif
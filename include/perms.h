@@ -3,6 +3,8 @@
 
 #include "utils.h"
 #include "deffs.h"
+#include "attr.h"
+#include "snapshot.h"
 
 int deffs_access(const char *path, int mask);
 
@@ -0,0 +1,37 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "attr.h"
+#include "deffs.h"
+#include "header.h"
+#include "keystore.h"
+#include "lease.h"
+#include "metastore.h"
+#include "scrub.h"
+#include "shards.h"
+#include "snapshot.h"
+
+// Shards released while holding the filesystem once
+#define RECLAIM_BATCH 64
+// Times a sweep is tried before it is left to the next crash
+#define RECLAIM_SWEEP_ATTEMPTS 10
+
+extern long reclaim_rate;
+
+int reclaim_start(int sweep);
+void reclaim_stop(void);
+
+int reclaim_queue(const struct deffs_header *header);
+void reclaim_note_move(void);
+
+#endif
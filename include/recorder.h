@@ -0,0 +1,26 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deffs.h"
+#include "trace.h"
+
+// Trace records gathered before they are written out
+#define RECORDER_BUFFER (1024 * 1024)
+
+extern char *trace_path;
+
+int recorder_start(struct fuse_operations *ops);
+void recorder_stop(void);
+
+#endif
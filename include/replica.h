@@ -0,0 +1,50 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deffs.h"
+#include "dirpolicy.h"
+#include "durability.h"
+#include "utils.h"
+
+// Extended attribute of a storepoint directory that holds its durability level
+#define REPLICA_LEVEL_XATTR "user.deffs.durability"
+
+extern char *replica_targets[DEFFS_REPLICA_MAX_TARGETS];
+extern int n_replica_targets;
+extern int replica_durability;
+extern long replica_queue_size;
+
+int replica_start(void);
+void replica_stop(void);
+
+void replica_write(const char hash[], const char *buf, size_t size);
+void replica_pwrite(const char hash[], const char *buf, size_t size, off_t offset);
+void replica_truncate(const char hash[], off_t size);
+void replica_allocate(const char hash[], off_t offset, off_t len);
+void replica_punch(const char hash[], off_t offset, off_t len);
+void replica_unlink(const char hash[]);
+ssize_t replica_read(const char hash[], char *buf, size_t size, off_t offset);
+
+uint64_t replica_mark(void);
+int replica_wait(uint64_t mark, const char path[]);
+
+int replica_level(const char path[]);
+int replica_dir_level(const char path[]);
+int replica_set_level(const char path[], int level);
+void replica_forget_levels(void);
+
+void replica_stats(struct deffs_replica_stats *out);
+
+#endif
@@ -5,10 +5,36 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
 
 #include "utils.h"
 #include "deffs.h"
+#include "attr.h"
+#include "blockmap.h"
+#include "clone.h"
+#include "bufpool.h"
+#include "cipherpolicy.h"
 #include "crypto.h"
+#include "cryptpool.h"
+#include "header.h"
+#include "integrity.h"
+#include "keystore.h"
+#include "pagecache.h"
+#include "reclaim.h"
+#include "replica.h"
+#include "scrub.h"
+#include "shards.h"
+#include "snapshot.h"
+#include "tier.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
 
 int deffs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 int deffs_open(const char *path, struct fuse_file_info *fi);
@@ -40,6 +66,12 @@ int deffs_truncate(const char *path, off_t size);
 int deffs_ftruncate(const char *path, off_t size,
             struct fuse_file_info *fi);
 
+int deffs_fallocate(const char *path, int mode, off_t offset, off_t length,
+            struct fuse_file_info *fi);
+
+int deffs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+            unsigned int flags, void *data);
+
 int deffs_utimens(const char *path, const struct timespec ts[2]);
 
 int deffs_release(const char *path, struct fuse_file_info *fi);
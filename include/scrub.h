@@ -0,0 +1,39 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "attr.h"
+#include "blockmap.h"
+#include "bufpool.h"
+#include "crypto.h"
+#include "deffs.h"
+#include "header.h"
+#include "integrity.h"
+#include "keystore.h"
+#include "scrubstat.h"
+#include "shards.h"
+
+extern long scrub_rate;
+extern long scrub_interval;
+extern int scrub_share;
+
+int scrub_start(void);
+void scrub_stop(void);
+
+void scrub_pause(void);
+void scrub_resume(void);
+
+void scrub_stats(struct deffs_scrub_stats *stats);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SCRUBSTAT_H
+#define SCRUBSTAT_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Progress and repair counters of the background scrubber, kept since the mount
+struct deffs_scrub_stats {
+    // Passes over the whole storepoint that have finished
+    uint64_t passes;
+    // Files and ciphertext bytes checked so far in the running pass
+    uint64_t files;
+    uint64_t bytes;
+    // Files and ciphertext bytes checked by the last finished pass
+    uint64_t last_files;
+    uint64_t last_bytes;
+    // Blocks whose ciphertext did not match the tree, and shards that could not be found
+    uint64_t corrupt_blocks;
+    uint64_t missing_shards;
+    // Key shares rewritten, and keys that no set of shares could rebuild
+    uint64_t repaired_shares;
+    uint64_t unrecoverable_keys;
+};
+
+// Read the scrubber's counters, issued on any file or directory in the mount
+#define DEFFS_IOC_SCRUB_STATS _IOR('D', 2, struct deffs_scrub_stats)
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "deffs.h"
+#include "utils.h"
+
+#define SEGMENT_MAGIC 0x44454653 // "DEFS"
+
+#define SEGMENT_RECORD_LIVE 1
+#define SEGMENT_RECORD_TOMBSTONE 2
+#define SEGMENT_RECORD_PATCH 3 // payload is the uint64_t shard offset, then the bytes written there
+
+// On-disk header that precedes every payload in a segment file
+struct segment_record {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t seq;
+    uint64_t length;
+    char hash[SHARD_FN_LEN];
+};
+
+// Where the payload of a shard currently lives
+struct segment_location {
+    uint32_t segment;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Called for each shard listed, a nonzero return stops the listing
+typedef int (*segment_list_fn)(const char hash[], void *ctx);
+
+extern int segment_store_enabled;
+extern off_t segment_max_size;
+extern double segment_gc_ratio;
+extern long segment_gc_rate;
+
+int segment_store_open(void);
+void segment_store_close(void);
+
+uint64_t segment_seq(void);
+int segment_list(uint64_t before, segment_list_fn fn, void *ctx);
+
+ssize_t segment_size(const char hash[]);
+ssize_t segment_read(const char hash[], char *buf, size_t size, off_t offset);
+int segment_write(const char hash[], const char *buf, size_t size);
+int segment_patch(const char hash[], const char *buf, size_t size, off_t offset);
+int segment_unlink(const char hash[]);
+
+int segment_compact(uint32_t segment);
+
+#endif
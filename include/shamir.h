@@ -1,17 +1,30 @@
 #ifndef SHAMIR_H
 #define SHAMIR_H
 
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/random.h>
 
+// Largest set of x coordinates whose Lagrange weights are cached
+#define SHAMIR_MAX_SHARES 16
+#define SHAMIR_WEIGHT_CACHE_SIZE 8
+
 typedef struct pair {
 	unsigned long long int a;
 	unsigned long long int b;
 } pair;
 
-void get_shares(unsigned long long int secret, int n_shares, int n_required, struct pair shares[]);
+int get_shares(unsigned long long int secret, int n_shares, int n_required, struct pair shares[]);
 unsigned long long int get_secret(struct pair shares[], int n_shares);
 
+int get_shares_batch(const unsigned long long int secrets[], int n_secrets, int n_shares,
+                     int n_required, unsigned long long int xs[], unsigned long long int ys[]);
+int get_secrets_batch(const unsigned long long int xs[], const unsigned long long int ys[], int k,
+                      int n_secrets, unsigned long long int secrets[]);
+int get_shares_at(const unsigned long long int xs[], const unsigned long long int ys[], int k,
+                  int n_secrets, unsigned long long int x, unsigned long long int shares[]);
+
 #endif
@@ -0,0 +1,69 @@
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "deffs.h"
+#include "replica.h"
+#include "segment.h"
+#include "tier.h"
+#include "utils.h"
+
+#define SHARD_FANOUT_MAX_DEPTH 4
+#define SHARD_FANOUT_MAX_WIDTH 4
+
+// File under the shardpoint that records the layout a store was created with
+#define SHARD_SUPERBLOCK "superblock"
+#define SHARD_SUPERBLOCK_MAGIC "DEFFS store 1"
+
+// Layout settings given explicitly, which must match the ones the store records
+#define SHARD_GIVEN_DEPTH 1
+#define SHARD_GIVEN_WIDTH 2
+
+// Called for each file found by fanout_walk, a nonzero return stops the walk
+typedef int (*fanout_walk_fn)(const char hash[], const struct stat *st, void *ctx);
+typedef segment_list_fn shard_list_fn;
+
+extern int shard_fanout_depth;
+extern int shard_fanout_width;
+extern int shard_fanout_given;
+
+size_t fanout_path_len(const char base[], const char suffix[]);
+void get_fanout_path(const char base[], const char hash[], const char suffix[], char obuf[]);
+int make_fanout_dirs(const char base[], const char hash[]);
+int fanout_walk(const char base[], const char suffix[], fanout_walk_fn fn, void *ctx);
+
+size_t shard_path_len(void);
+void get_shard_path(const char hash[], char obuf[]);
+int make_shard_dirs(const char hash[]);
+int migrate_flat_shards(void);
+
+int shard_layout_read(int *depth, int *width);
+int shard_layout_write(int replace);
+int shard_layout_open(void);
+
+ssize_t shard_size(const char hash[]);
+ssize_t shard_read(const char hash[], char *buf, size_t size, off_t offset);
+int shard_write(const char hash[], const char *buf, size_t size);
+int shard_pwrite(const char hash[], const char *buf, size_t size, off_t offset);
+int shard_truncate(const char hash[], off_t size);
+int shard_allocate(const char hash[], off_t offset, off_t len);
+int shard_punch(const char hash[], off_t offset, off_t len);
+int shard_unlink(const char hash[]);
+
+uint64_t shard_epoch(void);
+int shard_list(uint64_t before, shard_list_fn fn, void *ctx);
+
+int shard_refs(const char hash[]);
+int shard_ref(const char hash[]);
+int shard_unref(const char hash[]);
+
+#endif
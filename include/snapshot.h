@@ -0,0 +1,35 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "deffs.h"
+#include "header.h"
+#include "keystore.h"
+#include "shards.h"
+#include "utils.h"
+
+// Directory holding the snapshots of its parent, both at the root and in any subdirectory
+#define SNAPSHOT_DIR ".snapshots"
+
+int snapshot_frozen(const char path[]);
+int snapshot_pinned(const char path[]);
+int snapshot_root(const char path[]);
+
+int snapshot_create(const char path[]);
+int snapshot_delete(const char path[]);
+
+int snapshot_share(int src_fd, int dst_fd);
+int snapshot_retain(const struct deffs_header *header);
+int snapshot_release(const struct deffs_header *header);
+int snapshot_release_hash(const char hash[]);
+
+#endif
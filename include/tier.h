@@ -0,0 +1,55 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "deffs.h"
+#include "tierstat.h"
+#include "utils.h"
+
+#define TIER_FAST 0
+#define TIER_CAPACITY 1
+
+// Reads that make a shard on the capacity tier hot enough to move back
+#define TIER_PROMOTE_HITS 4
+// Seconds between passes over the fast tier, and that a shard just written or moved stays put
+#define TIER_SCAN_INTERVAL 60
+// Most shards whose accesses are tracked at once
+#define TIER_TRACK_MAX (1 << 18)
+// Locks that shard changes and moves between tiers are spread over by hash
+#define TIER_LOCKS 64
+// Bytes copied per step while a shard moves
+#define TIER_COPY_CHUNK (1024 * 1024)
+
+extern char *capacity_tier;
+extern long tier_fast_size;
+extern long tier_cold_age;
+extern long tier_rate;
+
+int tier_start(void);
+void tier_stop(void);
+
+const char *tier_base(int tier);
+void tier_lock(const char hash[]);
+void tier_unlock(const char hash[]);
+
+int tier_open_shard(const char hash[], int flags, int *tier);
+int tier_stat_shard(const char hash[], struct stat *st);
+int tier_unlink_shard(const char hash[]);
+
+void tier_note_read(const char hash[], int tier, size_t bytes);
+void tier_note_write(const char hash[], int tier);
+
+void tier_stats(struct deffs_tier_stats *out);
+
+#endif
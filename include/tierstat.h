@@ -0,0 +1,27 @@
+#ifndef TIERSTAT_H
+#define TIERSTAT_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Read and migration counters of the storage tiers, kept since the mount
+struct deffs_tier_stats {
+    // Shard reads, and the bytes they returned, served by each tier
+    uint64_t fast_reads;
+    uint64_t fast_bytes;
+    uint64_t capacity_reads;
+    uint64_t capacity_bytes;
+    // Shards, and their allocated bytes, moved up to the fast tier and down from it
+    uint64_t promoted;
+    uint64_t promoted_bytes;
+    uint64_t demoted;
+    uint64_t demoted_bytes;
+    // Shards and allocated bytes on the fast tier as of the last pass over it
+    uint64_t fast_shards;
+    uint64_t fast_used;
+};
+
+// Read the tier counters, issued on any file or directory in the mount
+#define DEFFS_IOC_TIER_STATS _IOR('D', 3, struct deffs_tier_stats)
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// A trace is a trace_header followed by trace_records in the order the calls finished, each
+// followed by its paths. Fields are in the byte order of the machine that wrote them
+#define TRACE_MAGIC "DEFT"
+#define TRACE_MAGIC_LEN 4
+#define TRACE_VERSION 1
+
+// Filesystem calls that are traced
+enum trace_op {
+    TRACE_GETATTR,
+    TRACE_FGETATTR,
+    TRACE_ACCESS,
+    TRACE_READLINK,
+    TRACE_OPENDIR,
+    TRACE_READDIR,
+    TRACE_RELEASEDIR,
+    TRACE_MKNOD,
+    TRACE_MKDIR,
+    TRACE_SYMLINK,
+    TRACE_UNLINK,
+    TRACE_RMDIR,
+    TRACE_RENAME,
+    TRACE_LINK,
+    TRACE_CHMOD,
+    TRACE_CHOWN,
+    TRACE_TRUNCATE,
+    TRACE_FTRUNCATE,
+    TRACE_UTIMENS,
+    TRACE_CREATE,
+    TRACE_OPEN,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_STATFS,
+    TRACE_FLUSH,
+    TRACE_RELEASE,
+    TRACE_FSYNC,
+    TRACE_FALLOCATE,
+    TRACE_IOCTL,
+    TRACE_SETXATTR,
+    TRACE_GETXATTR,
+    TRACE_LISTXATTR,
+    TRACE_REMOVEXATTR,
+    TRACE_N_OPS,
+};
+
+struct trace_header {
+    char magic[TRACE_MAGIC_LEN];
+    uint32_t version;
+    // Wall clock time the trace started at, in seconds since the epoch
+    uint64_t started;
+};
+
+// One call. Only the sizes of the data it moved are kept, never the data itself
+struct trace_record {
+    uint8_t op;
+    uint8_t unused;
+    // Lengths of the paths that follow the record. The second is the new name of a rename or
+    // link, the target of a symlink, or the name of an extended attribute
+    uint16_t path_len;
+    uint16_t path2_len;
+    uint16_t unused2;
+    uint32_t thread;
+    // What the call returned, a byte count or a negative errno
+    int32_t result;
+    // Nanoseconds from the start of the trace to the call, and how long it took
+    uint64_t start;
+    uint64_t duration;
+    // File handle the call used, or the one it opened
+    uint64_t fh;
+    // Bytes asked for, directory entries listed, or the size truncated to
+    uint64_t size;
+    int64_t offset;
+    // Mode, open flags, ioctl command or owner, depending on the call
+    uint64_t arg;
+};
+
+static inline const char *trace_op_name(int op)
+{
+    const char *names[] = {"getattr",   "fgetattr",   "access",      "readlink",  "opendir",
+                           "readdir",   "releasedir", "mknod",       "mkdir",     "symlink",
+                           "unlink",    "rmdir",      "rename",      "link",      "chmod",
+                           "chown",     "truncate",   "ftruncate",   "utimens",   "create",
+                           "open",      "read",       "write",       "statfs",    "flush",
+                           "release",   "fsync",      "fallocate",   "ioctl",     "setxattr",
+                           "getxattr",  "listxattr",  "removexattr"};
+
+    return op >= 0 && op < TRACE_N_OPS ? names[op] : "unknown";
+}
+
+#endif
@@ -4,14 +4,21 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/random.h>
 
 #include "deffs.h"
 
 const char *deffs_path_prepend(const char originalPath[], char to_prepend[]);
-void random_string(char output[], int length);
+int random_string(char output[], int length);
 int mkdir_if_not_exists(char path[], mode_t mode);
+int sync_dir(const char path[]);
+size_t hash_bucket(const char hash[], size_t n_buckets);
+uint64_t path_hash(const char path[]);
 int ends_with(const char str[], const char suffix[]);
 int starts_with(const char str[], const char prefix[]);
 
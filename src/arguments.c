@@ -7,6 +7,9 @@
 */
 
 #include "arguments.h"
+#include "header.h"
+#include "keystore.h"
+#include "shards.h"
 
 error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
@@ -19,7 +22,179 @@ error_t parse_opt(int key, char *arg, struct argp_state *state)
             argp_usage(state);
         arguments->points[state->arg_num] = arg;
         break;
+    case OPT_FANOUT_DEPTH:
+        arguments->fanout_depth = atoi(arg);
+        if (arguments->fanout_depth < 0 || arguments->fanout_depth > SHARD_FANOUT_MAX_DEPTH)
+            argp_error(state, "fan-out depth must be between 0 and %d", SHARD_FANOUT_MAX_DEPTH);
+        arguments->fanout_given |= SHARD_GIVEN_DEPTH;
+        break;
+    case OPT_FANOUT_WIDTH:
+        arguments->fanout_width = atoi(arg);
+        if (arguments->fanout_width < 1 || arguments->fanout_width > SHARD_FANOUT_MAX_WIDTH)
+            argp_error(state, "fan-out width must be between 1 and %d", SHARD_FANOUT_MAX_WIDTH);
+        arguments->fanout_given |= SHARD_GIVEN_WIDTH;
+        break;
+    case OPT_SEGMENTS:
+        arguments->segments = 1;
+        break;
+    case OPT_SEGMENT_SIZE:
+        arguments->segment_size = atol(arg);
+        if (arguments->segment_size < 1)
+            argp_error(state, "segment size must be at least 1 MiB");
+        break;
+    case OPT_GC_RATIO:
+        arguments->gc_ratio = atof(arg);
+        if (arguments->gc_ratio <= 0 || arguments->gc_ratio > 1)
+            argp_error(state, "compaction ratio must be in (0, 1]");
+        break;
+    case OPT_GC_RATE:
+        arguments->gc_rate = atol(arg);
+        if (arguments->gc_rate < 0)
+            argp_error(state, "compaction rate must not be negative");
+        break;
+    case OPT_INLINE_THRESHOLD:
+        arguments->inline_threshold = atol(arg);
+        if (arguments->inline_threshold < 0 || arguments->inline_threshold > HEADER_INLINE_MAX)
+            argp_error(state, "inline threshold must be between 0 and %d bytes", HEADER_INLINE_MAX);
+        break;
+    case OPT_KEY_TARGET:
+        if (arguments->n_key_targets == KEYSTORE_MAX_TARGETS)
+            argp_error(state, "at most %d key targets are supported", KEYSTORE_MAX_TARGETS);
+        arguments->key_targets[arguments->n_key_targets++] = arg;
+        break;
+    case OPT_KEY_SHARES:
+        arguments->key_shares = atoi(arg);
+        if (arguments->key_shares < 1 || arguments->key_shares > KEYSTORE_MAX_SHARES)
+            argp_error(state, "key shares must be between 1 and %d", KEYSTORE_MAX_SHARES);
+        break;
+    case OPT_KEY_THRESHOLD:
+        arguments->key_threshold = atoi(arg);
+        if (arguments->key_threshold < 1)
+            argp_error(state, "key threshold must be at least 1");
+        break;
+    case OPT_KEY_CACHE:
+        arguments->key_cache = atol(arg);
+        if (arguments->key_cache < 0)
+            argp_error(state, "key cache size must not be negative");
+        break;
+    case OPT_CRYPTO_WORKERS:
+        arguments->crypto_workers = atoi(arg);
+        if (arguments->crypto_workers < 0 || arguments->crypto_workers > CRYPTO_POOL_MAX_WORKERS)
+            argp_error(state, "crypto workers must be between 0 and %d", CRYPTO_POOL_MAX_WORKERS);
+        break;
+    case OPT_CRYPTO_CHUNK:
+        arguments->crypto_chunk = atol(arg);
+        if (arguments->crypto_chunk < 1)
+            argp_error(state, "crypto chunk size must be at least 1 KiB");
+        break;
+    case OPT_BUFFER_CACHE:
+        arguments->buffer_cache = atol(arg);
+        if (arguments->buffer_cache < 0)
+            argp_error(state, "buffer cache size must not be negative");
+        break;
+    case OPT_STREAM_WINDOW:
+        arguments->stream_window = atol(arg);
+        if (arguments->stream_window < STREAM_WINDOW_MIN / 1024)
+            argp_error(state, "stream window must be at least %d KiB", STREAM_WINDOW_MIN / 1024);
+        break;
+    case OPT_SCRUB_RATE:
+        arguments->scrub_rate = atol(arg);
+        if (arguments->scrub_rate < 0)
+            argp_error(state, "scrub rate must not be negative");
+        break;
+    case OPT_SCRUB_INTERVAL:
+        arguments->scrub_interval = atol(arg);
+        if (arguments->scrub_interval < 0)
+            argp_error(state, "scrub interval must not be negative");
+        break;
+    case OPT_SCRUB_SHARE:
+        arguments->scrub_share = atoi(arg);
+        if (arguments->scrub_share < 1 || arguments->scrub_share > 100)
+            argp_error(state, "scrub share must be between 1 and 100 percent");
+        break;
+    case OPT_INDEX_THREADS:
+        arguments->index_threads = atoi(arg);
+        if (arguments->index_threads < 1 || arguments->index_threads > INDEX_MAX_THREADS)
+            argp_error(state, "index threads must be between 1 and %d", INDEX_MAX_THREADS);
+        break;
+    case OPT_RECLAIM_RATE:
+        arguments->reclaim_rate = atol(arg);
+        if (arguments->reclaim_rate < 0)
+            argp_error(state, "reclaim rate must not be negative");
+        break;
+    case OPT_CAPACITY_TIER:
+        arguments->capacity_tier = arg;
+        break;
+    case OPT_TIER_FAST_SIZE:
+        arguments->tier_fast_size = atol(arg);
+        if (arguments->tier_fast_size < 0)
+            argp_error(state, "fast tier size must not be negative");
+        break;
+    case OPT_TIER_COLD_AGE:
+        arguments->tier_cold_age = atol(arg);
+        if (arguments->tier_cold_age < 1)
+            argp_error(state, "tier cold age must be at least 1 second");
+        break;
+    case OPT_TIER_RATE:
+        arguments->tier_rate = atol(arg);
+        if (arguments->tier_rate < 0)
+            argp_error(state, "tier rate must not be negative");
+        break;
+    case OPT_REPLICA_TARGET:
+        if (arguments->n_replica_targets == DEFFS_REPLICA_MAX_TARGETS)
+            argp_error(state, "at most %d replica targets are supported",
+                       DEFFS_REPLICA_MAX_TARGETS);
+        arguments->replica_targets[arguments->n_replica_targets++] = arg;
+        break;
+    case OPT_DURABILITY:
+        arguments->durability = durability_level(arg);
+        if (arguments->durability < DEFFS_DURABILITY_LOCAL)
+            argp_error(state, "durability must be local, quorum or all");
+        break;
+    case OPT_REPLICA_QUEUE:
+        arguments->replica_queue = atol(arg);
+        if (arguments->replica_queue < 1)
+            argp_error(state, "replica queue size must be at least 1 MiB");
+        break;
+    case OPT_LEASE_LISTEN:
+        arguments->lease_listen = arg;
+        break;
+    case OPT_LEASE_SERVER:
+        arguments->lease_server = arg;
+        break;
+    case OPT_CACHE_MODE:
+        arguments->cache_mode = cache_mode_value(arg);
+        if (arguments->cache_mode < DEFFS_CACHE_NONE)
+            argp_error(state, "cache mode must be none, keep or direct");
+        break;
+    case OPT_HASH_ENGINE:
+        arguments->hash_engine = hash_engine_value(arg);
+        if (arguments->hash_engine < 0)
+            argp_error(state, "hash engine must be auto, generic, avx2 or sha-ni");
+        if (!hash_engine_supported(arguments->hash_engine))
+            argp_error(state, "hash engine %s is not supported by this CPU", arg);
+        break;
+    case OPT_CIPHER:
+        arguments->cipher = cipher_value(arg);
+        if (arguments->cipher < DEFFS_CIPHER_AES)
+            argp_error(state, "cipher must be aes, chacha20 or none");
+        break;
+    case OPT_ALLOW_PLAINTEXT:
+        arguments->allow_plaintext = 1;
+        break;
+    case OPT_TRACE:
+        arguments->trace = arg;
+        break;
     case ARGP_KEY_END:
+        if (arguments->key_threshold > arguments->key_shares)
+            argp_error(state, "key threshold must not exceed the number of key shares");
+        if (arguments->capacity_tier != NULL && arguments->segments)
+            argp_error(state, "a capacity tier cannot be used with segments");
+        if ((arguments->lease_listen != NULL || arguments->lease_server != NULL) &&
+            arguments->segments)
+            argp_error(state, "segments cannot be shared with other mounts");
+        if (arguments->cipher == DEFFS_CIPHER_NONE && !arguments->allow_plaintext)
+            argp_error(state, "cipher none stores contents unencrypted, pass --allow-plaintext");
         if (state->arg_num < 2)
             argp_usage(state);
         break;
@@ -1,26 +1,493 @@
 /*
 * FILENAME: attr.c
 *
-* DESCRIPTION: FUSE callbacks relating to file attributes
+* DESCRIPTION: FUSE callbacks relating to file attributes. Attributes are
+*              answered from the metadata index, which learns a path the first
+*              time it is looked up and is kept current by every change made
+*              through DEFFS. Names missing from a directory whose listing is
+*              complete in the index do not exist, without asking the storepoint.
+*              Mounts sharing a store through leases look a path up again whenever
+*              they did not hold a lease on it.
+*              When the index is stale, the whole storepoint is indexed again by
+*              index_threads threads, each taking one directory at a time.
 *
 * AUTHOR: Charles Averill
 */
 
 #include "attr.h"
+#include "snapshot.h"
 
-int deffs_getattr(const char *path, struct stat *stbuf)
+int index_threads = -1;
+
+// Directories still to be indexed by a rebuild
+struct rebuild_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char **dirs;
+    size_t n_dirs;
+    size_t capacity;
+    // Threads indexing a directory, which may find more
+    int busy;
+    int error;
+};
+
+static int _indexed(const char path[])
 {
-    int res;
+    // The shardpoint is not part of the namespace, and changes without going through FUSE
+    return strncmp(path, "/.shards", 8) != 0 || (path[8] != '\0' && path[8] != '/');
+}
 
-    path = deffs_path_prepend(path, storepoint);
+static void _logical_size(struct stat *st, uint64_t size)
+{
+    // Report the size of the file's contents rather than of its header record
+    st->st_size   = size;
+    st->st_blocks = (size + 511) / 512;
+}
 
-    res = lstat(path, stbuf);
-    if (res == -1)
+static int _index_entry(const char path[], struct stat *st, int dir_fd, const char name[])
+{
+    // Index st, just read from the storepoint, with the size of the file's contents. The header
+    // record, name relative to dir_fd, is only read when the index cannot tell the size
+    struct stat old;
+    uint32_t old_flags = 0;
+    int known          = metastore_get(path, &old, &old_flags) == 0;
+
+    // A directory that is still the same one keeps its complete listing
+    uint32_t flags = known && S_ISDIR(st->st_mode) && S_ISDIR(old.st_mode) &&
+                             old.st_ino == st->st_ino ?
+                         old_flags & METASTORE_COMPLETE :
+                         0;
+
+    if (S_ISREG(st->st_mode)) {
+        if (known && !(old_flags & METASTORE_LINKED) && st->st_nlink == 1 &&
+            old.st_ino == st->st_ino) {
+            _logical_size(st, old.st_size);
+        } else {
+            struct deffs_header header;
+            int fd = openat(dir_fd, name, O_RDONLY);
+            if (fd != -1 && header_read(fd, &header, NULL) == 0)
+                _logical_size(st, header.size);
+            if (fd != -1)
+                close(fd);
+        }
+
+        if (st->st_nlink > 1)
+            flags |= METASTORE_LINKED;
+    }
+
+    return _indexed(path) ? metastore_put(path, st, flags) : 0;
+}
+
+int attr_index(const char path[], struct stat *stbuf)
+{
+    // Look path up in the storepoint and index what is there. stbuf may be NULL
+    char real_path[strlen(storepoint) + strlen(path) + 1];
+    sprintf(real_path, "%s%s", storepoint, path);
+
+    struct stat st;
+    if (lstat(real_path, &st) == -1) {
+        int res = -errno;
+        if (res == -ENOENT && _indexed(path))
+            metastore_remove(path);
+        return res;
+    }
+
+    int res = _index_entry(path, &st, AT_FDCWD, real_path);
+
+    if (stbuf != NULL)
+        *stbuf = st;
+
+    return res;
+}
+
+int attr_index_fd(const char path[], int fd, uint64_t size)
+{
+    // Index a file that was just changed through fd and now holds size bytes. Files changed
+    // after their last name was removed have no path and nothing to index
+    if (path == NULL || !_indexed(path))
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -errno;
+
+    _logical_size(&st, size);
+
+    return metastore_put(path, &st, st.st_nlink > 1 ? METASTORE_LINKED : 0);
+}
+
+int attr_index_new_dir(const char path[])
+{
+    // A directory that was just made has no children, so its listing is complete already
+    if (!_indexed(path))
+        return 0;
+
+    char real_path[strlen(storepoint) + strlen(path) + 1];
+    sprintf(real_path, "%s%s", storepoint, path);
+
+    struct stat st;
+    if (lstat(real_path, &st) == -1)
         return -errno;
 
+    return metastore_put(path, &st, S_ISDIR(st.st_mode) ? METASTORE_COMPLETE : 0);
+}
+
+int attr_index_parent(const char path[])
+{
+    // Creating or removing a name changes its directory's times and link count
+    char parent[strlen(path) + 2];
+    strcpy(parent, path);
+
+    char *slash = strrchr(parent, '/');
+    if (slash == NULL)
+        return 0;
+    slash[slash == parent] = '\0';
+
+    return attr_index(parent, NULL);
+}
+
+int attr_index_dir(const char path[], DIR *dp)
+{
+    // Index every child of the directory open in dp, then mark its listing complete
+    if (!_indexed(path))
+        return -ENOTSUP;
+
+    int dir_fd = dirfd(dp);
+    int res    = 0;
+    struct dirent *entry;
+
+    while (res == 0 && (entry = readdir(dp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char child[strlen(path) + strlen(entry->d_name) + 2];
+        sprintf(child, "%s/%s", strcmp(path, "/") == 0 ? "" : path, entry->d_name);
+
+        // Entries removed since the listing started are simply left out
+        struct stat st;
+        if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            res = _index_entry(child, &st, dir_fd, entry->d_name);
+    }
+
+    rewinddir(dp);
+
+    struct stat st;
+    if (res == 0 && fstat(dir_fd, &st) == -1)
+        res = -errno;
+    if (res == 0)
+        res = metastore_put(path, &st, METASTORE_COMPLETE);
+
+    return res;
+}
+
+int attr_complete(const char path[])
+{
+    // Whether every child of the directory path is in the index
+    struct stat st;
+    uint32_t flags;
+
+    return _indexed(path) && metastore_get(path, &st, &flags) == 0 && S_ISDIR(st.st_mode) &&
+           flags & METASTORE_COMPLETE;
+}
+
+int attr_forget(const char path[])
+{
+    return _indexed(path) ? metastore_remove(path) : 0;
+}
+
+int attr_move(const char from[], const char to[])
+{
+    if (!_indexed(from) || !_indexed(to))
+        return attr_forget(from) == 0 ? attr_forget(to) : -EIO;
+
+    int res = metastore_move(from, to);
+
+    // Renaming changes the entry's ctime
+    if (res == 0)
+        res = attr_index(to, NULL);
+
+    return res;
+}
+
+// Names of the indexed children of a directory
+struct child_names {
+    char **names;
+    size_t n_names;
+    size_t capacity;
+};
+
+static int _collect_child(const char name[], const struct stat *st, uint32_t flags, void *ctx)
+{
+    struct child_names *children = ctx;
+    (void)st;
+    (void)flags;
+
+    if (children->n_names == children->capacity) {
+        size_t capacity = children->capacity == 0 ? 64 : 2 * children->capacity;
+        char **grown    = realloc(children->names, capacity * sizeof(char *));
+        if (grown == NULL)
+            return -ENOMEM;
+
+        children->names    = grown;
+        children->capacity = capacity;
+    }
+
+    if ((children->names[children->n_names] = strdup(name)) == NULL)
+        return -ENOMEM;
+    children->n_names++;
+
+    return 0;
+}
+
+static void _refresh(const char path[])
+{
+    // Another mount may have changed path since this one last held a lease on it. A file's size
+    // is read from its header record again. A directory is listed from the storepoint again,
+    // after the children indexed under it that are gone are forgotten
+    struct stat st;
+    uint32_t flags;
+
+    if (_indexed(path) && metastore_get(path, &st, &flags) == 0 && !S_ISDIR(st.st_mode))
+        metastore_remove(path);
+
+    if (_indexed(path) && metastore_get(path, &st, &flags) == 0 && S_ISDIR(st.st_mode) &&
+        flags & METASTORE_COMPLETE) {
+        metastore_put(path, &st, flags & ~METASTORE_COMPLETE);
+
+        struct child_names children = {NULL, 0, 0};
+        metastore_list(path, _collect_child, &children);
+
+        for (size_t i = 0; i < children.n_names; i++) {
+            char child[strlen(path) + strlen(children.names[i]) + 2];
+            sprintf(child, "%s/%s", strcmp(path, "/") == 0 ? "" : path, children.names[i]);
+
+            attr_index(child, NULL);
+            free(children.names[i]);
+        }
+
+        free(children.names);
+    }
+
+    attr_index(path, NULL);
+}
+
+void attr_lease(const char path[], int mode)
+{
+    // Take a lease on path for the running operation, which ends with lease_end
+    if (lease_begin(path, mode) > 0)
+        _refresh(path);
+
+    // Leases taken earlier in the operation may have gone back while it waited for this one, and
+    // what is known of their paths is looked up again once they are taken again
+    char lost[PATH_MAX];
+    int lost_mode;
+    while (lease_lost(lost, &lost_mode)) {
+        lease_begin(lost, lost_mode);
+        _refresh(lost);
+    }
+}
+
+void attr_lease_parent(const char path[], int mode)
+{
+    // Names come and go under the lease of the directory holding them too
+    char parent[strlen(path) + 2];
+    strcpy(parent, path);
+
+    char *slash = strrchr(parent, '/');
+    if (slash != NULL && path[1] != '\0') {
+        slash[slash == parent] = '\0';
+        attr_lease(parent, mode);
+    }
+
+    attr_lease(path, mode);
+}
+
+static int _queue_push(struct rebuild_queue *queue, const char dir[])
+{
+    char *copy = strdup(dir);
+    if (copy == NULL)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->n_dirs == queue->capacity) {
+        size_t capacity = queue->capacity > 0 ? queue->capacity * 2 : 64;
+        char **dirs     = realloc(queue->dirs, capacity * sizeof(char *));
+        if (dirs == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            free(copy);
+            return -ENOMEM;
+        }
+
+        queue->dirs     = dirs;
+        queue->capacity = capacity;
+    }
+
+    queue->dirs[queue->n_dirs++] = copy;
+    pthread_cond_signal(&queue->cond);
+
+    pthread_mutex_unlock(&queue->lock);
+
     return 0;
 }
 
+static int _queue_subdir(const char name[], const struct stat *st, uint32_t flags, void *ctx)
+{
+    // Called for each child of the directory in ctx's first slot, with the store locked
+    void **args = ctx;
+    (void)flags;
+
+    if (!S_ISDIR(st->st_mode))
+        return 0;
+
+    const char *dir = args[0];
+    char child[strlen(dir) + strlen(name) + 2];
+    sprintf(child, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+
+    return _queue_push(args[1], child);
+}
+
+static int _rebuild_dir(struct rebuild_queue *queue, const char dir[])
+{
+    char real_path[strlen(storepoint) + strlen(dir) + 1];
+    sprintf(real_path, "%s%s", storepoint, dir);
+
+    // A directory that cannot be listed stays out of the index, and is looked up in the
+    // storepoint instead
+    DIR *dp = opendir(real_path);
+    if (dp == NULL)
+        return 0;
+
+    int res = attr_index_dir(dir, dp);
+    closedir(dp);
+
+    void *args[] = {(void *)dir, queue};
+    if (res == 0)
+        res = metastore_list(dir, _queue_subdir, args);
+
+    return res;
+}
+
+static void *_rebuild_worker(void *arg)
+{
+    struct rebuild_queue *queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (1) {
+        // The rebuild is done once nothing is queued and nobody can queue more
+        while (queue->n_dirs == 0 && queue->busy > 0 && queue->error == 0)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        if (queue->n_dirs == 0 || queue->error != 0)
+            break;
+
+        char *dir = queue->dirs[--queue->n_dirs];
+        queue->busy++;
+        pthread_mutex_unlock(&queue->lock);
+
+        int res = _rebuild_dir(queue, dir);
+        free(dir);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->busy--;
+        if (res != 0 && queue->error == 0)
+            queue->error = res;
+        pthread_cond_broadcast(&queue->cond);
+    }
+
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+int attr_rebuild(void)
+{
+    // Index every path under the storepoint, for a store whose index was found stale
+    int n_threads = index_threads;
+
+    if (n_threads <= 0)
+        n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > INDEX_MAX_THREADS)
+        n_threads = INDEX_MAX_THREADS;
+
+    struct rebuild_queue queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+    pthread_t threads[INDEX_MAX_THREADS];
+    int n_started = 0;
+
+    metastore_load_begin();
+
+    int res = _queue_push(&queue, "/");
+
+    for (; res == 0 && n_started < n_threads; n_started++) {
+        if (pthread_create(&threads[n_started], NULL, _rebuild_worker, &queue) != 0)
+            break;
+    }
+
+    // With no thread at all, this one does the work
+    if (res == 0 && n_started == 0)
+        _rebuild_worker(&queue);
+
+    for (int i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (res == 0)
+        res = queue.error;
+
+    for (size_t i = 0; i < queue.n_dirs; i++) {
+        free(queue.dirs[i]);
+    }
+    free(queue.dirs);
+
+    // Only a complete rebuild is merged and trusted
+    if (res == 0)
+        res = metastore_load_end();
+
+    return res;
+}
+
+static int _parent_complete(const char path[])
+{
+    char parent[strlen(path) + 2];
+    strcpy(parent, path);
+
+    char *slash = strrchr(parent, '/');
+    if (slash == NULL || path[1] == '\0')
+        return 0;
+    slash[slash == parent] = '\0';
+
+    return attr_complete(parent);
+}
+
+static int _getattr(const char path[], struct stat *stbuf)
+{
+    uint32_t flags;
+
+    if (_indexed(path)) {
+        int res = metastore_get(path, stbuf, &flags);
+
+        // Files with several names are changed under all of them, so only their header knows
+        if (res == 0 && !(flags & METASTORE_LINKED))
+            return 0;
+        if (res == -ENOENT && _parent_complete(path))
+            return -ENOENT;
+    }
+
+    return attr_index(path, stbuf);
+}
+
+int deffs_getattr(const char *path, struct stat *stbuf)
+{
+    attr_lease(path, LEASE_READ);
+    int res = _getattr(path, stbuf);
+    lease_end();
+
+    return res;
+}
+
 int deffs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 {
     int res;
@@ -33,6 +500,12 @@ int deffs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *
     if (res == -1)
         return -errno;
 
+    if (S_ISREG(stbuf->st_mode)) {
+        struct deffs_header header;
+        if (header_read(fi->fh, &header, NULL) == 0)
+            stbuf->st_size = header.size;
+    }
+
     return 0;
 }
 
@@ -46,6 +519,9 @@ static int deffs_setxattr(const char *path, const char *name, const char *value,
                           int flags)
 #endif
 {
+    if (snapshot_pinned(path))
+        return -EROFS;
+
 #ifdef __APPLE__
     int res;
     if (!strncmp(name, XATTR_APPLE_PREFIX, sizeof(XATTR_APPLE_PREFIX) - 1)) {
@@ -130,6 +606,9 @@ static int deffs_listxattr(const char *path, char *list, size_t size)
 
 static int deffs_removexattr(const char *path, const char *name)
 {
+    if (snapshot_pinned(path))
+        return -EROFS;
+
 #ifdef __APPLE__
     int res;
     if (strcmp(name, A_KAUTH_FILESEC_XATTR) == 0) {
@@ -0,0 +1,184 @@
+/*
+* FILENAME: blockmap.c
+*
+* DESCRIPTION: Per-block state and tags of files stored in shards. The header file
+*              keeps a flat binary tree of slots after its inline payload area:
+*              block b is the leaf in slot 2b, holding its state, the nonce it was
+*              encrypted under and the tag of its ciphertext, and every interior
+*              node sits in the odd slot between the two halves it covers. Any range
+*              of blocks is one contiguous run of slots, and so is every subtree
+*              inside it. Blocks past the end of the map are holes, so extending a
+*              file only changes its size, and shrinking it cuts the map and the
+*              shard with one ftruncate each. Only the slice of the map covering a
+*              request is ever read.
+*
+* USAGE: uint8_t states[n_blocks];
+*        unsigned char nonces[n_blocks][FILE_KEY_NONCE_LEN];
+*        blockmap_read(fd, block_of(offset), n_blocks, states, nonces);
+*
+*        blockmap_set(fd, block_of(offset), n_blocks, BLOCK_DATA);
+*        blockmap_set_tags(fd, block_of(offset), n_blocks, nonces, tags);
+*        blockmap_truncate(fd, blocks_for(size));
+*        blockmap_remap(fd, blocks_for(size), remap);
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "blockmap.h"
+
+// Slots moved per call when walking a range of the map
+#define BLOCKMAP_BATCH 256
+
+int blockmap_read_slots(int fd, uint64_t first_slot, size_t n_slots, struct blockmap_slot slots[])
+{
+    ssize_t n = pread(fd, slots, n_slots * BLOCKMAP_SLOT_LEN,
+                      BLOCKMAP_OFFSET + first_slot * BLOCKMAP_SLOT_LEN);
+    if (n == -1)
+        return -errno;
+
+    // The map only grows as far as the last block written
+    memset((char *)slots + n, 0, n_slots * BLOCKMAP_SLOT_LEN - n);
+
+    return 0;
+}
+
+int blockmap_write_slots(int fd, uint64_t first_slot, size_t n_slots,
+                         const struct blockmap_slot slots[])
+{
+    size_t len = n_slots * BLOCKMAP_SLOT_LEN;
+
+    if (pwrite(fd, slots, len, BLOCKMAP_OFFSET + first_slot * BLOCKMAP_SLOT_LEN) != (ssize_t)len)
+        return -EIO;
+
+    return 0;
+}
+
+int blockmap_leaves(int fd, uint64_t *n_blocks)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -errno;
+
+    // Holes in a header file read as zeros, so a partly written last slot still counts
+    uint64_t len   = (uint64_t)st.st_size > BLOCKMAP_OFFSET ? st.st_size - BLOCKMAP_OFFSET : 0;
+    uint64_t slots = (len + BLOCKMAP_SLOT_LEN - 1) / BLOCKMAP_SLOT_LEN;
+    *n_blocks      = (slots + 1) / 2;
+
+    return 0;
+}
+
+static int _walk(int fd, uint64_t first_block, uint64_t n_blocks, uint8_t state,
+                 unsigned char (*nonces)[FILE_KEY_NONCE_LEN],
+                 unsigned char (*tags)[FILE_KEY_TAG_LEN], uint8_t states[])
+{
+    // Read the leaves of a range batch by batch, then either report their states and nonces
+    // or give them a new state or nonce and tag. Interior slots between them are carried
+    // along untouched
+    struct blockmap_slot slots[2 * BLOCKMAP_BATCH - 1];
+
+    for (uint64_t done = 0; done < n_blocks; done += BLOCKMAP_BATCH) {
+        size_t len     = n_blocks - done < BLOCKMAP_BATCH ? n_blocks - done : BLOCKMAP_BATCH;
+        uint64_t first = 2 * (first_block + done);
+
+        int res = blockmap_read_slots(fd, first, 2 * len - 1, slots);
+        if (res != 0)
+            return res;
+
+        for (size_t i = 0; i < len; i++) {
+            struct blockmap_slot *leaf = &slots[2 * i];
+
+            if (states != NULL) {
+                states[done + i] = leaf->state;
+                if (nonces != NULL)
+                    memcpy(nonces[done + i], leaf->nonce, FILE_KEY_NONCE_LEN);
+            } else if (tags != NULL) {
+                memcpy(leaf->nonce, nonces[done + i], FILE_KEY_NONCE_LEN);
+                memcpy(leaf->node, tags[done + i], FILE_KEY_TAG_LEN);
+            } else {
+                // Blocks that read as zeros have no nonce or tag, which keeps their subtrees
+                // empty
+                leaf->state = state;
+                if (state == BLOCK_HOLE || state == BLOCK_ALLOCATED) {
+                    memset(leaf->nonce, 0, FILE_KEY_NONCE_LEN);
+                    memset(leaf->node, 0, FILE_KEY_TAG_LEN);
+                }
+            }
+        }
+
+        if (states == NULL && (res = blockmap_write_slots(fd, first, 2 * len - 1, slots)) != 0)
+            return res;
+    }
+
+    return 0;
+}
+
+int blockmap_read(int fd, uint64_t first_block, size_t n_blocks, uint8_t states[],
+                  unsigned char (*nonces)[FILE_KEY_NONCE_LEN])
+{
+    // nonces may be NULL when only the states are wanted
+    return _walk(fd, first_block, n_blocks, BLOCK_HOLE, nonces, NULL, states);
+}
+
+int blockmap_set(int fd, uint64_t first_block, uint64_t n_blocks, uint8_t state)
+{
+    // Blocks keep their nonces and tags across state changes that leave their ciphertext as it is
+    return _walk(fd, first_block, n_blocks, state, NULL, NULL, NULL);
+}
+
+int blockmap_set_tags(int fd, uint64_t first_block, size_t n_blocks,
+                      unsigned char (*nonces)[FILE_KEY_NONCE_LEN],
+                      unsigned char (*tags)[FILE_KEY_TAG_LEN])
+{
+    return _walk(fd, first_block, n_blocks, BLOCK_HOLE, nonces, tags, NULL);
+}
+
+int blockmap_truncate(int fd, uint64_t n_blocks)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -errno;
+
+    // The slots of the first n_blocks leaves and the nodes between them
+    uint64_t len = BLOCKMAP_OFFSET + (n_blocks > 0 ? 2 * n_blocks - 1 : 0) * BLOCKMAP_SLOT_LEN;
+
+    // Never grow the header file, blocks past the end of the map are already holes
+    if ((uint64_t)st.st_size <= len)
+        return 0;
+
+    if (ftruncate(fd, len) == -1)
+        return -errno;
+
+    return 0;
+}
+
+int blockmap_remap(int fd, uint64_t n_blocks, const uint8_t remap[256])
+{
+    // Translate every state through remap. Blocks past the end of the map stay holes, so
+    // remap[BLOCK_HOLE] must be BLOCK_HOLE
+    struct blockmap_slot slots[2 * BLOCKMAP_BATCH - 1];
+
+    uint64_t map_blocks;
+    int res = blockmap_leaves(fd, &map_blocks);
+    if (res != 0)
+        return res;
+
+    n_blocks = n_blocks < map_blocks ? n_blocks : map_blocks;
+
+    for (uint64_t block = 0; block < n_blocks; block += BLOCKMAP_BATCH) {
+        size_t len = n_blocks - block < BLOCKMAP_BATCH ? n_blocks - block : BLOCKMAP_BATCH;
+
+        res = blockmap_read_slots(fd, 2 * block, 2 * len - 1, slots);
+        if (res != 0)
+            return res;
+
+        for (size_t i = 0; i < len; i++) {
+            slots[2 * i].state = remap[slots[2 * i].state];
+        }
+
+        res = blockmap_write_slots(fd, 2 * block, 2 * len - 1, slots);
+        if (res != 0)
+            return res;
+    }
+
+    return 0;
+}
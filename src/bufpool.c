@@ -0,0 +1,127 @@
+/*
+* FILENAME: bufpool.c
+*
+* DESCRIPTION: Size-classed pools of aligned buffers, owned by the thread that
+*              releases them. Requests are rounded up to a power of two and served
+*              from the thread's free list for that class, so once a thread has
+*              seen its working set of sizes the read and write paths stop calling
+*              the allocator. Each thread keeps at most bufpool_thread_limit bytes
+*              cached, anything beyond that goes back to the system. Large
+*              transfers are cut into stream_window_size windows, so no request
+*              ever holds more than one window of pooled memory. A thread's cache
+*              is freed when the thread exits.
+*
+* USAGE: char *buf = bufpool_get(size);
+*        if (buf == NULL)
+*            return -ENOMEM;
+*
+*        ...
+*
+*        bufpool_put(buf, size);
+*
+* AUTHOR: Charles Averill
+*/
+
+#include <pthread.h>
+
+#include "bufpool.h"
+
+size_t bufpool_thread_limit = 64 * 1024 * 1024;
+size_t stream_window_size   = 1024 * 1024;
+
+// Free buffers are chained through their first bytes
+struct free_buffer {
+    struct free_buffer *next;
+};
+
+static __thread struct free_buffer *free_lists[BUFPOOL_N_CLASSES];
+static __thread size_t cached_bytes;
+
+// Threads that cache a buffer set this key, so its destructor frees their lists when they exit
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+static int exit_key_ready;
+
+static void _release_at_exit(void *arg)
+{
+    (void)arg;
+    bufpool_trim();
+}
+
+static void _create_exit_key(void)
+{
+    exit_key_ready = pthread_key_create(&exit_key, _release_at_exit) == 0;
+}
+
+static int _size_class(size_t size)
+{
+    int shift = BUFPOOL_MIN_SHIFT;
+    while (shift <= BUFPOOL_MAX_SHIFT && ((size_t)1 << shift) < size)
+        shift++;
+
+    return shift > BUFPOOL_MAX_SHIFT ? -1 : shift - BUFPOOL_MIN_SHIFT;
+}
+
+void *bufpool_get(size_t size)
+{
+    int class     = _size_class(size);
+    size_t actual = class < 0 ? size : (size_t)1 << (class + BUFPOOL_MIN_SHIFT);
+
+    if (class >= 0 && free_lists[class] != NULL) {
+        struct free_buffer *buf = free_lists[class];
+        free_lists[class]       = buf->next;
+        cached_bytes           -= actual;
+        return buf;
+    }
+
+    void *buf;
+    if (posix_memalign(&buf, BUFPOOL_ALIGN, actual > 0 ? actual : 1) != 0)
+        return NULL;
+
+    return buf;
+}
+
+void bufpool_put(void *buf, size_t size)
+{
+    if (buf == NULL)
+        return;
+
+    int class = _size_class(size);
+    if (class < 0) {
+        free(buf);
+        return;
+    }
+
+    size_t actual = (size_t)1 << (class + BUFPOOL_MIN_SHIFT);
+    if (cached_bytes + actual > bufpool_thread_limit) {
+        free(buf);
+        return;
+    }
+
+    if (cached_bytes == 0) {
+        pthread_once(&exit_once, _create_exit_key);
+        if (!exit_key_ready || pthread_setspecific(exit_key, free_lists) != 0) {
+            free(buf);
+            return;
+        }
+    }
+
+    struct free_buffer *node = buf;
+    node->next               = free_lists[class];
+    free_lists[class]        = node;
+    cached_bytes            += actual;
+}
+
+void bufpool_trim(void)
+{
+    // Return every buffer cached by the calling thread
+    for (int class = 0; class < BUFPOOL_N_CLASSES; class++) {
+        while (free_lists[class] != NULL) {
+            struct free_buffer *buf = free_lists[class];
+            free_lists[class]       = buf->next;
+            free(buf);
+        }
+    }
+
+    cached_bytes = 0;
+}
@@ -0,0 +1,98 @@
+/*
+* FILENAME: cachemode.c
+*
+* DESCRIPTION: Command line tool that shows or sets how the kernel caches the
+*              files below a directory in a DEFFS mount. Files take the mode of
+*              the nearest directory above them that has one, or the mode the
+*              store was mounted with. A new mode applies from the next open.
+*
+* USAGE: cmake --build ./ --target DEFFS-cachemode -- -j 6
+*        ./bin/DEFFS-cachemode ~/deffs/media direct
+*        ./bin/DEFFS-cachemode ~/deffs/media/film.mkv
+*
+* AUTHOR: Charles Averill
+*/
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cachemode.h"
+
+const char *argp_program_version     = "DEFFS-cachemode 0.0.2";
+const char *argp_program_bug_address = "charles.averill@utdallas.edu";
+static char doc[] =
+    "Show or set the cache mode of a DEFFS directory: inherit, none, keep or direct";
+static char args_doc[] = "PATH [MODE]";
+
+static struct argp_option options[] = {{0}};
+
+struct cachemode_arguments {
+    char *path;
+    int mode;
+};
+
+static error_t parse_cachemode_opt(int key, char *arg, struct argp_state *state)
+{
+    struct cachemode_arguments *arguments = state->input;
+
+    switch (key) {
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 1)
+            argp_usage(state);
+        if (state->arg_num == 0) {
+            arguments->path = arg;
+        } else {
+            arguments->mode = cache_mode_value(arg);
+            if (arguments->mode < 0)
+                argp_error(state, "mode must be inherit, none, keep or direct");
+        }
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_usage(state);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static struct argp argp = {options, parse_cachemode_opt, args_doc, doc, 0, 0, 0};
+
+int main(int argc, char *argv[])
+{
+    struct cachemode_arguments arguments = {NULL, -1};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    int fd = open(arguments.path, O_RDONLY);
+    if (fd == -1) {
+        printf("Could not open %s: %s\n", arguments.path, strerror(errno));
+        exit(1);
+    }
+
+    if (arguments.mode >= 0) {
+        if (ioctl(fd, DEFFS_IOC_SET_CACHE_MODE, &arguments.mode) == -1) {
+            printf("Could not set the cache mode of %s: %s\n", arguments.path, strerror(errno));
+            exit(1);
+        }
+    } else {
+        int mode;
+        if (ioctl(fd, DEFFS_IOC_GET_CACHE_MODE, &mode) == -1) {
+            printf("Could not read the cache mode of %s: %s\n", arguments.path, strerror(errno));
+            exit(1);
+        }
+
+        printf("%s\n", cache_mode_name(mode));
+    }
+
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*
+* FILENAME: cipher.c
+*
+* DESCRIPTION: Command line tool that shows the cipher a file in a DEFFS mount is
+*              stored under, or shows or sets the cipher of a directory. New
+*              files take the cipher of the nearest directory above them that
+*              has one, or the one the store was mounted with. Files keep the
+*              cipher they were first written with.
+*
+* USAGE: cmake --build ./ --target DEFFS-cipher -- -j 6
+*        ./bin/DEFFS-cipher ~/deffs/scratch none
+*        ./bin/DEFFS-cipher ~/deffs/scratch/build.log
+*
+* AUTHOR: Charles Averill
+*/
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cipher.h"
+
+const char *argp_program_version     = "DEFFS-cipher 0.0.2";
+const char *argp_program_bug_address = "charles.averill@utdallas.edu";
+static char doc[] =
+    "Show the cipher of a DEFFS file, or show or set that of a directory: inherit, aes, "
+    "chacha20 or none";
+static char args_doc[] = "PATH [CIPHER]";
+
+static struct argp_option options[] = {{0}};
+
+struct cipher_arguments {
+    char *path;
+    int cipher;
+};
+
+static error_t parse_cipher_opt(int key, char *arg, struct argp_state *state)
+{
+    struct cipher_arguments *arguments = state->input;
+
+    switch (key) {
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 1)
+            argp_usage(state);
+        if (state->arg_num == 0) {
+            arguments->path = arg;
+        } else {
+            arguments->cipher = cipher_value(arg);
+            if (arguments->cipher < 0)
+                argp_error(state, "cipher must be inherit, aes, chacha20 or none");
+        }
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_usage(state);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static struct argp argp = {options, parse_cipher_opt, args_doc, doc, 0, 0, 0};
+
+int main(int argc, char *argv[])
+{
+    struct cipher_arguments arguments = {NULL, -1};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    int fd = open(arguments.path, O_RDONLY);
+    if (fd == -1) {
+        printf("Could not open %s: %s\n", arguments.path, strerror(errno));
+        exit(1);
+    }
+
+    if (arguments.cipher >= 0) {
+        if (ioctl(fd, DEFFS_IOC_SET_CIPHER, &arguments.cipher) == -1) {
+            printf("Could not set the cipher of %s: %s\n", arguments.path, strerror(errno));
+            exit(1);
+        }
+    } else {
+        int cipher;
+        if (ioctl(fd, DEFFS_IOC_GET_CIPHER, &cipher) == -1) {
+            printf("Could not read the cipher of %s: %s\n", arguments.path, strerror(errno));
+            exit(1);
+        }
+
+        printf("%s\n", cipher_name(cipher));
+    }
+
+    close(fd);
+
+    return 0;
+}
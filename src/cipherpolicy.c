@@ -0,0 +1,77 @@
+/*
+* FILENAME: cipherpolicy.c
+*
+* DESCRIPTION: Choice of the cipher a new file is stored under. The cipher comes
+*              from the nearest directory above the file that has one, or from
+*              the mount, whose cipher defaults to the fastest one the CPU runs:
+*              AES where it has AES instructions and ChaCha20 where it does not.
+*              The choice is recorded in the file's header when the file is
+*              first written, so it never changes for the data already stored.
+*              Storing contents unencrypted with none has to be allowed by the
+*              mount.
+*
+* USAGE: if (file_cipher == DEFFS_CIPHER_INHERIT)
+*            file_cipher = cipher_fastest();
+*
+*        generate_file_key(&file_key);
+*        file_key.cipher = cipher_policy_file(path);
+*        header_set_cipher(&header, file_key.cipher);
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "cipherpolicy.h"
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+// Cipher of the mount, DEFFS_CIPHER_INHERIT until it is chosen at startup
+int file_cipher = DEFFS_CIPHER_INHERIT;
+
+// Whether the mount and its directories may choose DEFFS_CIPHER_NONE
+int cipher_none_allowed = 0;
+
+// Ciphers of directories
+static struct dirpolicy cipher_policy = DIRPOLICY_INIT(CIPHER_POLICY_XATTR, DEFFS_CIPHER_NONE,
+                                                       cipher_name, cipher_value, &file_cipher);
+
+int cipher_fastest(void)
+{
+    // Without AES instructions, AES runs from lookup tables at a fraction of ChaCha20's speed
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("aes") ? DEFFS_CIPHER_AES : DEFFS_CIPHER_CHACHA20;
+#elif defined(__aarch64__) && defined(HWCAP_AES)
+    return getauxval(AT_HWCAP) & HWCAP_AES ? DEFFS_CIPHER_AES : DEFFS_CIPHER_CHACHA20;
+#else
+    return DEFFS_CIPHER_CHACHA20;
+#endif
+}
+
+int cipher_policy_file(const char path[])
+{
+    // A directory set to none under a mount that allowed it gets the mount's cipher otherwise
+    int cipher = dirpolicy_file(&cipher_policy, path);
+    if (cipher == DEFFS_CIPHER_NONE && !cipher_none_allowed)
+        return file_cipher == DEFFS_CIPHER_NONE ? cipher_fastest() : file_cipher;
+
+    return cipher;
+}
+
+int cipher_policy_dir(const char path[])
+{
+    return dirpolicy_dir(&cipher_policy, path);
+}
+
+int cipher_policy_set(const char path[], int cipher)
+{
+    if (cipher == DEFFS_CIPHER_NONE && !cipher_none_allowed)
+        return -EPERM;
+
+    return dirpolicy_set(&cipher_policy, path, cipher);
+}
+
+void cipher_policy_forget(void)
+{
+    dirpolicy_forget(&cipher_policy);
+}
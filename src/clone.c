@@ -0,0 +1,126 @@
+/*
+* FILENAME: clone.c
+*
+* DESCRIPTION: Command line tool that copies a file inside a DEFFS mount without
+*              moving its data. It asks the filesystem, through an ioctl on the
+*              destination, to make the destination share the source's shards and
+*              key. Both files copy on write afterwards, so the copy takes the same
+*              few milliseconds whatever the size of the source.
+*
+* USAGE: cmake --build ./ --target DEFFS-clone -- -j 6
+*        ./bin/DEFFS-clone ~/deffs/disk.img ~/deffs/disk-copy.img
+*
+* AUTHOR: Charles Averill
+*/
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "clone.h"
+
+const char *argp_program_version     = "DEFFS-clone 0.0.2";
+const char *argp_program_bug_address = "charles.averill@utdallas.edu";
+static char doc[]                    = "Copy a file inside a DEFFS mount by sharing its shards";
+static char args_doc[]               = "SOURCE DEST";
+
+static struct argp_option options[] = {{0}};
+
+static error_t parse_clone_opt(int key, char *arg, struct argp_state *state)
+{
+    char **paths = state->input;
+
+    switch (key) {
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 1)
+            argp_usage(state);
+        paths[state->arg_num] = arg;
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 2)
+            argp_usage(state);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static struct argp argp = {options, parse_clone_opt, args_doc, doc, 0, 0, 0};
+
+static int _mount_root(const char path[], dev_t dev, char root[])
+{
+    // Walk up from path until the parent lives on another device
+    strcpy(root, path);
+
+    while (strcmp(root, "/") != 0) {
+        char parent[PATH_MAX];
+        char *slash = strrchr(root, '/');
+        size_t len  = slash == root ? 1 : (size_t)(slash - root);
+
+        memcpy(parent, root, len);
+        parent[len] = '\0';
+
+        struct stat st;
+        if (stat(parent, &st) == -1)
+            return -errno;
+        if (st.st_dev != dev)
+            break;
+
+        strcpy(root, parent);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *paths[2];
+    argp_parse(&argp, argc, argv, 0, 0, paths);
+
+    char source[PATH_MAX];
+    struct stat source_st;
+    if (realpath(paths[0], source) == NULL || stat(source, &source_st) == -1) {
+        printf("Could not find %s: %s\n", paths[0], strerror(errno));
+        exit(1);
+    }
+
+    int fd = open(paths[1], O_WRONLY | O_CREAT, source_st.st_mode & 0777);
+    struct stat dest_st;
+    if (fd == -1 || fstat(fd, &dest_st) == -1) {
+        printf("Could not open %s: %s\n", paths[1], strerror(errno));
+        exit(1);
+    }
+
+    if (dest_st.st_dev != source_st.st_dev) {
+        printf("%s and %s are not in the same DEFFS mount\n", paths[0], paths[1]);
+        exit(1);
+    }
+
+    // The filesystem resolves the source relative to its own root
+    char root[PATH_MAX];
+    if (_mount_root(source, source_st.st_dev, root) != 0) {
+        printf("Could not find the mount containing %s\n", paths[0]);
+        exit(1);
+    }
+
+    struct deffs_clone_args args;
+    snprintf(args.source, sizeof(args.source), "%s",
+             strcmp(root, "/") == 0 ? source : source + strlen(root));
+
+    if (ioctl(fd, DEFFS_IOC_CLONE, &args) == -1) {
+        printf("Could not clone %s to %s: %s\n", paths[0], paths[1], strerror(errno));
+        exit(1);
+    }
+
+    close(fd);
+
+    return 0;
+}
@@ -12,6 +12,9 @@
 *        struct EncryptionData *plain = get_plaintext(cipher->ciphertext, cipher->key);
 *        printf("Cipher text: --%s--\n", plain->plaintext);
 *
+*        free_encryption_data(cipher);
+*        free_encryption_data(plain);
+*
 * AUTHOR: Charles Averill
 */
 
@@ -31,7 +34,7 @@ struct EncryptionData *get_ciphertext(char *plaintext)
     }
 
     // Set plaintext before any operations in case of mangling by OpenSSL
-    output->plaintext = malloc(strlen(plaintext));
+    output->plaintext = malloc(strlen(plaintext) + 1);
     if (output->plaintext == NULL) {
         free(output);
         return NULL;
@@ -39,7 +42,11 @@ struct EncryptionData *get_ciphertext(char *plaintext)
     strcpy(output->plaintext, plaintext);
 
     // Fill the key with random values
-    random_string(key, 17);
+    if (random_string(key, 16) != 0) {
+        free(output->plaintext);
+        free(output);
+        return NULL;
+    }
 
     printf("Key: %s\n", key);
     AES_set_encrypt_key((const unsigned char *)key, 128, &AES_key);
@@ -50,8 +57,9 @@ struct EncryptionData *get_ciphertext(char *plaintext)
     // Assign key and ciphertext to returned struct
     strcpy(output->key, key);
 
-    output->ciphertext = malloc(strlen(ciphertext));
+    output->ciphertext = malloc(strlen(ciphertext) + 1);
     if (output->ciphertext == NULL) {
+        free(output->plaintext);
         free(output);
         return NULL;
     }
@@ -73,7 +81,7 @@ struct EncryptionData *get_ciphertext_with_key(char *plaintext, unsigned char ke
     }
 
     // Set plaintext before any operations in case of mangling by OpenSSL
-    output->plaintext = malloc(strlen(plaintext));
+    output->plaintext = malloc(strlen(plaintext) + 1);
     if (output->plaintext == NULL) {
         free(output);
         return NULL;
@@ -83,13 +91,14 @@ struct EncryptionData *get_ciphertext_with_key(char *plaintext, unsigned char ke
     AES_set_encrypt_key((const unsigned char *)key, 128, &AES_key);
 
     // Encrypt plaintext
-    AES_encrypt("bruh", ciphertext, &AES_key);
+    AES_encrypt(plaintext, ciphertext, &AES_key);
 
     // Assign key and ciphertext to returned struct
     strcpy(output->key, key);
 
-    output->ciphertext = malloc(strlen(ciphertext));
+    output->ciphertext = malloc(strlen(ciphertext) + 1);
     if (output->ciphertext == NULL) {
+        free(output->plaintext);
         free(output);
         return NULL;
     }
@@ -117,8 +126,9 @@ struct EncryptionData *get_plaintext(char ciphertext[], unsigned char key[16])
 
     // Assign values to returned struct
     strcpy(output->key, key);
+    output->ciphertext = NULL;
 
-    output->plaintext = malloc(strlen(plaintext));
+    output->plaintext = malloc(strlen(plaintext) + 1);
     if (output->plaintext == NULL) {
         free(output);
         return NULL;
@@ -129,6 +139,230 @@ struct EncryptionData *get_plaintext(char ciphertext[], unsigned char key[16])
     return output;
 }
 
+void free_encryption_data(struct EncryptionData *data)
+{
+    if (data == NULL)
+        return;
+
+    free(data->plaintext);
+    free(data->ciphertext);
+    free(data);
+}
+
+int generate_file_key(struct FileKey *file_key)
+{
+    // Every bit of the key is random, never drawn from a printable alphabet
+    if (RAND_bytes(file_key->key, FILE_KEY_LEN) != 1)
+        return -EIO;
+
+    file_key->key[FILE_KEY_LEN] = '\0';
+    expand_file_key(file_key);
+
+    return 0;
+}
+
+void expand_file_key(struct FileKey *file_key)
+{
+    // Files that do not say otherwise are stored under AES
+    file_key->cipher = DEFFS_CIPHER_AES;
+
+    struct hash_ctx ctx;
+    hash_init(&ctx);
+    hash_update(&ctx, "DEFFS chacha20", strlen("DEFFS chacha20"));
+    hash_update(&ctx, file_key->key, FILE_KEY_LEN);
+    hash_final(&ctx, file_key->chacha_key);
+
+    // The tag key is kept apart from the cipher key. Its HMAC pads are hashed once here,
+    // so tagging a block costs two hash passes and no key setup
+    unsigned char tag_key[HASH_LEN];
+    hash_init(&ctx);
+    hash_update(&ctx, "DEFFS block tag", strlen("DEFFS block tag"));
+    hash_update(&ctx, file_key->key, FILE_KEY_LEN);
+    hash_final(&ctx, tag_key);
+
+    unsigned char inner_pad[HASH_BLOCK_LEN], outer_pad[HASH_BLOCK_LEN];
+    memset(inner_pad, 0x36, sizeof(inner_pad));
+    memset(outer_pad, 0x5c, sizeof(outer_pad));
+    for (size_t i = 0; i < sizeof(tag_key); i++) {
+        inner_pad[i] ^= tag_key[i];
+        outer_pad[i] ^= tag_key[i];
+    }
+
+    hash_init(&file_key->tag_inner);
+    hash_update(&file_key->tag_inner, inner_pad, sizeof(inner_pad));
+    hash_init(&file_key->tag_outer);
+    hash_update(&file_key->tag_outer, outer_pad, sizeof(outer_pad));
+}
+
+static void _index_bytes(uint64_t index, unsigned char out[8])
+{
+    for (int i = 0; i < 8; i++) {
+        out[i] = index >> (8 * i);
+    }
+}
+
+int file_key_nonces(unsigned char (*nonces)[FILE_KEY_NONCE_LEN], size_t n_nonces)
+{
+    // Random nonces never need to be kept in step between the shards, snapshots and clones that
+    // share a file key
+    if (RAND_bytes(nonces[0], n_nonces * FILE_KEY_NONCE_LEN) != 1)
+        return -EIO;
+
+    return 0;
+}
+
+void file_key_tag(const struct FileKey *file_key, uint64_t index,
+                  const unsigned char nonce[FILE_KEY_NONCE_LEN], const unsigned char *data,
+                  size_t len, unsigned char tag[FILE_KEY_TAG_LEN])
+{
+    // The block index is part of the tag, so a block cannot be moved to another position, and
+    // so is the nonce of encrypted data, so it cannot be swapped for another
+    unsigned char index_bytes[8];
+    _index_bytes(index, index_bytes);
+
+    unsigned char digest[HASH_LEN];
+    struct hash_ctx ctx = file_key->tag_inner;
+    hash_update(&ctx, index_bytes, sizeof(index_bytes));
+    if (nonce != NULL)
+        hash_update(&ctx, nonce, FILE_KEY_NONCE_LEN);
+    hash_update(&ctx, data, len);
+    hash_final(&ctx, digest);
+
+    ctx = file_key->tag_outer;
+    hash_update(&ctx, digest, sizeof(digest));
+    hash_final(&ctx, tag);
+}
+
+void file_key_tag_many(const struct FileKey *file_key, uint64_t first_index,
+                       unsigned char (*nonces)[FILE_KEY_NONCE_LEN],
+                       const unsigned char *data, size_t unit_len, size_t n_units,
+                       unsigned char (*tags)[FILE_KEY_TAG_LEN])
+{
+    // Tags n_units consecutive units of unit_len bytes, the same as file_key_tag on each, with
+    // as many units hashed side by side as the hash engine takes
+    for (size_t first = 0; first < n_units; first += HASH_LANES) {
+        size_t lanes = n_units - first < HASH_LANES ? n_units - first : HASH_LANES;
+        struct hash_ctx ctxs[HASH_LANES];
+        const unsigned char *units[HASH_LANES];
+        unsigned char digests[HASH_LANES][HASH_LEN];
+
+        for (size_t i = 0; i < lanes; i++) {
+            unsigned char index_bytes[8];
+            _index_bytes(first_index + first + i, index_bytes);
+
+            ctxs[i] = file_key->tag_inner;
+            hash_update(&ctxs[i], index_bytes, sizeof(index_bytes));
+            hash_update(&ctxs[i], nonces[first + i], FILE_KEY_NONCE_LEN);
+            units[i] = data + (first + i) * unit_len;
+        }
+
+        hash_update_many(ctxs, units, unit_len, lanes);
+        hash_final_many(ctxs, lanes, digests);
+
+        for (size_t i = 0; i < lanes; i++) {
+            ctxs[i]  = file_key->tag_outer;
+            units[i] = digests[i];
+        }
+
+        hash_update_many(ctxs, units, HASH_LEN, lanes);
+        hash_final_many(ctxs, lanes, &tags[first]);
+    }
+}
+
+// Cipher context of each thread, keyed with the last file key the thread used
+struct cipher_state {
+    EVP_CIPHER_CTX *ctx;
+    int cipher;
+    unsigned char key[FILE_KEY_LEN];
+};
+
+static __thread struct cipher_state cipher_state;
+
+static EVP_CIPHER_CTX *_keyed_context(const struct FileKey *file_key)
+{
+    // Reads and writes come in runs on the same file, so the key schedule is usually reused
+    struct cipher_state *state = &cipher_state;
+
+    if (state->ctx == NULL && (state->ctx = EVP_CIPHER_CTX_new()) == NULL)
+        return NULL;
+
+    if (state->cipher == file_key->cipher && memcmp(state->key, file_key->key, FILE_KEY_LEN) == 0)
+        return state->ctx;
+
+    int res;
+    if (file_key->cipher == DEFFS_CIPHER_CHACHA20)
+        res = EVP_EncryptInit_ex(state->ctx, EVP_chacha20(), NULL, file_key->chacha_key, NULL);
+    else
+        res = EVP_EncryptInit_ex(state->ctx, EVP_aes_128_ctr(), NULL, file_key->key, NULL);
+
+    // A context left half keyed must not be mistaken for one keyed with this file key
+    if (res != 1) {
+        state->cipher = DEFFS_CIPHER_INHERIT;
+        return NULL;
+    }
+
+    state->cipher = file_key->cipher;
+    memcpy(state->key, file_key->key, FILE_KEY_LEN);
+
+    return state->ctx;
+}
+
+static void _set_iv(int cipher, const unsigned char nonce[], uint32_t counter,
+                    unsigned char ivec[16])
+{
+    // The nonce takes 96 bits and the counter 32. AES counts big-endian after the nonce,
+    // ChaCha20 little-endian before it
+    unsigned char *counter_bytes = cipher == DEFFS_CIPHER_CHACHA20 ? ivec : ivec + 12;
+    unsigned char *nonce_bytes   = cipher == DEFFS_CIPHER_CHACHA20 ? ivec + 4 : ivec;
+
+    memcpy(nonce_bytes, nonce, FILE_KEY_NONCE_LEN);
+    for (int i = 0; i < 4; i++) {
+        if (cipher == DEFFS_CIPHER_CHACHA20)
+            counter_bytes[i] = counter >> (8 * i);
+        else
+            counter_bytes[3 - i] = counter >> (8 * i);
+    }
+}
+
+int file_key_crypt(const struct FileKey *file_key, const unsigned char *in, unsigned char *out,
+                   size_t len, uint64_t offset, const unsigned char nonce[FILE_KEY_NONCE_LEN])
+{
+    // A stream cipher under the given nonce, whose counter is the cipher block of each byte
+    // from the start of what the nonce covers. Any byte range can be encrypted or decrypted on
+    // its own and matches a single pass over the whole. Both ciphers run through EVP, which
+    // uses the CPU's AES or vector instructions
+    if (file_key->cipher == DEFFS_CIPHER_NONE) {
+        if (in != out)
+            memmove(out, in, len);
+        return 0;
+    }
+
+    size_t block_len = file_key->cipher == DEFFS_CIPHER_CHACHA20 ? 64 : AES_BLOCK_SIZE;
+    EVP_CIPHER_CTX *ctx = _keyed_context(file_key);
+    if (ctx == NULL)
+        return -EIO;
+
+    unsigned char ivec[16];
+    _set_iv(file_key->cipher, nonce, offset / block_len, ivec);
+    if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, ivec) != 1)
+        return -EIO;
+
+    // Starting mid-block, skip the keystream that belongs to the bytes before the offset
+    unsigned char skip[64] = {0};
+    int out_len;
+    if (offset % block_len != 0 &&
+        EVP_EncryptUpdate(ctx, skip, &out_len, skip, offset % block_len) != 1)
+        return -EIO;
+
+    for (size_t done = 0; done < len; done += out_len) {
+        int step = len - done < INT_MAX / 2 ? len - done : INT_MAX / 2;
+        if (EVP_EncryptUpdate(ctx, out + done, &out_len, in + done, step) != 1)
+            return -EIO;
+    }
+
+    return 0;
+}
+
 EncryptionData *get_encrypted_shards(char *plaintext)
 {
     // Encrypt plaintext
@@ -137,18 +371,10 @@ EncryptionData *get_encrypted_shards(char *plaintext)
     return cipher;
 }
 
-void get_sha256_hash(char *plaintext, char *obuf)
+void get_sha256_hash(const char *data, size_t len, char *obuf)
 {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-
-    SHA256_Update(&sha256, plaintext, strlen(plaintext));
-    SHA256_Final(hash, &sha256);
-
-    int i = 0;
-    for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(obuf + (i * 2), "%02x", hash[i]);
-    }
-    obuf[64] = '\0';
+    // obuf takes the digest in hex, HASH_LEN * 2 + 1 bytes
+    unsigned char hash[HASH_LEN];
+    hash_digest(data, len, hash);
+    hash_hex(hash, HASH_LEN, obuf);
 }
@@ -0,0 +1,273 @@
+/*
+* FILENAME: cryptpool.c
+*
+* DESCRIPTION: A pool of crypto worker threads that share large buffers with the
+*              FUSE thread. A buffer is cut into crypto_chunk_size chunks that are
+*              encrypted independently. Because the file cipher is counter mode
+*              under a nonce per block, every chunk writes its own slice of the
+*              output and the result is bit-identical to a single serial pass. The
+*              calling thread works on chunks too and returns only once all of them
+*              are done, so callers see ordinary blocking calls. Block tags are
+*              spread over the same workers, whole blocks per chunk.
+*
+* USAGE: crypto_pool_start();
+*
+*        crypto_pool_crypt(&file_key, plaintext, ciphertext, len, offset, nonces);
+*        crypto_pool_crypt(&file_key, ciphertext, plaintext, len, offset, nonces);
+*        crypto_pool_tag(&file_key, ciphertext, DEFFS_BLOCK_SIZE, first_block, n_blocks, nonces,
+*                        tags);
+*
+*        crypto_pool_stop();
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "cryptpool.h"
+
+int crypto_workers       = -1;
+size_t crypto_chunk_size = 64 * 1024;
+
+// One buffer being processed. It lives on the caller's stack until every chunk is done
+struct crypto_job {
+    const struct FileKey *file_key;
+    const unsigned char *in;
+    unsigned char *out;
+    size_t len;
+    uint64_t offset;
+
+    // Nonces of the blocks from the one holding offset, or of the units being tagged
+    unsigned char (*nonces)[FILE_KEY_NONCE_LEN];
+
+    // Tag jobs tag every unit_len bytes of in, starting at tag index offset
+    unsigned char (*tags)[FILE_KEY_TAG_LEN];
+    size_t unit_len;
+
+    size_t chunk_len;
+    size_t n_chunks;
+    size_t next_chunk;
+    size_t done_chunks;
+    int error; // first error of any chunk
+
+    struct crypto_job *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond  = PTHREAD_COND_INITIALIZER;
+
+static struct crypto_job *queue_head;
+static struct crypto_job *queue_tail;
+
+static pthread_t workers[CRYPTO_POOL_MAX_WORKERS];
+static int n_running;
+static int pool_stopping;
+
+static int _run_chunk(struct crypto_job *job, size_t chunk)
+{
+    size_t start = chunk * job->chunk_len;
+    size_t len   = job->len - start < job->chunk_len ? job->len - start : job->chunk_len;
+
+    if (job->tags != NULL) {
+        size_t first_unit = start / job->unit_len;
+        file_key_tag_many(job->file_key, job->offset + first_unit, &job->nonces[first_unit],
+                          job->in + first_unit * job->unit_len, job->unit_len,
+                          len / job->unit_len, &job->tags[first_unit]);
+        return 0;
+    }
+
+    // Each block's part of the chunk is under that block's nonce
+    int res = 0;
+    size_t step;
+    for (size_t done = 0; res == 0 && done < len; done += step) {
+        uint64_t pos = job->offset + start + done;
+        uint64_t at  = pos % DEFFS_BLOCK_SIZE;
+        step         = len - done < DEFFS_BLOCK_SIZE - at ? len - done : DEFFS_BLOCK_SIZE - at;
+
+        res = file_key_crypt(job->file_key, job->in + start + done, job->out + start + done,
+                             step, at, job->nonces[block_of(pos) - block_of(job->offset)]);
+    }
+
+    return res;
+}
+
+static size_t _claim_chunk(struct crypto_job *job)
+{
+    // Called with pool_lock held. Jobs leave the queue once their last chunk is claimed
+    size_t chunk = job->next_chunk++;
+
+    if (job->next_chunk == job->n_chunks) {
+        struct crypto_job **link = &queue_head;
+        struct crypto_job *prev  = NULL;
+
+        while (*link != job) {
+            prev = *link;
+            link = &(*link)->next;
+        }
+
+        *link = job->next;
+        if (queue_tail == job)
+            queue_tail = prev;
+    }
+
+    return chunk;
+}
+
+static void _finish_chunk(struct crypto_job *job, int res)
+{
+    // Called with pool_lock held
+    if (res < 0 && job->error == 0)
+        job->error = res;
+
+    if (++job->done_chunks == job->n_chunks)
+        pthread_cond_broadcast(&done_cond);
+}
+
+static void *_worker_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&pool_lock);
+
+    while (1) {
+        while (queue_head == NULL && !pool_stopping)
+            pthread_cond_wait(&work_cond, &pool_lock);
+
+        if (queue_head == NULL)
+            break;
+
+        struct crypto_job *job = queue_head;
+        size_t chunk           = _claim_chunk(job);
+
+        pthread_mutex_unlock(&pool_lock);
+        int res = _run_chunk(job, chunk);
+        pthread_mutex_lock(&pool_lock);
+
+        _finish_chunk(job, res);
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    return NULL;
+}
+
+int crypto_pool_start(void)
+{
+    int n_workers = crypto_workers;
+
+    // By default, one worker per CPU besides the one running the FUSE thread
+    if (n_workers < 0)
+        n_workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (n_workers > CRYPTO_POOL_MAX_WORKERS)
+        n_workers = CRYPTO_POOL_MAX_WORKERS;
+
+    pool_stopping = 0;
+
+    for (n_running = 0; n_running < n_workers; n_running++) {
+        if (pthread_create(&workers[n_running], NULL, _worker_thread, NULL) != 0) {
+            crypto_pool_stop();
+            return -EAGAIN;
+        }
+    }
+
+    return 0;
+}
+
+void crypto_pool_stop(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = 1;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 0; i < n_running; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    n_running = 0;
+}
+
+static void _run_job(struct crypto_job *job)
+{
+    if (n_running == 0 || job->n_chunks == 1) {
+        // Not worth a hand-off, run every chunk here
+        for (size_t chunk = 0; job->error == 0 && chunk < job->n_chunks; chunk++) {
+            job->error = _run_chunk(job, chunk);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+
+    if (queue_tail != NULL)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    pthread_cond_broadcast(&work_cond);
+
+    // Help out instead of idling, then wait for chunks still held by workers
+    while (job->next_chunk < job->n_chunks) {
+        size_t chunk = _claim_chunk(job);
+
+        pthread_mutex_unlock(&pool_lock);
+        int res = _run_chunk(job, chunk);
+        pthread_mutex_lock(&pool_lock);
+
+        _finish_chunk(job, res);
+    }
+
+    while (job->done_chunks < job->n_chunks)
+        pthread_cond_wait(&done_cond, &pool_lock);
+
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void _job_init(struct crypto_job *job, const struct FileKey *file_key, const char *in,
+                      char *out, size_t len, uint64_t offset, size_t chunk_len)
+{
+    job->file_key    = file_key;
+    job->in          = (const unsigned char *)in;
+    job->out         = (unsigned char *)out;
+    job->len         = len;
+    job->offset      = offset;
+    job->nonces      = NULL;
+    job->tags        = NULL;
+    job->unit_len    = 0;
+    job->chunk_len   = chunk_len;
+    job->n_chunks    = len == 0 ? 1 : (len + chunk_len - 1) / chunk_len;
+    job->next_chunk  = 0;
+    job->done_chunks = 0;
+    job->error       = 0;
+    job->next        = NULL;
+}
+
+int crypto_pool_crypt(const struct FileKey *file_key, const char *in, char *out, size_t len,
+                      uint64_t offset, unsigned char (*nonces)[FILE_KEY_NONCE_LEN])
+{
+    struct crypto_job job;
+    _job_init(&job, file_key, in, out, len, offset, crypto_chunk_size);
+    job.nonces = nonces;
+
+    _run_job(&job);
+
+    return job.error;
+}
+
+void crypto_pool_tag(const struct FileKey *file_key, const char *in, size_t unit_len,
+                     uint64_t first_index, size_t n_units,
+                     unsigned char (*nonces)[FILE_KEY_NONCE_LEN],
+                     unsigned char (*tags)[FILE_KEY_TAG_LEN])
+{
+    // Chunks hold whole units, as close to crypto_chunk_size as they fit
+    size_t units_per_chunk = crypto_chunk_size / unit_len > 0 ? crypto_chunk_size / unit_len : 1;
+
+    struct crypto_job job;
+    _job_init(&job, file_key, in, NULL, n_units * unit_len, first_index,
+              units_per_chunk * unit_len);
+    job.nonces   = nonces;
+    job.tags     = tags;
+    job.unit_len = unit_len;
+
+    if (n_units > 0)
+        _run_job(&job);
+}
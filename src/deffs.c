@@ -1,8 +1,9 @@
 /*
 * FILENAME: deffs.c
 *
-* DESCRIPTION: Main DEFFS logic, including binding DEFFS methods to FUSE
-*                callbacks. Compiles to executable that mounts DEFFS filesystem.
+* DESCRIPTION: Command line front end of DEFFS. Parses options into the
+*                settings of libdeffs and hands its callbacks to FUSE. Compiles
+*                to executable that mounts DEFFS filesystem.
 *
 * USAGE: cmake --build ./ --target DEFFS -- -j 6
 *        mkdir ~/deffs
@@ -14,102 +15,29 @@
 
 #define FUSE_USE_VERSION 29
 
-#include "deffs.h"
+#include "libdeffs.h"
 #include "utils.h"
 
 #include "arguments.h"
 #include "attr.h"
+#include "bufpool.h"
+#include "cipherpolicy.h"
 #include "crypto.h"
-#include "perms.h"
+#include "cryptpool.h"
+#include "header.h"
+#include "keystore.h"
+#include "lease.h"
+#include "leasemgr.h"
+#include "metastore.h"
+#include "pagecache.h"
+#include "reclaim.h"
+#include "recorder.h"
+#include "replica.h"
 #include "rw.h"
-#include "shamir.h"
-
-char *mountpoint;
-char *storepoint;
-char *shardpoint;
-
-static struct fuse_operations deffs_oper = {
-    .init     = deffs_init,
-    .destroy  = NULL, //deffs_destroy,
-    .getattr  = deffs_getattr,
-    .fgetattr = deffs_fgetattr,
-#ifndef __APPLE__
-    .access = deffs_access,
-#endif
-    .readlink   = deffs_readlink,
-    .opendir    = deffs_opendir,
-    .readdir    = deffs_readdir,
-    .releasedir = deffs_releasedir,
-    .mknod      = NULL, //deffs_mknod,
-    .mkdir      = deffs_mkdir,
-    .symlink    = deffs_symlink,
-    .unlink     = deffs_unlink,
-    .rmdir      = deffs_rmdir,
-    .rename     = deffs_rename,
-    .link       = deffs_link,
-    .chmod      = deffs_chmod,
-    .chown      = deffs_chown,
-    .truncate   = deffs_truncate,
-    .ftruncate  = deffs_ftruncate,
-#ifdef HAVE_UTIMENSAT
-    .utimens = deffs_utimens,
-#endif
-    .create   = deffs_create,
-    .open     = deffs_open,
-    .read     = deffs_read,
-    .read_buf = NULL, //deffs_read_buf,
-    .write    = deffs_write,
-    .write_buf =
-        NULL, //deffs_write_buf, // This one could be implemented but it's different enough from write that I don't want to yet
-    .statfs  = deffs_statfs,
-    .flush   = deffs_flush,
-    .release = deffs_release,
-    .fsync   = NULL, //deffs_fsync,
-#if defined(HAVE_POSIX_FALLOCATE) || defined(__APPLE__)
-    .fallocate = deffs_fallocate,
-#endif
-#ifdef HAVE_SETXATTR
-    .setxattr    = deffs_setxattr,
-    .getxattr    = deffs_getxattr,
-    .listxattr   = deffs_listxattr,
-    .removexattr = deffs_removexattr,
-#endif
-#ifndef __APPLE__
-    .lock  = NULL, //deffs_lock,
-    .flock = NULL, //deffs_flock,
-#endif
-#ifdef __APPLE__
-    .setvolname  = NULL, //deffs_setvolname,
-    .exchange    = NULL, //deffs_exchange,
-    .getxtimes   = NULL, //deffs_getxtimes,
-    .setbkuptime = NULL, //deffs_setbkuptime,
-    .setchgtime  = NULL, //deffs_setchgtime,
-    .setcrtime   = NULL, //deffs_setcrtime,
-    .chflags     = NULL, //deffs_chflags,
-    .setattr_x   = NULL, //deffs_setattr_x,
-    .fsetattr_x  = NULL, //deffs_fsetattr_x,
-#endif
-    .flag_nullpath_ok = 1,
-#if HAVE_UTIMENSAT
-    .flag_utime_omit_ok = 1,
-#endif
-};
-
-void *deffs_init(struct fuse_conn_info *conn)
-{
-#ifdef __APPLE__
-    FUSE_ENABLE_SETVOLNAME(conn);
-    FUSE_ENABLE_XTIMES(conn);
-#endif
-    // Create the shardpoint directory
-    if (mkdir_if_not_exists(shardpoint, 0700) != 0) {
-        printf("%s", "Shards directory detected. When mounting DEFFS, use a fresh mountpoint and "
-                     "storepoint");
-        exit(1);
-    }
-
-    return NULL;
-}
+#include "scrub.h"
+#include "segment.h"
+#include "shards.h"
+#include "tier.h"
 
 const char *argp_program_version     = "DEFFS 0.0.2";
 const char *argp_program_bug_address = "charles.averill@utdallas.edu";
@@ -121,44 +49,204 @@ static struct argp_option options[] = {
     {"quiet", 'q', 0, 0, "Don't produce any output"},
     {"silent", 's', 0, OPTION_ALIAS},
     {"output", 'o', "FILE", 0, "Output to FILE instead of standard output"},
+    {"fanout-depth", OPT_FANOUT_DEPTH, "DEPTH", 0,
+     "Number of hex-prefix directory levels under .shards (default 2, 0 for a flat store)"},
+    {"fanout-width", OPT_FANOUT_WIDTH, "WIDTH", 0,
+     "Hex characters of the shard hash used per directory level (default 2)"},
+    {"segments", OPT_SEGMENTS, 0, 0, "Pack shards into append-only segment files"},
+    {"segment-size", OPT_SEGMENT_SIZE, "MIB", 0, "Size at which a segment is sealed (default 64)"},
+    {"gc-ratio", OPT_GC_RATIO, "RATIO", 0,
+     "Dead fraction at which a sealed segment is compacted (default 0.5)"},
+    {"gc-rate", OPT_GC_RATE, "MIBPS", 0,
+     "Bandwidth limit for segment compaction in MiB/s, 0 for unlimited (default 16)"},
+    {"inline-threshold", OPT_INLINE_THRESHOLD, "BYTES", 0,
+     "Keep encrypted payloads up to BYTES in the header record, 0 to disable (default 512)"},
+    {"key-target", OPT_KEY_TARGET, "DIR", 0,
+     "Directory that receives key shares, repeat to spread shares (default <storepoint>/.shards/keys)"},
+    {"key-shares", OPT_KEY_SHARES, "N", 0, "Number of Shamir shares per file key (default 3)"},
+    {"key-threshold", OPT_KEY_THRESHOLD, "K", 0,
+     "Number of shares needed to rebuild a file key (default 2)"},
+    {"key-cache", OPT_KEY_CACHE, "N", 0, "Number of reconstructed file keys kept (default 4096)"},
+    {"crypto-workers", OPT_CRYPTO_WORKERS, "N", 0,
+     "Threads that encrypt large buffers, 0 to encrypt on the FUSE thread (default one per extra CPU)"},
+    {"crypto-chunk", OPT_CRYPTO_CHUNK, "KIB", 0,
+     "Size of the chunks a buffer is split into for the crypto workers (default 64)"},
+    {"buffer-cache", OPT_BUFFER_CACHE, "MIB", 0,
+     "Free I/O buffers each thread keeps for reuse (default 64)"},
+    {"stream-window", OPT_STREAM_WINDOW, "KIB", 0,
+     "Largest buffer a single request streams data through (default 1024)"},
+    {"scrub-rate", OPT_SCRUB_RATE, "MIBPS", 0,
+     "Bandwidth limit for background scrubbing in MiB/s, 0 for unlimited (default 8)"},
+    {"scrub-interval", OPT_SCRUB_INTERVAL, "SECONDS", 0,
+     "Time between the starts of scrub passes, 0 to disable scrubbing (default 86400)"},
+    {"scrub-share", OPT_SCRUB_SHARE, "PERCENT", 0,
+     "Largest share of the time the scrubber may hold the filesystem (default 10)"},
+    {"index-threads", OPT_INDEX_THREADS, "N", 0,
+     "Threads that rebuild a stale metadata index on mount (default one per CPU)"},
+    {"reclaim-rate", OPT_RECLAIM_RATE, "N", 0,
+     "Shards released per second in the background after unlink, 0 for unlimited (default 1024)"},
+    {"capacity-tier", OPT_CAPACITY_TIER, "DIR", 0,
+     "Directory on a larger, slower device that cold shards move to (default none)"},
+    {"tier-fast-size", OPT_TIER_FAST_SIZE, "MIB", 0,
+     "Space shards may take in the shardpoint before the coldest move, 0 for no limit (default 0)"},
+    {"tier-cold-age", OPT_TIER_COLD_AGE, "SECONDS", 0,
+     "Time without access after which a shard moves to the capacity tier (default 86400)"},
+    {"tier-rate", OPT_TIER_RATE, "MIBPS", 0,
+     "Bandwidth limit for moving shards between tiers in MiB/s, 0 for unlimited (default 16)"},
+    {"replica-target", OPT_REPLICA_TARGET, "DIR", 0,
+     "Directory that receives a copy of every shard, repeat for more copies (default none)"},
+    {"durability", OPT_DURABILITY, "LEVEL", 0,
+     "Replicas a write waits for unless its directory says otherwise: local, quorum or all "
+     "(default local)"},
+    {"replica-queue", OPT_REPLICA_QUEUE, "MIB", 0,
+     "Data queued for the replica targets before writes wait for them (default 64)"},
+    {"lease-listen", OPT_LEASE_LISTEN, "[HOST:]PORT", 0,
+     "Serve leases to the mounts sharing this store, on loopback unless HOST is given"},
+    {"lease-server", OPT_LEASE_SERVER, "[HOST:]PORT", 0,
+     "Cache only under leases from the manager at this address (default the one served)"},
+    {"cache-mode", OPT_CACHE_MODE, "MODE", 0,
+     "How the kernel caches files unless their directory says otherwise: none, keep or direct "
+     "(default keep)"},
+    {"hash-engine", OPT_HASH_ENGINE, "ENGINE", 0,
+     "SHA-256 implementation for shard names and block tags: auto, generic, avx2 or sha-ni "
+     "(default auto)"},
+    {"cipher", OPT_CIPHER, "CIPHER", 0,
+     "Cipher of new files unless their directory says otherwise: aes, chacha20 or none "
+     "(default aes on CPUs with AES instructions, chacha20 on others)"},
+    {"allow-plaintext", OPT_ALLOW_PLAINTEXT, 0, 0,
+     "Let the mount and its directories choose the cipher none"},
+    {"trace", OPT_TRACE, "FILE", 0,
+     "Record every filesystem call to FILE for DEFFS-replay, without file contents"},
     {0}};
 
 static struct argp argp = {options, parse_opt, args_doc, doc, 0, 0, 0};
 
+// Set by the mount's init when the store did not open
+static int start_failed;
+
+static void *_init(struct fuse_conn_info *conn)
+{
+    // deffs_init ends the session when the store does not open, and main exits with an error
+    void *private_data = deffs_init(conn);
+    start_failed       = !libdeffs_running();
+
+    return private_data;
+}
+
 int main(int argc, char *argv[])
 {
     // Argument parsing
     struct arguments arguments;
+    arguments.fanout_depth      = shard_fanout_depth;
+    arguments.fanout_width      = shard_fanout_width;
+    arguments.fanout_given      = 0;
+    arguments.segments          = segment_store_enabled;
+    arguments.segment_size      = segment_max_size / (1024 * 1024);
+    arguments.gc_ratio          = segment_gc_ratio;
+    arguments.gc_rate           = segment_gc_rate / (1024 * 1024);
+    arguments.inline_threshold  = inline_threshold;
+    arguments.n_key_targets     = 0;
+    arguments.key_shares        = key_shares;
+    arguments.key_threshold     = key_shares_required;
+    arguments.key_cache         = key_cache_capacity;
+    arguments.crypto_workers    = crypto_workers;
+    arguments.crypto_chunk      = crypto_chunk_size / 1024;
+    arguments.buffer_cache      = bufpool_thread_limit / (1024 * 1024);
+    arguments.stream_window     = stream_window_size / 1024;
+    arguments.scrub_rate        = scrub_rate / (1024 * 1024);
+    arguments.scrub_interval    = scrub_interval;
+    arguments.scrub_share       = scrub_share;
+    arguments.index_threads     = index_threads;
+    arguments.reclaim_rate      = reclaim_rate;
+    arguments.capacity_tier     = capacity_tier;
+    arguments.tier_fast_size    = tier_fast_size / (1024 * 1024);
+    arguments.tier_cold_age     = tier_cold_age;
+    arguments.tier_rate         = tier_rate / (1024 * 1024);
+    arguments.n_replica_targets = 0;
+    arguments.durability        = replica_durability;
+    arguments.replica_queue     = replica_queue_size / (1024 * 1024);
+    arguments.lease_listen      = lease_listen;
+    arguments.lease_server      = lease_server;
+    arguments.cache_mode        = cache_mode;
+    arguments.hash_engine       = hash_engine;
+    arguments.cipher            = file_cipher;
+    arguments.allow_plaintext   = cipher_none_allowed;
+    arguments.trace             = trace_path;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
+    shard_fanout_depth    = arguments.fanout_depth;
+    shard_fanout_width    = arguments.fanout_width;
+    shard_fanout_given    = arguments.fanout_given;
+    segment_store_enabled = arguments.segments;
+    segment_max_size      = (off_t)arguments.segment_size * 1024 * 1024;
+    segment_gc_ratio      = arguments.gc_ratio;
+    segment_gc_rate       = arguments.gc_rate * 1024 * 1024;
+    inline_threshold      = arguments.inline_threshold;
+    key_shares            = arguments.key_shares;
+    key_shares_required   = arguments.key_threshold;
+    key_cache_capacity    = arguments.key_cache;
+    crypto_workers        = arguments.crypto_workers;
+    crypto_chunk_size     = (size_t)arguments.crypto_chunk * 1024;
+    bufpool_thread_limit  = (size_t)arguments.buffer_cache * 1024 * 1024;
+    stream_window_size    = (size_t)arguments.stream_window * 1024;
+    scrub_rate            = arguments.scrub_rate * 1024 * 1024;
+    scrub_interval        = arguments.scrub_interval;
+    scrub_share           = arguments.scrub_share;
+    index_threads         = arguments.index_threads;
+    reclaim_rate          = arguments.reclaim_rate;
+    capacity_tier         = arguments.capacity_tier;
+    tier_fast_size        = arguments.tier_fast_size * 1024 * 1024;
+    tier_cold_age         = arguments.tier_cold_age;
+    tier_rate             = arguments.tier_rate * 1024 * 1024;
+    replica_durability    = arguments.durability;
+    replica_queue_size    = arguments.replica_queue * 1024 * 1024;
+    lease_listen          = arguments.lease_listen;
+    lease_server          = arguments.lease_server != NULL ? arguments.lease_server : lease_listen;
+    cache_mode            = arguments.cache_mode;
+    hash_engine           = arguments.hash_engine;
+    file_cipher           = arguments.cipher;
+    cipher_none_allowed   = arguments.allow_plaintext;
+    trace_path            = arguments.trace;
+
+    n_key_targets = arguments.n_key_targets;
+    memcpy(key_targets, arguments.key_targets, sizeof(char *) * n_key_targets);
+
+    n_replica_targets = arguments.n_replica_targets;
+    memcpy(replica_targets, arguments.replica_targets, sizeof(char *) * n_replica_targets);
+
     // Setup mount, store, and shardpoints
     mountpoint = arguments.points[0];
-    storepoint = arguments.points[1];
-
-    shardpoint = malloc(strlen(storepoint) + strlen("/.shards/") + 1);
-    strcpy(shardpoint, storepoint);
-    strcat(shardpoint, "/.shards/");
-    shardpoint[strlen(storepoint) + strlen("/.shards/") + 1] = '\0';
+    libdeffs_set_store(arguments.points[1]);
+
+    // Mounts sharing a store through leases each keep a metadata index of their own, named
+    // after the host and the mountpoint so that a remount finds it again
+    if (lease_server != NULL) {
+        char host[HOST_NAME_MAX + 1] = "";
+        gethostname(host, sizeof(host) - 1);
+
+        char owner[strlen(host) + strlen(mountpoint) + 2];
+        sprintf(owner, "%s:%s", host, mountpoint);
+        snprintf(metastore_name, sizeof(metastore_name), "meta-%016llx",
+                 (unsigned long long)path_hash(owner));
+    }
 
     char *static_argv[] = {argv[0], mountpoint, "-o", "allow_other", "-d", "-s", "-f"};
     int static_argc     = sizeof(static_argv) / sizeof(static_argv[0]);
 
-    unsigned long long int secret = 65;
-    int num_shards                = 4;
-    int num_required              = 3;
+    // Set before the recorder wraps the callbacks, so that init is traced as well
+    deffs_oper.init = _init;
 
-    struct pair shares[num_shards];
-    get_shares(secret, num_shards, num_required, shares);
-
-    for (int i = 0; i < num_shards; i++) {
-        printf("X: %lld, Y: %lld\n", shares[i].a, shares[i].b);
+    // Every call is recorded from here on, until the filesystem is unmounted
+    if (trace_path != NULL && recorder_start(&deffs_oper) != 0) {
+        printf("Could not create trace %s\n", trace_path);
+        exit(1);
     }
 
-    unsigned long long int recovered_secret = get_secret(shares, num_shards);
-
-    printf("Secret: %lld\nRecovered Secret: %lld\n", secret, recovered_secret);
-
     // Start FUSE
-    return fuse_main(static_argc, static_argv, &deffs_oper, NULL);
+    int res = fuse_main(static_argc, static_argv, &deffs_oper, NULL);
+    if (start_failed)
+        exit(1);
+
+    return res;
 }
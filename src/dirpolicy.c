@@ -0,0 +1,182 @@
+/*
+* FILENAME: dirpolicy.c
+*
+* DESCRIPTION: Settings that a directory holds for everything below it, such as
+*              the durability level or the cache mode. A directory's setting is
+*              kept by name in an extended attribute of the directory in the
+*              storepoint. A file gets the setting of the nearest directory above
+*              it that has one, or the mount's if none up to the root does.
+*              Settings read from directories are cached by path, and the whole
+*              cache is dropped whenever a setting changes or a directory moves.
+*
+* USAGE: static struct dirpolicy policy =
+*            DIRPOLICY_INIT("user.deffs.x", X_MAX, x_name, x_value, &mount_x);
+*
+*        int value = dirpolicy_file(&policy, path);
+*        res = dirpolicy_set(&policy, dir, value);
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "dirpolicy.h"
+
+static size_t _slot(struct dirpolicy *policy, const char path[])
+{
+    size_t capacity = 2 * DIRPOLICY_CACHE;
+    size_t i        = path_hash(path) & (capacity - 1);
+    while (policy->cache[i].path != NULL && strcmp(policy->cache[i].path, path) != 0)
+        i = (i + 1) & (capacity - 1);
+
+    return i;
+}
+
+static void _forget(struct dirpolicy *policy)
+{
+    // Called with the policy's lock held
+    if (policy->cache == NULL)
+        return;
+
+    for (size_t i = 0; i < 2 * DIRPOLICY_CACHE; i++) {
+        free(policy->cache[i].path);
+        policy->cache[i].path = NULL;
+    }
+
+    policy->count = 0;
+}
+
+static int _read(struct dirpolicy *policy, const char dir[])
+{
+    char real_path[strlen(storepoint) + strlen(dir) + 1];
+    sprintf(real_path, "%s%s", storepoint, dir);
+
+    char name[16];
+    ssize_t n = lgetxattr(real_path, policy->xattr, name, sizeof(name) - 1);
+    if (n <= 0)
+        return DIRPOLICY_INHERIT;
+
+    name[n]   = '\0';
+    int value = policy->value(name);
+
+    return value < 0 || value > policy->max ? DIRPOLICY_INHERIT : value;
+}
+
+static int _dir_value(struct dirpolicy *policy, const char dir[])
+{
+    // Called with the policy's lock held. Returns the directory's own setting
+    if (policy->cache == NULL) {
+        policy->cache = calloc(2 * DIRPOLICY_CACHE, sizeof(struct dirpolicy_entry));
+        if (policy->cache == NULL)
+            return _read(policy, dir);
+    }
+
+    size_t i = _slot(policy, dir);
+    if (policy->cache[i].path != NULL)
+        return policy->cache[i].value;
+
+    int value = _read(policy, dir);
+
+    if (policy->count >= DIRPOLICY_CACHE) {
+        _forget(policy);
+        i = _slot(policy, dir);
+    }
+
+    policy->cache[i].path = strdup(dir);
+    if (policy->cache[i].path != NULL) {
+        policy->cache[i].value = value;
+        policy->count++;
+    }
+
+    return value;
+}
+
+static int _resolve(struct dirpolicy *policy, char dir[])
+{
+    // Walks from dir up to the root, cutting dir short on the way
+    int value = DIRPOLICY_INHERIT;
+
+    pthread_mutex_lock(&policy->lock);
+
+    for (;;) {
+        value = _dir_value(policy, dir);
+        if (value != DIRPOLICY_INHERIT || strcmp(dir, "/") == 0)
+            break;
+
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL)
+            break;
+
+        if (slash == dir)
+            slash[1] = '\0';
+        else
+            *slash = '\0';
+    }
+
+    pthread_mutex_unlock(&policy->lock);
+
+    return value != DIRPOLICY_INHERIT ? value : *policy->fallback;
+}
+
+int dirpolicy_file(struct dirpolicy *policy, const char path[])
+{
+    // Setting that applies to the file at path. Files that lost their name get the mount's
+    if (path == NULL)
+        return *policy->fallback;
+
+    char dir[strlen(path) + 2];
+    strcpy(dir, path);
+
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        return *policy->fallback;
+
+    if (slash == dir)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+
+    return _resolve(policy, dir);
+}
+
+int dirpolicy_dir(struct dirpolicy *policy, const char path[])
+{
+    // Setting that applies to the directory at path, its own if it has one
+    char dir[strlen(path) + 1];
+    strcpy(dir, path);
+
+    return _resolve(policy, dir);
+}
+
+int dirpolicy_set(struct dirpolicy *policy, const char path[], int value)
+{
+    if (value < DIRPOLICY_INHERIT || value > policy->max)
+        return -EINVAL;
+
+    char real_path[strlen(storepoint) + strlen(path) + 1];
+    sprintf(real_path, "%s%s", storepoint, path);
+
+    struct stat st;
+    if (lstat(real_path, &st) == -1)
+        return -errno;
+    if (!S_ISDIR(st.st_mode))
+        return -ENOTDIR;
+
+    int res;
+    if (value == DIRPOLICY_INHERIT) {
+        res = lremovexattr(real_path, policy->xattr) == -1 && errno != ENODATA ? -errno : 0;
+    } else {
+        const char *name = policy->name(value);
+        res = lsetxattr(real_path, policy->xattr, name, strlen(name), 0) == -1 ? -errno : 0;
+    }
+
+    // Everything below the directory may have taken its setting from above it
+    dirpolicy_forget(policy);
+
+    return res;
+}
+
+void dirpolicy_forget(struct dirpolicy *policy)
+{
+    pthread_mutex_lock(&policy->lock);
+    _forget(policy);
+    pthread_mutex_unlock(&policy->lock);
+}
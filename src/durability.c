@@ -0,0 +1,136 @@
+/*
+* FILENAME: durability.c
+*
+* DESCRIPTION: Command line tool that shows or sets the durability level of a
+*              directory in a DEFFS mount, and prints how far each replica target
+*              lags behind. Files take the level of the nearest directory above
+*              them that has one, or the level the store was mounted with.
+*
+* USAGE: cmake --build ./ --target DEFFS-durability -- -j 6
+*        ./bin/DEFFS-durability ~/deffs/scratch local
+*        ./bin/DEFFS-durability ~/deffs/ledger all
+*        ./bin/DEFFS-durability ~/deffs/ledger/2024.db
+*        ./bin/DEFFS-durability --stats ~/deffs
+*
+* AUTHOR: Charles Averill
+*/
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "durability.h"
+
+const char *argp_program_version     = "DEFFS-durability 0.0.2";
+const char *argp_program_bug_address = "charles.averill@utdallas.edu";
+static char doc[] =
+    "Show or set the durability level of a DEFFS directory: inherit, local, quorum or all";
+static char args_doc[] = "PATH [LEVEL]";
+
+static struct argp_option options[] = {
+    {"stats", 's', 0, 0, "Print the replication counters of the mount instead"}, {0}};
+
+struct durability_arguments {
+    char *path;
+    int level;
+    int stats;
+};
+
+static error_t parse_durability_opt(int key, char *arg, struct argp_state *state)
+{
+    struct durability_arguments *arguments = state->input;
+
+    switch (key) {
+    case 's':
+        arguments->stats = 1;
+        break;
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 1)
+            argp_usage(state);
+        if (state->arg_num == 0) {
+            arguments->path = arg;
+        } else {
+            arguments->level = durability_level(arg);
+            if (arguments->level < 0)
+                argp_error(state, "level must be inherit, local, quorum or all");
+        }
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_usage(state);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static struct argp argp = {options, parse_durability_opt, args_doc, doc, 0, 0, 0};
+
+static void _print_stats(const struct deffs_replica_stats *stats)
+{
+    printf("Replica targets:    %u\n", stats->n_targets);
+    printf("Mount level:        %s\n", durability_name(stats->durability));
+    printf("Queue stalls:       %llu, %llu ms\n", (unsigned long long)stats->stalls,
+           (unsigned long long)stats->stall_ms);
+    printf("Replica waits:      %llu, %llu ms\n", (unsigned long long)stats->sync_waits,
+           (unsigned long long)stats->sync_ms);
+
+    for (uint32_t i = 0; i < stats->n_targets && i < DEFFS_REPLICA_MAX_TARGETS; i++) {
+        const struct deffs_replica_target_stats *target = &stats->targets[i];
+
+        printf("Target %u:           %llu queued (%llu KiB, %llu ms behind), %llu applied "
+               "(%llu MiB), %llu failed\n",
+               i, (unsigned long long)target->queued,
+               (unsigned long long)(target->queued_bytes >> 10),
+               (unsigned long long)target->lag_ms, (unsigned long long)target->applied,
+               (unsigned long long)(target->applied_bytes >> 20),
+               (unsigned long long)target->failed);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct durability_arguments arguments = {NULL, -1, 0};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    int fd = open(arguments.path, O_RDONLY);
+    if (fd == -1) {
+        printf("Could not open %s: %s\n", arguments.path, strerror(errno));
+        exit(1);
+    }
+
+    if (arguments.stats) {
+        struct deffs_replica_stats stats;
+        if (ioctl(fd, DEFFS_IOC_REPLICA_STATS, &stats) == -1) {
+            printf("Could not read the replication counters of %s: %s\n", arguments.path,
+                   strerror(errno));
+            exit(1);
+        }
+
+        _print_stats(&stats);
+    } else if (arguments.level >= 0) {
+        if (ioctl(fd, DEFFS_IOC_SET_DURABILITY, &arguments.level) == -1) {
+            printf("Could not set the durability of %s: %s\n", arguments.path, strerror(errno));
+            exit(1);
+        }
+    } else {
+        int level;
+        if (ioctl(fd, DEFFS_IOC_GET_DURABILITY, &level) == -1) {
+            printf("Could not read the durability of %s: %s\n", arguments.path, strerror(errno));
+            exit(1);
+        }
+
+        printf("%s\n", durability_name(level));
+    }
+
+    close(fd);
+
+    return 0;
+}
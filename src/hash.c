@@ -0,0 +1,503 @@
+/*
+* FILENAME: hash.c
+*
+* DESCRIPTION: SHA-256, which names shards and tags and trees their blocks.
+*              Messages are hashed over explicit lengths, so binary data hashes
+*              whole. Single messages use the CPU's SHA extensions where it has
+*              them, and portable C otherwise. Several messages of the same length
+*              are hashed in one call. On CPUs with AVX2 but no SHA extensions,
+*              they are hashed eight at a time, one per 32-bit lane of a vector
+*              register. The engine is picked the first time anything is hashed,
+*              unless hash_engine pins one. Digests are spelled in hex through a
+*              table.
+*
+* USAGE: unsigned char digest[HASH_LEN];
+*        hash_digest(data, len, digest);
+*        hash_hex(digest, HASH_LEN, name);
+*
+*        // Parents of n pairs of sibling nodes, laid out one pair after the other
+*        hash_digest_many(pairs, 2 * HASH_LEN, n, parents);
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "hash.h"
+
+int hash_engine = HASH_ENGINE_AUTO;
+
+static const uint32_t _k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t _initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+typedef void (*compress_fn)(uint32_t state[8], const unsigned char *blocks, size_t n_blocks);
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+// Compression of one message's blocks, and whether several messages go through the vector lanes
+static compress_fn _compress;
+static int vector_lanes;
+
+static uint32_t _load_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void _store_be32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = value >> (24 - 8 * i);
+    }
+}
+
+static uint32_t _rotate(uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+static void _compress_generic(uint32_t state[8], const unsigned char *blocks, size_t n_blocks)
+{
+    for (; n_blocks > 0; n_blocks--, blocks += HASH_BLOCK_LEN) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; t++) {
+            w[t] = _load_be32(blocks + 4 * t);
+        }
+        for (int t = 16; t < 64; t++) {
+            uint32_t s0 = _rotate(w[t - 15], 7) ^ _rotate(w[t - 15], 18) ^ w[t - 15] >> 3;
+            uint32_t s1 = _rotate(w[t - 2], 17) ^ _rotate(w[t - 2], 19) ^ w[t - 2] >> 10;
+            w[t]        = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int t = 0; t < 64; t++) {
+            uint32_t t1 = h + (_rotate(e, 6) ^ _rotate(e, 11) ^ _rotate(e, 25)) +
+                          ((e & f) ^ (~e & g)) + _k[t] + w[t];
+            uint32_t t2 = (_rotate(a, 2) ^ _rotate(a, 13) ^ _rotate(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sha,sse4.1"))) static void
+_compress_sha_ni(uint32_t state[8], const unsigned char *blocks, size_t n_blocks)
+{
+    // The SHA extensions keep the state as ABEF and CDGH, and do two rounds per instruction
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh         = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    for (; n_blocks > 0; n_blocks--, blocks += HASH_BLOCK_LEN) {
+        __m128i abef_start = abef;
+        __m128i cdgh_start = cdgh;
+
+        // The schedule is kept four words at a time, each group replacing the one 16 words back
+        __m128i w[4];
+        for (int i = 0; i < 16; i++) {
+            __m128i *group = &w[i & 3];
+            if (i < 4) {
+                __m128i bytes = _mm_loadu_si128((const __m128i *)(blocks + 16 * i));
+                *group        = _mm_shuffle_epi8(bytes, bswap);
+            } else {
+                __m128i back7 = _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4);
+                *group        = _mm_sha256msg1_epu32(*group, w[(i - 3) & 3]);
+                *group        = _mm_add_epi32(*group, back7);
+                *group        = _mm_sha256msg2_epu32(*group, w[(i - 1) & 3]);
+            }
+
+            __m128i msg = _mm_add_epi32(*group, _mm_loadu_si128((const __m128i *)&_k[4 * i]));
+            cdgh        = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+            abef        = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        abef = _mm_add_epi32(abef, abef_start);
+        cdgh = _mm_add_epi32(cdgh, cdgh_start);
+    }
+
+    tmp  = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+__attribute__((target("avx2"))) static inline __m256i _rotate8(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2"))) static void _transpose8(__m256i r[8])
+{
+    // Rows become columns, turning eight lanes' words into each word of eight lanes and back
+    __m256i t[8], u[8];
+    for (int i = 0; i < 4; i++) {
+        t[2 * i]     = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+        t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+    }
+    for (int i = 0; i < 2; i++) {
+        u[4 * i]     = _mm256_unpacklo_epi64(t[4 * i], t[4 * i + 2]);
+        u[4 * i + 1] = _mm256_unpackhi_epi64(t[4 * i], t[4 * i + 2]);
+        u[4 * i + 2] = _mm256_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+        u[4 * i + 3] = _mm256_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        r[i]     = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+__attribute__((target("avx2"))) static void
+_compress_avx2(uint32_t *states[HASH_LANES], const unsigned char *const data[HASH_LANES],
+               size_t n_blocks)
+{
+    // Eight messages at once, each in its own 32-bit lane
+    const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    __m256i s[8];
+    for (int i = 0; i < HASH_LANES; i++) {
+        s[i] = _mm256_loadu_si256((const __m256i *)states[i]);
+    }
+    _transpose8(s);
+
+    for (size_t block = 0; block < n_blocks; block++) {
+        __m256i w[16];
+        for (int half = 0; half < 2; half++) {
+            __m256i *rows = &w[8 * half];
+            for (int i = 0; i < HASH_LANES; i++) {
+                rows[i] = _mm256_loadu_si256(
+                    (const __m256i *)(data[i] + block * HASH_BLOCK_LEN + 32 * half));
+            }
+            _transpose8(rows);
+            for (int i = 0; i < 8; i++) {
+                rows[i] = _mm256_shuffle_epi8(rows[i], bswap);
+            }
+        }
+
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3];
+        __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+        for (int t = 0; t < 64; t++) {
+            if (t >= 16) {
+                __m256i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+                __m256i s0  = _mm256_xor_si256(_rotate8(w15, 7), _rotate8(w15, 18));
+                __m256i s1  = _mm256_xor_si256(_rotate8(w2, 17), _rotate8(w2, 19));
+                s0          = _mm256_xor_si256(s0, _mm256_srli_epi32(w15, 3));
+                s1          = _mm256_xor_si256(s1, _mm256_srli_epi32(w2, 10));
+                w[t & 15]   = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0),
+                                               _mm256_add_epi32(w[(t - 7) & 15], s1));
+            }
+
+            __m256i sum1 = _mm256_xor_si256(_mm256_xor_si256(_rotate8(e, 6), _rotate8(e, 11)),
+                                            _rotate8(e, 25));
+            __m256i ch   = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i kw   = _mm256_add_epi32(_mm256_set1_epi32(_k[t]), w[t & 15]);
+            __m256i t1   = _mm256_add_epi32(_mm256_add_epi32(h, sum1), _mm256_add_epi32(ch, kw));
+            __m256i sum0 = _mm256_xor_si256(_mm256_xor_si256(_rotate8(a, 2), _rotate8(a, 13)),
+                                            _rotate8(a, 22));
+            __m256i maj  = _mm256_or_si256(_mm256_and_si256(a, b),
+                                           _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            __m256i t2   = _mm256_add_epi32(sum0, maj);
+
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi32(t1, t2);
+        }
+
+        s[0] = _mm256_add_epi32(s[0], a);
+        s[1] = _mm256_add_epi32(s[1], b);
+        s[2] = _mm256_add_epi32(s[2], c);
+        s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e);
+        s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g);
+        s[7] = _mm256_add_epi32(s[7], h);
+    }
+
+    _transpose8(s);
+    for (int i = 0; i < HASH_LANES; i++) {
+        _mm256_storeu_si256((__m256i *)states[i], s[i]);
+    }
+}
+
+#endif
+
+int hash_engine_supported(int engine)
+{
+    switch (engine) {
+    case HASH_ENGINE_AUTO:
+    case HASH_ENGINE_GENERIC:
+        return 1;
+#if defined(__x86_64__) || defined(__i386__)
+    case HASH_ENGINE_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case HASH_ENGINE_SHA_NI:
+        return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void _select(void)
+{
+    int engine = hash_engine_supported(hash_engine) ? hash_engine : HASH_ENGINE_AUTO;
+
+    // The SHA extensions hash one message faster than the vector lanes hash eight
+    if (engine == HASH_ENGINE_AUTO) {
+        for (engine = HASH_ENGINE_SHA_NI; engine > HASH_ENGINE_GENERIC; engine--) {
+            if (hash_engine_supported(engine))
+                break;
+        }
+    }
+
+    _compress    = _compress_generic;
+    vector_lanes = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (engine == HASH_ENGINE_SHA_NI)
+        _compress = _compress_sha_ni;
+    vector_lanes = engine == HASH_ENGINE_AVX2;
+#endif
+}
+
+static void _compress_lanes(struct hash_ctx ctxs[], const unsigned char *const data[], size_t n,
+                            size_t n_blocks)
+{
+    // The same number of blocks of each of n messages
+#if defined(__x86_64__) || defined(__i386__)
+    if (vector_lanes && n > 1) {
+        for (size_t first = 0; first < n; first += HASH_LANES) {
+            uint32_t spare[HASH_LANES][8];
+            uint32_t *states[HASH_LANES];
+            const unsigned char *lane_data[HASH_LANES];
+
+            // Lanes past the last message hash the first one again, into a state nobody reads
+            for (size_t i = 0; i < HASH_LANES; i++) {
+                if (first + i < n) {
+                    states[i]    = ctxs[first + i].state;
+                    lane_data[i] = data[first + i];
+                } else {
+                    memcpy(spare[i], ctxs[first].state, sizeof(spare[i]));
+                    states[i]    = spare[i];
+                    lane_data[i] = data[first];
+                }
+            }
+
+            _compress_avx2(states, lane_data, n_blocks);
+        }
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < n; i++) {
+        _compress(ctxs[i].state, data[i], n_blocks);
+    }
+}
+
+static size_t _pad(const struct hash_ctx *ctx, unsigned char tail[2 * HASH_BLOCK_LEN])
+{
+    // The message's last bytes, a one bit, zeros and its length in bits fill one or two blocks
+    size_t used     = ctx->len % HASH_BLOCK_LEN;
+    size_t n_blocks = used < HASH_BLOCK_LEN - 8 ? 1 : 2;
+    uint64_t bits   = ctx->len * 8;
+
+    memcpy(tail, ctx->buf, used);
+    tail[used] = 0x80;
+    memset(tail + used + 1, 0, n_blocks * HASH_BLOCK_LEN - used - 1);
+
+    _store_be32(tail + n_blocks * HASH_BLOCK_LEN - 8, bits >> 32);
+    _store_be32(tail + n_blocks * HASH_BLOCK_LEN - 4, bits);
+
+    return n_blocks;
+}
+
+static void _output(const uint32_t state[8], unsigned char digest[HASH_LEN])
+{
+    for (int i = 0; i < 8; i++) {
+        _store_be32(digest + 4 * i, state[i]);
+    }
+}
+
+void hash_init(struct hash_ctx *ctx)
+{
+    memcpy(ctx->state, _initial, sizeof(ctx->state));
+    ctx->len = 0;
+}
+
+void hash_update(struct hash_ctx *ctx, const void *data, size_t len)
+{
+    pthread_once(&engine_once, _select);
+
+    const unsigned char *bytes = data;
+    size_t used                = ctx->len % HASH_BLOCK_LEN;
+    ctx->len += len;
+
+    if (used > 0) {
+        size_t fill = HASH_BLOCK_LEN - used < len ? HASH_BLOCK_LEN - used : len;
+        memcpy(ctx->buf + used, bytes, fill);
+        if (used + fill < HASH_BLOCK_LEN)
+            return;
+
+        _compress(ctx->state, ctx->buf, 1);
+        bytes += fill;
+        len -= fill;
+    }
+
+    size_t n_blocks = len / HASH_BLOCK_LEN;
+    if (n_blocks > 0)
+        _compress(ctx->state, bytes, n_blocks);
+
+    memcpy(ctx->buf, bytes + n_blocks * HASH_BLOCK_LEN, len % HASH_BLOCK_LEN);
+}
+
+void hash_final(struct hash_ctx *ctx, unsigned char digest[HASH_LEN])
+{
+    pthread_once(&engine_once, _select);
+
+    unsigned char tail[2 * HASH_BLOCK_LEN];
+    _compress(ctx->state, tail, _pad(ctx, tail));
+    _output(ctx->state, digest);
+}
+
+void hash_digest(const void *data, size_t len, unsigned char digest[HASH_LEN])
+{
+    struct hash_ctx ctx;
+    hash_init(&ctx);
+    hash_update(&ctx, data, len);
+    hash_final(&ctx, digest);
+}
+
+void hash_update_many(struct hash_ctx ctxs[], const unsigned char *const data[], size_t len,
+                      size_t n)
+{
+    // Feeds len bytes to each of n messages. They must all have been fed the same number of bytes
+    // before, so that their blocks line up
+    pthread_once(&engine_once, _select);
+
+    if (n == 0)
+        return;
+
+    size_t used = ctxs[0].len % HASH_BLOCK_LEN;
+    size_t fill = 0;
+    if (used > 0)
+        fill = HASH_BLOCK_LEN - used < len ? HASH_BLOCK_LEN - used : len;
+
+    size_t n_blocks = (len - fill) / HASH_BLOCK_LEN;
+    size_t rest     = (len - fill) % HASH_BLOCK_LEN;
+
+    for (size_t first = 0; first < n; first += HASH_LANES) {
+        size_t lanes = n - first < HASH_LANES ? n - first : HASH_LANES;
+        struct hash_ctx *group = &ctxs[first];
+        const unsigned char *blocks[HASH_LANES];
+
+        for (size_t i = 0; i < lanes; i++) {
+            group[i].len += len;
+            memcpy(group[i].buf + used, data[first + i], fill);
+            blocks[i] = group[i].buf;
+        }
+
+        if (used > 0 && used + fill == HASH_BLOCK_LEN)
+            _compress_lanes(group, blocks, lanes, 1);
+
+        if (n_blocks > 0) {
+            for (size_t i = 0; i < lanes; i++) {
+                blocks[i] = data[first + i] + fill;
+            }
+            _compress_lanes(group, blocks, lanes, n_blocks);
+        }
+
+        for (size_t i = 0; i < lanes; i++) {
+            memcpy(group[i].buf, data[first + i] + fill + n_blocks * HASH_BLOCK_LEN, rest);
+        }
+    }
+}
+
+void hash_final_many(struct hash_ctx ctxs[], size_t n, unsigned char (*digests)[HASH_LEN])
+{
+    pthread_once(&engine_once, _select);
+
+    for (size_t first = 0; first < n; first += HASH_LANES) {
+        size_t lanes = n - first < HASH_LANES ? n - first : HASH_LANES;
+        unsigned char tails[HASH_LANES][2 * HASH_BLOCK_LEN];
+        const unsigned char *blocks[HASH_LANES];
+        size_t n_blocks = 0;
+
+        for (size_t i = 0; i < lanes; i++) {
+            n_blocks  = _pad(&ctxs[first + i], tails[i]);
+            blocks[i] = tails[i];
+        }
+
+        _compress_lanes(&ctxs[first], blocks, lanes, n_blocks);
+
+        for (size_t i = 0; i < lanes; i++) {
+            _output(ctxs[first + i].state, digests[first + i]);
+        }
+    }
+}
+
+void hash_digest_many(const unsigned char *data, size_t len, size_t n,
+                      unsigned char (*digests)[HASH_LEN])
+{
+    // Hashes n messages of len bytes laid out one after the other. The digests must not overlap
+    // the messages
+    for (size_t first = 0; first < n; first += HASH_LANES) {
+        size_t lanes = n - first < HASH_LANES ? n - first : HASH_LANES;
+        struct hash_ctx ctxs[HASH_LANES];
+        const unsigned char *messages[HASH_LANES];
+
+        for (size_t i = 0; i < lanes; i++) {
+            hash_init(&ctxs[i]);
+            messages[i] = data + (first + i) * len;
+        }
+
+        hash_update_many(ctxs, messages, len, lanes);
+        hash_final_many(ctxs, lanes, &digests[first]);
+    }
+}
+
+void hash_hex(const unsigned char *bytes, size_t len, char hex[])
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; i++) {
+        hex[2 * i]     = digits[bytes[i] >> 4];
+        hex[2 * i + 1] = digits[bytes[i] & 0x0f];
+    }
+    hex[2 * len] = '\0';
+}
@@ -0,0 +1,97 @@
+/*
+* FILENAME: header.c
+*
+* DESCRIPTION: Reading and writing of header records. Every logical file is
+*              mirrored by a header file under the storepoint that names its
+*              shard. Files whose encrypted payload is at most inline_threshold
+*              bytes keep that payload directly after the header, so reading them
+*              takes one pread on the already open header instead of a second
+*              open and read of a shard.
+*
+* USAGE: struct deffs_header header;
+*        char payload[HEADER_INLINE_MAX];
+*
+*        if (header_read(fd, &header, payload) == 0 && header.flags & HEADER_FLAG_INLINE)
+*            file_key_crypt(&file_key, payload, plaintext, header.payload_len, 0, header.nonce);
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "header.h"
+
+size_t inline_threshold = 512;
+
+ssize_t header_read(int fd, struct deffs_header *header, char *payload)
+{
+    // Read the header and any inline payload in a single call
+    char buf[sizeof(struct deffs_header) + HEADER_INLINE_MAX];
+
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    if (n == -1)
+        return -errno;
+
+    memset(header, 0, sizeof(struct deffs_header));
+    memcpy(header->magic, HEADER_MAGIC, HEADER_MAGIC_LEN);
+
+    // Files that were created but never written have no header yet
+    if (n == 0)
+        return -ENODATA;
+
+    if (n < (ssize_t)sizeof(struct deffs_header) ||
+        memcmp(buf, HEADER_MAGIC, HEADER_MAGIC_LEN) != 0)
+        return -EIO;
+
+    memcpy(header, buf, sizeof(struct deffs_header));
+    header->hash[SHARD_FN_LEN] = '\0';
+
+    if (header->n_bases > HEADER_MAX_BASES)
+        return -EIO;
+    for (uint32_t i = 0; i < header->n_bases; i++) {
+        header->bases[i][SHARD_FN_LEN] = '\0';
+    }
+
+    if (header->flags & HEADER_FLAG_INLINE) {
+        if (header->payload_len > HEADER_INLINE_MAX ||
+            n < (ssize_t)(sizeof(struct deffs_header) + header->payload_len))
+            return -EIO;
+
+        if (payload != NULL)
+            memcpy(payload, buf + sizeof(struct deffs_header), header->payload_len);
+    }
+
+    return 0;
+}
+
+int header_write(int fd, struct deffs_header *header, const char *payload)
+{
+    memcpy(header->magic, HEADER_MAGIC, HEADER_MAGIC_LEN);
+    if (!(header->flags & HEADER_FLAG_INLINE))
+        header->payload_len = 0;
+
+    struct iovec iov[2] = {{header, sizeof(struct deffs_header)},
+                           {(void *)payload, header->payload_len}};
+    size_t len          = sizeof(struct deffs_header) + header->payload_len;
+
+    if (pwritev(fd, iov, header->payload_len > 0 ? 2 : 1, 0) != (ssize_t)len)
+        return -EIO;
+
+    // Drop whatever was left of a longer inline payload. Files in shards keep their block map
+    // past the inline area, so their header files are left as they are
+    if (header->flags & HEADER_FLAG_INLINE && ftruncate(fd, len) == -1)
+        return -errno;
+
+    return 0;
+}
+
+int header_read_path(const char path[], struct deffs_header *header, char *payload)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+
+    int res = header_read(fd, header, payload);
+
+    close(fd);
+
+    return res;
+}
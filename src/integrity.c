@@ -0,0 +1,239 @@
+/*
+* FILENAME: integrity.c
+*
+* DESCRIPTION: Merkle tree over the block tags of a file. Every data block is
+*              tagged with an HMAC of its ciphertext, nonce and index under the
+*              file key, and the tags are the leaves of the tree kept in the block
+*              map. The tree's root is sealed under the file key and stored in the
+*              header, so a read checks only the blocks it touches and the siblings
+*              on their paths to the root, and a write rehashes only those paths.
+*              Holes and preallocated blocks have empty tags, and a node whose
+*              right half is empty takes the value of its left half, so the root
+*              does not change when a file grows without data.
+*
+* USAGE: blockmap_set_tags(fd, first_block, n_blocks, nonces, tags);
+*        integrity_rehash(fd, &file_key, first_block, n_blocks, header.root);
+*
+*        if (integrity_verify(fd, &file_key, first_block, n_blocks, tags, header.root) != 0)
+*            return -EIO;
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "integrity.h"
+
+static int _empty(const unsigned char node[])
+{
+    for (int i = 0; i < FILE_KEY_TAG_LEN; i++) {
+        if (node[i] != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void _parent(const unsigned char left[], const unsigned char right[], unsigned char out[])
+{
+    if (_empty(right)) {
+        memmove(out, left, FILE_KEY_TAG_LEN);
+        return;
+    }
+
+    unsigned char pair[2 * FILE_KEY_TAG_LEN];
+    memcpy(pair, left, FILE_KEY_TAG_LEN);
+    memcpy(pair + FILE_KEY_TAG_LEN, right, FILE_KEY_TAG_LEN);
+    hash_digest(pair, sizeof(pair), out);
+}
+
+static int _read_node(int fd, int level, uint64_t index, unsigned char node[])
+{
+    // Once a tree grows taller, its left edge above the old root is not stored until a path
+    // through it is rehashed. Until then the old root is what it holds
+    struct blockmap_slot slot;
+
+    for (; level >= 0; level--) {
+        int res = blockmap_read_slots(fd, blockmap_node(level, index), 1, &slot);
+        if (res != 0)
+            return res;
+
+        if (index != 0 || !_empty(slot.node))
+            break;
+    }
+
+    memcpy(node, slot.node, FILE_KEY_TAG_LEN);
+
+    return 0;
+}
+
+static int _climb(int fd, uint64_t first_block, size_t n_blocks,
+                  unsigned char (*nodes)[FILE_KEY_TAG_LEN], struct blockmap_slot span[],
+                  unsigned char tree_root[])
+{
+    // Hash the leaves in nodes up to the root, one level at a time and in place. Siblings
+    // outside the range come from the map. With a span, the slots from the first leaf to
+    // the last, the new nodes are stored: those inside it in the span, the rest directly
+    uint64_t n_leaves;
+    int res = blockmap_leaves(fd, &n_leaves);
+    if (res != 0)
+        return res;
+
+    uint64_t span_first = 2 * first_block;
+    uint64_t span_last  = 2 * (first_block + n_blocks - 1);
+    uint64_t a          = first_block;
+    uint64_t b          = first_block + n_blocks - 1;
+    n_leaves            = n_leaves > b + 1 ? n_leaves : b + 1;
+
+    // The root is the first node covering every leaf
+    for (int level = 0; a != 0 || b != 0 || (UINT64_C(1) << level) < n_leaves; level++) {
+        for (uint64_t parent = a / 2; parent <= b / 2;) {
+            // Parents whose children are both in nodes sit next to each other as pairs and are
+            // hashed side by side. The ones at the edges take a sibling from the map
+            uint64_t run = 0;
+            if (2 * parent >= a && 2 * parent + 1 <= b) {
+                run = (b + 1) / 2 - parent;
+                run = run < HASH_LANES ? run : HASH_LANES;
+            }
+
+            unsigned char out[HASH_LANES][FILE_KEY_TAG_LEN];
+            if (run > 0) {
+                hash_digest_many(nodes[2 * parent - a], 2 * FILE_KEY_TAG_LEN, run, out);
+                for (uint64_t i = 0; i < run; i++) {
+                    const unsigned char *left = nodes[2 * (parent + i) - a];
+                    if (_empty(left + FILE_KEY_TAG_LEN))
+                        memcpy(out[i], left, FILE_KEY_TAG_LEN);
+                }
+            } else {
+                unsigned char left[FILE_KEY_TAG_LEN], right[FILE_KEY_TAG_LEN];
+                run = 1;
+
+                if (2 * parent < a)
+                    res = _read_node(fd, level, 2 * parent, left);
+                else
+                    memcpy(left, nodes[2 * parent - a], FILE_KEY_TAG_LEN);
+
+                if (res == 0 && 2 * parent + 1 > b)
+                    res = _read_node(fd, level, 2 * parent + 1, right);
+                else if (res == 0)
+                    memcpy(right, nodes[2 * parent + 1 - a], FILE_KEY_TAG_LEN);
+
+                if (res != 0)
+                    return res;
+
+                _parent(left, right, out[0]);
+            }
+
+            for (uint64_t i = 0; i < run; i++, parent++) {
+                // Never overwrites a node this level still has to read
+                unsigned char *node = nodes[parent - a / 2];
+                memcpy(node, out[i], FILE_KEY_TAG_LEN);
+
+                if (span == NULL)
+                    continue;
+
+                uint64_t slot = blockmap_node(level + 1, parent);
+                if (slot >= span_first && slot <= span_last) {
+                    memcpy(span[slot - span_first].node, node, FILE_KEY_TAG_LEN);
+                } else if (pwrite(fd, node, FILE_KEY_TAG_LEN,
+                                  BLOCKMAP_OFFSET + slot * BLOCKMAP_SLOT_LEN +
+                                      offsetof(struct blockmap_slot, node)) != FILE_KEY_TAG_LEN) {
+                    return -EIO;
+                }
+            }
+        }
+
+        a /= 2;
+        b /= 2;
+    }
+
+    memcpy(tree_root, nodes[0], FILE_KEY_TAG_LEN);
+
+    return 0;
+}
+
+void integrity_seal(const struct FileKey *file_key, const unsigned char tree_root[FILE_KEY_TAG_LEN],
+                    unsigned char root[FILE_KEY_TAG_LEN])
+{
+    // The tree itself is unkeyed, so its root is tagged before it goes in the header
+    file_key_tag(file_key, FILE_KEY_TAG_ROOT, NULL, tree_root, FILE_KEY_TAG_LEN, root);
+}
+
+int integrity_rehash(int fd, const struct FileKey *file_key, uint64_t first_block,
+                     uint64_t n_blocks, unsigned char root[FILE_KEY_TAG_LEN])
+{
+    // Recompute the nodes above blocks whose tags changed, a window's worth of map at a time
+    uint64_t chunk  = stream_window_size / (2 * BLOCKMAP_SLOT_LEN);
+    size_t span_len = (2 * chunk - 1) * BLOCKMAP_SLOT_LEN;
+
+    struct blockmap_slot *span               = bufpool_get(span_len);
+    unsigned char (*nodes)[FILE_KEY_TAG_LEN] = bufpool_get(chunk * FILE_KEY_TAG_LEN);
+    unsigned char tree_root[FILE_KEY_TAG_LEN];
+    int res = span == NULL || nodes == NULL ? -ENOMEM : 0;
+
+    for (uint64_t done = 0; res == 0 && done < n_blocks; done += chunk) {
+        size_t len     = n_blocks - done < chunk ? n_blocks - done : chunk;
+        uint64_t first = first_block + done;
+
+        res = blockmap_read_slots(fd, 2 * first, 2 * len - 1, span);
+        if (res != 0)
+            break;
+
+        for (size_t i = 0; i < len; i++) {
+            memcpy(nodes[i], span[2 * i].node, FILE_KEY_TAG_LEN);
+        }
+
+        res = _climb(fd, first, len, nodes, span, tree_root);
+        if (res == 0)
+            res = blockmap_write_slots(fd, 2 * first, 2 * len - 1, span);
+    }
+
+    if (res == 0 && n_blocks > 0)
+        integrity_seal(file_key, tree_root, root);
+
+    bufpool_put(span, span_len);
+    bufpool_put(nodes, chunk * FILE_KEY_TAG_LEN);
+
+    return res;
+}
+
+int integrity_verify(int fd, const struct FileKey *file_key, uint64_t first_block, size_t n_blocks,
+                     unsigned char (*tags)[FILE_KEY_TAG_LEN],
+                     const unsigned char root[FILE_KEY_TAG_LEN])
+{
+    // The tags of the blocks just read are hashed up to the root in place, which only takes
+    // the siblings along their paths from the map
+    unsigned char tree_root[FILE_KEY_TAG_LEN], sealed[FILE_KEY_TAG_LEN];
+
+    int res = _climb(fd, first_block, n_blocks, tags, NULL, tree_root);
+    if (res != 0)
+        return res;
+
+    integrity_seal(file_key, tree_root, sealed);
+
+    return CRYPTO_memcmp(sealed, root, FILE_KEY_TAG_LEN) == 0 ? 0 : -EIO;
+}
+
+int integrity_check_root(int fd, const struct FileKey *file_key,
+                         const unsigned char root[FILE_KEY_TAG_LEN])
+{
+    // Seal the stored tree's root and compare, which only succeeds with the right file key
+    uint64_t n_leaves;
+    int res = blockmap_leaves(fd, &n_leaves);
+    if (res != 0)
+        return res;
+
+    unsigned char tree_root[FILE_KEY_TAG_LEN] = {0};
+    if (n_leaves > 0) {
+        int level = 0;
+        while ((UINT64_C(1) << level) < n_leaves)
+            level++;
+
+        res = _read_node(fd, level, 0, tree_root);
+        if (res != 0)
+            return res;
+    }
+
+    unsigned char sealed[FILE_KEY_TAG_LEN];
+    integrity_seal(file_key, tree_root, sealed);
+
+    return CRYPTO_memcmp(sealed, root, FILE_KEY_TAG_LEN) == 0 ? 0 : -EIO;
+}
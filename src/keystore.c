@@ -0,0 +1,551 @@
+/*
+* FILENAME: keystore.c
+*
+* DESCRIPTION: Storage of per-file AES keys as Shamir shares. Each key is split
+*              into key_shares shares, any key_shares_required of which rebuild
+*              it, and share x is written to key target (x - 1) % n_key_targets.
+*              Keys are reconstructed when a file is opened and kept, already
+*              expanded into their cipher and tag keys, in a bounded LRU cache so
+*              that reads and writes skip both the interpolation and the key setup.
+*
+* USAGE: struct FileKey file_key;
+*        generate_file_key(&file_key);
+*        keystore_store(hash, &file_key);
+*
+*        keystore_load(hash, &file_key);
+*        file_key_crypt(&file_key, ciphertext, plaintext, len, offset, nonce);
+*
+*        keystore_repair(hash, check_key, &header);
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "keystore.h"
+
+char *key_targets[KEYSTORE_MAX_TARGETS];
+int n_key_targets         = 0;
+int key_shares            = 3;
+int key_shares_required   = 2;
+size_t key_cache_capacity = 4096;
+
+// The targets as they were given, which keystore_close puts back for the next store
+static char *given_targets[KEYSTORE_MAX_TARGETS];
+static int n_given_targets = -1;
+
+struct key_cache_entry {
+    char hash[SHARD_FN_LEN];
+    struct FileKey file_key;
+    struct key_cache_entry *lru_prev;
+    struct key_cache_entry *lru_next;
+    struct key_cache_entry *bucket_next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct key_cache_entry **cache_buckets;
+static size_t cache_n_buckets;
+static size_t cache_count;
+
+// Most recently used at the head, eviction from the tail
+static struct key_cache_entry *lru_head;
+static struct key_cache_entry *lru_tail;
+
+static void _check_spread(void)
+{
+    // A directory that receives enough shares to rebuild a key protects nothing by the split
+    struct stat st[n_key_targets];
+    for (int i = 0; i < n_key_targets; i++) {
+        if (stat(key_targets[i], &st[i]) == -1)
+            return;
+    }
+
+    for (int i = 0; i < n_key_targets; i++) {
+        int shares = 0;
+        for (int x = 1; x <= key_shares; x++) {
+            const struct stat *target = &st[(x - 1) % n_key_targets];
+            shares += target->st_dev == st[i].st_dev && target->st_ino == st[i].st_ino;
+        }
+
+        if (shares >= key_shares_required) {
+            printf("%s receives %d key shares and %d rebuild a file key, give more --key-target "
+                   "directories to keep keys split\n",
+                   key_targets[i], shares, key_shares_required);
+            return;
+        }
+    }
+}
+
+static void _share_path(const char hash[], int x, char obuf[], size_t len)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%d.key", x);
+
+    const char *target = key_targets[(x - 1) % n_key_targets];
+    if (fanout_path_len(target, suffix) <= len)
+        get_fanout_path(target, hash, suffix, obuf);
+}
+
+static uint64_t _key_part(const unsigned char key[], int part)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < KEY_PART_BYTES && part * KEY_PART_BYTES + i < 16; i++)
+        value |= (uint64_t)key[part * KEY_PART_BYTES + i] << (8 * i);
+
+    return value;
+}
+
+static void _set_key_part(unsigned char key[], int part, uint64_t value)
+{
+    for (int i = 0; i < KEY_PART_BYTES && part * KEY_PART_BYTES + i < 16; i++)
+        key[part * KEY_PART_BYTES + i] = (value >> (8 * i)) & 0xff;
+}
+
+static void _lru_unlink(struct key_cache_entry *entry)
+{
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        lru_head = entry->lru_next;
+
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        lru_tail = entry->lru_prev;
+}
+
+static void _lru_push_front(struct key_cache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+
+    if (lru_head != NULL)
+        lru_head->lru_prev = entry;
+    lru_head = entry;
+
+    if (lru_tail == NULL)
+        lru_tail = entry;
+}
+
+static struct key_cache_entry **_cache_slot(const char hash[])
+{
+    struct key_cache_entry **slot = &cache_buckets[hash_bucket(hash, cache_n_buckets)];
+    while (*slot != NULL && memcmp((*slot)->hash, hash, SHARD_FN_LEN) != 0)
+        slot = &(*slot)->bucket_next;
+
+    return slot;
+}
+
+static struct key_cache_entry *_cache_detach(const char hash[])
+{
+    struct key_cache_entry **slot = _cache_slot(hash);
+    if (*slot == NULL)
+        return NULL;
+
+    struct key_cache_entry *entry = *slot;
+    *slot                         = entry->bucket_next;
+    _lru_unlink(entry);
+    cache_count--;
+
+    return entry;
+}
+
+static void _cache_remove(const char hash[])
+{
+    free(_cache_detach(hash));
+}
+
+static void _cache_insert(const char hash[], const struct FileKey *file_key)
+{
+    if (key_cache_capacity == 0)
+        return;
+
+    struct key_cache_entry **slot = _cache_slot(hash);
+    if (*slot != NULL) {
+        (*slot)->file_key = *file_key;
+        _lru_unlink(*slot);
+        _lru_push_front(*slot);
+        return;
+    }
+
+    // Once the cache is full, the evicted entry is recycled instead of going back to malloc
+    struct key_cache_entry *entry = NULL;
+    if (cache_count >= key_cache_capacity)
+        entry = _cache_detach(lru_tail->hash);
+    if (entry == NULL)
+        entry = malloc(sizeof(struct key_cache_entry));
+    if (entry == NULL)
+        return;
+
+    memcpy(entry->hash, hash, SHARD_FN_LEN);
+    entry->file_key    = *file_key;
+    entry->bucket_next = NULL;
+
+    // The slot may have moved if eviction touched the same bucket
+    slot  = _cache_slot(hash);
+    *slot = entry;
+    _lru_push_front(entry);
+    cache_count++;
+}
+
+static int _cache_lookup(const char hash[], struct FileKey *file_key)
+{
+    struct key_cache_entry *entry = *_cache_slot(hash);
+    if (entry == NULL)
+        return 0;
+
+    *file_key = entry->file_key;
+    _lru_unlink(entry);
+    _lru_push_front(entry);
+
+    return 1;
+}
+
+static int _read_share(const char hash[], int x, struct key_share_record *record)
+{
+    const char *target = key_targets[(x - 1) % n_key_targets];
+    char share_path[fanout_path_len(target, "-00.key")];
+    _share_path(hash, x, share_path, sizeof(share_path));
+
+    int fd = open(share_path, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+
+    ssize_t n = read(fd, record, sizeof(*record));
+    close(fd);
+
+    if (n != sizeof(*record) || record->magic != KEY_SHARE_MAGIC || record->x != (uint32_t)x)
+        return -EIO;
+
+    return 0;
+}
+
+static int _write_share(const char hash[], const struct key_share_record *record, int replace)
+{
+    const char *target = key_targets[(record->x - 1) % n_key_targets];
+    char share_path[fanout_path_len(target, "-00.key")];
+    _share_path(hash, record->x, share_path, sizeof(share_path));
+
+    int res = make_fanout_dirs(target, hash);
+    if (res < 0)
+        return res;
+
+    // Replacing a share goes through a temporary file, so a concurrent load never sees half of it
+    char tmp_path[sizeof(share_path) + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s%s", share_path, replace ? ".tmp" : "");
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        return -errno;
+
+    res = write(fd, record, sizeof(*record)) == sizeof(*record) ? 0 : -EIO;
+    close(fd);
+
+    if (res == 0 && replace && rename(tmp_path, share_path) == -1)
+        res = -errno;
+
+    return res;
+}
+
+int keystore_open(void)
+{
+    if (key_shares < 1 || key_shares > KEYSTORE_MAX_SHARES || key_shares_required < 1 ||
+        key_shares_required > key_shares)
+        return -EINVAL;
+
+    memcpy(given_targets, key_targets, sizeof(char *) * n_key_targets);
+    n_given_targets = n_key_targets;
+
+    // Without explicit targets, keep the shares next to the shards
+    if (n_key_targets == 0) {
+        key_targets[0] = malloc(strlen(shardpoint) + strlen("keys/") + 1);
+        if (key_targets[0] == NULL)
+            return -ENOMEM;
+
+        strcpy(key_targets[0], shardpoint);
+        strcat(key_targets[0], "keys/");
+        n_key_targets = 1;
+    }
+
+    for (int i = 0; i < n_key_targets; i++) {
+        // Fan-out paths are built by appending to the target
+        if (!ends_with(key_targets[i], "/")) {
+            char *target = malloc(strlen(key_targets[i]) + 2);
+            if (target == NULL)
+                return -ENOMEM;
+
+            strcpy(target, key_targets[i]);
+            strcat(target, "/");
+            key_targets[i] = target;
+        }
+
+        if (mkdir_if_not_exists(key_targets[i], 0700) != 0 && errno != EEXIST)
+            return -errno;
+    }
+
+    _check_spread();
+
+    // Keep chains short: at least two buckets per cached key, rounded to a power of two
+    cache_n_buckets = 1;
+    while (cache_n_buckets < 2 * key_cache_capacity)
+        cache_n_buckets *= 2;
+
+    cache_buckets = calloc(cache_n_buckets, sizeof(struct key_cache_entry *));
+    if (cache_buckets == NULL)
+        return -ENOMEM;
+
+    return 0;
+}
+
+void keystore_close(void)
+{
+    pthread_mutex_lock(&cache_lock);
+
+    while (lru_head != NULL)
+        _cache_remove(lru_head->hash);
+
+    free(cache_buckets);
+    cache_buckets   = NULL;
+    cache_n_buckets = 0;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    if (n_given_targets < 0)
+        return;
+
+    // The default target and the targets given a trailing slash were allocated by keystore_open
+    for (int i = 0; i < n_key_targets; i++) {
+        if (i >= n_given_targets || key_targets[i] != given_targets[i])
+            free(key_targets[i]);
+    }
+
+    memcpy(key_targets, given_targets, sizeof(char *) * n_given_targets);
+    n_key_targets   = n_given_targets;
+    n_given_targets = -1;
+}
+
+int keystore_store(const char hash[], const struct FileKey *file_key)
+{
+    // Split every part of the key in one batch, all with the same x coordinates
+    unsigned long long int parts[KEY_SECRET_PARTS];
+    for (int part = 0; part < KEY_SECRET_PARTS; part++)
+        parts[part] = _key_part(file_key->key, part);
+
+    unsigned long long int xs[key_shares];
+    unsigned long long int ys[key_shares * KEY_SECRET_PARTS];
+    int res = get_shares_batch(parts, KEY_SECRET_PARTS, key_shares, key_shares_required, xs, ys);
+    if (res != 0)
+        return res;
+
+    for (int i = 0; i < key_shares; i++) {
+        struct key_share_record record;
+        record.magic = KEY_SHARE_MAGIC;
+        record.x     = xs[i];
+        for (int part = 0; part < KEY_SECRET_PARTS; part++)
+            record.y[part] = ys[i * KEY_SECRET_PARTS + part];
+
+        res = _write_share(hash, &record, 0);
+        if (res < 0)
+            return res;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    _cache_insert(hash, file_key);
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+int keystore_load(const char hash[], struct FileKey *file_key)
+{
+    pthread_mutex_lock(&cache_lock);
+    int hit = _cache_lookup(hash, file_key);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (hit)
+        return 0;
+
+    // Gather the first key_shares_required shares that can still be read
+    unsigned long long int xs[key_shares_required];
+    unsigned long long int ys[key_shares_required * KEY_SECRET_PARTS];
+    int found = 0;
+
+    for (int x = 1; x <= key_shares && found < key_shares_required; x++) {
+        struct key_share_record record;
+        if (_read_share(hash, x, &record) != 0)
+            continue;
+
+        xs[found] = record.x;
+        for (int part = 0; part < KEY_SECRET_PARTS; part++)
+            ys[found * KEY_SECRET_PARTS + part] = record.y[part];
+        found++;
+    }
+
+    if (found < key_shares_required)
+        return -ENOKEY;
+
+    // The same few x coordinates come up for almost every key, so the weights are cached
+    unsigned long long int parts[KEY_SECRET_PARTS];
+    if (get_secrets_batch(xs, ys, found, KEY_SECRET_PARTS, parts) != 0)
+        return -EIO;
+
+    memset(file_key->key, 0, sizeof(file_key->key));
+    for (int part = 0; part < KEY_SECRET_PARTS; part++)
+        _set_key_part(file_key->key, part, parts[part]);
+
+    expand_file_key(file_key);
+
+    pthread_mutex_lock(&cache_lock);
+    _cache_insert(hash, file_key);
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+struct keystore_list_ctx {
+    time_t before;
+    shard_list_fn fn;
+    void *ctx;
+};
+
+static int _list_share(const char hash[], const struct stat *st, void *ctx)
+{
+    struct keystore_list_ctx *list = ctx;
+
+    if (st->st_mtime + 1 >= list->before)
+        return 0;
+
+    return list->fn(hash, list->ctx);
+}
+
+int keystore_list(time_t before, shard_list_fn fn, void *ctx)
+{
+    // Calls fn for every share written before the given time, so once for each share of a key
+    struct keystore_list_ctx list = {before, fn, ctx};
+    int res                       = 0;
+
+    for (int i = 0; res == 0 && i < n_key_targets; i++) {
+        res = fanout_walk(key_targets[i], ".key", _list_share, &list);
+    }
+
+    return res;
+}
+
+int keystore_remove(const char hash[])
+{
+    pthread_mutex_lock(&cache_lock);
+    _cache_remove(hash);
+    pthread_mutex_unlock(&cache_lock);
+
+    int res = 0;
+    for (int x = 1; x <= key_shares; x++) {
+        const char *target = key_targets[(x - 1) % n_key_targets];
+        char share_path[fanout_path_len(target, "-00.key")];
+        _share_path(hash, x, share_path, sizeof(share_path));
+
+        if (unlink(share_path) == -1 && errno != ENOENT)
+            res = -errno;
+    }
+
+    return res;
+}
+
+static int _rewrite_shares(const char hash[], const unsigned long long int xs[],
+                           const unsigned long long int ys[], const struct key_share_record records[],
+                           const int readable[])
+{
+    // Every share is recomputed on the polynomial through the trusted ones, and the shares that
+    // are missing or disagree with it are written again
+    int repaired = 0;
+
+    for (int x = 1; x <= key_shares; x++) {
+        struct key_share_record record;
+        record.magic = KEY_SHARE_MAGIC;
+        record.x     = x;
+
+        unsigned long long int y[KEY_SECRET_PARTS];
+        if (get_shares_at(xs, ys, key_shares_required, KEY_SECRET_PARTS, x, y) != 0)
+            return -EIO;
+        for (int part = 0; part < KEY_SECRET_PARTS; part++)
+            record.y[part] = y[part];
+
+        if (readable[x - 1] && memcmp(record.y, records[x - 1].y, sizeof(record.y)) == 0)
+            continue;
+
+        int res = _write_share(hash, &record, 1);
+        if (res < 0)
+            return res;
+
+        repaired++;
+    }
+
+    return repaired;
+}
+
+int keystore_repair(const char hash[], keystore_check_fn check, void *ctx)
+{
+    // Returns the number of shares rewritten, or -ENOKEY if no set of shares gives a key check
+    // accepts
+    struct key_share_record records[key_shares];
+    int readable[key_shares];
+    int usable[key_shares];
+    int n_usable = 0;
+
+    for (int x = 1; x <= key_shares; x++) {
+        readable[x - 1] = _read_share(hash, x, &records[x - 1]) == 0;
+        if (readable[x - 1])
+            usable[n_usable++] = x - 1;
+    }
+
+    int k = key_shares_required;
+    if (n_usable < k)
+        return -ENOKEY;
+
+    // Try every set of k readable shares, starting with the first k that keystore_load uses
+    int pick[k];
+    for (int i = 0; i < k; i++) {
+        pick[i] = i;
+    }
+
+    while (1) {
+        unsigned long long int xs[k];
+        unsigned long long int ys[k * KEY_SECRET_PARTS];
+        for (int i = 0; i < k; i++) {
+            const struct key_share_record *record = &records[usable[pick[i]]];
+            xs[i]                                 = record->x;
+            for (int part = 0; part < KEY_SECRET_PARTS; part++)
+                ys[i * KEY_SECRET_PARTS + part] = record->y[part];
+        }
+
+        unsigned long long int parts[KEY_SECRET_PARTS];
+        struct FileKey file_key;
+        memset(file_key.key, 0, sizeof(file_key.key));
+
+        if (get_secrets_batch(xs, ys, k, KEY_SECRET_PARTS, parts) == 0) {
+            for (int part = 0; part < KEY_SECRET_PARTS; part++)
+                _set_key_part(file_key.key, part, parts[part]);
+            expand_file_key(&file_key);
+
+            if (check(&file_key, ctx) == 0) {
+                // A bad share may have put a wrong key in the cache
+                pthread_mutex_lock(&cache_lock);
+                _cache_insert(hash, &file_key);
+                pthread_mutex_unlock(&cache_lock);
+
+                return _rewrite_shares(hash, xs, ys, records, readable);
+            }
+        }
+
+        int i = k - 1;
+        while (i >= 0 && pick[i] == n_usable - k + i)
+            i--;
+        if (i < 0)
+            break;
+
+        pick[i]++;
+        for (int j = i + 1; j < k; j++) {
+            pick[j] = pick[j - 1] + 1;
+        }
+    }
+
+    return -ENOKEY;
+}
@@ -0,0 +1,604 @@
+/*
+* FILENAME: lease.c
+*
+* DESCRIPTION: Leases that let mounts sharing a store cache what they read. A
+*              mount holds a read or write lease on each path it uses, granted
+*              by the lease manager at lease_server, and may trust its metadata
+*              index and the kernel's pages for a path only while it holds one.
+*              A path it did not hold is looked up in the storepoint again. When
+*              another mount needs a conflicting lease, the manager revokes this
+*              one, and it is given back as soon as no operation is running, so
+*              a change is never seen half made. FUSE runs single-threaded and
+*              every operation takes its leases before it changes anything, so
+*              one that waits for a grant gives back what was revoked from it
+*              first, and takes those leases again before it goes on. Without a
+*              manager to talk to, nothing is cached.
+*
+* USAGE: lease_start();
+*
+*        if (lease_begin(path, LEASE_READ) > 0)
+*            // look path up again
+*        while (lease_lost(lost, &mode))
+*            // take the lease on lost again, and look it up again
+*        lease_end();
+*
+*        lease_stop();
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "lease.h"
+
+char *lease_server = NULL;
+char *lease_listen = NULL;
+
+struct lease_entry {
+    char *path;
+    // Mode held, and a higher one asked for and not granted yet
+    int mode;
+    int wanted;
+    // Opened since the lease was granted, so the kernel's pages of the file are current
+    int opened;
+    // Running operations that took the lease
+    int users;
+    struct lease_entry *next;
+};
+
+// A revoked lease that goes back once no running operation uses it any more
+struct lease_deferred {
+    char *path;
+    int users;
+};
+
+// A lease the running operation took. One given back while the operation waited for another is
+// lost, and is taken again before the operation goes on
+struct lease_taken {
+    char *path;
+    int mode;
+    int held;
+    int lost;
+};
+
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+// Broadcast for grants and for connections made or lost
+static pthread_cond_t lease_cond = PTHREAD_COND_INITIALIZER;
+
+static struct lease_entry *leases[LEASE_BUCKETS];
+static int server_fd = -1;
+static int lease_running;
+static pthread_t lease_thread;
+
+// Operations between lease_begin and lease_end, and the paths revoked while one was running
+static int active;
+static struct lease_deferred *deferred;
+static size_t n_deferred;
+static size_t deferred_capacity;
+
+// The calling thread's operation, what it took, and until when it waits for grants
+static __thread int in_op;
+static __thread struct lease_taken *taken;
+static __thread size_t n_taken;
+static __thread size_t taken_capacity;
+static __thread struct timespec op_deadline;
+
+int lease_connect(const char address[], int do_listen)
+{
+    // address is HOST:PORT, or PORT alone for the loopback interface. Returns a socket
+    char host[strlen(address) + 1];
+    strcpy(host, address);
+
+    char *port = strrchr(host, ':');
+    if (port != NULL)
+        *port++ = '\0';
+    else
+        port = host;
+
+    struct addrinfo hints = {0};
+    hints.ai_family       = AF_UNSPEC;
+    hints.ai_socktype     = SOCK_STREAM;
+
+    struct addrinfo *info;
+    if (getaddrinfo(port == host ? "127.0.0.1" : host, port, &hints, &info) != 0)
+        return -EINVAL;
+
+    int fd = socket(info->ai_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        freeaddrinfo(info);
+        return -errno;
+    }
+
+    int one = 1;
+    int res = 0;
+    if (do_listen) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, info->ai_addr, info->ai_addrlen) == -1 ||
+            listen(fd, LEASE_MAX_CLIENTS) == -1)
+            res = -errno;
+    } else {
+        // Operations wait on every round trip
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, info->ai_addr, info->ai_addrlen) == -1)
+            res = -errno;
+    }
+
+    freeaddrinfo(info);
+
+    if (res != 0) {
+        close(fd);
+        return res;
+    }
+
+    return fd;
+}
+
+int lease_send(int fd, int type, int mode, const char path[])
+{
+    size_t path_len = strlen(path);
+    if (path_len >= PATH_MAX)
+        return -ENAMETOOLONG;
+
+    char buf[sizeof(struct lease_msg) + path_len];
+    struct lease_msg *msg = (struct lease_msg *)buf;
+    msg->type             = type;
+    msg->mode             = mode;
+    msg->path_len         = htons(path_len);
+    memcpy(buf + sizeof(struct lease_msg), path, path_len);
+
+    for (size_t sent = 0; sent < sizeof(buf);) {
+        ssize_t n = send(fd, buf + sent, sizeof(buf) - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 ? -EPIPE : -errno;
+        sent += n;
+    }
+
+    return 0;
+}
+
+static int _recv_all(int fd, void *buf, size_t len)
+{
+    for (size_t got = 0; got < len;) {
+        ssize_t n = recv(fd, (char *)buf + got, len - got, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 ? -ECONNRESET : -errno;
+        got += n;
+    }
+
+    return 0;
+}
+
+int lease_recv(int fd, struct lease_msg *msg, char path[])
+{
+    // path must hold PATH_MAX bytes
+    int res = _recv_all(fd, msg, sizeof(*msg));
+    if (res != 0)
+        return res;
+
+    size_t path_len = ntohs(msg->path_len);
+    if (path_len >= PATH_MAX)
+        return -EPROTO;
+
+    res = _recv_all(fd, path, path_len);
+    path[path_len] = '\0';
+
+    return res;
+}
+
+static struct lease_entry *_find(const char path[], int create)
+{
+    // Called with lease_lock held
+    struct lease_entry **slot = &leases[path_hash(path) & (LEASE_BUCKETS - 1)];
+    for (struct lease_entry *entry = *slot; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0)
+            return entry;
+    }
+
+    if (!create)
+        return NULL;
+
+    struct lease_entry *entry = calloc(1, sizeof(struct lease_entry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+
+    entry->next = *slot;
+    *slot       = entry;
+
+    return entry;
+}
+
+static void _drop(const char path[])
+{
+    // Called with lease_lock held
+    struct lease_entry **link = &leases[path_hash(path) & (LEASE_BUCKETS - 1)];
+    while (*link != NULL && strcmp((*link)->path, path) != 0)
+        link = &(*link)->next;
+
+    struct lease_entry *entry = *link;
+    if (entry != NULL) {
+        *link = entry->next;
+        free(entry->path);
+        free(entry);
+    }
+}
+
+static void _clear(void)
+{
+    // Called with lease_lock held, once nothing this mount held can be trusted any more
+    for (size_t i = 0; i < LEASE_BUCKETS; i++) {
+        while (leases[i] != NULL) {
+            struct lease_entry *entry = leases[i];
+            leases[i]                 = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    }
+
+    for (size_t i = 0; i < n_deferred; i++)
+        free(deferred[i].path);
+    n_deferred = 0;
+}
+
+static void _release(const char path[])
+{
+    // Called with lease_lock held. A connection that breaks is noticed by the lease thread
+    if (server_fd != -1)
+        lease_send(server_fd, LEASE_MSG_RELEASE, LEASE_NONE, path);
+}
+
+static void _flush_deferred(int all)
+{
+    // Called with lease_lock held. Gives back the revoked leases no running operation uses, or
+    // all of them
+    size_t kept = 0;
+
+    for (size_t i = 0; i < n_deferred; i++) {
+        if (!all && deferred[i].users > 0) {
+            deferred[kept++] = deferred[i];
+            continue;
+        }
+
+        _release(deferred[i].path);
+        free(deferred[i].path);
+    }
+
+    n_deferred = kept;
+}
+
+static struct lease_deferred *_find_deferred(const char path[])
+{
+    // Called with lease_lock held
+    for (size_t i = 0; i < n_deferred; i++) {
+        if (strcmp(deferred[i].path, path) == 0)
+            return &deferred[i];
+    }
+
+    return NULL;
+}
+
+static struct lease_taken *_find_taken(const char path[])
+{
+    for (size_t i = 0; i < n_taken; i++) {
+        if (strcmp(taken[i].path, path) == 0)
+            return &taken[i];
+    }
+
+    return NULL;
+}
+
+static void _note_taken(const char path[], int mode)
+{
+    // Called with lease_lock held, once the operation holds a lease of mode on path
+    struct lease_taken *lease = _find_taken(path);
+
+    if (lease == NULL && n_taken == taken_capacity) {
+        size_t capacity           = taken_capacity == 0 ? 8 : 2 * taken_capacity;
+        struct lease_taken *grown = realloc(taken, capacity * sizeof(struct lease_taken));
+        if (grown == NULL)
+            return;
+
+        taken          = grown;
+        taken_capacity = capacity;
+    }
+
+    if (lease == NULL) {
+        char *copy = strdup(path);
+        if (copy == NULL)
+            return;
+
+        lease  = &taken[n_taken++];
+        *lease = (struct lease_taken){copy, LEASE_NONE, 0, 0};
+    }
+
+    if (!lease->held) {
+        struct lease_entry *entry = _find(path, 0);
+        if (entry != NULL)
+            entry->users++;
+        lease->held = 1;
+    }
+
+    lease->mode = mode > lease->mode ? mode : lease->mode;
+}
+
+static void _give_back_taken(void)
+{
+    // Called with lease_lock held, while the operation waits for a grant. Leases it took that
+    // were revoked go back, or the manager could wait on this mount while it waits on the
+    // manager, and the operation takes them again before it goes on
+    for (size_t i = 0; i < n_deferred; i++) {
+        struct lease_taken *lease = _find_taken(deferred[i].path);
+        if (lease == NULL || !lease->held || deferred[i].users != 1)
+            continue;
+
+        lease->held       = 0;
+        lease->lost       = 1;
+        deferred[i].users = 0;
+    }
+}
+
+static void _revoke(const char path[])
+{
+    // Called with lease_lock held. The path is looked up again the next time it is used
+    struct lease_entry *entry = _find(path, 0);
+    int users                 = entry != NULL ? entry->users : 0;
+    _drop(path);
+
+    if (users == 0) {
+        _release(path);
+        return;
+    }
+
+    if (n_deferred == deferred_capacity) {
+        size_t capacity              = deferred_capacity == 0 ? 16 : 2 * deferred_capacity;
+        struct lease_deferred *grown = realloc(deferred, capacity * sizeof(*deferred));
+        if (grown != NULL) {
+            deferred          = grown;
+            deferred_capacity = capacity;
+        }
+    }
+
+    char *copy = n_deferred < deferred_capacity ? strdup(path) : NULL;
+    if (copy != NULL)
+        deferred[n_deferred++] = (struct lease_deferred){copy, users};
+    else
+        _release(path);
+
+    // An operation waiting for a grant can give it back right away
+    pthread_cond_broadcast(&lease_cond);
+}
+
+static void *_lease_loop(void *arg)
+{
+    (void)arg;
+
+    struct lease_msg msg;
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&lease_lock);
+
+    while (lease_running) {
+        // The manager may be another mount that is not up yet, or one that went away
+        if (server_fd == -1) {
+            pthread_mutex_unlock(&lease_lock);
+            int fd = lease_connect(lease_server, 0);
+            pthread_mutex_lock(&lease_lock);
+
+            if (fd < 0) {
+                struct timespec retry;
+                clock_gettime(CLOCK_REALTIME, &retry);
+                retry.tv_sec++;
+                pthread_cond_timedwait(&lease_cond, &lease_lock, &retry);
+                continue;
+            }
+
+            server_fd = fd;
+            pthread_cond_broadcast(&lease_cond);
+        }
+
+        int fd = server_fd;
+        pthread_mutex_unlock(&lease_lock);
+        int res = lease_recv(fd, &msg, path);
+        pthread_mutex_lock(&lease_lock);
+
+        if (res != 0) {
+            close(server_fd);
+            server_fd = -1;
+            _clear();
+            pthread_cond_broadcast(&lease_cond);
+            continue;
+        }
+
+        if (msg.type == LEASE_MSG_GRANT) {
+            struct lease_entry *entry = _find(path, 1);
+            if (entry != NULL) {
+                entry->mode   = msg.mode > entry->mode ? msg.mode : entry->mode;
+                entry->wanted = entry->wanted > entry->mode ? entry->wanted : LEASE_NONE;
+            }
+            pthread_cond_broadcast(&lease_cond);
+        } else if (msg.type == LEASE_MSG_REVOKE) {
+            _revoke(path);
+        }
+    }
+
+    pthread_mutex_unlock(&lease_lock);
+
+    return NULL;
+}
+
+int lease_start(void)
+{
+    if (lease_server == NULL)
+        return 0;
+
+    lease_running = 1;
+    if (pthread_create(&lease_thread, NULL, _lease_loop, NULL) != 0) {
+        lease_running = 0;
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+void lease_stop(void)
+{
+    if (!lease_running)
+        return;
+
+    pthread_mutex_lock(&lease_lock);
+    lease_running = 0;
+    if (server_fd != -1)
+        shutdown(server_fd, SHUT_RDWR);
+    pthread_cond_broadcast(&lease_cond);
+    pthread_mutex_unlock(&lease_lock);
+
+    pthread_join(lease_thread, NULL);
+
+    if (server_fd != -1)
+        close(server_fd);
+    server_fd = -1;
+    _clear();
+}
+
+int lease_begin(const char path[], int mode)
+{
+    // Takes a lease on path for the operation that is starting, and returns 1 if what this
+    // mount knows of path may be stale. Every lease an operation needs is taken before it
+    // changes anything, and those lease_lost returns are taken again. A NULL path only marks
+    // the operation as running
+    if (lease_server == NULL)
+        return 0;
+
+    pthread_mutex_lock(&lease_lock);
+
+    // All the waits of an operation together last no longer than LEASE_WAIT
+    if (!in_op) {
+        in_op = 1;
+        active++;
+        clock_gettime(CLOCK_REALTIME, &op_deadline);
+        op_deadline.tv_sec += LEASE_WAIT;
+    }
+
+    int stale = path != NULL && server_fd == -1;
+    while (path != NULL && server_fd != -1) {
+        struct lease_entry *entry = _find(path, 1);
+        if (entry != NULL && entry->mode >= mode)
+            break;
+
+        stale = 1;
+        if (entry == NULL)
+            break;
+
+        if (entry->wanted < mode) {
+            if (lease_send(server_fd, LEASE_MSG_ACQUIRE, mode, path) != 0)
+                break;
+            entry->wanted = mode;
+        }
+
+        // Nothing has changed yet, so what was revoked from this operation can go back now.
+        // Leases other running operations use stay until they are done
+        _give_back_taken();
+        _flush_deferred(0);
+
+        // Without a grant the operation goes on, looking everything up in the storepoint
+        if (pthread_cond_timedwait(&lease_cond, &lease_lock, &op_deadline) == ETIMEDOUT)
+            break;
+    }
+
+    struct lease_entry *entry = path != NULL ? _find(path, 0) : NULL;
+    if (entry != NULL && entry->mode >= mode)
+        _note_taken(path, mode);
+
+    pthread_mutex_unlock(&lease_lock);
+
+    return stale;
+}
+
+int lease_lost(char path[], int *mode)
+{
+    // Returns 1 and a lease the running operation took and gave back while it waited for another,
+    // which it takes again with lease_begin before it goes on. path must hold PATH_MAX bytes
+    for (size_t i = 0; i < n_taken; i++) {
+        if (!taken[i].lost)
+            continue;
+
+        taken[i].lost = 0;
+        snprintf(path, PATH_MAX, "%s", taken[i].path);
+        *mode = taken[i].mode;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void lease_end(void)
+{
+    // Ends the calling thread's operation. Leases revoked while operations ran go back once
+    // none of those using them is still running
+    if (lease_server == NULL)
+        return;
+
+    pthread_mutex_lock(&lease_lock);
+
+    if (in_op) {
+        // The leases this operation used, whether still held or revoked meanwhile
+        for (size_t i = 0; i < n_taken; i++) {
+            struct lease_entry *entry      = _find(taken[i].path, 0);
+            struct lease_deferred *revoked = entry == NULL ? _find_deferred(taken[i].path) : NULL;
+
+            if (taken[i].held && entry != NULL && entry->users > 0)
+                entry->users--;
+            else if (taken[i].held && revoked != NULL && revoked->users > 0)
+                revoked->users--;
+
+            free(taken[i].path);
+        }
+        n_taken = 0;
+
+        in_op = 0;
+        _flush_deferred(--active == 0);
+    }
+
+    pthread_mutex_unlock(&lease_lock);
+}
+
+int lease_keep_cache(const char path[])
+{
+    // Whether the kernel may keep its pages of the file at path as it is opened. They are
+    // current if the file was opened before under the read lease still held. Without leases no
+    // other mount changes the file
+    if (lease_server == NULL)
+        return 1;
+    if (path == NULL)
+        return 0;
+
+    pthread_mutex_lock(&lease_lock);
+
+    struct lease_entry *entry = _find(path, 0);
+    int keep                  = entry != NULL && entry->mode >= LEASE_READ && entry->opened;
+    if (entry != NULL && entry->mode >= LEASE_READ)
+        entry->opened = 1;
+
+    pthread_mutex_unlock(&lease_lock);
+
+    return keep;
+}
+
+void lease_uncache(const char path[])
+{
+    // The file at path changed without the kernel seeing it, so its pages go at the next open
+    if (lease_server == NULL || path == NULL)
+        return;
+
+    pthread_mutex_lock(&lease_lock);
+
+    struct lease_entry *entry = _find(path, 0);
+    if (entry != NULL)
+        entry->opened = 0;
+
+    pthread_mutex_unlock(&lease_lock);
+}
@@ -0,0 +1,334 @@
+/*
+* FILENAME: leasemgr.c
+*
+* DESCRIPTION: Lease manager, run by one of the mounts that share a store with
+*              --lease-listen. It grants any number of read leases on a path, or
+*              one write lease. A request that conflicts with leases held by
+*              other mounts sends each of them a revoke and is granted once they
+*              have all given theirs back, in the order requests arrived. A mount
+*              that does not answer a revoke within LEASE_REVOKE_TIMEOUT seconds
+*              is disconnected, which makes it drop everything it cached. One
+*              thread serves every mount, so none of this state is locked.
+*
+* USAGE: leasemgr_start();
+*        leasemgr_stop();
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "leasemgr.h"
+
+// A mount waiting for a lease
+struct mgr_request {
+    int client;
+    int mode;
+    struct mgr_request *next;
+};
+
+struct mgr_path {
+    char *path;
+    // Mounts holding read leases, one bit per client, and the one holding the write lease
+    uint64_t readers;
+    int writer;
+    // Mounts asked to give their lease back, and since when
+    uint64_t revoking;
+    time_t revoked_at;
+    struct mgr_request *waiting;
+    struct mgr_path *next;
+};
+
+static struct mgr_path *paths[LEASE_BUCKETS];
+static int clients[LEASE_MAX_CLIENTS];
+// Paths with revokes that have not been answered
+static size_t n_revoking;
+
+static int listen_fd = -1;
+static int mgr_running;
+static pthread_t mgr_thread;
+
+static struct mgr_path **_link(const char path[])
+{
+    struct mgr_path **link = &paths[path_hash(path) & (LEASE_BUCKETS - 1)];
+    while (*link != NULL && strcmp((*link)->path, path) != 0)
+        link = &(*link)->next;
+
+    return link;
+}
+
+static void _send(int client, int type, int mode, const char path[])
+{
+    // A client that cannot be written to is shut down, and dropped by the main loop
+    if (lease_send(clients[client], type, mode, path) != 0)
+        shutdown(clients[client], SHUT_RDWR);
+}
+
+static void _serve(struct mgr_path *entry)
+{
+    // Grant waiting requests in order until one conflicts with leases held elsewhere
+    while (entry->waiting != NULL) {
+        struct mgr_request *request = entry->waiting;
+        uint64_t self               = 1ULL << request->client;
+        uint64_t writer             = entry->writer >= 0 ? 1ULL << entry->writer : 0;
+        uint64_t conflict =
+            (request->mode == LEASE_WRITE ? entry->readers | writer : writer) & ~self;
+
+        if (conflict != 0) {
+            uint64_t ask = conflict & ~entry->revoking;
+            for (int i = 0; i < LEASE_MAX_CLIENTS; i++) {
+                if (ask & (1ULL << i))
+                    _send(i, LEASE_MSG_REVOKE, LEASE_NONE, entry->path);
+            }
+
+            if (ask != 0) {
+                n_revoking += entry->revoking == 0;
+                entry->revoking |= ask;
+                entry->revoked_at = time(NULL);
+            }
+
+            return;
+        }
+
+        if (request->mode == LEASE_WRITE) {
+            entry->writer = request->client;
+            entry->readers &= ~self;
+        } else if (entry->writer != request->client) {
+            entry->readers |= self;
+        }
+
+        _send(request->client, LEASE_MSG_GRANT, request->mode, entry->path);
+
+        entry->waiting = request->next;
+        free(request);
+    }
+}
+
+static void _settle(struct mgr_path **link)
+{
+    // Serve what is waiting on the path, and forget it once nobody holds or wants it
+    struct mgr_path *entry = *link;
+    _serve(entry);
+
+    if (entry->readers == 0 && entry->writer < 0 && entry->waiting == NULL) {
+        *link = entry->next;
+        free(entry->path);
+        free(entry);
+    }
+}
+
+static void _give_back(struct mgr_path *entry, int client)
+{
+    uint64_t bit = 1ULL << client;
+
+    entry->readers &= ~bit;
+    if (entry->writer == client)
+        entry->writer = -1;
+
+    if (entry->revoking & bit) {
+        entry->revoking &= ~bit;
+        n_revoking -= entry->revoking == 0;
+    }
+}
+
+static void _acquire(int client, int mode, const char path[])
+{
+    struct mgr_path **link = _link(path);
+
+    if (*link == NULL) {
+        struct mgr_path *entry = calloc(1, sizeof(struct mgr_path));
+        if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+            free(entry);
+            shutdown(clients[client], SHUT_RDWR);
+            return;
+        }
+
+        entry->writer = -1;
+        *link         = entry;
+    }
+
+    // A client asking again while it waits wants the higher of both modes
+    struct mgr_request **tail = &(*link)->waiting;
+    while (*tail != NULL && (*tail)->client != client)
+        tail = &(*tail)->next;
+
+    if (*tail != NULL) {
+        (*tail)->mode = mode > (*tail)->mode ? mode : (*tail)->mode;
+    } else if ((*tail = calloc(1, sizeof(struct mgr_request))) != NULL) {
+        (*tail)->client = client;
+        (*tail)->mode   = mode;
+    } else {
+        shutdown(clients[client], SHUT_RDWR);
+    }
+
+    _settle(link);
+}
+
+static void _release(int client, const char path[])
+{
+    struct mgr_path **link = _link(path);
+    if (*link == NULL)
+        return;
+
+    _give_back(*link, client);
+    _settle(link);
+}
+
+static void _disconnect(int client)
+{
+    // Everything the client held or waited for goes, as if it had given it all back
+    close(clients[client]);
+    clients[client] = -1;
+
+    for (size_t i = 0; i < LEASE_BUCKETS; i++) {
+        struct mgr_path **link = &paths[i];
+        while (*link != NULL) {
+            struct mgr_path *entry = *link;
+
+            struct mgr_request **request = &entry->waiting;
+            while (*request != NULL) {
+                struct mgr_request *gone = *request;
+                if (gone->client == client) {
+                    *request = gone->next;
+                    free(gone);
+                } else {
+                    request = &gone->next;
+                }
+            }
+
+            _give_back(entry, client);
+            _settle(link);
+
+            // The entry may have been freed, in which case link already names the next one
+            if (*link == entry)
+                link = &entry->next;
+        }
+    }
+}
+
+static void _expire(void)
+{
+    // Shut down clients sitting on revoked leases, which then count as disconnected
+    if (n_revoking == 0)
+        return;
+
+    time_t now = time(NULL);
+    for (size_t i = 0; i < LEASE_BUCKETS; i++) {
+        for (struct mgr_path *entry = paths[i]; entry != NULL; entry = entry->next) {
+            if (entry->revoking == 0 || now - entry->revoked_at < LEASE_REVOKE_TIMEOUT)
+                continue;
+
+            for (int client = 0; client < LEASE_MAX_CLIENTS; client++) {
+                if (entry->revoking & (1ULL << client))
+                    shutdown(clients[client], SHUT_RDWR);
+            }
+        }
+    }
+}
+
+static void _accept(void)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    for (int i = 0; i < LEASE_MAX_CLIENTS; i++) {
+        if (clients[i] == -1) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            clients[i] = fd;
+            return;
+        }
+    }
+
+    close(fd);
+}
+
+static void *_mgr_loop(void *arg)
+{
+    (void)arg;
+
+    struct pollfd fds[LEASE_MAX_CLIENTS + 1];
+    int owners[LEASE_MAX_CLIENTS + 1];
+    struct lease_msg msg;
+    char path[PATH_MAX];
+
+    while (mgr_running) {
+        nfds_t n_fds = 0;
+
+        fds[n_fds].fd     = listen_fd;
+        fds[n_fds].events = POLLIN;
+        owners[n_fds++]   = -1;
+
+        for (int i = 0; i < LEASE_MAX_CLIENTS; i++) {
+            if (clients[i] != -1) {
+                fds[n_fds].fd     = clients[i];
+                fds[n_fds].events = POLLIN;
+                owners[n_fds++]   = i;
+            }
+        }
+
+        // Wake up every second to notice a stop and revokes that went unanswered
+        if (poll(fds, n_fds, 1000) > 0) {
+            for (nfds_t i = 0; i < n_fds; i++) {
+                if (fds[i].revents == 0)
+                    continue;
+
+                if (owners[i] == -1) {
+                    _accept();
+                    continue;
+                }
+
+                int client = owners[i];
+                if (lease_recv(clients[client], &msg, path) != 0)
+                    _disconnect(client);
+                else if (msg.type == LEASE_MSG_ACQUIRE &&
+                         (msg.mode == LEASE_READ || msg.mode == LEASE_WRITE))
+                    _acquire(client, msg.mode, path);
+                else if (msg.type == LEASE_MSG_RELEASE)
+                    _release(client, path);
+            }
+        }
+
+        _expire();
+    }
+
+    return NULL;
+}
+
+int leasemgr_start(void)
+{
+    if (lease_listen == NULL)
+        return 0;
+
+    listen_fd = lease_connect(lease_listen, 1);
+    if (listen_fd < 0)
+        return listen_fd;
+
+    for (int i = 0; i < LEASE_MAX_CLIENTS; i++)
+        clients[i] = -1;
+
+    mgr_running = 1;
+    if (pthread_create(&mgr_thread, NULL, _mgr_loop, NULL) != 0) {
+        mgr_running = 0;
+        close(listen_fd);
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+void leasemgr_stop(void)
+{
+    if (!mgr_running)
+        return;
+
+    mgr_running = 0;
+    pthread_join(mgr_thread, NULL);
+
+    for (int i = 0; i < LEASE_MAX_CLIENTS; i++) {
+        if (clients[i] != -1)
+            _disconnect(i);
+    }
+
+    close(listen_fd);
+    listen_fd = -1;
+}
@@ -0,0 +1,310 @@
+/*
+* FILENAME: libdeffs.c
+*
+* DESCRIPTION: The DEFFS filesystem as a library. Binds DEFFS methods to the
+*              FUSE callbacks, opens and closes a store, and lets a process
+*              make the same calls a mount would without the kernel, so that
+*              benchmarks and stress tests can drive the core directly.
+*
+* USAGE: cmake --build ./ --target libdeffs -- -j 6
+*        if (libdeffs_open("/home/user/deffs_storage") != 0)
+*            return;
+*        deffs_oper.create("/hello", 0644, &fi);
+*        libdeffs_close();
+*
+* AUTHOR: Charles Averill
+*/
+
+#define FUSE_USE_VERSION 29
+
+#include "libdeffs.h"
+#include "utils.h"
+
+#include "attr.h"
+#include "bufpool.h"
+#include "cipherpolicy.h"
+#include "crypto.h"
+#include "cryptpool.h"
+#include "keystore.h"
+#include "lease.h"
+#include "leasemgr.h"
+#include "metastore.h"
+#include "perms.h"
+#include "reclaim.h"
+#include "replica.h"
+#include "rw.h"
+#include "scrub.h"
+#include "segment.h"
+#include "shards.h"
+#include "snapshot.h"
+#include "tier.h"
+
+char *mountpoint;
+char *storepoint;
+char *shardpoint;
+
+struct fuse_operations deffs_oper = {
+    .init     = deffs_init,
+    .destroy  = deffs_destroy,
+    .getattr  = deffs_getattr,
+    .fgetattr = deffs_fgetattr,
+#ifndef __APPLE__
+    .access = deffs_access,
+#endif
+    .readlink   = deffs_readlink,
+    .opendir    = deffs_opendir,
+    .readdir    = deffs_readdir,
+    .releasedir = deffs_releasedir,
+    .mknod      = NULL, //deffs_mknod,
+    .mkdir      = deffs_mkdir,
+    .symlink    = deffs_symlink,
+    .unlink     = deffs_unlink,
+    .rmdir      = deffs_rmdir,
+    .rename     = deffs_rename,
+    .link       = deffs_link,
+    .chmod      = deffs_chmod,
+    .chown      = deffs_chown,
+    .truncate   = deffs_truncate,
+    .ftruncate  = deffs_ftruncate,
+#ifdef HAVE_UTIMENSAT
+    .utimens = deffs_utimens,
+#endif
+    .create   = deffs_create,
+    .open     = deffs_open,
+    .read     = deffs_read,
+    .read_buf = NULL, //deffs_read_buf,
+    .write    = deffs_write,
+    .write_buf =
+        NULL, //deffs_write_buf, // This one could be implemented but it's different enough from write that I don't want to yet
+    .statfs  = deffs_statfs,
+    .flush   = deffs_flush,
+    .release = deffs_release,
+    .fsync   = NULL, //deffs_fsync,
+#if defined(HAVE_POSIX_FALLOCATE) || defined(__APPLE__)
+    .fallocate = deffs_fallocate,
+#endif
+    .ioctl = deffs_ioctl,
+#ifdef HAVE_SETXATTR
+    .setxattr    = deffs_setxattr,
+    .getxattr    = deffs_getxattr,
+    .listxattr   = deffs_listxattr,
+    .removexattr = deffs_removexattr,
+#endif
+#ifndef __APPLE__
+    .lock  = NULL, //deffs_lock,
+    .flock = NULL, //deffs_flock,
+#endif
+#ifdef __APPLE__
+    .setvolname  = NULL, //deffs_setvolname,
+    .exchange    = NULL, //deffs_exchange,
+    .getxtimes   = NULL, //deffs_getxtimes,
+    .setbkuptime = NULL, //deffs_setbkuptime,
+    .setchgtime  = NULL, //deffs_setchgtime,
+    .setcrtime   = NULL, //deffs_setcrtime,
+    .chflags     = NULL, //deffs_chflags,
+    .setattr_x   = NULL, //deffs_setattr_x,
+    .fsetattr_x  = NULL, //deffs_fsetattr_x,
+#endif
+    .flag_nullpath_ok = 1,
+#if HAVE_UTIMENSAT
+    .flag_utime_omit_ok = 1,
+#endif
+};
+
+// Whether libdeffs_start opened the store, so that deffs_destroy has something to close
+static int store_started;
+
+static void _stop(void)
+{
+    // The reclaimer and the scrubber work through the stores, so they stop before those close.
+    // Replicas get whatever is still queued for them before the unmount completes
+    reclaim_stop();
+    scrub_stop();
+    tier_stop();
+    replica_stop();
+    lease_stop();
+    leasemgr_stop();
+
+    if (segment_store_enabled)
+        segment_store_close();
+
+    metastore_close();
+    keystore_close();
+    crypto_pool_stop();
+    bufpool_trim();
+}
+
+static int _start_failed(int res)
+{
+    // Whatever was started before the failure is stopped again
+    _stop();
+
+    return res < 0 ? res : -EIO;
+}
+
+int libdeffs_start(void)
+{
+    // Without a cipher given, new files get the fastest one this CPU runs
+    if (file_cipher == DEFFS_CIPHER_INHERIT)
+        file_cipher = cipher_fastest();
+
+    // Create the shardpoint directory, or reuse the one of an existing store
+    int res = mkdir_if_not_exists(shardpoint, 0700) != 0 && errno != EEXIST ? -errno : 0;
+    if (res != 0) {
+        printf("Could not create %s\n", shardpoint);
+        return res;
+    }
+
+    // Shards are only found again with the fan-out layout the store was created with
+    int depth, width;
+    res = shard_layout_open();
+    if (res == -EINVAL && shard_layout_read(&depth, &width) == 0) {
+        printf("%s was created with --fanout-depth %d --fanout-width %d\n", storepoint, depth,
+               width);
+        return res;
+    } else if (res < 0) {
+        printf("Could not read the layout of %s\n", storepoint);
+        return res;
+    }
+
+    // The root's snapshots are always there to browse
+    char snapshots[strlen(storepoint) + strlen(SNAPSHOT_DIR) + 2];
+    sprintf(snapshots, "%s/%s", storepoint, SNAPSHOT_DIR);
+    res = mkdir_if_not_exists(snapshots, 0755) != 0 && errno != EEXIST ? -errno : 0;
+    if (res != 0) {
+        printf("Could not create %s\n", snapshots);
+        return res;
+    }
+
+    if (segment_store_enabled && (res = segment_store_open()) != 0) {
+        printf("Could not open segment store in %s\n", shardpoint);
+        return _start_failed(res);
+    }
+
+    if ((res = tier_start()) != 0) {
+        printf("Could not open capacity tier %s\n", capacity_tier);
+        return _start_failed(res);
+    }
+
+    if ((res = replica_start()) != 0) {
+        printf("Could not open replica targets\n");
+        return _start_failed(res);
+    }
+
+    // A mount that serves leases takes its own from itself, like every other mount
+    if ((res = leasemgr_start()) != 0) {
+        printf("Could not listen for leases on %s\n", lease_listen);
+        return _start_failed(res);
+    }
+
+    if ((res = lease_start()) != 0) {
+        printf("Could not start the lease client\n");
+        return _start_failed(res);
+    }
+
+    // A store that was not unmounted cleanly may have changed after its index was last written
+    int stale = metastore_open();
+    if (stale < 0) {
+        printf("Could not open metadata store in %s\n", shardpoint);
+        return _start_failed(stale);
+    }
+
+    if (stale && (res = attr_rebuild()) != 0) {
+        printf("Could not rebuild the metadata index of %s\n", storepoint);
+        return _start_failed(res);
+    }
+
+    if ((res = keystore_open()) != 0) {
+        printf("Could not open key targets\n");
+        return _start_failed(res);
+    }
+
+    if ((res = crypto_pool_start()) != 0) {
+        printf("Could not start crypto workers\n");
+        return _start_failed(res);
+    }
+
+    if ((res = scrub_start()) != 0) {
+        printf("Could not start the scrubber\n");
+        return _start_failed(res);
+    }
+
+    // After a crash, shards whose release was still queued are found by a sweep
+    if ((res = reclaim_start(stale)) != 0) {
+        printf("Could not start the reclaimer\n");
+        return _start_failed(res);
+    }
+
+    store_started = 1;
+
+    return 0;
+}
+
+int libdeffs_running(void)
+{
+    return store_started;
+}
+
+void *deffs_init(struct fuse_conn_info *conn)
+{
+#ifdef __APPLE__
+    FUSE_ENABLE_SETVOLNAME(conn);
+    FUSE_ENABLE_XTIMES(conn);
+#else
+    (void)conn;
+#endif
+    // FUSE cannot fail its init, so a store that does not open ends the session instead
+    if (libdeffs_start() != 0)
+        fuse_exit(fuse_get_context()->fuse);
+
+    return NULL;
+}
+
+void deffs_destroy(void *private_data)
+{
+    (void)private_data;
+
+    // A store that did not open was closed again by libdeffs_start
+    if (store_started) {
+        store_started = 0;
+        _stop();
+    }
+}
+
+void libdeffs_set_store(char *store)
+{
+    // Shards live in a hidden directory of the store
+    storepoint = store;
+
+    shardpoint = malloc(strlen(storepoint) + strlen("/.shards/") + 1);
+    strcpy(shardpoint, storepoint);
+    strcat(shardpoint, "/.shards/");
+}
+
+int libdeffs_open(char *store)
+{
+    // Opens the store as a mount would, for calls made through deffs_oper in this process
+    struct stat st;
+    if (stat(store, &st) == -1)
+        return -errno;
+    if (!S_ISDIR(st.st_mode))
+        return -ENOTDIR;
+
+    libdeffs_set_store(store);
+
+    int res = libdeffs_start();
+    if (res != 0) {
+        free(shardpoint);
+        shardpoint = NULL;
+    }
+
+    return res;
+}
+
+void libdeffs_close(void)
+{
+    deffs_oper.destroy(NULL);
+
+    free(shardpoint);
+    shardpoint = NULL;
+}
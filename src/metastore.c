@@ -0,0 +1,1088 @@
+/*
+* FILENAME: metastore.c
+*
+* DESCRIPTION: Embedded metadata index. It holds the attributes of every path
+*              under the storepoint that has been looked up or changed, with the
+*              logical size of regular files, so getattr and readdir are answered
+*              without touching the storepoint. It is a small LSM tree: changes go
+*              to an append-only log of checksummed records under .shards/meta/
+*              and to a skip list in memory, and once the skip list has grown far
+*              enough it is merged with the sorted table on disk into a new table,
+*              which is mapped into memory and searched in place. A torn record at
+*              the end of the log is dropped when the log is replayed. Keys are
+*              ordered by directory, so the children of a directory, and
+*              everything below it, are contiguous ranges. Closing the store
+*              leaves a marker that the next open consumes. A store opened
+*              without the marker may have missed changes, so it starts out
+*              empty and reports itself stale, to be loaded again in bulk
+*              without logging.
+*
+* USAGE: metastore_open();
+*
+*        metastore_put("/dir/file", &st, 0);
+*        if (metastore_get("/dir/file", &st, &flags) == -ENOENT)
+*            ...
+*        metastore_list("/dir", fill_entry, ctx);
+*        metastore_move("/dir", "/other");
+*        metastore_remove("/other");
+*
+*        metastore_close();
+*
+*        if (metastore_open() > 0) {
+*            metastore_load_begin();
+*            // metastore_put every path
+*            metastore_load_end();
+*        }
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "metastore.h"
+
+#define METASTORE_MAX_HEIGHT 16
+
+// The skip list is merged into the table once it holds this many entries, or a sixteenth of
+// the table if that is more, so each change rewrites a bounded number of entries on average
+#define METASTORE_MEMTABLE_MIN 65536
+
+// Longest key, a path whose every byte is escaped
+#define METASTORE_KEY_MAX (2 * PATH_MAX)
+
+#define METASTORE_TABLE_MAGIC "DEFM"
+#define METASTORE_TABLE_VERSION 1
+
+#define METASTORE_LOG_PUT 1
+#define METASTORE_LOG_DELETE 2
+
+// Attributes of one path, as kept in every layer
+struct meta_record {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t ino;
+    uint64_t rdev;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t atime_nsec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t flags;
+};
+
+// Skip list node, followed by its key. Deleted keys stay as tombstones until the next merge,
+// since the table may still hold them
+struct meta_node {
+    struct meta_record record;
+    uint16_t key_len;
+    uint8_t dead;
+    uint8_t height;
+    struct meta_node *next[];
+};
+
+struct meta_table_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t n_entries;
+    // Offsets of the entries, in key order, follow the entries themselves
+    uint64_t index_offset;
+};
+
+// Table entries are followed by their key and padded to 8 bytes
+struct meta_table_entry {
+    struct meta_record record;
+    uint16_t key_len;
+    uint16_t pad[3];
+};
+
+struct meta_log_record {
+    // FNV-1a of the rest of the record and the key that follows it
+    uint32_t checksum;
+    uint8_t op;
+    uint8_t pad;
+    uint16_t key_len;
+    struct meta_record record;
+};
+
+// Position in the merged view of the skip list and the table, up to an exclusive end key
+struct meta_iter {
+    struct meta_node *node;
+    uint64_t pos;
+    const char *end;
+    size_t end_len;
+};
+
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct meta_node *memtable;
+static size_t memtable_count;
+static uint32_t height_seed = 0x9e3779b9;
+
+static char *table;
+static size_t table_len;
+static uint64_t table_entries;
+static const uint64_t *table_index;
+
+static int log_fd = -1;
+
+// Set while the store is loaded in bulk, which skips the log and merges less often
+static int unlogged;
+
+char metastore_name[METASTORE_NAME_MAX] = "meta";
+
+static void _meta_path(const char name[], char obuf[], size_t len)
+{
+    snprintf(obuf, len, "%s%s/%s", shardpoint, metastore_name, name);
+}
+
+static int _compare(const char a[], size_t a_len, const char b[], size_t b_len)
+{
+    int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (res != 0)
+        return res;
+
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+static size_t _encode(const char path[], char key[], size_t *last)
+{
+    // Slashes turn into 1 bytes, and the 1 and 2 bytes of names are kept behind a 2 byte, so
+    // that no name reads as a slash or as the end of a range. last is where the last slash went
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+        len--;
+
+    size_t key_len = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (path[i] == '/')
+            *last = key_len;
+        else if (path[i] == 1 || path[i] == 2)
+            key[key_len++] = 2;
+
+        key[key_len++] = path[i] == '/' ? 1 : path[i];
+    }
+
+    return key_len;
+}
+
+static size_t _encode_dir(const char path[], char key[])
+{
+    // A directory's children start with its path and a 0 byte. Its grandchildren and below
+    // start with its path and a 1 byte, right after them
+    size_t last;
+
+    return _encode(path, key, &last);
+}
+
+static size_t _encode_key(const char path[], char key[])
+{
+    // "/a/b/c" is kept as "\1a\1b\0c", and the root as the empty key
+    size_t last = SIZE_MAX;
+    size_t len  = _encode(path, key, &last);
+
+    if (last != SIZE_MAX)
+        key[last] = 0;
+
+    return len;
+}
+
+static uint32_t _checksum(const void *buf, size_t len)
+{
+    const unsigned char *bytes = buf;
+    uint32_t hash              = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static void _to_record(const struct stat *st, uint32_t flags, struct meta_record *record)
+{
+    memset(record, 0, sizeof(*record));
+    record->mode   = st->st_mode;
+    record->uid    = st->st_uid;
+    record->gid    = st->st_gid;
+    record->nlink  = st->st_nlink;
+    record->size   = st->st_size;
+    record->blocks = st->st_blocks;
+    record->ino    = st->st_ino;
+    record->rdev   = st->st_rdev;
+    record->flags  = flags;
+#ifdef __APPLE__
+    record->atime      = st->st_atimespec.tv_sec;
+    record->atime_nsec = st->st_atimespec.tv_nsec;
+    record->mtime      = st->st_mtimespec.tv_sec;
+    record->mtime_nsec = st->st_mtimespec.tv_nsec;
+    record->ctime      = st->st_ctimespec.tv_sec;
+    record->ctime_nsec = st->st_ctimespec.tv_nsec;
+#else
+    record->atime      = st->st_atim.tv_sec;
+    record->atime_nsec = st->st_atim.tv_nsec;
+    record->mtime      = st->st_mtim.tv_sec;
+    record->mtime_nsec = st->st_mtim.tv_nsec;
+    record->ctime      = st->st_ctim.tv_sec;
+    record->ctime_nsec = st->st_ctim.tv_nsec;
+#endif
+}
+
+static void _to_stat(const struct meta_record *record, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode    = record->mode;
+    st->st_uid     = record->uid;
+    st->st_gid     = record->gid;
+    st->st_nlink   = record->nlink;
+    st->st_size    = record->size;
+    st->st_blocks  = record->blocks;
+    st->st_ino     = record->ino;
+    st->st_rdev    = record->rdev;
+    st->st_blksize = 4096;
+#ifdef __APPLE__
+    st->st_atimespec.tv_sec  = record->atime;
+    st->st_atimespec.tv_nsec = record->atime_nsec;
+    st->st_mtimespec.tv_sec  = record->mtime;
+    st->st_mtimespec.tv_nsec = record->mtime_nsec;
+    st->st_ctimespec.tv_sec  = record->ctime;
+    st->st_ctimespec.tv_nsec = record->ctime_nsec;
+#else
+    st->st_atim.tv_sec  = record->atime;
+    st->st_atim.tv_nsec = record->atime_nsec;
+    st->st_mtim.tv_sec  = record->mtime;
+    st->st_mtim.tv_nsec = record->mtime_nsec;
+    st->st_ctim.tv_sec  = record->ctime;
+    st->st_ctim.tv_nsec = record->ctime_nsec;
+#endif
+}
+
+static char *_node_key(struct meta_node *node)
+{
+    return (char *)&node->next[node->height];
+}
+
+static int _random_height(void)
+{
+    // Each level holds a quarter of the nodes of the one below
+    height_seed ^= height_seed << 13;
+    height_seed ^= height_seed >> 17;
+    height_seed ^= height_seed << 5;
+
+    int height    = 1;
+    uint32_t bits = height_seed;
+    while (height < METASTORE_MAX_HEIGHT && (bits & 3) == 0) {
+        height++;
+        bits >>= 2;
+    }
+
+    return height;
+}
+
+static struct meta_node *_memtable_seek(const char key[], size_t len,
+                                        struct meta_node *update[])
+{
+    // First node not below key, with the last node before it on every level in update
+    struct meta_node *node = memtable;
+
+    for (int level = METASTORE_MAX_HEIGHT - 1; level >= 0; level--) {
+        while (node->next[level] != NULL &&
+               _compare(_node_key(node->next[level]), node->next[level]->key_len, key, len) < 0)
+            node = node->next[level];
+
+        if (update != NULL)
+            update[level] = node;
+    }
+
+    return node->next[0];
+}
+
+static int _memtable_set(const char key[], size_t len, const struct meta_record *record,
+                         int dead)
+{
+    struct meta_node *update[METASTORE_MAX_HEIGHT];
+    struct meta_node *node = _memtable_seek(key, len, update);
+
+    if (node != NULL && _compare(_node_key(node), node->key_len, key, len) == 0) {
+        node->record = *record;
+        node->dead   = dead;
+        return 0;
+    }
+
+    int height = _random_height();
+    node       = malloc(sizeof(struct meta_node) + height * sizeof(struct meta_node *) + len);
+    if (node == NULL)
+        return -ENOMEM;
+
+    node->record  = *record;
+    node->key_len = len;
+    node->dead    = dead;
+    node->height  = height;
+    memcpy(_node_key(node), key, len);
+
+    for (int level = 0; level < height; level++) {
+        node->next[level]          = update[level]->next[level];
+        update[level]->next[level] = node;
+    }
+
+    memtable_count++;
+
+    return 0;
+}
+
+static void _memtable_clear(void)
+{
+    struct meta_node *node = memtable->next[0];
+    while (node != NULL) {
+        struct meta_node *next = node->next[0];
+        free(node);
+        node = next;
+    }
+
+    memset(memtable->next, 0, METASTORE_MAX_HEIGHT * sizeof(struct meta_node *));
+    memtable_count = 0;
+}
+
+static const struct meta_table_entry *_table_entry(uint64_t i)
+{
+    // A damaged table reads as if it ended at the first entry out of bounds
+    if (i >= table_entries)
+        return NULL;
+
+    uint64_t offset = table_index[i];
+    if (offset < sizeof(struct meta_table_header) ||
+        offset + sizeof(struct meta_table_entry) > table_len)
+        return NULL;
+
+    const struct meta_table_entry *entry = (const void *)(table + offset);
+    if (offset + sizeof(struct meta_table_entry) + entry->key_len > table_len)
+        return NULL;
+
+    return entry;
+}
+
+static const char *_entry_key(const struct meta_table_entry *entry)
+{
+    return (const char *)(entry + 1);
+}
+
+static uint64_t _table_seek(const char key[], size_t len)
+{
+    // Position of the first entry not below key
+    uint64_t lo = 0, hi = table_entries;
+
+    while (lo < hi) {
+        uint64_t mid                         = lo + (hi - lo) / 2;
+        const struct meta_table_entry *entry = _table_entry(mid);
+
+        if (entry != NULL && _compare(_entry_key(entry), entry->key_len, key, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void _iter_seek(struct meta_iter *it, const char key[], size_t len, const char end[],
+                       size_t end_len)
+{
+    // A NULL end runs to the last key
+    it->node    = _memtable_seek(key, len, NULL);
+    it->pos     = _table_seek(key, len);
+    it->end     = end;
+    it->end_len = end_len;
+}
+
+static int _in_range(const struct meta_iter *it, const char key[], size_t len)
+{
+    return it->end == NULL || _compare(key, len, it->end, it->end_len) < 0;
+}
+
+static int _iter_next(struct meta_iter *it, const char **key, size_t *len,
+                      struct meta_record *record)
+{
+    // Returns 1 with the next live entry, where the skip list shadows the table
+    while (1) {
+        const struct meta_table_entry *entry = _table_entry(it->pos);
+        const char *node_key                 = NULL;
+        const char *entry_key                = NULL;
+
+        if (it->node != NULL && _in_range(it, _node_key(it->node), it->node->key_len))
+            node_key = _node_key(it->node);
+        if (entry != NULL && _in_range(it, _entry_key(entry), entry->key_len))
+            entry_key = _entry_key(entry);
+
+        if (node_key == NULL && entry_key == NULL)
+            return 0;
+
+        int cmp = node_key == NULL  ? 1 :
+                  entry_key == NULL ? -1 :
+                                      _compare(node_key, it->node->key_len, entry_key,
+                                               entry->key_len);
+
+        if (cmp > 0) {
+            it->pos++;
+            *key    = entry_key;
+            *len    = entry->key_len;
+            *record = entry->record;
+            return 1;
+        }
+
+        struct meta_node *node = it->node;
+        it->node               = node->next[0];
+        if (cmp == 0)
+            it->pos++;
+
+        if (node->dead)
+            continue;
+
+        *key    = node_key;
+        *len    = node->key_len;
+        *record = node->record;
+        return 1;
+    }
+}
+
+static int _get(const char key[], size_t len, struct meta_record *record)
+{
+    struct meta_node *node = _memtable_seek(key, len, NULL);
+    if (node != NULL && _compare(_node_key(node), node->key_len, key, len) == 0) {
+        if (node->dead)
+            return -ENOENT;
+
+        *record = node->record;
+        return 0;
+    }
+
+    const struct meta_table_entry *entry = _table_entry(_table_seek(key, len));
+    if (entry != NULL && _compare(_entry_key(entry), entry->key_len, key, len) == 0) {
+        *record = entry->record;
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+static int _table_map(void)
+{
+    char path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _meta_path("meta.db", path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -errno;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct meta_table_header)) {
+        close(fd);
+        return -EIO;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -errno;
+
+    const struct meta_table_header *header = (const void *)map;
+    if (memcmp(header->magic, METASTORE_TABLE_MAGIC, 4) != 0 ||
+        header->version != METASTORE_TABLE_VERSION || header->index_offset % 8 != 0 ||
+        header->index_offset > (uint64_t)st.st_size ||
+        header->n_entries > ((uint64_t)st.st_size - header->index_offset) / sizeof(uint64_t)) {
+        munmap(map, st.st_size);
+        return -EIO;
+    }
+
+    table         = map;
+    table_len     = st.st_size;
+    table_entries = header->n_entries;
+    table_index   = (const uint64_t *)(map + header->index_offset);
+
+    return 0;
+}
+
+static void _table_unmap(void)
+{
+    if (table != NULL)
+        munmap(table, table_len);
+
+    table         = NULL;
+    table_len     = 0;
+    table_entries = 0;
+    table_index   = NULL;
+}
+
+static int _write_all(int fd, const char *buf, size_t len)
+{
+    return write(fd, buf, len) == (ssize_t)len ? 0 : -EIO;
+}
+
+static int _compact(void)
+{
+    // Merge the skip list and the table into a new table, which then stands in for the log
+    char path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    char tmp_path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _meta_path("meta.db", path, sizeof(path));
+    _meta_path("meta.db.tmp", tmp_path, sizeof(tmp_path));
+
+    size_t window     = stream_window_size;
+    char *buf         = bufpool_get(window);
+    uint64_t capacity = memtable_count + table_entries;
+    uint64_t *offsets = malloc(capacity * sizeof(uint64_t) + 1);
+    int fd            = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    int res = buf == NULL || offsets == NULL ? -ENOMEM : fd == -1 ? -errno : 0;
+
+    struct meta_table_header header;
+    memcpy(header.magic, METASTORE_TABLE_MAGIC, 4);
+    header.version   = METASTORE_TABLE_VERSION;
+    header.n_entries = 0;
+
+    size_t used  = sizeof(header);
+    uint64_t pos = sizeof(header);
+
+    struct meta_iter it;
+    const char *key;
+    size_t len;
+    struct meta_record record;
+
+    if (res == 0)
+        _iter_seek(&it, "", 0, NULL, 0);
+
+    while (res == 0 && _iter_next(&it, &key, &len, &record)) {
+        size_t entry_len = (sizeof(struct meta_table_entry) + len + 7) & ~(size_t)7;
+
+        if (used + entry_len > window) {
+            res  = _write_all(fd, buf, used);
+            used = 0;
+        }
+
+        struct meta_table_entry *entry = (void *)(buf + used);
+        memset(entry, 0, entry_len);
+        entry->record  = record;
+        entry->key_len = len;
+        memcpy(entry + 1, key, len);
+
+        offsets[header.n_entries++] = pos;
+        pos += entry_len;
+        used += entry_len;
+    }
+
+    header.index_offset = pos;
+
+    if (res == 0)
+        res = _write_all(fd, buf, used);
+    if (res == 0)
+        res = _write_all(fd, (const char *)offsets, header.n_entries * sizeof(uint64_t));
+    if (res == 0 && pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        res = -EIO;
+    if (res == 0 && fsync(fd) == -1)
+        res = -errno;
+
+    if (fd != -1)
+        close(fd);
+    if (res == 0 && rename(tmp_path, path) == -1)
+        res = -errno;
+
+    bufpool_put(buf, window);
+    free(offsets);
+
+    if (res != 0) {
+        unlink(tmp_path);
+        return res;
+    }
+
+    // Replaying the log over the new table would change nothing, so a crash from here on is
+    // harmless. Until the new table is mapped, the old one and the skip list still hold it all
+    char *old_table      = table;
+    size_t old_table_len = table_len;
+
+    res = _table_map();
+    if (res != 0)
+        return res;
+
+    if (old_table != NULL)
+        munmap(old_table, old_table_len);
+    _memtable_clear();
+
+    if (ftruncate(log_fd, 0) == -1)
+        res = -errno;
+
+    return res;
+}
+
+static int _set(const char key[], size_t len, const struct meta_record *record, int dead)
+{
+    // The change is logged before it is applied
+    struct {
+        struct meta_log_record head;
+        char key[METASTORE_KEY_MAX];
+    } entry;
+
+    memset(&entry.head, 0, sizeof(entry.head));
+    entry.head.op      = dead ? METASTORE_LOG_DELETE : METASTORE_LOG_PUT;
+    entry.head.key_len = len;
+    if (!dead)
+        entry.head.record = *record;
+    memcpy(entry.key, key, len);
+
+    size_t total         = sizeof(entry.head) + len;
+    entry.head.checksum  = _checksum((char *)&entry + sizeof(uint32_t), total - sizeof(uint32_t));
+
+    if (!unlogged && _write_all(log_fd, (const char *)&entry, total) != 0)
+        return -EIO;
+
+    int res = _memtable_set(key, len, &entry.head.record, dead);
+    if (res != 0)
+        return res;
+
+    // A bulk load merges whenever the skip list has caught up with the table, so that every
+    // entry is rewritten about twice however large the store is
+    uint64_t share = unlogged ? table_entries : table_entries / 16;
+    size_t limit   = share > METASTORE_MEMTABLE_MIN ? share : METASTORE_MEMTABLE_MIN;
+    if (memtable_count >= limit && _compact() != 0)
+        printf("Could not compact the metadata store, its log keeps growing\n");
+
+    return 0;
+}
+
+static int _replay(void)
+{
+    // Apply every whole record in the log, and cut it after the last one
+    size_t window = stream_window_size;
+    char *buf     = bufpool_get(window);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    off_t pos   = 0;
+    size_t used = 0;
+    int res     = 0;
+
+    while (res == 0) {
+        ssize_t n = pread(log_fd, buf + used, window - used, pos + used);
+        if (n < 0) {
+            res = -errno;
+            break;
+        }
+
+        used += n;
+
+        size_t offset = 0;
+        while (used - offset >= sizeof(struct meta_log_record)) {
+            struct meta_log_record head;
+            memcpy(&head, buf + offset, sizeof(head));
+
+            size_t total = sizeof(head) + head.key_len;
+            if (head.key_len >= METASTORE_KEY_MAX) {
+                n = 0;
+                break;
+            }
+            if (used - offset < total)
+                break;
+            if (_checksum(buf + offset + sizeof(uint32_t), total - sizeof(uint32_t)) !=
+                    head.checksum ||
+                (head.op != METASTORE_LOG_PUT && head.op != METASTORE_LOG_DELETE)) {
+                n = 0;
+                break;
+            }
+
+            res = _memtable_set(buf + offset + sizeof(head), head.key_len, &head.record,
+                                head.op == METASTORE_LOG_DELETE);
+            if (res != 0)
+                break;
+
+            offset += total;
+        }
+
+        pos += offset;
+        memmove(buf, buf + offset, used - offset);
+        used -= offset;
+
+        // Either the log ended or its next record is damaged
+        if (n == 0 || (used > 0 && used == window))
+            break;
+    }
+
+    bufpool_put(buf, window);
+
+    if (res == 0 && ftruncate(log_fd, pos) == -1)
+        res = -errno;
+
+    return res;
+}
+
+static int _sync_dir(void)
+{
+    char dir[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _meta_path("", dir, sizeof(dir));
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return -errno;
+
+    int res = fsync(fd) == -1 ? -errno : 0;
+    close(fd);
+
+    return res;
+}
+
+static int _take_clean_marker(void)
+{
+    // Returns 1 if the last mount closed the store. The marker is gone for good before anything
+    // changes, so a crash from here on leaves the store stale
+    char clean_path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _meta_path("clean", clean_path, sizeof(clean_path));
+
+    if (unlink(clean_path) == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    int res = _sync_dir();
+
+    return res == 0 ? 1 : res;
+}
+
+static int _leave_clean_marker(void)
+{
+    char clean_path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _meta_path("clean", clean_path, sizeof(clean_path));
+
+    // Everything the marker vouches for has to be on disk before it is
+    if (fsync(log_fd) == -1)
+        return -errno;
+
+    int fd = open(clean_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        return -errno;
+    close(fd);
+
+    return _sync_dir();
+}
+
+static int _discard(void)
+{
+    // Drop the table and the log of a stale store
+    char path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _meta_path("meta.db", path, sizeof(path));
+    if (unlink(path) == -1 && errno != ENOENT)
+        return -errno;
+
+    _meta_path("meta.log", path, sizeof(path));
+    if (truncate(path, 0) == -1 && errno != ENOENT)
+        return -errno;
+
+    return 0;
+}
+
+int metastore_open(void)
+{
+    // Returns 1 if the store is stale and starts out empty
+    char dir[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _meta_path("", dir, sizeof(dir));
+
+    if (mkdir_if_not_exists(dir, 0700) != 0 && errno != EEXIST)
+        return -errno;
+
+    int clean = _take_clean_marker();
+    if (clean < 0)
+        return clean;
+    if (!clean && _discard() != 0)
+        return -EIO;
+
+    memtable =
+        calloc(1, sizeof(struct meta_node) + METASTORE_MAX_HEIGHT * sizeof(struct meta_node *));
+    if (memtable == NULL)
+        return -ENOMEM;
+    memtable->height = METASTORE_MAX_HEIGHT;
+
+    int res = _table_map();
+    if (res != 0)
+        return res;
+
+    char log_path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _meta_path("meta.log", log_path, sizeof(log_path));
+
+    log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (log_fd == -1)
+        return -errno;
+
+    res = _replay();
+    if (res != 0)
+        return res;
+
+    return !clean;
+}
+
+void metastore_close(void)
+{
+    pthread_mutex_lock(&meta_lock);
+
+    // Leave a table and an empty log, so the next open has nothing to replay. A log that could
+    // not be merged is still whole, and is replayed instead
+    if (memtable != NULL && memtable_count > 0 && _compact() != 0)
+        printf("Could not compact the metadata store\n");
+
+    if (log_fd != -1 && !unlogged && _leave_clean_marker() != 0)
+        printf("Could not mark the metadata store as closed, it will be rebuilt\n");
+
+    if (memtable != NULL) {
+        _memtable_clear();
+        free(memtable);
+        memtable = NULL;
+    }
+
+    _table_unmap();
+
+    if (log_fd != -1)
+        close(log_fd);
+    log_fd = -1;
+
+    pthread_mutex_unlock(&meta_lock);
+}
+
+void metastore_load_begin(void)
+{
+    pthread_mutex_lock(&meta_lock);
+    unlogged = 1;
+    pthread_mutex_unlock(&meta_lock);
+}
+
+int metastore_load_end(void)
+{
+    // Nothing loaded is in the log, so it is all merged into the table now. Until that works,
+    // changes are not logged either and the store is never marked as closed
+    pthread_mutex_lock(&meta_lock);
+
+    int res = memtable_count > 0 ? _compact() : 0;
+    if (res == 0)
+        unlogged = 0;
+
+    pthread_mutex_unlock(&meta_lock);
+
+    return res;
+}
+
+int metastore_get(const char path[], struct stat *st, uint32_t *flags)
+{
+    char key[METASTORE_KEY_MAX];
+    size_t len = _encode_key(path, key);
+    struct meta_record record;
+
+    pthread_mutex_lock(&meta_lock);
+    int res = _get(key, len, &record);
+    pthread_mutex_unlock(&meta_lock);
+
+    if (res != 0)
+        return res;
+
+    _to_stat(&record, st);
+    if (flags != NULL)
+        *flags = record.flags;
+
+    return 0;
+}
+
+int metastore_put(const char path[], const struct stat *st, uint32_t flags)
+{
+    char key[METASTORE_KEY_MAX];
+    size_t len = _encode_key(path, key);
+    struct meta_record record;
+    _to_record(st, flags, &record);
+
+    pthread_mutex_lock(&meta_lock);
+    int res = _set(key, len, &record, 0);
+    pthread_mutex_unlock(&meta_lock);
+
+    return res;
+}
+
+static int _collect(const char dir_key[], size_t dir_len, char **keys, size_t **lens,
+                    struct meta_record **records, size_t *n)
+{
+    // Copy out everything below a directory, so it can be changed while walking it
+    char first[METASTORE_KEY_MAX + 1], end[METASTORE_KEY_MAX + 1];
+    memcpy(first, dir_key, dir_len);
+    memcpy(end, dir_key, dir_len);
+    first[dir_len] = 0;
+    end[dir_len]   = 2;
+
+    size_t capacity = 0, bytes = 0, capacity_bytes = 0;
+    *keys           = NULL;
+    *lens           = NULL;
+    *records        = NULL;
+    *n              = 0;
+
+    struct meta_iter it;
+    const char *key;
+    size_t len;
+    struct meta_record record;
+
+    _iter_seek(&it, first, dir_len + 1, end, dir_len + 1);
+
+    while (_iter_next(&it, &key, &len, &record)) {
+        if (*n == capacity) {
+            capacity    = capacity ? 2 * capacity : 64;
+            void *lens_ = realloc(*lens, capacity * sizeof(size_t));
+            void *recs_ = realloc(*records, capacity * sizeof(struct meta_record));
+            if (lens_ != NULL)
+                *lens = lens_;
+            if (recs_ != NULL)
+                *records = recs_;
+            if (lens_ == NULL || recs_ == NULL)
+                return -ENOMEM;
+        }
+
+        if (bytes + len > capacity_bytes) {
+            capacity_bytes = 2 * (bytes + len) + 4096;
+            void *keys_    = realloc(*keys, capacity_bytes);
+            if (keys_ == NULL)
+                return -ENOMEM;
+            *keys = keys_;
+        }
+
+        memcpy(*keys + bytes, key, len);
+        (*lens)[*n]    = len;
+        (*records)[*n] = record;
+        bytes += len;
+        (*n)++;
+    }
+
+    return 0;
+}
+
+static int _remove(const char path[])
+{
+    char key[METASTORE_KEY_MAX], dir_key[METASTORE_KEY_MAX];
+    size_t len     = _encode_key(path, key);
+    size_t dir_len = _encode_dir(path, dir_key);
+
+    struct meta_record record;
+    int res = _get(key, len, &record) == 0 ? _set(key, len, &record, 1) : 0;
+
+    char *keys = NULL;
+    size_t *lens = NULL, n = 0;
+    struct meta_record *records = NULL;
+    if (res == 0)
+        res = _collect(dir_key, dir_len, &keys, &lens, &records, &n);
+
+    for (size_t i = 0, offset = 0; res == 0 && i < n; offset += lens[i++]) {
+        res = _set(keys + offset, lens[i], &records[i], 1);
+    }
+
+    free(keys);
+    free(lens);
+    free(records);
+
+    return res;
+}
+
+int metastore_remove(const char path[])
+{
+    // The entry goes, and with it everything indexed below it
+    pthread_mutex_lock(&meta_lock);
+    int res = _remove(path);
+    pthread_mutex_unlock(&meta_lock);
+
+    return res;
+}
+
+int metastore_move(const char from[], const char to[])
+{
+    char from_key[METASTORE_KEY_MAX], to_key[METASTORE_KEY_MAX], from_dir[METASTORE_KEY_MAX],
+        to_dir[METASTORE_KEY_MAX + 1];
+    size_t from_len     = _encode_key(from, from_key);
+    size_t to_len       = _encode_key(to, to_key);
+    size_t from_dir_len = _encode_dir(from, from_dir);
+    size_t to_dir_len   = _encode_dir(to, to_dir);
+
+    pthread_mutex_lock(&meta_lock);
+
+    // Whatever was indexed at the destination was replaced
+    int res = _remove(to);
+
+    struct meta_record record;
+    if (res == 0 && _get(from_key, from_len, &record) == 0) {
+        res = _set(to_key, to_len, &record, 0);
+        if (res == 0)
+            res = _set(from_key, from_len, &record, 1);
+    }
+
+    char *keys = NULL;
+    size_t *lens = NULL, n = 0;
+    struct meta_record *records = NULL;
+    if (res == 0)
+        res = _collect(from_dir, from_dir_len, &keys, &lens, &records, &n);
+
+    // Everything below moves with it, keeping the part of its key past the directory
+    for (size_t i = 0, offset = 0; res == 0 && i < n; offset += lens[i++]) {
+        char moved[METASTORE_KEY_MAX];
+        size_t rest = lens[i] - from_dir_len;
+        if (to_dir_len + rest >= METASTORE_KEY_MAX) {
+            res = -ENAMETOOLONG;
+            break;
+        }
+
+        memcpy(moved, to_dir, to_dir_len);
+        memcpy(moved + to_dir_len, keys + offset + from_dir_len, rest);
+
+        res = _set(moved, to_dir_len + rest, &records[i], 0);
+        if (res == 0)
+            res = _set(keys + offset, lens[i], &records[i], 1);
+    }
+
+    pthread_mutex_unlock(&meta_lock);
+
+    free(keys);
+    free(lens);
+    free(records);
+
+    return res;
+}
+
+int metastore_list(const char dir[], metastore_list_fn fn, void *ctx)
+{
+    // fn runs with the store locked, so it must not call back into it
+    char first[METASTORE_KEY_MAX + 1], end[METASTORE_KEY_MAX + 1];
+    size_t dir_len = _encode_dir(dir, first);
+    memcpy(end, first, dir_len);
+    first[dir_len] = 0;
+    end[dir_len]   = 1;
+
+    pthread_mutex_lock(&meta_lock);
+
+    struct meta_iter it;
+    const char *key;
+    size_t len;
+    struct meta_record record;
+
+    _iter_seek(&it, first, dir_len + 1, end, dir_len + 1);
+
+    int res = 0;
+    while (res == 0 && _iter_next(&it, &key, &len, &record)) {
+        // The name is the rest of the key, with the bytes kept behind a 2 byte taken back out
+        char name[NAME_MAX + 1];
+        size_t name_len = 0;
+        for (size_t i = dir_len + 1; i < len && name_len <= NAME_MAX; i++) {
+            i += key[i] == 2 && i + 1 < len;
+            name[name_len++] = key[i];
+        }
+        if (name_len > NAME_MAX)
+            continue;
+
+        name[name_len] = '\0';
+
+        struct stat st;
+        _to_stat(&record, &st);
+        res = fn(name, &st, record.flags, ctx);
+    }
+
+    pthread_mutex_unlock(&meta_lock);
+
+    return res < 0 ? res : 0;
+}
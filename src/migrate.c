@@ -0,0 +1,110 @@
+/*
+* FILENAME: migrate.c
+*
+* DESCRIPTION: Offline tool that converts a flat shard store, where every shard
+*              sits directly in <storepoint>/.shards/, to the fan-out layout used
+*              by current DEFFS mounts, and records the new layout in the store's
+*              superblock. Run it while the store is not mounted.
+*
+* USAGE: cmake --build ./ --target DEFFS-migrate -- -j 6
+*        ./bin/DEFFS-migrate ~/deffs_storepoint
+*        ./bin/DEFFS-migrate --fanout-depth 3 --fanout-width 1 ~/deffs_storepoint
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "deffs.h"
+#include "utils.h"
+
+#include "arguments.h"
+#include "shards.h"
+
+char *mountpoint;
+char *storepoint;
+char *shardpoint;
+
+const char *argp_program_version     = "DEFFS-migrate 0.0.2";
+const char *argp_program_bug_address = "charles.averill@utdallas.edu";
+static char doc[]                    = "Move the shards of a flat DEFFS store into fan-out directories";
+static char args_doc[]               = "STOREPOINT";
+
+static struct argp_option options[] = {
+    {"fanout-depth", OPT_FANOUT_DEPTH, "DEPTH", 0,
+     "Number of hex-prefix directory levels under .shards (default 2)"},
+    {"fanout-width", OPT_FANOUT_WIDTH, "WIDTH", 0,
+     "Hex characters of the shard hash used per directory level (default 2)"},
+    {0}};
+
+static error_t parse_migrate_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 0)
+            argp_usage(state);
+        arguments->points[1] = arg;
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_usage(state);
+        break;
+    case OPT_FANOUT_DEPTH:
+    case OPT_FANOUT_WIDTH:
+        // Share validation with the mount options
+        return parse_opt(key, arg, state);
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static struct argp argp = {options, parse_migrate_opt, args_doc, doc, 0, 0, 0};
+
+int main(int argc, char *argv[])
+{
+    struct arguments arguments;
+    arguments.fanout_depth = shard_fanout_depth;
+    arguments.fanout_width = shard_fanout_width;
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    shard_fanout_depth = arguments.fanout_depth;
+    shard_fanout_width = arguments.fanout_width;
+
+    storepoint = arguments.points[1];
+
+    shardpoint = malloc(strlen(storepoint) + strlen("/.shards/") + 1);
+    strcpy(shardpoint, storepoint);
+    strcat(shardpoint, "/.shards/");
+
+    // Only a flat store can be laid out again, as shards already in fan-out directories stay
+    int depth, width;
+    int res = shard_layout_read(&depth, &width);
+    if (res == 0 && depth > 0 && (depth != shard_fanout_depth || width != shard_fanout_width)) {
+        printf("%s is already laid out with --fanout-depth %d --fanout-width %d\n", storepoint,
+               depth, width);
+        return 1;
+    } else if (res < 0 && res != -ENOENT) {
+        printf("Could not read the layout of %s: %s\n", storepoint, strerror(-res));
+        return 1;
+    }
+
+    int migrated = migrate_flat_shards();
+    if (migrated < 0) {
+        printf("Migration of %s failed: %s\n", shardpoint, strerror(-migrated));
+        return 1;
+    }
+
+    res = shard_layout_write(1);
+    if (res < 0) {
+        printf("Could not record the layout of %s: %s\n", storepoint, strerror(-res));
+        return 1;
+    }
+
+    printf("Migrated %d shards in %s\n", migrated, shardpoint);
+
+    return 0;
+}
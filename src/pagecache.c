@@ -0,0 +1,152 @@
+/*
+* FILENAME: pagecache.c
+*
+* DESCRIPTION: How the kernel caches the pages of a file, chosen as the file is
+*              opened. The mode comes from the nearest directory above the file
+*              that has one, or from the mount. Files in none mode have their
+*              pages dropped at every open. Files in keep mode keep them as long
+*              as the file's header record is the one the kernel saw at the last
+*              open, since every change to a file rewrites it. A header changed
+*              within the second before an open is not trusted at the next one,
+*              as its timestamps may not have moved. Files in direct mode skip
+*              the page cache and send every read and write through DEFFS.
+*
+* USAGE: res = _open(path, fi);
+*        if (res == 0)
+*            pagecache_open(path, fi->fh, fi);
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "pagecache.h"
+
+int cache_mode = DEFFS_CACHE_KEEP;
+
+// Cache modes of directories
+static struct dirpolicy mode_policy = DIRPOLICY_INIT(PAGECACHE_MODE_XATTR, DEFFS_CACHE_DIRECT,
+                                                     cache_mode_name, cache_mode_value,
+                                                     &cache_mode);
+
+// State of a file's header record at its last open in none or keep mode
+struct page_stamp {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtim;
+    struct timespec ctim;
+    // Whether the header had been left alone for a second when the stamp was taken
+    int settled;
+};
+
+static pthread_mutex_t stamp_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct page_stamp *stamps;
+static size_t n_stamps;
+
+int pagecache_mode(const char path[])
+{
+    return dirpolicy_file(&mode_policy, path);
+}
+
+int pagecache_dir_mode(const char path[])
+{
+    return dirpolicy_dir(&mode_policy, path);
+}
+
+int pagecache_set_mode(const char path[], int mode)
+{
+    return dirpolicy_set(&mode_policy, path, mode);
+}
+
+void pagecache_forget_modes(void)
+{
+    dirpolicy_forget(&mode_policy);
+}
+
+static size_t _stamp_slot(const char path[])
+{
+    size_t capacity = 2 * PAGECACHE_STAMPS;
+    size_t i        = path_hash(path) & (capacity - 1);
+    while (stamps[i].path != NULL && strcmp(stamps[i].path, path) != 0)
+        i = (i + 1) & (capacity - 1);
+
+    return i;
+}
+
+static void _forget_stamps(void)
+{
+    // Called with stamp_lock held
+    for (size_t i = 0; i < 2 * PAGECACHE_STAMPS; i++) {
+        free(stamps[i].path);
+        stamps[i].path = NULL;
+    }
+
+    n_stamps = 0;
+}
+
+static int _same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static int _restamp(const char path[], int fd)
+{
+    // Records the header record behind fd as the one the kernel now has pages of, and returns
+    // whether it is the same the kernel had at the last open
+    struct stat st;
+    struct timespec now;
+    if (path == NULL || fstat(fd, &st) == -1 || clock_gettime(CLOCK_REALTIME, &now) == -1)
+        return 0;
+
+    pthread_mutex_lock(&stamp_lock);
+
+    if (stamps == NULL && (stamps = calloc(2 * PAGECACHE_STAMPS, sizeof(*stamps))) == NULL) {
+        pthread_mutex_unlock(&stamp_lock);
+        return 0;
+    }
+
+    struct page_stamp *stamp = &stamps[_stamp_slot(path)];
+
+    int unchanged = stamp->path != NULL && stamp->settled && stamp->dev == st.st_dev &&
+                    stamp->ino == st.st_ino && _same_time(&stamp->mtim, &st.st_mtim) &&
+                    _same_time(&stamp->ctim, &st.st_ctim);
+
+    if (stamp->path == NULL) {
+        if (n_stamps >= PAGECACHE_STAMPS) {
+            _forget_stamps();
+            stamp = &stamps[_stamp_slot(path)];
+        }
+
+        stamp->path = strdup(path);
+        if (stamp->path == NULL) {
+            pthread_mutex_unlock(&stamp_lock);
+            return 0;
+        }
+        n_stamps++;
+    }
+
+    stamp->dev     = st.st_dev;
+    stamp->ino     = st.st_ino;
+    stamp->mtim    = st.st_mtim;
+    stamp->ctim    = st.st_ctim;
+    stamp->settled = now.tv_sec > st.st_ctim.tv_sec + 1 ||
+                     (now.tv_sec == st.st_ctim.tv_sec + 1 && now.tv_nsec >= st.st_ctim.tv_nsec);
+
+    pthread_mutex_unlock(&stamp_lock);
+
+    return unchanged;
+}
+
+void pagecache_open(const char path[], int fd, struct fuse_file_info *fi)
+{
+    int mode = pagecache_mode(path);
+    if (mode == DEFFS_CACHE_DIRECT) {
+        fi->direct_io = 1;
+        return;
+    }
+
+    // Both are asked every time, since each notes that the kernel now has the file's pages
+    int unchanged = _restamp(path, fd);
+    int leased    = lease_keep_cache(path);
+
+    fi->keep_cache = mode == DEFFS_CACHE_KEEP && unchanged && leased;
+}
@@ -21,36 +21,64 @@ int deffs_access(const char *path, int mask)
     return 0;
 }
 
-int deffs_chmod(const char *path, mode_t mode)
+static int _chmod(const char *path, mode_t mode)
 {
     int res;
 
-    path = deffs_path_prepend(path, storepoint);
+    if (snapshot_pinned(path))
+        return -EROFS;
+
+    const char *real_path = deffs_path_prepend(path, storepoint);
 
 #ifdef __APPLE__
-    res = lchmod(path, mode);
+    res = lchmod(real_path, mode);
 #else
-    res = chmod(path, mode);
+    res = chmod(real_path, mode);
 #endif
     if (res == -1)
         return -errno;
 
+    attr_index(path, NULL);
+
     return 0;
 }
 
-int deffs_chown(const char *path, uid_t uid, gid_t gid)
+int deffs_chmod(const char *path, mode_t mode)
+{
+    attr_lease(path, LEASE_WRITE);
+    int res = _chmod(path, mode);
+    lease_end();
+
+    return res;
+}
+
+static int _chown(const char *path, uid_t uid, gid_t gid)
 {
     int res;
 
-    path = deffs_path_prepend(path, storepoint);
+    if (snapshot_pinned(path))
+        return -EROFS;
+
+    const char *real_path = deffs_path_prepend(path, storepoint);
 
-    res = lchown(path, uid, gid);
+    res = lchown(real_path, uid, gid);
     if (res == -1)
         return -errno;
 
+    attr_index(path, NULL);
+
     return 0;
 }
 
+int deffs_chown(const char *path, uid_t uid, gid_t gid)
+{
+    attr_lease(path, LEASE_WRITE);
+    int res = _chown(path, uid, gid);
+    lease_end();
+
+    return res;
+}
+
 int deffs_statfs(const char *path, struct statvfs *stbuf)
 {
     int res;
@@ -0,0 +1,550 @@
+/*
+* FILENAME: reclaim.c
+*
+* DESCRIPTION: Deferred release of shards. Removing the last name of a file only
+*              queues the shards its header record named. A background thread
+*              releases them in batches of RECLAIM_BATCH, dropping reference
+*              counts, key shares and shards or segment records, at no more than
+*              reclaim_rate shards per second. Whatever is still queued at unmount
+*              is saved with the mount's metadata index for the next mount. A crash
+*              loses the queue, so after one a mark-and-sweep pass walks the index,
+*              marks every shard a header record names, and releases the shards
+*              and key shares that were written before the pass and are unmarked.
+*
+* USAGE: reclaim_start(stale);
+*
+*        reclaim_queue(&header);
+*        reclaim_note_move(); // after a rename, link, clone or snapshot
+*
+*        reclaim_stop();
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "reclaim.h"
+
+long reclaim_rate = 1024;
+
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond  = PTHREAD_COND_INITIALIZER;
+
+// Ring of hashes waiting to be released
+static char (*queue)[SHARD_FN_LEN + 1];
+static size_t queue_head;
+static size_t queue_count;
+static size_t queue_capacity;
+
+// Counts changes that give existing shards a new name, which a sweep could miss
+static uint64_t moves;
+
+static pthread_t reclaim_thread;
+static int reclaim_running;
+static int sweep_pending;
+
+// Hashes named by a header record, kept by their first 64 bits. Two hashes sharing those only
+// keep a shard that could have gone
+struct mark_set {
+    uint64_t *slots;
+    size_t capacity;
+    size_t count;
+};
+
+// Children of a directory, copied out of the index
+struct mark_list {
+    char **names;
+    mode_t *modes;
+    size_t n_children;
+    size_t capacity;
+};
+
+// Unmarked hashes found by a sweep
+struct sweep_found {
+    struct mark_set *marks;
+    char (*hashes)[SHARD_FN_LEN + 1];
+    size_t n_hashes;
+    size_t capacity;
+};
+
+static void _queue_path(char obuf[], size_t len)
+{
+    // Kept with the mount's metadata index, so that mounts sharing a store each keep their own
+    snprintf(obuf, len, "%s%s/reclaim.queue", shardpoint, metastore_name);
+}
+
+static int _push(const char hash[])
+{
+    // Called with reclaim_lock held
+    if (queue_count == queue_capacity) {
+        size_t capacity                 = queue_capacity > 0 ? queue_capacity * 2 : 1024;
+        char (*grown)[SHARD_FN_LEN + 1] = malloc(capacity * sizeof(*grown));
+        if (grown == NULL)
+            return -ENOMEM;
+
+        for (size_t i = 0; i < queue_count; i++) {
+            memcpy(grown[i], queue[(queue_head + i) % queue_capacity], SHARD_FN_LEN + 1);
+        }
+
+        free(queue);
+        queue          = grown;
+        queue_head     = 0;
+        queue_capacity = capacity;
+    }
+
+    char *slot = queue[(queue_head + queue_count) % queue_capacity];
+    memcpy(slot, hash, SHARD_FN_LEN);
+    slot[SHARD_FN_LEN] = '\0';
+    queue_count++;
+
+    return 0;
+}
+
+static size_t _pop(char (*batch)[SHARD_FN_LEN + 1], size_t max)
+{
+    // Called with reclaim_lock held
+    size_t n = 0;
+
+    while (n < max && queue_count > 0) {
+        memcpy(batch[n++], queue[queue_head], SHARD_FN_LEN + 1);
+        queue_head = (queue_head + 1) % queue_capacity;
+        queue_count--;
+    }
+
+    return n;
+}
+
+static int _load_queue(void)
+{
+    // Pick up what the last mount left queued. Once it is in memory, a crash leaves it to the
+    // sweep
+    char path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _queue_path(path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    char hash[SHARD_FN_LEN];
+    int res = 0;
+
+    while (res == 0 && read(fd, hash, SHARD_FN_LEN) == SHARD_FN_LEN) {
+        res = _push(hash);
+    }
+
+    close(fd);
+
+    if (res == 0 && unlink(path) == -1)
+        res = -errno;
+
+    return res;
+}
+
+static int _save_queue(void)
+{
+    if (queue_count == 0)
+        return 0;
+
+    char path[strlen(shardpoint) + METASTORE_NAME_MAX + 16];
+    _queue_path(path, sizeof(path));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        return -errno;
+
+    int res = 0;
+    for (size_t i = 0; res == 0 && i < queue_count; i++) {
+        if (write(fd, queue[(queue_head + i) % queue_capacity], SHARD_FN_LEN) != SHARD_FN_LEN)
+            res = -EIO;
+    }
+
+    // The queue has to be on disk before the metadata store is marked as closed
+    if (res == 0 && fsync(fd) == -1)
+        res = -errno;
+
+    close(fd);
+
+    if (res != 0)
+        unlink(path);
+
+    return res;
+}
+
+static void _throttle(const struct timespec *start, size_t n)
+{
+    if (reclaim_rate <= 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double busy    = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    double seconds = (double)n / reclaim_rate - busy;
+    if (seconds <= 0)
+        return;
+
+    struct timespec delay = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&delay, NULL);
+}
+
+static void _release(char (*batch)[SHARD_FN_LEN + 1], size_t n)
+{
+    // Reference counts and shards are changed by the foreground too, always with the scrubber
+    // held off
+    scrub_pause();
+
+    for (size_t i = 0; i < n; i++) {
+        if (snapshot_release_hash(batch[i]) != 0)
+            printf("Could not release shard %s\n", batch[i]);
+    }
+
+    scrub_resume();
+}
+
+static uint64_t _mark_key(const char hash[])
+{
+    char prefix[17];
+    memcpy(prefix, hash, 16);
+    prefix[16] = '\0';
+
+    // 0 marks an empty slot
+    uint64_t key = strtoull(prefix, NULL, 16);
+
+    return key != 0 ? key : 1;
+}
+
+static size_t _mark_slot(const struct mark_set *set, uint64_t key)
+{
+    size_t i = key & (set->capacity - 1);
+    while (set->slots[i] != 0 && set->slots[i] != key)
+        i = (i + 1) & (set->capacity - 1);
+
+    return i;
+}
+
+static int _mark(struct mark_set *set, const char hash[])
+{
+    // Files that were never written have no hash
+    if (hash[0] == '\0')
+        return 0;
+
+    if (2 * (set->count + 1) > set->capacity) {
+        struct mark_set grown = {NULL, set->capacity > 0 ? set->capacity * 2 : 1024, 0};
+        grown.slots           = calloc(grown.capacity, sizeof(uint64_t));
+        if (grown.slots == NULL)
+            return -ENOMEM;
+
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->slots[i] != 0)
+                grown.slots[_mark_slot(&grown, set->slots[i])] = set->slots[i];
+        }
+
+        free(set->slots);
+        grown.count = set->count;
+        *set        = grown;
+    }
+
+    uint64_t key = _mark_key(hash);
+    size_t i     = _mark_slot(set, key);
+    if (set->slots[i] == 0) {
+        set->slots[i] = key;
+        set->count++;
+    }
+
+    return 0;
+}
+
+static int _marked(const struct mark_set *set, const char hash[])
+{
+    return set->capacity > 0 && set->slots[_mark_slot(set, _mark_key(hash))] != 0;
+}
+
+static int _collect_child(const char name[], const struct stat *st, uint32_t flags, void *ctx)
+{
+    // Runs with the index locked, so the children are only copied out here
+    struct mark_list *list = ctx;
+    (void)flags;
+
+    if (list->n_children == list->capacity) {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+        char **names    = realloc(list->names, capacity * sizeof(char *));
+        if (names == NULL)
+            return -ENOMEM;
+        list->names = names;
+
+        mode_t *modes = realloc(list->modes, capacity * sizeof(mode_t));
+        if (modes == NULL)
+            return -ENOMEM;
+        list->modes = modes;
+
+        list->capacity = capacity;
+    }
+
+    char *copy = strdup(name);
+    if (copy == NULL)
+        return -ENOMEM;
+
+    list->names[list->n_children] = copy;
+    list->modes[list->n_children] = st->st_mode;
+    list->n_children++;
+
+    return 0;
+}
+
+static int _mark_file(struct mark_set *set, const char path[])
+{
+    char real_path[strlen(storepoint) + strlen(path) + 1];
+    sprintf(real_path, "%s%s", storepoint, path);
+
+    // A header record must not be read halfway through a change
+    struct deffs_header header;
+    scrub_pause();
+    int res = header_read_path(real_path, &header, NULL);
+    scrub_resume();
+
+    // Files that were never written name nothing, and files removed since were queued
+    if (res == -ENODATA || res == -ENOENT)
+        return 0;
+
+    if (res == 0)
+        res = _mark(set, header.hash);
+    for (uint32_t i = 0; res == 0 && i < header.n_bases; i++) {
+        res = _mark(set, header.bases[i]);
+    }
+
+    return res;
+}
+
+static int _mark_dir(struct mark_set *set, const char dir[])
+{
+    // A directory missing from the index could hide a name, and then nothing can be swept
+    if (!attr_complete(dir))
+        return -EAGAIN;
+
+    struct mark_list list = {NULL, NULL, 0, 0};
+    int res               = metastore_list(dir, _collect_child, &list);
+
+    for (size_t i = 0; res == 0 && i < list.n_children; i++) {
+        if (!reclaim_running) {
+            res = -EINTR;
+            break;
+        }
+
+        char path[strlen(dir) + strlen(list.names[i]) + 2];
+        sprintf(path, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, list.names[i]);
+
+        if (S_ISDIR(list.modes[i]))
+            res = _mark_dir(set, path);
+        else if (S_ISREG(list.modes[i]))
+            res = _mark_file(set, path);
+    }
+
+    for (size_t i = 0; i < list.n_children; i++) {
+        free(list.names[i]);
+    }
+    free(list.names);
+    free(list.modes);
+
+    return res;
+}
+
+static int _sweep_candidate(const char hash[], void *ctx)
+{
+    struct sweep_found *found = ctx;
+
+    if (_marked(found->marks, hash))
+        return 0;
+
+    if (found->n_hashes == found->capacity) {
+        size_t capacity                  = found->capacity > 0 ? found->capacity * 2 : 64;
+        char (*hashes)[SHARD_FN_LEN + 1] = realloc(found->hashes, capacity * sizeof(*hashes));
+        if (hashes == NULL)
+            return -ENOMEM;
+
+        found->hashes   = hashes;
+        found->capacity = capacity;
+    }
+
+    strcpy(found->hashes[found->n_hashes++], hash);
+
+    // Every share of a key is listed, so the hash is only taken once
+    return _mark(found->marks, hash);
+}
+
+static int _sweep(void)
+{
+    // Anything written from here on is newer than the sweep and kept
+    uint64_t shards_before = shard_epoch();
+    time_t keys_before     = time(NULL);
+
+    pthread_mutex_lock(&reclaim_lock);
+    uint64_t start_moves = moves;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    struct mark_set marks    = {NULL, 0, 0};
+    struct sweep_found found = {&marks, NULL, 0, 0};
+
+    int res = _mark_dir(&marks, "/");
+
+    // A name that moved into a directory already marked may have been missed
+    pthread_mutex_lock(&reclaim_lock);
+    if (res == 0 && moves != start_moves)
+        res = -EAGAIN;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    if (res == 0)
+        res = shard_list(shards_before, _sweep_candidate, &found);
+    if (res == 0)
+        res = keystore_list(keys_before, _sweep_candidate, &found);
+
+
+    for (size_t i = 0; res == 0 && i < found.n_hashes && reclaim_running; i += RECLAIM_BATCH) {
+        size_t n = found.n_hashes - i < RECLAIM_BATCH ? found.n_hashes - i : RECLAIM_BATCH;
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        scrub_pause();
+        for (size_t j = i; j < i + n; j++) {
+            // Orphaned keys of inline files never had a shard
+            int released = keystore_remove(found.hashes[j]);
+            if (released == 0)
+                released = shard_unlink(found.hashes[j]);
+            if (released != 0 && released != -ENOENT)
+                printf("Could not release orphaned shard %s\n", found.hashes[j]);
+        }
+        scrub_resume();
+
+        _throttle(&start, n);
+    }
+
+    if (res == 0 && found.n_hashes > 0)
+        printf("Released %zu orphaned shards\n", found.n_hashes);
+
+    free(marks.slots);
+    free(found.hashes);
+
+    return res;
+}
+
+static void *_reclaim_loop(void *arg)
+{
+    (void)arg;
+
+    // Names that move while the sweep marks, and directories only partly indexed, make it start
+    // over a little later
+    int res = 0;
+    for (int attempt = 0; sweep_pending && attempt < RECLAIM_SWEEP_ATTEMPTS && reclaim_running;
+         attempt++) {
+        if (attempt > 0)
+            sleep(1);
+        if ((res = _sweep()) != -EAGAIN)
+            break;
+    }
+
+    // Only a sweep that was tried and did not finish is reported, not one the unmount came before
+    if (res != 0 && res != -EINTR)
+        printf("Skipped the orphan sweep: %s\n", strerror(-res));
+
+    char batch[RECLAIM_BATCH][SHARD_FN_LEN + 1];
+
+    pthread_mutex_lock(&reclaim_lock);
+
+    while (reclaim_running) {
+        size_t n = _pop(batch, RECLAIM_BATCH);
+        if (n == 0) {
+            pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&reclaim_lock);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        _release(batch, n);
+        _throttle(&start, n);
+
+        pthread_mutex_lock(&reclaim_lock);
+    }
+
+    pthread_mutex_unlock(&reclaim_lock);
+
+    bufpool_trim();
+
+    return NULL;
+}
+
+int reclaim_queue(const struct deffs_header *header)
+{
+    // Hand the shards of a header record that is gone to the reclaimer
+    if (!reclaim_running)
+        return snapshot_release(header);
+
+    pthread_mutex_lock(&reclaim_lock);
+
+    int res = _push(header->hash);
+    for (uint32_t i = 0; res == 0 && i < header->n_bases; i++) {
+        res = _push(header->bases[i]);
+    }
+
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+
+    return res;
+}
+
+void reclaim_note_move(void)
+{
+    pthread_mutex_lock(&reclaim_lock);
+    moves++;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+int reclaim_start(int sweep)
+{
+    pthread_mutex_lock(&reclaim_lock);
+    int res = _load_queue();
+    pthread_mutex_unlock(&reclaim_lock);
+
+    if (res != 0)
+        return res;
+
+    // Another mount sharing the store may move a name while this one marks, without its
+    // index seeing it, so shared stores are not swept
+    sweep_pending   = sweep && lease_server == NULL;
+    reclaim_running = 1;
+    if (pthread_create(&reclaim_thread, NULL, _reclaim_loop, NULL) != 0) {
+        reclaim_running = 0;
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+void reclaim_stop(void)
+{
+    if (!reclaim_running)
+        return;
+
+    pthread_mutex_lock(&reclaim_lock);
+    reclaim_running = 0;
+    pthread_cond_broadcast(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+
+    pthread_join(reclaim_thread, NULL);
+
+    // What is left is released by the next mount, or now if it cannot be saved for it
+    if (_save_queue() != 0) {
+        char batch[RECLAIM_BATCH][SHARD_FN_LEN + 1];
+        size_t n;
+
+        while ((n = _pop(batch, RECLAIM_BATCH)) > 0) {
+            _release(batch, n);
+        }
+    }
+
+    free(queue);
+    queue          = NULL;
+    queue_head     = 0;
+    queue_count    = 0;
+    queue_capacity = 0;
+}
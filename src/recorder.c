@@ -0,0 +1,538 @@
+/*
+* FILENAME: recorder.c
+*
+* DESCRIPTION: Recording of every filesystem call DEFFS serves into a trace file
+*              for DEFFS-replay. The FUSE callbacks are wrapped so that each call
+*              is timed and logged with its arguments and result, the thread that
+*              served it and the sizes of the data it moved. File contents and
+*              attribute values are never written. Records are gathered in memory
+*              and written out once a second or when the buffer fills.
+*
+* USAGE: if (trace_path != NULL && recorder_start(&deffs_oper) != 0)
+*            exit(1);
+*
+*        fuse_main(argc, argv, &deffs_oper, NULL);
+*
+* AUTHOR: Charles Averill
+*/
+
+#define FUSE_USE_VERSION 29
+
+#include "recorder.h"
+
+char *trace_path = NULL;
+
+// The callbacks being traced
+static struct fuse_operations traced;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static char *buffer;
+static size_t buffered;
+static uint64_t last_flush;
+static struct timespec epoch;
+
+static __thread uint32_t thread_id;
+
+static uint64_t _now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)(now.tv_sec - epoch.tv_sec) * 1000000000 + now.tv_nsec - epoch.tv_nsec;
+}
+
+static void _flush(void)
+{
+    // Called with trace_lock held. A trace that cannot be written is given up, not the mount
+    for (size_t done = 0; done < buffered;) {
+        ssize_t n = write(trace_fd, buffer + done, buffered - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n <= 0) {
+            printf("Could not write trace %s, no longer tracing\n", trace_path);
+            close(trace_fd);
+            trace_fd = -1;
+            break;
+        }
+
+        done += n;
+    }
+
+    buffered = 0;
+}
+
+static void _record(int op, uint64_t start, int result, const char *path, const char *path2,
+                    uint64_t fh, uint64_t size, int64_t offset, uint64_t arg)
+{
+    uint64_t end = _now();
+    if (thread_id == 0)
+        thread_id = syscall(SYS_gettid);
+
+    struct trace_record record = {0};
+    record.op                  = op;
+    record.path_len            = path != NULL ? strnlen(path, UINT16_MAX) : 0;
+    record.path2_len           = path2 != NULL ? strnlen(path2, UINT16_MAX) : 0;
+    record.thread              = thread_id;
+    record.result              = result;
+    record.start               = start;
+    record.duration            = end - start;
+    record.fh                  = fh;
+    record.size                = size;
+    record.offset              = offset;
+    record.arg                 = arg;
+
+    size_t len = sizeof(record) + record.path_len + record.path2_len;
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_fd != -1 && (buffered + len > RECORDER_BUFFER || end - last_flush > 1000000000)) {
+        _flush();
+        last_flush = end;
+    }
+
+    if (trace_fd != -1) {
+        memcpy(buffer + buffered, &record, sizeof(record));
+        memcpy(buffer + buffered + sizeof(record), path, record.path_len);
+        memcpy(buffer + buffered + sizeof(record) + record.path_len, path2, record.path2_len);
+        buffered += len;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static uint64_t _fh(const struct fuse_file_info *fi)
+{
+    return fi != NULL ? fi->fh : 0;
+}
+
+static int _getattr(const char *path, struct stat *st)
+{
+    uint64_t start = _now();
+    int res        = traced.getattr(path, st);
+    _record(TRACE_GETATTR, start, res, path, NULL, 0, 0, 0, 0);
+
+    return res;
+}
+
+static int _fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.fgetattr(path, st, fi);
+    _record(TRACE_FGETATTR, start, res, path, NULL, _fh(fi), 0, 0, 0);
+
+    return res;
+}
+
+static int _access(const char *path, int mask)
+{
+    uint64_t start = _now();
+    int res        = traced.access(path, mask);
+    _record(TRACE_ACCESS, start, res, path, NULL, 0, 0, 0, mask);
+
+    return res;
+}
+
+static int _readlink(const char *path, char *buf, size_t size)
+{
+    uint64_t start = _now();
+    int res        = traced.readlink(path, buf, size);
+    _record(TRACE_READLINK, start, res, path, NULL, 0, size, 0, 0);
+
+    return res;
+}
+
+static int _opendir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.opendir(path, fi);
+    _record(TRACE_OPENDIR, start, res, path, NULL, _fh(fi), 0, 0, 0);
+
+    return res;
+}
+
+// Counts the entries a readdir hands to the kernel
+struct entry_count {
+    void *buf;
+    fuse_fill_dir_t filler;
+    uint64_t n;
+};
+
+static int _count_entry(void *buf, const char *name, const struct stat *st, off_t offset)
+{
+    struct entry_count *count = buf;
+
+    int full = count->filler(count->buf, name, st, offset);
+    if (!full)
+        count->n++;
+
+    return full;
+}
+
+static int _readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    struct entry_count count = {buf, filler, 0};
+
+    uint64_t start = _now();
+    int res        = traced.readdir(path, &count, _count_entry, offset, fi);
+    _record(TRACE_READDIR, start, res, path, NULL, _fh(fi), count.n, offset, 0);
+
+    return res;
+}
+
+static int _releasedir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t fh    = _fh(fi);
+    uint64_t start = _now();
+    int res        = traced.releasedir(path, fi);
+    _record(TRACE_RELEASEDIR, start, res, path, NULL, fh, 0, 0, 0);
+
+    return res;
+}
+
+static int _mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    uint64_t start = _now();
+    int res        = traced.mknod(path, mode, rdev);
+    _record(TRACE_MKNOD, start, res, path, NULL, 0, 0, 0, mode);
+
+    return res;
+}
+
+static int _mkdir(const char *path, mode_t mode)
+{
+    uint64_t start = _now();
+    int res        = traced.mkdir(path, mode);
+    _record(TRACE_MKDIR, start, res, path, NULL, 0, 0, 0, mode);
+
+    return res;
+}
+
+static int _symlink(const char *from, const char *to)
+{
+    // The link itself is the path, what it points to the second one
+    uint64_t start = _now();
+    int res        = traced.symlink(from, to);
+    _record(TRACE_SYMLINK, start, res, to, from, 0, 0, 0, 0);
+
+    return res;
+}
+
+static int _unlink(const char *path)
+{
+    uint64_t start = _now();
+    int res        = traced.unlink(path);
+    _record(TRACE_UNLINK, start, res, path, NULL, 0, 0, 0, 0);
+
+    return res;
+}
+
+static int _rmdir(const char *path)
+{
+    uint64_t start = _now();
+    int res        = traced.rmdir(path);
+    _record(TRACE_RMDIR, start, res, path, NULL, 0, 0, 0, 0);
+
+    return res;
+}
+
+static int _rename(const char *from, const char *to)
+{
+    uint64_t start = _now();
+    int res        = traced.rename(from, to);
+    _record(TRACE_RENAME, start, res, from, to, 0, 0, 0, 0);
+
+    return res;
+}
+
+static int _link(const char *from, const char *to)
+{
+    uint64_t start = _now();
+    int res        = traced.link(from, to);
+    _record(TRACE_LINK, start, res, from, to, 0, 0, 0, 0);
+
+    return res;
+}
+
+static int _chmod(const char *path, mode_t mode)
+{
+    uint64_t start = _now();
+    int res        = traced.chmod(path, mode);
+    _record(TRACE_CHMOD, start, res, path, NULL, 0, 0, 0, mode);
+
+    return res;
+}
+
+static int _chown(const char *path, uid_t uid, gid_t gid)
+{
+    uint64_t start = _now();
+    int res        = traced.chown(path, uid, gid);
+    _record(TRACE_CHOWN, start, res, path, NULL, 0, 0, 0, (uint64_t)uid << 32 | gid);
+
+    return res;
+}
+
+static int _truncate(const char *path, off_t size)
+{
+    uint64_t start = _now();
+    int res        = traced.truncate(path, size);
+    _record(TRACE_TRUNCATE, start, res, path, NULL, 0, size, 0, 0);
+
+    return res;
+}
+
+static int _ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.ftruncate(path, size, fi);
+    _record(TRACE_FTRUNCATE, start, res, path, NULL, _fh(fi), size, 0, 0);
+
+    return res;
+}
+
+static int _utimens(const char *path, const struct timespec ts[2])
+{
+    uint64_t start = _now();
+    int res        = traced.utimens(path, ts);
+    _record(TRACE_UTIMENS, start, res, path, NULL, 0, 0, 0, 0);
+
+    return res;
+}
+
+static int _create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.create(path, mode, fi);
+    _record(TRACE_CREATE, start, res, path, NULL, _fh(fi), 0, 0,
+            (uint64_t)(uint32_t)fi->flags << 32 | mode);
+
+    return res;
+}
+
+static int _open(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.open(path, fi);
+    _record(TRACE_OPEN, start, res, path, NULL, _fh(fi), 0, 0, (uint32_t)fi->flags);
+
+    return res;
+}
+
+static int _read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.read(path, buf, size, offset, fi);
+    _record(TRACE_READ, start, res, path, NULL, _fh(fi), size, offset, 0);
+
+    return res;
+}
+
+static int _write(const char *path, const char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.write(path, buf, size, offset, fi);
+    _record(TRACE_WRITE, start, res, path, NULL, _fh(fi), size, offset, 0);
+
+    return res;
+}
+
+static int _statfs(const char *path, struct statvfs *st)
+{
+    uint64_t start = _now();
+    int res        = traced.statfs(path, st);
+    _record(TRACE_STATFS, start, res, path, NULL, 0, 0, 0, 0);
+
+    return res;
+}
+
+static int _flush_file(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.flush(path, fi);
+    _record(TRACE_FLUSH, start, res, path, NULL, _fh(fi), 0, 0, 0);
+
+    return res;
+}
+
+static int _release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t fh    = _fh(fi);
+    uint64_t start = _now();
+    int res        = traced.release(path, fi);
+    _record(TRACE_RELEASE, start, res, path, NULL, fh, 0, 0, 0);
+
+    return res;
+}
+
+static int _fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.fsync(path, datasync, fi);
+    _record(TRACE_FSYNC, start, res, path, NULL, _fh(fi), 0, 0, datasync);
+
+    return res;
+}
+
+static int _fallocate(const char *path, int mode, off_t offset, off_t length,
+                      struct fuse_file_info *fi)
+{
+    uint64_t start = _now();
+    int res        = traced.fallocate(path, mode, offset, length, fi);
+    _record(TRACE_FALLOCATE, start, res, path, NULL, _fh(fi), length, offset, mode);
+
+    return res;
+}
+
+static int _ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                  unsigned int flags, void *data)
+{
+    uint64_t start = _now();
+    int res        = traced.ioctl(path, cmd, arg, fi, flags, data);
+    _record(TRACE_IOCTL, start, res, path, NULL, _fh(fi), 0, 0, (uint32_t)cmd);
+
+    return res;
+}
+
+#ifndef __APPLE__
+static int _setxattr(const char *path, const char *name, const char *value, size_t size,
+                     int flags)
+{
+    uint64_t start = _now();
+    int res        = traced.setxattr(path, name, value, size, flags);
+    _record(TRACE_SETXATTR, start, res, path, name, 0, size, 0, flags);
+
+    return res;
+}
+
+static int _getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    uint64_t start = _now();
+    int res        = traced.getxattr(path, name, value, size);
+    _record(TRACE_GETXATTR, start, res, path, name, 0, size, 0, 0);
+
+    return res;
+}
+
+static int _listxattr(const char *path, char *list, size_t size)
+{
+    uint64_t start = _now();
+    int res        = traced.listxattr(path, list, size);
+    _record(TRACE_LISTXATTR, start, res, path, NULL, 0, size, 0, 0);
+
+    return res;
+}
+
+static int _removexattr(const char *path, const char *name)
+{
+    uint64_t start = _now();
+    int res        = traced.removexattr(path, name);
+    _record(TRACE_REMOVEXATTR, start, res, path, name, 0, 0, 0, 0);
+
+    return res;
+}
+#endif
+
+static void _destroy(void *private_data)
+{
+    if (traced.destroy != NULL)
+        traced.destroy(private_data);
+
+    recorder_stop();
+}
+
+#define WRAP(ops, name, wrapper)                                                                   \
+    do {                                                                                           \
+        if ((ops)->name != NULL)                                                                   \
+            (ops)->name = (wrapper);                                                               \
+    } while (0)
+
+int recorder_start(struct fuse_operations *ops)
+{
+    // Wraps every callback in ops that DEFFS implements
+    trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (trace_fd == -1)
+        return -errno;
+
+    buffer = malloc(RECORDER_BUFFER);
+    if (buffer == NULL) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -ENOMEM;
+    }
+
+    struct trace_header header = {{0}};
+    memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    header.version = TRACE_VERSION;
+    header.started = time(NULL);
+
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+        int res = errno != 0 ? -errno : -EIO;
+        recorder_stop();
+        return res;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    traced = *ops;
+
+    WRAP(ops, getattr, _getattr);
+    WRAP(ops, fgetattr, _fgetattr);
+    WRAP(ops, access, _access);
+    WRAP(ops, readlink, _readlink);
+    WRAP(ops, opendir, _opendir);
+    WRAP(ops, readdir, _readdir);
+    WRAP(ops, releasedir, _releasedir);
+    WRAP(ops, mknod, _mknod);
+    WRAP(ops, mkdir, _mkdir);
+    WRAP(ops, symlink, _symlink);
+    WRAP(ops, unlink, _unlink);
+    WRAP(ops, rmdir, _rmdir);
+    WRAP(ops, rename, _rename);
+    WRAP(ops, link, _link);
+    WRAP(ops, chmod, _chmod);
+    WRAP(ops, chown, _chown);
+    WRAP(ops, truncate, _truncate);
+    WRAP(ops, ftruncate, _ftruncate);
+    WRAP(ops, utimens, _utimens);
+    WRAP(ops, create, _create);
+    WRAP(ops, open, _open);
+    WRAP(ops, read, _read);
+    WRAP(ops, write, _write);
+    WRAP(ops, statfs, _statfs);
+    WRAP(ops, flush, _flush_file);
+    WRAP(ops, release, _release);
+    WRAP(ops, fsync, _fsync);
+    WRAP(ops, fallocate, _fallocate);
+    WRAP(ops, ioctl, _ioctl);
+#ifndef __APPLE__
+    WRAP(ops, setxattr, _setxattr);
+    WRAP(ops, getxattr, _getxattr);
+    WRAP(ops, listxattr, _listxattr);
+    WRAP(ops, removexattr, _removexattr);
+#endif
+
+    // The trace is completed once the filesystem is unmounted
+    ops->destroy = _destroy;
+
+    return 0;
+}
+
+void recorder_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_fd != -1) {
+        _flush();
+        if (trace_fd != -1)
+            close(trace_fd);
+        trace_fd = -1;
+    }
+
+    free(buffer);
+    buffer   = NULL;
+    buffered = 0;
+
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,854 @@
+/*
+* FILENAME: replay.c
+*
+* DESCRIPTION: Command line tool that replays a trace recorded with --trace
+*              against a mounted DEFFS, at the pace it was recorded or faster,
+*              and reports the latency of each kind of call next to the one in
+*              the trace. Calls are issued one at a time in the order they
+*              started. Written data is a fixed pattern of the recorded sizes.
+*              The replay's own timings can be saved as a trace, and two traces
+*              compared, so that builds are compared on the same workload.
+*              With --core the calls go to libdeffs in this process instead of
+*              to a mount, which measures the core without the kernel.
+*
+* USAGE: cmake --build ./ --target DEFFS-replay -- -j 6
+*        ./bin/DEFFS-replay --speed 4 --output new.trace prod.trace ~/deffs
+*        ./bin/DEFFS-replay --speed 0 --core prod.trace ~/deffs_storage
+*        ./bin/DEFFS-replay --compare old.trace new.trace
+*
+* AUTHOR: Charles Averill
+*/
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 29
+
+#include <argp.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libdeffs.h"
+#include "trace.h"
+
+const char *argp_program_version     = "DEFFS-replay 0.0.2";
+const char *argp_program_bug_address = "charles.averill@utdallas.edu";
+static char doc[] = "Replay a DEFFS trace against a mount and report latencies per call, or "
+                    "compare the latencies of two traces";
+static char args_doc[] = "TRACE MOUNTPOINT\n--core TRACE STOREPOINT\n--compare BASE TRACE";
+
+static struct argp_option options[] = {
+    {"speed", 's', "FACTOR", 0,
+     "Pace relative to the recording, 0 to issue calls back to back (default 1)"},
+    {"output", 'o', "FILE", 0, "Save the replay's own timings as a trace"},
+    {"compare", 'c', 0, 0, "Compare two traces instead of replaying one"},
+    {"core", 'C', 0, 0, "Make the calls in this process on the store, without a mount"},
+    {0}};
+
+struct replay_arguments {
+    char *paths[2];
+    double speed;
+    char *output;
+    int compare;
+    int core;
+};
+
+static error_t parse_replay_opt(int key, char *arg, struct argp_state *state)
+{
+    struct replay_arguments *arguments = state->input;
+
+    switch (key) {
+    case 's':
+        arguments->speed = atof(arg);
+        if (arguments->speed < 0)
+            argp_error(state, "speed must not be negative");
+        break;
+    case 'o':
+        arguments->output = arg;
+        break;
+    case 'c':
+        arguments->compare = 1;
+        break;
+    case 'C':
+        arguments->core = 1;
+        break;
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 1)
+            argp_usage(state);
+        arguments->paths[state->arg_num] = arg;
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 2)
+            argp_usage(state);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static struct argp argp = {options, parse_replay_opt, args_doc, doc, 0, 0, 0};
+
+// A record of a trace in memory, with its paths
+struct call {
+    struct trace_record record;
+    const char *path;
+    const char *path2;
+};
+
+struct trace {
+    char *data;
+    struct call *calls;
+    size_t n_calls;
+};
+
+// Latencies of one kind of call, in nanoseconds
+struct latencies {
+    uint64_t *ns;
+    size_t n;
+    size_t capacity;
+};
+
+// A file or directory the replay holds open for a handle of the trace. Calls made in this
+// process hold libdeffs' own handle instead of a descriptor
+struct handle {
+    uint64_t fh;
+    int fd;
+    DIR *dir;
+    struct fuse_file_info fi;
+    int core_open;
+};
+
+// What a handle of libdeffs holds open
+#define CORE_FILE 1
+#define CORE_DIR 2
+
+static struct handle *handles;
+static size_t n_handles;
+static size_t handles_capacity;
+
+static char *data_buf;
+static size_t data_len;
+
+static int _by_start(const void *a, const void *b)
+{
+    const struct call *x = a, *y = b;
+
+    return x->record.start < y->record.start ? -1 : x->record.start > y->record.start;
+}
+
+static int _load_trace(const char path[], struct trace *trace)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (trace->data = malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    ssize_t n = 0;
+    for (ssize_t got; n < st.st_size; n += got) {
+        got = read(fd, trace->data + n, st.st_size - n);
+        if (got <= 0)
+            break;
+    }
+    close(fd);
+
+    struct trace_header header;
+    if (n < (ssize_t)sizeof(header))
+        return -EINVAL;
+
+    memcpy(&header, trace->data, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0 ||
+        header.version != TRACE_VERSION)
+        return -EINVAL;
+
+    // Paths are copied out so that each can be NUL-terminated
+    size_t capacity = 1024;
+    trace->calls    = malloc(capacity * sizeof(struct call));
+    trace->n_calls  = 0;
+
+    for (size_t pos = sizeof(header); pos + sizeof(struct trace_record) <= (size_t)n;) {
+        struct call call;
+        memcpy(&call.record, trace->data + pos, sizeof(call.record));
+        pos += sizeof(call.record);
+
+        size_t paths_len = call.record.path_len + call.record.path2_len;
+        if (pos + paths_len > (size_t)n || call.record.op >= TRACE_N_OPS)
+            break;
+
+        char *paths = malloc(paths_len + 2);
+        if (paths == NULL)
+            return -ENOMEM;
+
+        memcpy(paths, trace->data + pos, call.record.path_len);
+        paths[call.record.path_len] = '\0';
+        memcpy(paths + call.record.path_len + 1, trace->data + pos + call.record.path_len,
+               call.record.path2_len);
+        paths[paths_len + 1] = '\0';
+        pos += paths_len;
+
+        call.path  = paths;
+        call.path2 = paths + call.record.path_len + 1;
+
+        if (trace->n_calls == capacity) {
+            capacity *= 2;
+            struct call *calls = realloc(trace->calls, capacity * sizeof(struct call));
+            if (calls == NULL)
+                return -ENOMEM;
+            trace->calls = calls;
+        }
+
+        trace->calls[trace->n_calls++] = call;
+    }
+
+    // Records are written as calls finish, so calls that overlapped may be out of order
+    qsort(trace->calls, trace->n_calls, sizeof(struct call), _by_start);
+
+    return 0;
+}
+
+static void _add_latency(struct latencies *latencies, uint64_t ns)
+{
+    if (latencies->n == latencies->capacity) {
+        size_t capacity = latencies->capacity > 0 ? 2 * latencies->capacity : 64;
+        uint64_t *grown = realloc(latencies->ns, capacity * sizeof(uint64_t));
+        if (grown == NULL)
+            return;
+
+        latencies->ns       = grown;
+        latencies->capacity = capacity;
+    }
+
+    latencies->ns[latencies->n++] = ns;
+}
+
+static int _by_value(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void _summarize(struct latencies *latencies, double *mean, double *p99)
+{
+    // In microseconds
+    *mean = *p99 = 0;
+    if (latencies->n == 0)
+        return;
+
+    qsort(latencies->ns, latencies->n, sizeof(uint64_t), _by_value);
+
+    double sum = 0;
+    for (size_t i = 0; i < latencies->n; i++) {
+        sum += latencies->ns[i];
+    }
+
+    *mean = sum / latencies->n / 1000;
+    *p99  = latencies->ns[(latencies->n - 1) * 99 / 100] / 1000.0;
+}
+
+static void _report(struct latencies base[], struct latencies run[], const char base_name[],
+                    const char run_name[])
+{
+    printf("%-12s %9s  %10s %10s  %10s %10s  %8s\n", "call", "count", base_name, "p99",
+           run_name, "p99", "change");
+
+    for (int op = 0; op < TRACE_N_OPS; op++) {
+        if (base[op].n == 0 && run[op].n == 0)
+            continue;
+
+        double base_mean, base_p99, run_mean, run_p99;
+        _summarize(&base[op], &base_mean, &base_p99);
+        _summarize(&run[op], &run_mean, &run_p99);
+
+        char change[16] = "-";
+        if (base_mean > 0 && run[op].n > 0)
+            snprintf(change, sizeof(change), "%+.1f%%", 100 * (run_mean - base_mean) / base_mean);
+
+        printf("%-12s %9zu  %10.1f %10.1f  %10.1f %10.1f  %8s\n", trace_op_name(op),
+               run[op].n > 0 ? run[op].n : base[op].n, base_mean, base_p99, run_mean, run_p99,
+               change);
+    }
+
+    printf("Latencies are means and 99th percentiles in microseconds\n");
+}
+
+static struct handle *_handle(uint64_t fh)
+{
+    for (size_t i = 0; i < n_handles; i++) {
+        if (handles[i].fh == fh)
+            return &handles[i];
+    }
+
+    return NULL;
+}
+
+static struct handle *_add_handle(uint64_t fh, int fd, DIR *dir)
+{
+    if (n_handles == handles_capacity) {
+        size_t capacity       = handles_capacity > 0 ? 2 * handles_capacity : 64;
+        struct handle *grown = realloc(handles, capacity * sizeof(struct handle));
+        if (grown == NULL)
+            return NULL;
+
+        handles          = grown;
+        handles_capacity = capacity;
+    }
+
+    handles[n_handles] = (struct handle){fh, fd, dir};
+
+    return &handles[n_handles++];
+}
+
+static void _drop_handle(struct handle *handle)
+{
+    *handle = handles[--n_handles];
+}
+
+static int _file_fd(const struct call *call, const char path[])
+{
+    // Files opened before the recording started are opened when first used
+    struct handle *handle = _handle(call->record.fh);
+    if (handle != NULL && handle->fd != -1)
+        return handle->fd;
+
+    int fd = open(path, O_RDWR);
+    if (fd == -1)
+        fd = open(path, O_RDONLY);
+    if (fd != -1 && _add_handle(call->record.fh, fd, NULL) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static char *_data(size_t len)
+{
+    // Written data is a pattern, as the trace never holds the original
+    if (len > data_len) {
+        char *grown = realloc(data_buf, len);
+        if (grown == NULL)
+            return NULL;
+
+        for (size_t i = data_len; i < len; i++) {
+            grown[i] = 'a' + i % 26;
+        }
+
+        data_buf = grown;
+        data_len = len;
+    }
+
+    return data_buf;
+}
+
+static long _issue(const struct call *call, const char path[], const char path2[])
+{
+    // Makes the system call that leads to the recorded filesystem call. Returns what it did
+    // in the trace's terms, a byte count or a negative errno
+    const struct trace_record *record = &call->record;
+    struct handle *handle;
+    struct stat st;
+    struct statvfs stv;
+    char *buf;
+    long res = 0;
+
+    switch (record->op) {
+    case TRACE_GETATTR:
+        res = lstat(path, &st);
+        break;
+    case TRACE_FGETATTR:
+        handle = _handle(record->fh);
+        res    = handle != NULL && handle->fd != -1 ? fstat(handle->fd, &st) : lstat(path, &st);
+        break;
+    case TRACE_ACCESS:
+        res = access(path, record->arg);
+        break;
+    case TRACE_READLINK:
+        buf = _data(record->size);
+        res = buf != NULL ? readlink(path, buf, record->size) : -1;
+        break;
+    case TRACE_OPENDIR: {
+        DIR *dir = opendir(path);
+        res      = dir != NULL ? 0 : -1;
+        if (dir != NULL && _add_handle(record->fh, -1, dir) == NULL)
+            closedir(dir);
+        break;
+    }
+    case TRACE_READDIR: {
+        handle = _handle(record->fh);
+        if (handle == NULL || handle->dir == NULL) {
+            errno = EBADF;
+            return -EBADF;
+        }
+
+        if (record->offset == 0)
+            rewinddir(handle->dir);
+        for (uint64_t n = 0; record->size == 0 || n < record->size; n++) {
+            if (readdir(handle->dir) == NULL)
+                break;
+        }
+        break;
+    }
+    case TRACE_RELEASEDIR:
+        handle = _handle(record->fh);
+        if (handle != NULL && handle->dir != NULL) {
+            res = closedir(handle->dir);
+            _drop_handle(handle);
+        }
+        break;
+    case TRACE_MKNOD:
+        res = mknod(path, record->arg, 0);
+        break;
+    case TRACE_MKDIR:
+        res = mkdir(path, record->arg);
+        break;
+    case TRACE_SYMLINK:
+        res = symlink(call->path2, path);
+        break;
+    case TRACE_UNLINK:
+        res = unlink(path);
+        break;
+    case TRACE_RMDIR:
+        res = rmdir(path);
+        break;
+    case TRACE_RENAME:
+        res = rename(path, path2);
+        break;
+    case TRACE_LINK:
+        res = link(path, path2);
+        break;
+    case TRACE_CHMOD:
+        res = chmod(path, record->arg);
+        break;
+    case TRACE_CHOWN:
+        res = lchown(path, record->arg >> 32, (uint32_t)record->arg);
+        break;
+    case TRACE_TRUNCATE:
+        res = truncate(path, record->size);
+        break;
+    case TRACE_FTRUNCATE:
+        res = ftruncate(_file_fd(call, path), record->size);
+        break;
+    case TRACE_UTIMENS:
+        res = utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW);
+        break;
+    case TRACE_CREATE:
+    case TRACE_OPEN: {
+        int flags = (int)record->arg;
+        if (record->op == TRACE_CREATE)
+            flags = (int)(record->arg >> 32) | O_CREAT;
+
+        int fd = open(path, flags, (mode_t)record->arg);
+        res    = fd != -1 ? 0 : -1;
+
+        // A handle the trace reuses belongs to a file the recording saw closed
+        if ((handle = _handle(record->fh)) != NULL) {
+            if (handle->fd != -1)
+                close(handle->fd);
+            _drop_handle(handle);
+        }
+        if (fd != -1 && _add_handle(record->fh, fd, NULL) == NULL)
+            close(fd);
+        break;
+    }
+    case TRACE_READ:
+        buf = _data(record->size);
+        res = buf != NULL ? pread(_file_fd(call, path), buf, record->size, record->offset) : -1;
+        break;
+    case TRACE_WRITE:
+        buf = _data(record->size);
+        res = buf != NULL ? pwrite(_file_fd(call, path), buf, record->size, record->offset) : -1;
+        break;
+    case TRACE_STATFS:
+        res = statvfs(path, &stv);
+        break;
+    case TRACE_RELEASE:
+        handle = _handle(record->fh);
+        if (handle != NULL && handle->fd != -1) {
+            res = close(handle->fd);
+            _drop_handle(handle);
+        }
+        break;
+    case TRACE_FSYNC:
+        res = record->arg ? fdatasync(_file_fd(call, path)) : fsync(_file_fd(call, path));
+        break;
+    case TRACE_FALLOCATE:
+        res = fallocate(_file_fd(call, path), record->arg, record->offset, record->size);
+        break;
+    case TRACE_SETXATTR:
+        buf = _data(record->size);
+        res = buf != NULL ? lsetxattr(path, call->path2, buf, record->size, record->arg) : -1;
+        break;
+    case TRACE_GETXATTR:
+        buf = _data(record->size);
+        res = buf != NULL ? lgetxattr(path, call->path2, buf, record->size) : -1;
+        break;
+    case TRACE_LISTXATTR:
+        buf = _data(record->size);
+        res = buf != NULL ? llistxattr(path, buf, record->size) : -1;
+        break;
+    case TRACE_REMOVEXATTR:
+        res = lremovexattr(path, call->path2);
+        break;
+    }
+
+    return res == -1 ? -errno : res;
+}
+
+static int _count_entry(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    // Stops a listing once it has as many entries as the recorded one
+    (void)name, (void)st, (void)off;
+    uint64_t *left = buf;
+
+    return *left > 0 && --*left == 0;
+}
+
+static struct fuse_file_info *_core_file(const struct call *call, const char path[])
+{
+    // Files opened before the recording started are opened when first used
+    struct handle *handle = _handle(call->record.fh);
+    if (handle != NULL && handle->core_open == CORE_FILE)
+        return &handle->fi;
+
+    struct fuse_file_info fi = {0};
+    fi.flags                 = O_RDWR;
+    if (deffs_oper.open(path, &fi) != 0) {
+        fi.flags = O_RDONLY;
+        if (deffs_oper.open(path, &fi) != 0)
+            return NULL;
+    }
+
+    if ((handle = _add_handle(call->record.fh, -1, NULL)) == NULL) {
+        deffs_oper.release(path, &fi);
+        return NULL;
+    }
+
+    handle->fi        = fi;
+    handle->core_open = CORE_FILE;
+
+    return &handle->fi;
+}
+
+// Callbacks libdeffs leaves out fail as they would on a mount
+#define CORE_CALL(op, ...) (deffs_oper.op != NULL ? deffs_oper.op(__VA_ARGS__) : -ENOSYS)
+
+static int _close_core(const char path[], struct handle *handle)
+{
+    int res = 0;
+    if (handle->core_open == CORE_FILE)
+        res = CORE_CALL(release, path, &handle->fi);
+    else if (handle->core_open == CORE_DIR)
+        res = CORE_CALL(releasedir, path, &handle->fi);
+
+    _drop_handle(handle);
+
+    return res;
+}
+
+static long _issue_core(const struct call *call, const char path[], const char path2[])
+{
+    // Makes the recorded filesystem call itself, through libdeffs in this process
+    const struct trace_record *record = &call->record;
+    struct handle *handle;
+    struct fuse_file_info *fi;
+    struct stat st;
+    struct statvfs stv;
+    char *buf = _data(record->size > 0 ? record->size : 1);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    switch (record->op) {
+    case TRACE_GETATTR:
+        return CORE_CALL(getattr, path, &st);
+    case TRACE_FGETATTR:
+        handle = _handle(record->fh);
+        if (handle != NULL && handle->core_open == CORE_FILE)
+            return CORE_CALL(fgetattr, path, &st, &handle->fi);
+        return CORE_CALL(getattr, path, &st);
+    case TRACE_ACCESS:
+        return CORE_CALL(access, path, record->arg);
+    case TRACE_READLINK:
+        return CORE_CALL(readlink, path, buf, record->size);
+    case TRACE_OPENDIR: {
+        struct fuse_file_info dir = {0};
+        int res                   = CORE_CALL(opendir, path, &dir);
+        if (res == 0) {
+            if ((handle = _add_handle(record->fh, -1, NULL)) == NULL) {
+                CORE_CALL(releasedir, path, &dir);
+                return -ENOMEM;
+            }
+            handle->fi        = dir;
+            handle->core_open = CORE_DIR;
+        }
+        return res;
+    }
+    case TRACE_READDIR: {
+        handle = _handle(record->fh);
+        if (handle == NULL || handle->core_open != CORE_DIR)
+            return -EBADF;
+
+        uint64_t left = record->size;
+        return CORE_CALL(readdir, path, &left, _count_entry, record->offset, &handle->fi);
+    }
+    case TRACE_RELEASEDIR:
+    case TRACE_RELEASE:
+        handle = _handle(record->fh);
+        return handle != NULL ? _close_core(path, handle) : 0;
+    case TRACE_MKNOD:
+        return CORE_CALL(mknod, path, record->arg, 0);
+    case TRACE_MKDIR:
+        return CORE_CALL(mkdir, path, record->arg);
+    case TRACE_SYMLINK:
+        return CORE_CALL(symlink, call->path2, path);
+    case TRACE_UNLINK:
+        return CORE_CALL(unlink, path);
+    case TRACE_RMDIR:
+        return CORE_CALL(rmdir, path);
+    case TRACE_RENAME:
+        return CORE_CALL(rename, path, path2);
+    case TRACE_LINK:
+        return CORE_CALL(link, path, path2);
+    case TRACE_CHMOD:
+        return CORE_CALL(chmod, path, record->arg);
+    case TRACE_CHOWN:
+        return CORE_CALL(chown, path, record->arg >> 32, (uint32_t)record->arg);
+    case TRACE_TRUNCATE:
+        return CORE_CALL(truncate, path, record->size);
+    case TRACE_FTRUNCATE:
+        fi = _core_file(call, path);
+        return fi != NULL ? CORE_CALL(ftruncate, path, record->size, fi) : -EBADF;
+    case TRACE_UTIMENS: {
+        struct timespec now[2] = {{0, UTIME_NOW}, {0, UTIME_NOW}};
+        return CORE_CALL(utimens, path, now);
+    }
+    case TRACE_CREATE:
+    case TRACE_OPEN: {
+        // A handle the trace reuses belongs to a file the recording saw closed
+        if ((handle = _handle(record->fh)) != NULL)
+            _close_core(path, handle);
+
+        struct fuse_file_info file = {0};
+        int res;
+        if (record->op == TRACE_CREATE) {
+            file.flags = (int)(record->arg >> 32) | O_CREAT;
+            res        = CORE_CALL(create, path, (mode_t)record->arg, &file);
+        } else {
+            file.flags = (int)record->arg;
+            res        = CORE_CALL(open, path, &file);
+        }
+
+        if (res == 0) {
+            if ((handle = _add_handle(record->fh, -1, NULL)) == NULL) {
+                CORE_CALL(release, path, &file);
+                return -ENOMEM;
+            }
+            handle->fi        = file;
+            handle->core_open = CORE_FILE;
+        }
+        return res;
+    }
+    case TRACE_READ:
+        fi = _core_file(call, path);
+        return fi != NULL ? CORE_CALL(read, path, buf, record->size, record->offset, fi) : -EBADF;
+    case TRACE_WRITE:
+        fi = _core_file(call, path);
+        return fi != NULL ? CORE_CALL(write, path, buf, record->size, record->offset, fi) : -EBADF;
+    case TRACE_STATFS:
+        return CORE_CALL(statfs, path, &stv);
+    case TRACE_FSYNC:
+        fi = _core_file(call, path);
+        return fi != NULL ? CORE_CALL(fsync, path, record->arg, fi) : -EBADF;
+    case TRACE_FALLOCATE:
+        fi = _core_file(call, path);
+        if (fi == NULL)
+            return -EBADF;
+        return CORE_CALL(fallocate, path, record->arg, record->offset, record->size, fi);
+    case TRACE_SETXATTR:
+        return CORE_CALL(setxattr, path, call->path2, buf, record->size, record->arg);
+    case TRACE_GETXATTR:
+        return CORE_CALL(getxattr, path, call->path2, buf, record->size);
+    case TRACE_LISTXATTR:
+        return CORE_CALL(listxattr, path, buf, record->size);
+    case TRACE_REMOVEXATTR:
+        return CORE_CALL(removexattr, path, call->path2);
+    }
+
+    return 0;
+}
+
+static void _release_core_handles(void)
+{
+    // Files the trace left open are closed before the store is
+    while (n_handles > 0) {
+        _close_core(NULL, &handles[n_handles - 1]);
+    }
+}
+
+static int _replayable(int op)
+{
+    // Flushes come with every close, and ioctls cannot be rebuilt without their arguments
+    return op != TRACE_FLUSH && op != TRACE_IOCTL;
+}
+
+static uint64_t _clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void _wait_until(uint64_t when)
+{
+    struct timespec ts = {when / 1000000000, when % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void _write_call(FILE *out, const struct call *call, uint64_t start, uint64_t duration,
+                        long result)
+{
+    struct trace_record record = call->record;
+    record.start               = start;
+    record.duration            = duration;
+    record.result              = result;
+    record.thread              = 0;
+
+    fwrite(&record, sizeof(record), 1, out);
+    fwrite(call->path, 1, record.path_len, out);
+    fwrite(call->path2, 1, record.path2_len, out);
+}
+
+static void _replay(const struct trace *trace, const char mountpoint[], double speed, FILE *out,
+                    struct latencies replayed[],
+                    long (*issue)(const struct call *, const char[], const char[]))
+{
+    size_t skipped = 0, failed = 0;
+    uint64_t begin = _clock();
+
+    for (size_t i = 0; i < trace->n_calls; i++) {
+        const struct call *call = &trace->calls[i];
+        if (!_replayable(call->record.op)) {
+            skipped++;
+            continue;
+        }
+
+        if (speed > 0)
+            _wait_until(begin + (uint64_t)(call->record.start / speed));
+
+        char path[strlen(mountpoint) + call->record.path_len + 1];
+        char path2[strlen(mountpoint) + call->record.path2_len + 1];
+        sprintf(path, "%s%s", mountpoint, call->path);
+        sprintf(path2, "%s%s", mountpoint, call->path2);
+
+        uint64_t start = _clock();
+        long res       = issue(call, path, path2);
+        uint64_t end   = _clock();
+
+        // Calls are expected to fail as they did when recorded, and only differences count
+        if ((res < 0) != (call->record.result < 0))
+            failed++;
+
+        _add_latency(&replayed[call->record.op], end - start);
+        if (out != NULL)
+            _write_call(out, call, start - begin, end - start, res);
+    }
+
+    double seconds = (_clock() - begin) / 1e9;
+    printf("Replayed %zu calls in %.2f s, %zu skipped, %zu did not fail or succeed as recorded\n",
+           trace->n_calls - skipped, seconds, skipped, failed);
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay_arguments arguments = {{NULL, NULL}, 1, NULL, 0, 0};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    struct trace base;
+    int res = _load_trace(arguments.paths[0], &base);
+    if (res != 0) {
+        printf("Could not read trace %s: %s\n", arguments.paths[0], strerror(-res));
+        exit(1);
+    }
+
+    struct latencies recorded[TRACE_N_OPS] = {{0}};
+    struct latencies replayed[TRACE_N_OPS] = {{0}};
+
+    for (size_t i = 0; i < base.n_calls; i++) {
+        _add_latency(&recorded[base.calls[i].record.op], base.calls[i].record.duration);
+    }
+
+    if (arguments.compare) {
+        struct trace run;
+        res = _load_trace(arguments.paths[1], &run);
+        if (res != 0) {
+            printf("Could not read trace %s: %s\n", arguments.paths[1], strerror(-res));
+            exit(1);
+        }
+
+        for (size_t i = 0; i < run.n_calls; i++) {
+            _add_latency(&replayed[run.calls[i].record.op], run.calls[i].record.duration);
+        }
+
+        _report(recorded, replayed, "base", "trace");
+        return 0;
+    }
+
+    FILE *out = NULL;
+    if (arguments.output != NULL) {
+        out = fopen(arguments.output, "w");
+        if (out == NULL) {
+            printf("Could not create %s: %s\n", arguments.output, strerror(errno));
+            exit(1);
+        }
+
+        struct trace_header header = {{0}};
+        memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+        header.version = TRACE_VERSION;
+        header.started = time(NULL);
+        fwrite(&header, sizeof(header), 1, out);
+    }
+
+    // Calls made in this process name paths from the root of the filesystem, as a mount sees them
+    if (arguments.core) {
+        res = libdeffs_open(arguments.paths[1]);
+        if (res != 0) {
+            printf("Could not open store %s: %s\n", arguments.paths[1], strerror(-res));
+            exit(1);
+        }
+
+        _replay(&base, "", arguments.speed, out, replayed, _issue_core);
+        _release_core_handles();
+        libdeffs_close();
+    } else {
+        _replay(&base, arguments.paths[1], arguments.speed, out, replayed, _issue);
+    }
+
+    if (out != NULL && fclose(out) != 0) {
+        printf("Could not write %s: %s\n", arguments.output, strerror(errno));
+        exit(1);
+    }
+
+    // Recorded latencies are measured inside DEFFS, replayed ones around the system call, or
+    // around the same callback when replayed in this process
+    _report(recorded, replayed, "recorded", arguments.core ? "core" : "replayed");
+
+    return 0;
+}
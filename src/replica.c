@@ -0,0 +1,524 @@
+/*
+* FILENAME: replica.c
+*
+* DESCRIPTION: Replication of shards to the replica targets. Every change made to
+*              a shard is queued for each target and applied there, in order, by
+*              a thread of its own, so that a slow target only holds up itself.
+*              Queued payloads are bounded by replica_queue_size, past which new
+*              changes wait for room. A write takes a mark before it changes any
+*              shard and waits afterwards for as many targets as its durability
+*              level asks for: none for local, enough to make a majority of all
+*              copies for quorum, and every target for all. The level comes from
+*              the nearest directory above a file that has one, kept in an
+*              extended attribute of the directory in the storepoint, or from the
+*              mount. Shards missing from the shardpoint are read from a replica.
+*              The counters are read through the DEFFS_IOC_REPLICA_STATS ioctl.
+*
+* USAGE: replica_start();
+*
+*        uint64_t mark = replica_mark();
+*        shard_pwrite(hash, ciphertext, len, offset); // queues the change for each target
+*        res = replica_wait(mark, path);
+*
+*        replica_stop();
+*
+* AUTHOR: Charles Averill
+*/
+
+#define _GNU_SOURCE
+
+#include "replica.h"
+#include "shards.h"
+
+char *replica_targets[DEFFS_REPLICA_MAX_TARGETS];
+int n_replica_targets;
+int replica_durability  = DEFFS_DURABILITY_LOCAL;
+long replica_queue_size = 64 * 1024 * 1024;
+
+enum replica_op_type {
+    REPLICA_WRITE,
+    REPLICA_PWRITE,
+    REPLICA_TRUNCATE,
+    REPLICA_ALLOCATE,
+    REPLICA_PUNCH,
+    REPLICA_UNLINK,
+};
+
+// A change to one shard, shared by the queues of every target until all have applied it
+struct replica_op {
+    enum replica_op_type type;
+    char hash[SHARD_FN_LEN + 1];
+    off_t offset;
+    // Length of the data or of the range, or the new size of a truncated shard
+    off_t len;
+    char *data;
+    uint64_t seq;
+    struct timespec queued;
+    int pending;
+};
+
+struct replica_target {
+    pthread_t thread;
+    // Ring of changes waiting for the target, the first one being applied
+    struct replica_op **ring;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    // Last change the target got to, and last one that failed there
+    uint64_t applied_seq;
+    uint64_t failed_seq;
+    struct deffs_replica_target_stats stats;
+};
+
+static struct replica_target targets[DEFFS_REPLICA_MAX_TARGETS];
+
+// Guards the queues and counters. The condition is broadcast for new changes, for progress on
+// a target and for room in the queue
+static pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replica_cond  = PTHREAD_COND_INITIALIZER;
+
+static uint64_t replica_seq;
+static size_t queued_bytes;
+static struct deffs_replica_stats stats;
+static int replica_running;
+static int n_started;
+
+// Durability levels of directories
+static struct dirpolicy level_policy = DIRPOLICY_INIT(REPLICA_LEVEL_XATTR, DEFFS_DURABILITY_ALL,
+                                                      durability_name, durability_level,
+                                                      &replica_durability);
+
+static uint64_t _ms_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int _push(struct replica_target *target, struct replica_op *op)
+{
+    // Called with replica_lock held
+    if (target->count == target->capacity) {
+        size_t capacity           = target->capacity > 0 ? target->capacity * 2 : 256;
+        struct replica_op **grown = malloc(capacity * sizeof(*grown));
+        if (grown == NULL)
+            return -ENOMEM;
+
+        for (size_t i = 0; i < target->count; i++)
+            grown[i] = target->ring[(target->head + i) % target->capacity];
+
+        free(target->ring);
+        target->ring     = grown;
+        target->head     = 0;
+        target->capacity = capacity;
+    }
+
+    target->ring[(target->head + target->count) % target->capacity] = op;
+    target->count++;
+
+    return 0;
+}
+
+static void _enqueue(enum replica_op_type type, const char hash[], const char *buf, off_t offset,
+                     off_t len)
+{
+    if (n_replica_targets == 0 || !replica_running)
+        return;
+
+    size_t bytes          = buf != NULL ? (size_t)len : 0;
+    struct replica_op *op = malloc(sizeof(struct replica_op));
+    char *data            = bytes > 0 ? malloc(bytes) : NULL;
+
+    pthread_mutex_lock(&replica_lock);
+
+    // Without memory for the change, every target misses it and says so to whoever waits
+    if (op == NULL || (bytes > 0 && data == NULL)) {
+        replica_seq++;
+        for (int i = 0; i < n_replica_targets; i++) {
+            targets[i].failed_seq = replica_seq;
+            targets[i].stats.failed++;
+        }
+
+        pthread_mutex_unlock(&replica_lock);
+        printf("Could not queue replication of shard %s\n", hash);
+        free(op);
+        free(data);
+        return;
+    }
+
+    // A full queue holds the writer back until the targets catch up, a single change always fits
+    if (queued_bytes > 0 && queued_bytes + bytes > (size_t)replica_queue_size) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        stats.stalls++;
+        while (queued_bytes > 0 && queued_bytes + bytes > (size_t)replica_queue_size)
+            pthread_cond_wait(&replica_cond, &replica_lock);
+        stats.stall_ms += _ms_since(&start);
+    }
+
+    op->type = type;
+    memcpy(op->hash, hash, SHARD_FN_LEN);
+    op->hash[SHARD_FN_LEN] = '\0';
+    op->offset             = offset;
+    op->len                = len;
+    op->data               = data;
+    op->seq                = ++replica_seq;
+    op->pending            = 0;
+    clock_gettime(CLOCK_MONOTONIC, &op->queued);
+
+    if (bytes > 0)
+        memcpy(data, buf, bytes);
+
+    for (int i = 0; i < n_replica_targets; i++) {
+        if (_push(&targets[i], op) != 0) {
+            targets[i].failed_seq = op->seq;
+            targets[i].stats.failed++;
+            continue;
+        }
+
+        targets[i].stats.queued++;
+        targets[i].stats.queued_bytes += bytes;
+        op->pending++;
+    }
+
+    if (op->pending > 0) {
+        queued_bytes += bytes;
+        pthread_cond_broadcast(&replica_cond);
+    } else {
+        free(op->data);
+        free(op);
+    }
+
+    pthread_mutex_unlock(&replica_lock);
+}
+
+void replica_write(const char hash[], const char *buf, size_t size)
+{
+    _enqueue(REPLICA_WRITE, hash, buf, 0, size);
+}
+
+void replica_pwrite(const char hash[], const char *buf, size_t size, off_t offset)
+{
+    _enqueue(REPLICA_PWRITE, hash, buf, offset, size);
+}
+
+void replica_truncate(const char hash[], off_t size)
+{
+    _enqueue(REPLICA_TRUNCATE, hash, NULL, 0, size);
+}
+
+void replica_allocate(const char hash[], off_t offset, off_t len)
+{
+    _enqueue(REPLICA_ALLOCATE, hash, NULL, offset, len);
+}
+
+void replica_punch(const char hash[], off_t offset, off_t len)
+{
+    _enqueue(REPLICA_PUNCH, hash, NULL, offset, len);
+}
+
+void replica_unlink(const char hash[])
+{
+    _enqueue(REPLICA_UNLINK, hash, NULL, 0, 0);
+}
+
+static int _apply(const char base[], const struct replica_op *op)
+{
+    char path[fanout_path_len(base, ".shard")];
+    get_fanout_path(base, op->hash, ".shard", path);
+
+    // Changes to a shard the target never got have nothing to change, which is no failure
+    switch (op->type) {
+    case REPLICA_TRUNCATE:
+        return truncate(path, op->len) == -1 && errno != ENOENT ? -errno : 0;
+    case REPLICA_UNLINK:
+        return unlink(path) == -1 && errno != ENOENT ? -errno : 0;
+    default:
+        break;
+    }
+
+    int flags = O_WRONLY;
+    if (op->type != REPLICA_PUNCH)
+        flags |= O_CREAT;
+    if (op->type == REPLICA_WRITE)
+        flags |= O_TRUNC;
+
+    if (flags & O_CREAT) {
+        int res = make_fanout_dirs(base, op->hash);
+        if (res < 0)
+            return res;
+    }
+
+    int fd = open(path, flags, 0600);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    int res = 0;
+    switch (op->type) {
+    case REPLICA_WRITE:
+        if (write(fd, op->data, op->len) != op->len)
+            res = -EIO;
+        break;
+    case REPLICA_PWRITE:
+        if (pwrite(fd, op->data, op->len, op->offset) != op->len)
+            res = -EIO;
+        break;
+    case REPLICA_ALLOCATE:
+#ifdef HAVE_POSIX_FALLOCATE
+        res = posix_fallocate(fd, op->offset, op->len);
+        res = res == EOPNOTSUPP || res == EINVAL ? 0 : -res;
+#endif
+        break;
+    case REPLICA_PUNCH:
+#ifdef __linux__
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, op->offset, op->len) == -1 &&
+            errno != EOPNOTSUPP)
+            res = -errno;
+#endif
+        break;
+    default:
+        break;
+    }
+
+    close(fd);
+
+    return res;
+}
+
+static void *_replica_loop(void *arg)
+{
+    struct replica_target *target = arg;
+    const char *base              = replica_targets[target - targets];
+
+    pthread_mutex_lock(&replica_lock);
+
+    // Whatever is queued at unmount is still applied
+    while (replica_running || target->count > 0) {
+        if (target->count == 0) {
+            pthread_cond_wait(&replica_cond, &replica_lock);
+            continue;
+        }
+
+        struct replica_op *op = target->ring[target->head];
+        pthread_mutex_unlock(&replica_lock);
+
+        int res = _apply(base, op);
+
+        pthread_mutex_lock(&replica_lock);
+
+        size_t bytes = op->data != NULL ? (size_t)op->len : 0;
+
+        target->head = (target->head + 1) % target->capacity;
+        target->count--;
+        target->stats.queued--;
+        target->stats.queued_bytes -= bytes;
+        target->applied_seq = op->seq;
+
+        if (res != 0) {
+            target->failed_seq = op->seq;
+            target->stats.failed++;
+            printf("Could not replicate shard %s to %s: %s\n", op->hash, base, strerror(-res));
+        } else {
+            target->stats.applied++;
+            target->stats.applied_bytes += bytes;
+        }
+
+        if (--op->pending == 0) {
+            queued_bytes -= bytes;
+            free(op->data);
+            free(op);
+        }
+
+        pthread_cond_broadcast(&replica_cond);
+    }
+
+    pthread_mutex_unlock(&replica_lock);
+
+    return NULL;
+}
+
+ssize_t replica_read(const char hash[], char *buf, size_t size, off_t offset)
+{
+    // Read a shard from the first replica target that has it
+    ssize_t res = -ENOENT;
+
+    for (int i = 0; i < n_replica_targets && res == -ENOENT; i++) {
+        char path[fanout_path_len(replica_targets[i], ".shard")];
+        get_fanout_path(replica_targets[i], hash, ".shard", path);
+
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            res = -errno;
+            continue;
+        }
+
+        res = pread(fd, buf, size, offset);
+        if (res == -1)
+            res = -errno;
+
+        close(fd);
+    }
+
+    return res;
+}
+
+uint64_t replica_mark(void)
+{
+    // Changes queued after the mark are the ones replica_wait waits for
+    pthread_mutex_lock(&replica_lock);
+    uint64_t mark = replica_seq;
+    pthread_mutex_unlock(&replica_lock);
+
+    return mark;
+}
+
+static int _needed(int level)
+{
+    // Replica targets that, with the shardpoint, make the copies the level asks for
+    switch (level) {
+    case DEFFS_DURABILITY_ALL:
+        return n_replica_targets;
+    case DEFFS_DURABILITY_QUORUM:
+        return (n_replica_targets + 1) / 2;
+    default:
+        return 0;
+    }
+}
+
+int replica_wait(uint64_t mark, const char path[])
+{
+    if (n_replica_targets == 0)
+        return 0;
+
+    uint64_t last = replica_mark();
+    if (last == mark)
+        return 0;
+
+    int needed = _needed(replica_level(path));
+    if (needed == 0)
+        return 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&replica_lock);
+
+    stats.sync_waits++;
+
+    int res = 0;
+    for (;;) {
+        // A target that failed any change since the mark cannot vouch for this write
+        int acks = 0, possible = 0;
+        for (int i = 0; i < n_replica_targets; i++) {
+            if (targets[i].failed_seq > mark)
+                continue;
+
+            if (targets[i].applied_seq >= last)
+                acks++;
+            else
+                possible++;
+        }
+
+        if (acks >= needed)
+            break;
+
+        if (acks + possible < needed) {
+            res = -EIO;
+            break;
+        }
+
+        pthread_cond_wait(&replica_cond, &replica_lock);
+    }
+
+    stats.sync_ms += _ms_since(&start);
+
+    pthread_mutex_unlock(&replica_lock);
+
+    return res;
+}
+
+int replica_level(const char path[])
+{
+    return dirpolicy_file(&level_policy, path);
+}
+
+int replica_dir_level(const char path[])
+{
+    return dirpolicy_dir(&level_policy, path);
+}
+
+int replica_set_level(const char path[], int level)
+{
+    return dirpolicy_set(&level_policy, path, level);
+}
+
+void replica_forget_levels(void)
+{
+    dirpolicy_forget(&level_policy);
+}
+
+void replica_stats(struct deffs_replica_stats *out)
+{
+    pthread_mutex_lock(&replica_lock);
+
+    *out            = stats;
+    out->n_targets  = n_replica_targets;
+    out->durability = replica_durability;
+
+    for (int i = 0; i < n_replica_targets; i++) {
+        out->targets[i] = targets[i].stats;
+        out->targets[i].lag_ms =
+            targets[i].count > 0 ? _ms_since(&targets[i].ring[targets[i].head]->queued) : 0;
+    }
+
+    pthread_mutex_unlock(&replica_lock);
+}
+
+int replica_start(void)
+{
+    for (int i = 0; i < n_replica_targets; i++) {
+        // Fan-out paths are built by appending to the target
+        if (!ends_with(replica_targets[i], "/")) {
+            char *target = malloc(strlen(replica_targets[i]) + 2);
+            if (target == NULL)
+                return -ENOMEM;
+
+            strcpy(target, replica_targets[i]);
+            strcat(target, "/");
+            replica_targets[i] = target;
+        }
+
+        if (mkdir_if_not_exists(replica_targets[i], 0700) != 0 && errno != EEXIST)
+            return -errno;
+    }
+
+    replica_running = 1;
+
+    for (n_started = 0; n_started < n_replica_targets; n_started++) {
+        if (pthread_create(&targets[n_started].thread, NULL, _replica_loop,
+                           &targets[n_started]) != 0) {
+            replica_stop();
+            return -EAGAIN;
+        }
+    }
+
+    return 0;
+}
+
+void replica_stop(void)
+{
+    if (!replica_running)
+        return;
+
+    pthread_mutex_lock(&replica_lock);
+    replica_running = 0;
+    pthread_cond_broadcast(&replica_cond);
+    pthread_mutex_unlock(&replica_lock);
+
+    for (int i = 0; i < n_started; i++)
+        pthread_join(targets[i].thread, NULL);
+
+    n_started = 0;
+}
@@ -8,32 +8,729 @@
 
 #include "rw.h"
 
-int FLAG_OPENED_EMPTY_FILE;
-int FLAG_TRUNCATE;
-
 // TODO: Replace all exit calls with error returns
 
-int deffs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static int _open_header(const char path[], int flags, mode_t mode)
+{
+    // Header records are read back on every write, so open them read-write where
+    // permissions allow. O_APPEND would send the positioned header writes to the end
+    int fd = open(path, (flags & ~(O_ACCMODE | O_APPEND)) | O_RDWR, mode);
+    if (fd == -1 && errno == EACCES)
+        fd = open(path, flags & ~O_APPEND, mode);
+
+    return fd;
+}
+
+// FUSE only passes open flags to open and create, so calls such as ioctl look up the access
+// mode their handle was opened with here
+static unsigned char *handle_modes;
+static size_t n_handle_modes;
+
+static void _note_handle(int fd, int flags)
+{
+    if ((size_t)fd >= n_handle_modes) {
+        size_t n_modes = n_handle_modes > 0 ? n_handle_modes * 2 : 64;
+        n_modes        = n_modes > (size_t)fd ? n_modes : (size_t)fd + 1;
+
+        unsigned char *grown = realloc(handle_modes, n_modes);
+        if (grown == NULL)
+            return;
+
+        memset(grown + n_handle_modes, O_RDONLY, n_modes - n_handle_modes);
+        handle_modes   = grown;
+        n_handle_modes = n_modes;
+    }
+
+    handle_modes[fd] = flags & O_ACCMODE;
+}
+
+static int _handle_mode(int fd)
+{
+    // A handle that could not be noted is treated as read-only
+    return (size_t)fd < n_handle_modes ? handle_modes[fd] : O_RDONLY;
+}
+
+static int _check_inline(const struct deffs_header *header, const struct FileKey *file_key,
+                         const char inline_buf[])
+{
+    // Inline payloads are small enough to check whole
+    unsigned char tag[FILE_KEY_TAG_LEN];
+    file_key_tag(file_key, FILE_KEY_TAG_INLINE, header->nonce, (const unsigned char *)inline_buf,
+                 header->payload_len, tag);
+
+    return CRYPTO_memcmp(tag, header->root, FILE_KEY_TAG_LEN) == 0 ? 0 : -EIO;
+}
+
+static int _change_inline(struct deffs_header *header, const struct FileKey *file_key,
+                          char inline_buf[], const char *buf, uint64_t from, uint64_t to)
+{
+    // An inline payload is encrypted whole under one nonce, so any change draws a new nonce and
+    // encrypts all of it again. Bytes between its old end and from become zeros, and so do the
+    // bytes from from to to without a buf
+    char plaintext[HEADER_INLINE_MAX];
+    uint64_t len = header->payload_len;
+
+    if (len > 0 && _check_inline(header, file_key, inline_buf) != 0)
+        return -EIO;
+
+    int res = file_key_crypt(file_key, (unsigned char *)inline_buf, (unsigned char *)plaintext,
+                             len, 0, header->nonce);
+    if (res != 0)
+        return res;
+
+    if (from > len)
+        memset(plaintext + len, 0, from - len);
+    if (buf != NULL)
+        memcpy(plaintext + from, buf, to - from);
+    else
+        memset(plaintext + from, 0, to - from);
+
+    res = file_key_nonces(&header->nonce, 1);
+    if (res != 0)
+        return res;
+
+    header->payload_len = to > len ? to : len;
+
+    return file_key_crypt(file_key, (unsigned char *)plaintext, (unsigned char *)inline_buf,
+                          header->payload_len, 0, header->nonce);
+}
+
+static int _shard_name(char hash[])
+{
+    // Shards are named at random. Their ciphertext is under random nonces, so naming them after
+    // it would be no different, and a shard forked off a snapshot has none of its own yet
+    unsigned char digest[HASH_LEN];
+    if (RAND_bytes(digest, sizeof(digest)) != 1)
+        return -EIO;
+
+    hash_hex(digest, HASH_LEN, hash);
+
+    return 0;
+}
+
+static int _new_file_key(const char path[], struct deffs_header *header, struct FileKey *file_key)
+{
+    // Draw a fresh file key under the cipher of the file's directory and name the file's shard
+    int res = generate_file_key(file_key);
+    if (res != 0)
+        return res;
+
+    file_key->cipher = cipher_policy_file(path);
+    header_set_cipher(header, file_key->cipher);
+
+    if ((res = _shard_name(header->hash)) != 0)
+        return res;
+
+    // Nothing is stored under it yet, so the file's tree is empty
+    unsigned char empty[FILE_KEY_TAG_LEN] = {0};
+    integrity_seal(file_key, empty, header->root);
+
+    // Split its key across the key targets
+    return keystore_store(header->hash, file_key);
+}
+
+static int _load_file_key(const struct deffs_header *header, struct FileKey *file_key)
+{
+    // The key comes from the key store, the cipher from the header
+    int res = keystore_load(header->hash, file_key);
+    if (res == 0)
+        file_key->cipher = header_cipher(header);
+
+    return res;
+}
+
+static int _name_empty_file(const char path[], struct deffs_header *header,
+                            struct FileKey *file_key)
+{
+    // Growing a file that was never written, it starts out as an empty inline payload
+    header->flags |= HEADER_FLAG_INLINE;
+
+    return _new_file_key(path, header, file_key);
+}
+
+static const char *_block_shard(const struct deffs_header *header, uint8_t state)
+{
+    return state >= BLOCK_BASE ? header->bases[state - BLOCK_BASE] : header->hash;
+}
+
+static int _write_blocks(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                         const char *plaintext, uint64_t first_block, uint64_t n_blocks)
+{
+    // Encrypt whole blocks into the file's own shard one window at a time, each under a nonce
+    // drawn for it, so no keystream is ever used twice. They are tagged straight from the
+    // window they were encrypted in and become data
+    if (n_blocks == 0)
+        return 0;
+
+    size_t per_window = stream_window_size / DEFFS_BLOCK_SIZE;
+    per_window        = n_blocks < per_window ? n_blocks : per_window;
+
+    char *ciphertext                            = bufpool_get(per_window * DEFFS_BLOCK_SIZE);
+    unsigned char (*nonces)[FILE_KEY_NONCE_LEN] = bufpool_get(per_window * FILE_KEY_NONCE_LEN);
+    unsigned char (*tags)[FILE_KEY_TAG_LEN]     = bufpool_get(per_window * FILE_KEY_TAG_LEN);
+    int res = ciphertext == NULL || nonces == NULL || tags == NULL ? -ENOMEM : 0;
+
+    size_t len;
+    for (uint64_t done = 0; res == 0 && done < n_blocks; done += len) {
+        uint64_t block = first_block + done;
+        len            = n_blocks - done < per_window ? n_blocks - done : per_window;
+
+        res = file_key_nonces(nonces, len);
+        if (res != 0)
+            break;
+
+        res = crypto_pool_crypt(file_key, plaintext + done * DEFFS_BLOCK_SIZE, ciphertext,
+                                len * DEFFS_BLOCK_SIZE, block * DEFFS_BLOCK_SIZE, nonces);
+        if (res == 0)
+            res = shard_pwrite(header->hash, ciphertext, len * DEFFS_BLOCK_SIZE,
+                               block * DEFFS_BLOCK_SIZE);
+
+        if (res == 0) {
+            crypto_pool_tag(file_key, ciphertext, DEFFS_BLOCK_SIZE, block, len, nonces, tags);
+            res = blockmap_set_tags(fd, block, len, nonces, tags);
+        }
+    }
+
+    if (res == 0)
+        res = blockmap_set(fd, first_block, n_blocks, BLOCK_DATA);
+
+    bufpool_put(ciphertext, per_window * DEFFS_BLOCK_SIZE);
+    bufpool_put(nonces, per_window * FILE_KEY_NONCE_LEN);
+    bufpool_put(tags, per_window * FILE_KEY_TAG_LEN);
+
+    return res;
+}
+
+static int _seal_range(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                       uint64_t start, uint64_t end)
+{
+    // Blocks were tagged as they were written, so only their paths to the root are rehashed
+    uint64_t first = block_of(start);
+    uint64_t last  = block_of(end - 1);
+
+    return integrity_rehash(fd, file_key, first, last - first + 1, header->root);
+}
+
+static int _seal_tail(int fd, struct deffs_header *header, const struct FileKey *file_key)
+{
+    // After the map was cut, the path from its new last block is the only one that changed
+    uint64_t n_blocks;
+    int res = blockmap_leaves(fd, &n_blocks);
+    if (res != 0)
+        return res;
+
+    if (n_blocks > 0)
+        return integrity_rehash(fd, file_key, n_blocks - 1, 1, header->root);
+
+    unsigned char empty[FILE_KEY_TAG_LEN] = {0};
+    integrity_seal(file_key, empty, header->root);
+
+    return 0;
+}
+
+static int _write_header(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                         const char inline_buf[])
+{
+    // Inline payloads are tagged whole, files in shards sealed their root as their tree changed
+    if (!(header->flags & HEADER_FLAG_INLINE))
+        return header_write(fd, header, NULL);
+
+    file_key_tag(file_key, FILE_KEY_TAG_INLINE, header->nonce, (const unsigned char *)inline_buf,
+                 header->payload_len, header->root);
+
+    return header_write(fd, header, inline_buf);
+}
+
+static int _promote(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                    char inline_buf[])
+{
+    // Move an inline payload into a shard. The rest of its last block is zeros, since every
+    // data block is backed in full
+    char plaintext[blocks_for(HEADER_INLINE_MAX) * DEFFS_BLOCK_SIZE];
+    uint64_t n_blocks = blocks_for(header->payload_len);
+
+    if (header->payload_len > 0 && _check_inline(header, file_key, inline_buf) != 0)
+        return -EIO;
+
+    memset(plaintext, 0, n_blocks * DEFFS_BLOCK_SIZE);
+    int res = file_key_crypt(file_key, (unsigned char *)inline_buf, (unsigned char *)plaintext,
+                             header->payload_len, 0, header->nonce);
+    if (res != 0)
+        return res;
+
+    // Snapshots of an inline file keep their own copy of the payload, so the new shard
+    // is not shared with them
+    header->flags &= ~(HEADER_FLAG_INLINE | HEADER_FLAG_SHARED);
+
+    // The shard is created empty, then its blocks are written
+    res = shard_write(header->hash, plaintext, 0);
+    if (res == 0)
+        res = _write_blocks(fd, header, file_key, plaintext, 0, n_blocks);
+    if (res == 0)
+        res = n_blocks > 0 ? integrity_rehash(fd, file_key, 0, n_blocks, header->root) :
+                             _seal_tail(fd, header, file_key);
+
+    return res;
+}
+
+static int _copy_blocks(const char from[], const char to[], uint64_t first_block,
+                        uint64_t n_blocks)
+{
+    // Ciphertext depends only on the file key and the block's nonce, which stays in the map,
+    // so blocks move between a file's shards without being decrypted
+    size_t window = stream_window_size;
+    char *buf     = bufpool_get(window);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    uint64_t start = first_block * DEFFS_BLOCK_SIZE;
+    uint64_t end   = (first_block + n_blocks) * DEFFS_BLOCK_SIZE;
+    int res        = 0;
+
+    for (uint64_t pos = start; res == 0 && pos < end; pos += window) {
+        size_t len = end - pos < window ? end - pos : window;
+
+        ssize_t n = shard_read(from, buf, len, pos);
+        if (n < 0)
+            res = n;
+        else if (n > 0)
+            res = shard_pwrite(to, buf, n, pos);
+    }
+
+    bufpool_put(buf, window);
+
+    return res;
+}
+
+static int _copy_state(int fd, const char from[], const char to[], uint64_t n_blocks,
+                       uint8_t state)
+{
+    // Copy every run of blocks in the given state
+    uint8_t states[256];
+
+    for (uint64_t block = 0; block < n_blocks; block += sizeof(states)) {
+        size_t len = n_blocks - block < sizeof(states) ? n_blocks - block : sizeof(states);
+
+        int res = blockmap_read(fd, block, len, states, NULL);
+        if (res != 0)
+            return res;
+
+        for (size_t i = 0; i < len;) {
+            size_t j = i;
+            while (j < len && (states[j] == state) == (states[i] == state))
+                j++;
+
+            if (states[i] == state) {
+                res = _copy_blocks(from, to, block + i, j - i);
+                if (res != 0)
+                    return res;
+            }
+
+            i = j;
+        }
+    }
+
+    return 0;
+}
+
+static int _detach(int fd, struct deffs_header *header, const struct FileKey *file_key)
+{
+    // A file shared with a snapshot moves onto a new shard before its first change. Its
+    // blocks stay where they are and are read from the old shard, which becomes a base
+    if (!(header->flags & HEADER_FLAG_SHARED) || header->flags & HEADER_FLAG_INLINE)
+        return 0;
+
+    header->flags &= ~HEADER_FLAG_SHARED;
+
+    int refs = shard_refs(header->hash);
+    if (refs < 0)
+        return refs;
+    if (refs == 1) // Every snapshot naming it is gone
+        return header_write(fd, header, NULL);
+
+    // The new shard keeps the file key. Every block written to it draws its own nonce, so it
+    // never repeats a keystream the old shard holds
+    char hash[SHARD_FN_LEN + 1];
+    int res = _shard_name(hash);
+    if (res != 0)
+        return res;
+
+    res = keystore_store(hash, file_key);
+    if (res != 0)
+        return res;
+
+    uint8_t remap[256];
+    for (int state = 0; state < 256; state++) {
+        remap[state] = state;
+    }
+
+    uint64_t n_blocks = blocks_for(header->size);
+    char dropped[SHARD_FN_LEN + 1] = "";
+
+    if (header->n_bases == HEADER_MAX_BASES) {
+        // Out of bases, so the blocks still read from the oldest one are copied instead
+        res = _copy_state(fd, header->bases[0], hash, n_blocks, BLOCK_BASE);
+        if (res != 0)
+            return res;
+
+        remap[BLOCK_BASE] = BLOCK_DATA;
+        for (int i = 1; i < HEADER_MAX_BASES; i++) {
+            remap[BLOCK_BASE + i] = BLOCK_BASE + i - 1;
+        }
+
+        strcpy(dropped, header->bases[0]);
+        memmove(header->bases[0], header->bases[1],
+                (HEADER_MAX_BASES - 1) * sizeof(header->bases[0]));
+        header->n_bases--;
+    }
+
+    remap[BLOCK_DATA] = BLOCK_BASE + header->n_bases;
+    res               = blockmap_remap(fd, n_blocks, remap);
+    if (res != 0)
+        return res;
+
+    strcpy(header->bases[header->n_bases++], header->hash);
+    strcpy(header->hash, hash);
+
+    res = header_write(fd, header, NULL);
+    if (res == 0 && dropped[0] != '\0')
+        res = snapshot_release_hash(dropped);
+
+    return res;
+}
+
+static ssize_t _read_blocks(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                            char *buf, size_t len, off_t offset)
+{
+    // Runs of data blocks are read whole and checked against the root through their tags before
+    // the requested part of them is decrypted. Holes are zeros and cost nothing
+    uint8_t states[256];
+    unsigned char nonces[256][FILE_KEY_NONCE_LEN];
+    unsigned char tags[256][FILE_KEY_TAG_LEN];
+    size_t batch = stream_window_size / DEFFS_BLOCK_SIZE < sizeof(states) ?
+                       stream_window_size / DEFFS_BLOCK_SIZE :
+                       sizeof(states);
+
+    char *ciphertext = bufpool_get(batch * DEFFS_BLOCK_SIZE);
+    if (ciphertext == NULL)
+        return -ENOMEM;
+
+    uint64_t end        = offset + len;
+    uint64_t last_block = block_of(end - 1);
+    ssize_t res         = 0;
+
+    for (uint64_t first_block = block_of(offset); res == 0 && first_block <= last_block;
+         first_block += batch) {
+        size_t n_blocks =
+            last_block - first_block + 1 < batch ? last_block - first_block + 1 : batch;
+
+        res = blockmap_read(fd, first_block, n_blocks, states, nonces);
+
+        for (size_t i = 0, j; res == 0 && i < n_blocks; i = j) {
+            for (j = i; j < n_blocks && states[j] == states[i]; j++)
+                ;
+
+            if (states[i] != BLOCK_DATA && states[i] < BLOCK_BASE) {
+                memset(tags[i], 0, (j - i) * FILE_KEY_TAG_LEN);
+                continue;
+            }
+
+            char *run      = ciphertext + i * DEFFS_BLOCK_SIZE;
+            size_t run_len = (j - i) * DEFFS_BLOCK_SIZE;
+
+            ssize_t n = shard_read(_block_shard(header, states[i]), run, run_len,
+                                   (first_block + i) * DEFFS_BLOCK_SIZE);
+            if (n < 0) {
+                res = n;
+                break;
+            }
+
+            memset(run + n, 0, run_len - n);
+            crypto_pool_tag(file_key, run, DEFFS_BLOCK_SIZE, first_block + i, j - i, &nonces[i],
+                            &tags[i]);
+        }
+
+        if (res == 0) {
+            res = integrity_verify(fd, file_key, first_block, n_blocks, tags, header->root);
+            if (res == -EIO)
+                printf("Shard %s failed verification\n", header->hash);
+        }
+
+        for (size_t i = 0, j; res == 0 && i < n_blocks; i = j) {
+            for (j = i; j < n_blocks && states[j] == states[i]; j++)
+                ;
+
+            uint64_t run_start = (first_block + i) * DEFFS_BLOCK_SIZE;
+            uint64_t run_end   = (first_block + j) * DEFFS_BLOCK_SIZE;
+            run_start          = run_start > (uint64_t)offset ? run_start : (uint64_t)offset;
+            run_end            = run_end < end ? run_end : end;
+
+            char *dst = buf + (run_start - offset);
+
+            if (states[i] == BLOCK_DATA || states[i] >= BLOCK_BASE)
+                res = crypto_pool_crypt(
+                    file_key, ciphertext + (run_start - first_block * DEFFS_BLOCK_SIZE), dst,
+                    run_end - run_start, run_start, &nonces[block_of(run_start) - first_block]);
+            else
+                memset(dst, 0, run_end - run_start);
+        }
+    }
+
+    bufpool_put(ciphertext, batch * DEFFS_BLOCK_SIZE);
+
+    return res < 0 ? res : (ssize_t)len;
+}
+
+static int _merge_block(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                        const char *buf, uint64_t from, uint64_t to, char block_buf[])
+{
+    // Fill block_buf with the block holding from as it reads now, checked against the root, with
+    // the bytes from from to to taken from buf, or zeros without one
+    uint64_t start = block_of(from) * DEFFS_BLOCK_SIZE;
+
+    ssize_t res = _read_blocks(fd, header, file_key, block_buf, DEFFS_BLOCK_SIZE, start);
+    if (res < 0)
+        return res;
+
+    if (buf != NULL)
+        memcpy(block_buf + (from - start), buf, to - from);
+    else
+        memset(block_buf + (from - start), 0, to - from);
+
+    return 0;
+}
+
+static int _write_range(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                        const char *buf, size_t size, off_t offset)
+{
+    // Blocks are always encrypted whole. Those the write covers whole come straight from buf,
+    // the ones at either end it covers only in part are merged with what they hold first. Both
+    // are read before anything is written, while the root still matches the map
+    uint64_t end        = offset + size;
+    uint64_t first      = block_of(offset);
+    uint64_t last       = block_of(end - 1);
+    uint64_t head_end   = first == last ? end : (first + 1) * DEFFS_BLOCK_SIZE;
+    uint64_t tail_start = last * DEFFS_BLOCK_SIZE;
+    int head            = offset % DEFFS_BLOCK_SIZE != 0 || head_end % DEFFS_BLOCK_SIZE != 0;
+    int tail            = last != first && end % DEFFS_BLOCK_SIZE != 0;
+
+    char *edges = bufpool_get(2 * DEFFS_BLOCK_SIZE);
+    if (edges == NULL)
+        return -ENOMEM;
+
+    int res = 0;
+
+    if (head)
+        res = _merge_block(fd, header, file_key, buf, offset, head_end, edges);
+    if (res == 0 && tail)
+        res = _merge_block(fd, header, file_key, buf + (tail_start - offset), tail_start, end,
+                           edges + DEFFS_BLOCK_SIZE);
+
+    uint64_t whole_first = first + head;
+    uint64_t whole_end   = last + 1 - tail;
+
+    if (res == 0 && head)
+        res = _write_blocks(fd, header, file_key, edges, first, 1);
+    if (res == 0 && whole_end > whole_first)
+        res = _write_blocks(fd, header, file_key, buf + (whole_first * DEFFS_BLOCK_SIZE - offset),
+                            whole_first, whole_end - whole_first);
+    if (res == 0 && tail)
+        res = _write_blocks(fd, header, file_key, edges + DEFFS_BLOCK_SIZE, last, 1);
+
+    bufpool_put(edges, 2 * DEFFS_BLOCK_SIZE);
+
+    return res;
+}
+
+static int _preallocate(int fd, struct deffs_header *header, uint64_t start, uint64_t end)
+{
+    // Reserve whole blocks in the shard and mark the ones not holding data yet as allocated
+    uint8_t states[256];
+    uint64_t first_block = block_of(start);
+    uint64_t end_block   = blocks_for(end);
+
+    for (uint64_t block = first_block; block < end_block; block += sizeof(states)) {
+        size_t n_blocks = end_block - block < sizeof(states) ? end_block - block : sizeof(states);
+
+        int res = blockmap_read(fd, block, n_blocks, states, NULL);
+        if (res != 0)
+            return res;
+
+        for (size_t i = 0; i < n_blocks;) {
+            size_t j = i;
+            while (j < n_blocks && (states[j] == BLOCK_HOLE) == (states[i] == BLOCK_HOLE))
+                j++;
+
+            if (states[i] == BLOCK_HOLE) {
+                res = blockmap_set(fd, block + i, j - i, BLOCK_ALLOCATED);
+                if (res != 0)
+                    return res;
+            }
+
+            i = j;
+        }
+    }
+
+    return shard_allocate(header->hash, first_block * DEFFS_BLOCK_SIZE,
+                          (end_block - first_block) * DEFFS_BLOCK_SIZE);
+}
+
+static int _zero_if_data(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                         uint64_t from, uint64_t to)
+{
+    // Part of a block is punched by writing the block again with zeros there, if it holds data.
+    // Its path is rehashed at once, so the root matches the map for the next block checked
+    uint64_t block = block_of(from);
+    uint8_t state;
+    int res = blockmap_read(fd, block, 1, &state, NULL);
+    if (res != 0 || (state != BLOCK_DATA && state < BLOCK_BASE))
+        return res;
+
+    char block_buf[DEFFS_BLOCK_SIZE];
+    res = _merge_block(fd, header, file_key, NULL, from, to, block_buf);
+    if (res == 0)
+        res = _write_blocks(fd, header, file_key, block_buf, block, 1);
+    if (res == 0)
+        res = integrity_rehash(fd, file_key, block, 1, header->root);
+
+    return res;
+}
+
+static int _punch_hole(int fd, struct deffs_header *header, const struct FileKey *file_key,
+                       char inline_buf[], uint64_t start, uint64_t end)
+{
+    if (start >= end)
+        return 0;
+
+    if (header->flags & HEADER_FLAG_INLINE)
+        return _change_inline(header, file_key, inline_buf, NULL, start, end);
+
+    // Whole blocks become holes and give their space back, partial blocks at either end
+    // are zeroed in place
+    uint64_t full_start = blocks_for(start) * DEFFS_BLOCK_SIZE;
+    uint64_t full_end   = block_of(end) * DEFFS_BLOCK_SIZE;
+    uint64_t head_end   = full_start < end ? full_start : end;
+    uint64_t tail_start = full_end > head_end ? full_end : head_end;
+
+    int res = 0;
+    if (start < head_end)
+        res = _zero_if_data(fd, header, file_key, start, head_end);
+    if (res == 0 && tail_start < end)
+        res = _zero_if_data(fd, header, file_key, tail_start, end);
+    if (res == 0 && full_start < full_end)
+        res = blockmap_set(fd, block_of(full_start), block_of(full_end) - block_of(full_start),
+                           BLOCK_HOLE);
+    if (res == 0 && full_start < full_end)
+        res = shard_punch(header->hash, full_start, full_end - full_start);
+    if (res == 0)
+        res = _seal_range(fd, header, file_key, start, end);
+
+    return res;
+}
+
+static int _truncate_fd(const char path[], int fd, off_t size)
+{
+    int res;
+
+    struct deffs_header header;
+    char inline_buf[HEADER_INLINE_MAX];
+    int header_res = header_read(fd, &header, inline_buf);
+    if (header_res < 0 && header_res != -ENODATA)
+        return header_res;
+
+    if (header_res == -ENODATA && size == 0)
+        return 0;
+
+    struct FileKey file_key;
+
+    if (header_res == -ENODATA) {
+        res = _name_empty_file(path, &header, &file_key);
+        if (res != 0)
+            return res;
+    } else {
+        res = _load_file_key(&header, &file_key);
+        if (res != 0)
+            return res;
+    }
+
+    if (header.flags & HEADER_FLAG_INLINE && (uint64_t)size <= inline_threshold) {
+        // Inline payloads are small, so extending them simply stores the zeros. Cutting one
+        // short leaves the rest of its ciphertext as it was
+        if ((uint64_t)size > header.size)
+            res = _change_inline(&header, &file_key, inline_buf, NULL, header.size, size);
+        if (res != 0)
+            return res;
+        header.payload_len = size;
+    } else {
+        if (header.flags & HEADER_FLAG_INLINE) {
+            res = _promote(fd, &header, &file_key, inline_buf);
+            if (res != 0)
+                return res;
+        }
+
+        if ((uint64_t)size < header.size) {
+            // Whole blocks past the new end are dropped, only a partial tail block is
+            // touched, so that extending the file again reads zeros there
+            res = _detach(fd, &header, &file_key);
+            if (res == 0 && size % DEFFS_BLOCK_SIZE != 0)
+                res = _zero_if_data(fd, &header, &file_key, size,
+                                    blocks_for(size) * DEFFS_BLOCK_SIZE);
+            if (res == 0)
+                res = blockmap_truncate(fd, blocks_for(size));
+            if (res == 0)
+                res = _seal_tail(fd, &header, &file_key);
+            if (res == 0)
+                res = shard_truncate(header.hash, blocks_for(size) * DEFFS_BLOCK_SIZE);
+            if (res != 0)
+                return res;
+        }
+
+        // Growing a file in a shard leaves holes, which need neither storage nor encryption
+    }
+
+    header.size = size;
+
+    return _write_header(fd, &header, &file_key, inline_buf);
+}
+
+static int _create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     int fd;
 
+    if (snapshot_frozen(path))
+        return -EROFS;
+
     // Copy path to non-constant copy for fopen
     char nonconst_path[strlen(storepoint) + strlen(path) + 1];
     strcpy(nonconst_path, path);
     strcpy(nonconst_path, deffs_path_prepend(nonconst_path, storepoint));
 
-    fd = open(nonconst_path, fi->flags, mode);
+    fd = _open_header(nonconst_path, fi->flags, mode);
     if (fd == -1)
         return -errno;
 
     fi->fh = fd;
+    _note_handle(fd, fi->flags);
 
-    FLAG_OPENED_EMPTY_FILE = 1;
+    struct deffs_header header;
+    attr_index_fd(path, fd, header_read(fd, &header, NULL) == 0 ? header.size : 0);
+    attr_index_parent(path);
 
     return 0;
 }
 
-int deffs_open(const char *path, struct fuse_file_info *fi)
+int deffs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    attr_lease_parent(path, LEASE_WRITE);
+    int res = _create(path, mode, fi);
+    if (res == 0)
+        pagecache_open(path, fi->fh, fi);
+    lease_end();
+
+    return res;
+}
+
+static int _open(const char *path, struct fuse_file_info *fi)
 {
     int fd;
 
@@ -42,14 +739,39 @@ int deffs_open(const char *path, struct fuse_file_info *fi)
     strcpy(nonconst_path, path);
     strcpy(nonconst_path, deffs_path_prepend(nonconst_path, storepoint));
 
-    fd = open(nonconst_path, fi->flags);
+    // Snapshots are read-only
+    if (snapshot_frozen(path) && ((fi->flags & O_ACCMODE) != O_RDONLY || fi->flags & O_TRUNC))
+        return -EROFS;
+
+    fd = _open_header(nonconst_path, fi->flags, 0);
     if (fd == -1)
         return -errno;
 
     fi->fh = fd;
+    _note_handle(fd, fi->flags);
+
+    // Reconstruct the file key now so reads and writes find it cached
+    struct deffs_header header;
+    struct FileKey file_key;
+    if (header_read(fd, &header, NULL) == 0)
+        _load_file_key(&header, &file_key);
+
     return 0;
 }
 
+int deffs_open(const char *path, struct fuse_file_info *fi)
+{
+    int writing = (fi->flags & O_ACCMODE) != O_RDONLY || fi->flags & O_TRUNC;
+    attr_lease(path, writing ? LEASE_WRITE : LEASE_READ);
+    int res = _open(path, fi);
+
+    if (res == 0)
+        pagecache_open(path, fi->fh, fi);
+    lease_end();
+
+    return res;
+}
+
 int deffs_readlink(const char *path, char *buf, size_t size)
 {
     int res;
@@ -62,13 +784,23 @@ int deffs_readlink(const char *path, char *buf, size_t size)
     return 0;
 }
 
-int deffs_opendir(const char *path, struct fuse_file_info *fi)
+static int _opendir(const char *path, struct fuse_file_info *fi)
 {
     int res;
     struct deffs_dirp *d = malloc(sizeof(struct deffs_dirp));
     if (d == NULL)
         return -ENOMEM;
 
+    d->offset = 0;
+    d->entry  = NULL;
+    d->dp     = NULL;
+
+    // Directories whose children are all indexed are listed from the index alone
+    if (attr_complete(path)) {
+        fi->fh = (unsigned long)d;
+        return 0;
+    }
+
     // Copy path to non-constant copy for fopen
     char nonconst_path[strlen(storepoint) + strlen(path) + 1];
     strcpy(nonconst_path, path);
@@ -80,14 +812,21 @@ int deffs_opendir(const char *path, struct fuse_file_info *fi)
         free(d);
         return res;
     }
-    d->offset = 0;
-    d->entry  = NULL;
 
     fi->fh = (unsigned long)d;
     return 0;
 }
 
-int deffs_mknod(const char *path, mode_t mode, dev_t rdev)
+int deffs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    attr_lease(path, LEASE_READ);
+    int res = _opendir(path, fi);
+    lease_end();
+
+    return res;
+}
+
+static int _mknod(const char *path, mode_t mode, dev_t rdev)
 {
     int res;
 
@@ -106,10 +845,42 @@ int deffs_mknod(const char *path, mode_t mode, dev_t rdev)
     return 0;
 }
 
-int deffs_mkdir(const char *path, mode_t mode)
+int deffs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    attr_lease_parent(path, LEASE_WRITE);
+    int res = _mknod(path, mode, rdev);
+    lease_end();
+
+    return res;
+}
+
+static int _mkdir(const char *path, mode_t mode)
 {
     int res;
 
+    // Making <dir>/.snapshots/<name> takes a snapshot of <dir>
+    if (snapshot_root(path) >= 0) {
+        scrub_pause();
+        res = snapshot_create(path);
+        scrub_resume();
+
+        reclaim_note_move();
+
+        // Sharing shards rewrote the header records under <dir>, which may also have gained its
+        // .snapshots, so everything indexed there is looked up again when next asked for
+        char dir[strlen(path) + 2];
+        sprintf(dir, "%.*s", snapshot_root(path), path);
+        if (dir[0] == '\0')
+            strcpy(dir, "/");
+
+        attr_forget(dir);
+        attr_index(dir, NULL);
+
+        return res;
+    }
+    if (snapshot_frozen(path))
+        return -EROFS;
+
     // Copy path to non-constant copy for fopen
     char nonconst_path[strlen(storepoint) + strlen(path) + 1];
     strcpy(nonconst_path, path);
@@ -119,74 +890,125 @@ int deffs_mkdir(const char *path, mode_t mode)
     if (res == -1)
         return -errno;
 
+    attr_index_new_dir(path);
+    attr_index_parent(path);
+
     return 0;
 }
 
-int deffs_unlink(const char *path)
+int deffs_mkdir(const char *path, mode_t mode)
+{
+    attr_lease_parent(path, LEASE_WRITE);
+    int res = _mkdir(path, mode);
+    lease_end();
+
+    return res;
+}
+
+static int _unlink(const char *path)
 {
     int res;
 
+    if (snapshot_frozen(path))
+        return -EROFS;
+
     // Copy path to non-constant copy for fopen
     char nonconst_path[strlen(storepoint) + strlen(path) + 1];
     strcpy(nonconst_path, path);
     strcpy(nonconst_path, deffs_path_prepend(nonconst_path, storepoint));
 
-    // Open header file
-    FILE *header_pointer;
-    header_pointer = fopen(nonconst_path, "r+");
-    if (header_pointer == NULL) {
-        printf("Could not open file %s for encrypting, %s\n", nonconst_path, path);
-        exit(1);
-    }
-
-    // Get header size
-    fseek(header_pointer, 0, SEEK_END);
-    int header_size = ftell(header_pointer);
-    fseek(header_pointer, 0, SEEK_SET);
-
-    // Read hash from header file
-    char hash_buf[SHARD_FN_LEN];
-    fread(hash_buf, SHARD_FN_LEN, 1, header_pointer);
-    hash_buf[SHARD_FN_LEN] = '\0';
-
-    // Construct shard filepath from hash
-    char shard_path[strlen(shardpoint) + SHARD_FN_LEN + 7];
-    strcpy(shard_path, shardpoint);
-    strcat(shard_path, hash_buf);
-    strcat(shard_path, ".shard");
-
-    // Close header and unlink header and shard
-    fclose(header_pointer);
-    res = unlink(nonconst_path) + unlink(shard_path);
-    if (res < 0)
-        return -errno;
+    // Read hash from header record. Symbolic links name no shards, and neither does a name
+    // of a file that has others
+    struct deffs_header header;
+    int header_res = -ENOENT;
 
-    return 0;
+    int fd = open(nonconst_path, O_RDONLY | O_NOFOLLOW);
+    if (fd != -1) {
+        struct stat st;
+        header_res = fstat(fd, &st) == 0 && st.st_nlink == 1 ? header_read(fd, &header, NULL) :
+                                                               -EMLINK;
+        close(fd);
+    }
+
+    // Unlink header
+    res = unlink(nonconst_path) == -1 ? -errno : 0;
+
+    // Files that were never written have neither key shares nor a shard. The shards are released
+    // in the background, and only once no snapshot names them either
+    if (res == 0 && header_res == 0)
+        res = reclaim_queue(&header);
+
+    // The name may be gone even if its shards could not be queued
+    attr_index(path, NULL);
+    attr_index_parent(path);
+
+    return res;
 }
 
-int deffs_rmdir(const char *path)
+int deffs_unlink(const char *path)
+{
+    attr_lease_parent(path, LEASE_WRITE);
+    int res = _unlink(path);
+    lease_end();
+
+    return res;
+}
+
+static int _rmdir(const char *path)
 {
     int res;
 
+    if (snapshot_root(path) >= 0) {
+        scrub_pause();
+        res = snapshot_delete(path);
+        scrub_resume();
+
+        // Whatever could not be removed stays indexed
+        attr_index(path, NULL);
+        attr_index_parent(path);
+
+        return res;
+    }
+    if (snapshot_pinned(path))
+        return -EROFS;
+
     // Copy path to non-constant copy for fopen
     char nonconst_path[strlen(storepoint) + strlen(path) + 1];
     strcpy(nonconst_path, path);
     strcpy(nonconst_path, deffs_path_prepend(nonconst_path, storepoint));
 
-    res = rmdir(path);
+    res = rmdir(nonconst_path);
     if (res == -1)
         return -errno;
 
+    replica_forget_levels();
+    pagecache_forget_modes();
+    cipher_policy_forget();
+    attr_forget(path);
+    attr_index_parent(path);
+
     return 0;
 }
 
-int deffs_symlink(const char *from, const char *to)
+int deffs_rmdir(const char *path)
+{
+    attr_lease_parent(path, LEASE_WRITE);
+    int res = _rmdir(path);
+    lease_end();
+
+    return res;
+}
+
+static int _symlink(const char *from, const char *to)
 {
     int res;
 
+    if (snapshot_frozen(to))
+        return -EROFS;
+
     // Copy from to non-constant copy for fopen
     char nonconst_from[strlen(storepoint) + strlen(from) + 1];
-    strcpy(nonconst_from, nonconst_from);
+    strcpy(nonconst_from, from);
     strcpy(nonconst_from, deffs_path_prepend(nonconst_from, storepoint));
 
     // Copy to to non-constant copy for fopen
@@ -198,16 +1020,31 @@ int deffs_symlink(const char *from, const char *to)
     if (res == -1)
         return -errno;
 
+    attr_index(to, NULL);
+    attr_index_parent(to);
+
     return 0;
 }
 
-int deffs_rename(const char *from, const char *to)
+int deffs_symlink(const char *from, const char *to)
+{
+    attr_lease_parent(to, LEASE_WRITE);
+    int res = _symlink(from, to);
+    lease_end();
+
+    return res;
+}
+
+static int _rename(const char *from, const char *to)
 {
     int res;
 
+    if (snapshot_pinned(from) || snapshot_pinned(to))
+        return -EROFS;
+
     // Copy from to non-constant copy for fopen
     char nonconst_from[strlen(storepoint) + strlen(from) + 1];
-    strcpy(nonconst_from, nonconst_from);
+    strcpy(nonconst_from, from);
     strcpy(nonconst_from, deffs_path_prepend(nonconst_from, storepoint));
 
     // Copy to to non-constant copy for fopen
@@ -219,16 +1056,39 @@ int deffs_rename(const char *from, const char *to)
     if (res == -1)
         return -errno;
 
+    // Everything indexed under from moves with it, replacing whatever to was. Files below from
+    // may now take their durability level and cache mode from elsewhere
+    reclaim_note_move();
+    replica_forget_levels();
+    pagecache_forget_modes();
+    cipher_policy_forget();
+    attr_move(from, to);
+    attr_index_parent(from);
+    attr_index_parent(to);
+
     return 0;
 }
 
-int deffs_link(const char *from, const char *to)
+int deffs_rename(const char *from, const char *to)
+{
+    attr_lease_parent(from, LEASE_WRITE);
+    attr_lease_parent(to, LEASE_WRITE);
+    int res = _rename(from, to);
+    lease_end();
+
+    return res;
+}
+
+static int _link(const char *from, const char *to)
 {
     int res;
 
+    if (snapshot_pinned(from) || snapshot_pinned(to))
+        return -EROFS;
+
     // Copy from to non-constant copy for fopen
     char nonconst_from[strlen(storepoint) + strlen(from) + 1];
-    strcpy(nonconst_from, nonconst_from);
+    strcpy(nonconst_from, from);
     strcpy(nonconst_from, deffs_path_prepend(nonconst_from, storepoint));
 
     // Copy to to non-constant copy for fopen
@@ -240,13 +1100,33 @@ int deffs_link(const char *from, const char *to)
     if (res == -1)
         return -errno;
 
+    // Both names now share a link count
+    reclaim_note_move();
+    attr_index(from, NULL);
+    attr_index(to, NULL);
+    attr_index_parent(to);
+
     return 0;
 }
 
+int deffs_link(const char *from, const char *to)
+{
+    attr_lease(from, LEASE_WRITE);
+    attr_lease_parent(to, LEASE_WRITE);
+    int res = _link(from, to);
+    lease_end();
+
+    return res;
+}
+
 int deffs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     int res;
 
+    // Files read after their last name was removed, such as through a mapping, have no path
+    if (path == NULL)
+        path = "";
+
     // Copy path to non-constant copy for fopen
     char nonconst_path[strlen(storepoint) + strlen(path) + 1];
     strcpy(nonconst_path, path);
@@ -257,67 +1137,75 @@ int deffs_read(const char *path, char *buf, size_t size, off_t offset, struct fu
         if (res == -1)
             res = -errno;
     } else {
-        // Open header file
-        FILE *header_pointer;
-        header_pointer = fopen(nonconst_path, "r");
-        if (header_pointer == NULL) {
-            printf("Could not open file %s for decrypting\n", nonconst_path);
-            exit(1);
+        // Read header record, along with the payload if it is stored inline
+        struct deffs_header header;
+        char inline_buf[HEADER_INLINE_MAX];
+        res = header_read(fi->fh, &header, inline_buf);
+        if (res == -ENODATA)
+            return 0;
+        if (res < 0) {
+            printf("Cannot trace corresponding file shard for file %s\n", nonconst_path);
+            return res;
         }
 
-        // Get header size
-        fseek(header_pointer, 0, SEEK_END);
-        int header_size = ftell(header_pointer);
-        fseek(header_pointer, 0, SEEK_SET);
-        if (header_size <= 0) {
-            printf("Cannot trace corresponding file shard for file %s", nonconst_path);
-            exit(1);
+        if ((uint64_t)offset >= header.size)
+            return 0;
+
+        // Reconstruct the file key, usually straight from the key cache
+        struct FileKey file_key;
+        res = _load_file_key(&header, &file_key);
+        if (res != 0) {
+            printf("Could not reconstruct key of %s\n", nonconst_path);
+            return res;
         }
 
-        // Read hash from header file
-        char hash_buf[SHARD_FN_LEN + 1];
-        fread(hash_buf, SHARD_FN_LEN, 1, header_pointer);
-        hash_buf[SHARD_FN_LEN] = '\0';
+        // Only the requested range is read and decrypted, straight into the caller's buffer
+        size_t len = header.size - offset < size ? header.size - offset : size;
 
-        fclose(header_pointer);
+        if (header.flags & HEADER_FLAG_INLINE) {
+            if (_check_inline(&header, &file_key, inline_buf) != 0) {
+                printf("Inline payload of %s failed verification\n", nonconst_path);
+                return -EIO;
+            }
 
-        // Construct shard filepath from hash
-        char shard_path[strlen(shardpoint) + SHARD_FN_LEN + 7];
-        strcpy(shard_path, shardpoint);
-        strcat(shard_path, hash_buf);
-        strcat(shard_path, ".shard");
+            res = file_key_crypt(&file_key, (unsigned char *)inline_buf + offset,
+                                 (unsigned char *)buf, len, offset, header.nonce);
+            if (res == 0)
+                res = len;
+        } else {
+            res = _read_blocks(fi->fh, &header, &file_key, buf, len, offset);
+            if (res < 0 && res != -EIO)
+                printf("Could not find shard %s for file %s\n", header.hash, nonconst_path);
+        }
+    }
 
-        // Open shard file
-        FILE *shard_pointer;
-        shard_pointer = fopen(shard_path, "rw");
+    return res;
+}
 
-        // Get shard size
-        fseek(shard_pointer, 0, SEEK_END);
-        int shard_size = ftell(shard_pointer);
-        fseek(shard_pointer, 0, SEEK_SET);
+struct list_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
 
-        // Read shard metadata
-        char key[SHARD_KEY_LEN];
-        fread(key, SHARD_KEY_LEN, 1, shard_pointer);
+static int _list_child(const char name[], const struct stat *st, uint32_t flags, void *ctx)
+{
+    struct list_ctx *list = ctx;
 
-        // Read shard data
-        char ciphertext_buf[shard_size - SHARD_KEY_LEN];
-        fread(ciphertext_buf, shard_size - SHARD_KEY_LEN, 1, shard_pointer);
+    (void)flags;
 
-        fclose(shard_pointer);
+    return list->filler(list->buf, name, st, 0);
+}
 
-        // Decrypt shard
-        struct EncryptionData *plain = get_plaintext(ciphertext_buf, key);
+static int _list(const char path[], void *buf, fuse_fill_dir_t filler)
+{
+    struct list_ctx list = {buf, filler};
 
-        // Only read the requested data
-        char *sub_buf = malloc(size);
-        strncpy(sub_buf, plain->plaintext + offset, size);
-        strcpy(buf, sub_buf);
+    if (filler(buf, ".", NULL, 0) || filler(buf, "..", NULL, 0))
+        return 0;
 
-        res = strlen(buf);
-    }
+    int res = metastore_list(path, _list_child, &list);
 
-    return res;
+    return res < 0 ? res : 0;
 }
 
 int deffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
@@ -325,7 +1213,15 @@ int deffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 {
     struct deffs_dirp *d = get_dirp(fi);
 
-    (void)path;
+    // The first listing of a directory indexes it, and every listing after is served from there
+    if (d->dp != NULL && offset == 0 && path != NULL && attr_index_dir(path, d->dp) == 0) {
+        closedir(d->dp);
+        d->dp = NULL;
+    }
+
+    if (d->dp == NULL)
+        return path == NULL ? 0 : _list(path, buf, filler);
+
     if (offset != d->offset) {
         seekdir(d->dp, offset);
         d->entry  = NULL;
@@ -356,149 +1252,108 @@ int deffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
     return 0;
 }
 
-int deffs_write(const char *path, const char *buf, size_t size, off_t offset,
-                struct fuse_file_info *fi)
+static int _write(const char *path, const char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi)
 {
     int res;
 
-    // Copy path to non-constant copy for fopen
-    char nonconst_path[strlen(storepoint) + strlen(path) + 1];
-    strcpy(nonconst_path, path);
-    strcpy(nonconst_path, deffs_path_prepend(nonconst_path, storepoint));
-
     // umask so that only the creator can rwx their shards
     umask(007);
 
-    // Open header file
-    FILE *header_pointer;
-    header_pointer = fopen(nonconst_path, "r+");
-    if (header_pointer == NULL) {
-        printf("Could not open file %s for encrypting, %s\n", nonconst_path, path);
-        exit(1);
-    }
-
-    // Get header size
-    fseek(header_pointer, 0, SEEK_END);
-    int header_size = ftell(header_pointer);
-    fseek(header_pointer, 0, SEEK_SET);
-
-    if (FLAG_OPENED_EMPTY_FILE == 0) { // Not empty
-        // Read hash from header file
-        char hash_buf[SHARD_FN_LEN];
-        fread(hash_buf, SHARD_FN_LEN, 1, header_pointer);
-
-        // Construct shard filepath from hash
-        char shard_path[strlen(shardpoint) + SHARD_FN_LEN + 7];
-        strcpy(shard_path, shardpoint);
-        strcat(shard_path, hash_buf);
-        strcat(shard_path, ".shard");
-
-        // Open shard file
-        FILE *shard_pointer;
-        shard_pointer = fopen(shard_path, "r+");
-
-        // Get shard size
-        fseek(shard_pointer, 0, SEEK_END);
-        int shard_size = ftell(shard_pointer);
-        fseek(shard_pointer, 0, SEEK_SET);
-
-        // Read shard metadata
-        char key_buf[SHARD_KEY_LEN];
-        fread(key_buf, SHARD_KEY_LEN, 1, shard_pointer);
-        key_buf[SHARD_KEY_LEN] = '\0';
-
-        // Read shard data
-        char ciphertext_buf[shard_size - SHARD_KEY_LEN - 1];
-        fread(ciphertext_buf, shard_size - SHARD_KEY_LEN, 1, shard_pointer);
-        ciphertext_buf[shard_size - SHARD_KEY_LEN - 1] = '\0';
-
-        // Erase shard data
-        fseek(shard_pointer, 0, SEEK_SET);
-        fflush(shard_pointer);
-        ftruncate(fileno(shard_pointer), 0);
-
-        // Decrypt shard
-        char *plaintext_buf          = malloc(strlen(ciphertext_buf));
-        struct EncryptionData *plain = get_plaintext(ciphertext_buf, key_buf);
-        strcpy(plaintext_buf, plain->plaintext);
-
-        // Modify data
-        if (offset == 0) {
-            plaintext_buf = buf;
-        } else {
-            if (offset + strlen(buf) > strlen(plaintext_buf)) {
-                int len       = offset + strlen(buf) - strlen(plaintext_buf);
-                plaintext_buf = (char *)realloc(plaintext_buf, offset + strlen(buf));
-            }
-            for (int i = offset; i < offset + strlen(buf); i++) {
-                plaintext_buf[i] = buf[i - offset];
-            }
-        }
+    // Read header record, along with the payload if it is stored inline
+    struct deffs_header header;
+    char inline_buf[HEADER_INLINE_MAX];
+    int header_res = header_read(fi->fh, &header, inline_buf);
+    if (header_res < 0 && header_res != -ENODATA) {
+        printf("Could not read header of %s for encrypting\n", path);
+        return header_res;
+    }
 
-        // Re-encrypt modified data
-        struct EncryptionData *reencrypted = get_ciphertext(plaintext_buf);
+    // An empty first write leaves a file that was never written without a key or header
+    if (header_res == -ENODATA && size == 0)
+        return 0;
 
-        fseek(shard_pointer, 0, SEEK_END);
-        shard_size = ftell(shard_pointer);
-        fseek(shard_pointer, 0, SEEK_SET);
+    struct FileKey file_key;
+    uint64_t old_size = 0;
 
-        // Write metadata
-        int n = fwrite(reencrypted->key, 1, sizeof(reencrypted->key), shard_pointer);
-        if (n != SHARD_KEY_LEN) {
-            printf("Error writing key metadata, %d bytes written, %d expected\n", n, SHARD_KEY_LEN);
-            exit(1);
+    if (header_res == 0) { // Not empty
+        // Reconstruct the file key, usually straight from the key cache
+        res = _load_file_key(&header, &file_key);
+        if (res != 0) {
+            printf("Could not reconstruct key of %s\n", path);
+            return res;
         }
 
-        // Write encrypted data to shard
-        int ciphertext_len = 16 * ((strlen(plaintext_buf) + 15) / 16) + 1;
-        n                  = fwrite(reencrypted->ciphertext, 1, ciphertext_len, shard_pointer);
-
-        fclose(shard_pointer);
+        old_size = header.size;
     } else { // Empty
-        // Encrypt buffer
-        struct EncryptionData *encrypted = get_ciphertext(strdup(buf));
-
-        // Generate hash
-        unsigned char *hash_buf = malloc(65);
-        get_sha256_hash(encrypted->ciphertext, hash_buf);
-
-        // Construct shard filepath from hash
-        char shard_path[strlen(shardpoint) + SHARD_FN_LEN + 7];
-        strcpy(shard_path, shardpoint);
-        strcat(shard_path, hash_buf);
-        strcat(shard_path, ".shard");
-
-        // Open shard for writing
-        FILE *shard_pointer;
-        shard_pointer = fopen(shard_path, "w");
-
-        // Write metadata
-        int n = fwrite(encrypted->key, 1, sizeof(encrypted->key), shard_pointer);
-        if (n != SHARD_KEY_LEN) {
-            printf("Error writing key metadata\n");
-            exit(1);
+        res = _new_file_key(path, &header, &file_key);
+        if (res != 0) {
+            printf("Could not store key shares of %s\n", path);
+            return res;
         }
+    }
 
-        // Write encrypted data to shard
-        fprintf(shard_pointer, "%s", encrypted->ciphertext);
-
-        fclose(shard_pointer);
+    uint64_t new_size = offset + size > old_size ? offset + size : old_size;
+    char *payload     = NULL;
 
-        // Write hash to buf
-        pwrite(fi->fh, hash_buf, strlen(hash_buf), 0);
+    if (new_size <= inline_threshold &&
+        (header_res == -ENODATA || header.flags & HEADER_FLAG_INLINE)) {
+        // Small enough to keep in the header record
+        header.flags |= HEADER_FLAG_INLINE;
+        res     = _change_inline(&header, &file_key, inline_buf, buf, offset, offset + size);
+        payload = inline_buf;
+    } else {
+        // Promote to a shard the first time the payload outgrows the header, and move off a
+        // shard shared with a snapshot before changing it
+        if (header.flags & HEADER_FLAG_INLINE)
+            res = _promote(fi->fh, &header, &file_key, inline_buf);
+        else
+            res = _detach(fi->fh, &header, &file_key);
+
+        header.flags &= ~HEADER_FLAG_INLINE;
+
+        // Blocks the write skips over stay holes, only the blocks it touches become data
+        if (res == 0 && size > 0)
+            res = _write_range(fi->fh, &header, &file_key, buf, size, offset);
+        if (res == 0 && size > 0)
+            res = _seal_range(fi->fh, &header, &file_key, offset, offset + size);
+        if (res != 0)
+            printf("Error writing shard %s\n", header.hash);
     }
 
-    if (res == -1)
-        return -errno;
+    if (res != 0)
+        return res;
+
+    header.size = new_size;
 
-    FLAG_OPENED_EMPTY_FILE = 0;
-    FLAG_TRUNCATE          = -1;
+    res = _write_header(fi->fh, &header, &file_key, payload);
+    if (res != 0)
+        return res;
 
-    fclose(header_pointer);
+    attr_index_fd(path, fi->fh, header.size);
 
-    // FUSE expects res to be the number of characters written, but DEFFS
-    // writes the ciphertext for the entire file. So just fudge the numbers.
-    return strlen(buf);
+    return size;
+}
+
+int deffs_write(const char *path, const char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi)
+{
+    attr_lease(path, LEASE_WRITE);
+    uint64_t mark = replica_mark();
+
+    // The scrubber must not see a header record, block map and shard out of step
+    scrub_pause();
+    int res = _write(path, buf, size, offset, fi);
+    scrub_resume();
+    lease_end();
+
+    // Replicas are waited for without holding the scrubber off
+    if (res >= 0) {
+        int replicated = replica_wait(mark, path);
+        res            = replicated < 0 ? replicated : res;
+    }
+
+    return res;
 }
 
 int deffs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
@@ -532,68 +1387,366 @@ int deffs_flush(const char *path, struct fuse_file_info *fi)
     return res;
 }
 
-int deffs_truncate(const char *path, off_t size)
+static int _truncate(const char *path, off_t size)
 {
     int res;
 
-    FLAG_TRUNCATE = size;
-
-    return size;
-    /*
+    if (snapshot_frozen(path))
+        return -EROFS;
 
     // Copy path to non-constant copy for fopen
     char nonconst_path[strlen(storepoint) + strlen(path) + 1];
     strcpy(nonconst_path, path);
     strcpy(nonconst_path, deffs_path_prepend(nonconst_path, storepoint));
 
-    if(size == 0){
-        // Open header file
-        FILE *header_pointer;
-        header_pointer = fopen(nonconst_path, "rw");
-        if(header_pointer == NULL){
-            printf("Could not open file %s for truncating, %s\n", nonconst_path, path);
-            exit(1);
-        }
+    int fd = open(nonconst_path, O_RDWR);
+    if (fd == -1)
+        return -errno;
 
-        // Read hash from header file
-        char hash_buf[SHARD_FN_LEN + 1];
-        fread(hash_buf, SHARD_FN_LEN, 1, header_pointer);
-        hash_buf[SHARD_FN_LEN] = '\0';
+    uint64_t mark = replica_mark();
 
-        // Construct shard filepath from hash
-        char shard_path[strlen(shardpoint) + SHARD_FN_LEN + 7];
-        strcpy(shard_path, shardpoint);
-        strcat(shard_path, hash_buf);
-        strcat(shard_path, ".shard");
+    scrub_pause();
+    res = _truncate_fd(path, fd, size);
+    scrub_resume();
 
-        res = truncate(shard_path, size);
-        if (res == -1)
-            return -errno;
-    } else {
-        printf("Trying to truncate %s to size %zu", nonconst_path, size);
-        exit(1);
-    }
+    if (res == 0)
+        attr_index_fd(path, fd, size);
 
-    return 0;
-    */
+    close(fd);
+
+    return res == 0 ? replica_wait(mark, path) : res;
+}
+
+int deffs_truncate(const char *path, off_t size)
+{
+    attr_lease(path, LEASE_WRITE);
+    int res = _truncate(path, size);
+    lease_end();
+
+    return res;
 }
 
 int deffs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    attr_lease(path, LEASE_WRITE);
+    uint64_t mark = replica_mark();
+
+    scrub_pause();
+    int res = _truncate_fd(path, fi->fh, size);
+    scrub_resume();
+
+    if (res == 0)
+        attr_index_fd(path, fi->fh, size);
+    lease_end();
+
+    return res == 0 ? replica_wait(mark, path) : res;
+}
+
+static int _fallocate(const char path[], int fd, int mode, off_t offset, off_t length)
 {
     int res;
-    (void)path;
 
-    res = ftruncate(fi->fh, size);
-    if (res == -1)
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+
+    // As with fallocate(2), punching a hole never changes the size
+    if (mode & FALLOC_FL_PUNCH_HOLE && !(mode & FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+
+    struct deffs_header header;
+    char inline_buf[HEADER_INLINE_MAX];
+    int header_res = header_read(fd, &header, inline_buf);
+    if (header_res < 0 && header_res != -ENODATA)
+        return header_res;
+
+    // A file that was never written has nothing to punch and keeps its size of 0
+    if (header_res == -ENODATA && mode & FALLOC_FL_KEEP_SIZE)
+        return 0;
+
+    struct FileKey file_key;
+
+    if (header_res == -ENODATA)
+        res = _name_empty_file(path, &header, &file_key);
+    else
+        res = _load_file_key(&header, &file_key);
+    if (res != 0)
+        return res;
+
+    uint64_t end = offset + length;
+
+    res = _detach(fd, &header, &file_key);
+    if (res != 0)
+        return res;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        res = _punch_hole(fd, &header, &file_key, inline_buf, offset,
+                          end < header.size ? end : header.size);
+    } else {
+        uint64_t new_size = mode & FALLOC_FL_KEEP_SIZE || end < header.size ? header.size : end;
+
+        if (header.flags & HEADER_FLAG_INLINE && end <= inline_threshold) {
+            // The header record already has room for the whole range
+            if (new_size > header.size)
+                res = _change_inline(&header, &file_key, inline_buf, NULL, header.size, new_size);
+        } else {
+            if (header.flags & HEADER_FLAG_INLINE)
+                res = _promote(fd, &header, &file_key, inline_buf);
+            if (res == 0)
+                res = _preallocate(fd, &header, offset, end);
+        }
+
+        header.size = new_size;
+    }
+
+    if (res == 0)
+        res = _write_header(fd, &header, &file_key, inline_buf);
+    if (res == 0)
+        attr_index_fd(path, fd, header.size);
+
+    return res;
+}
+
+int deffs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi)
+{
+    attr_lease(path, LEASE_WRITE);
+    uint64_t mark = replica_mark();
+
+    scrub_pause();
+    int res = _fallocate(path, fi->fh, mode, offset, length);
+    scrub_resume();
+    lease_end();
+
+    return res == 0 ? replica_wait(mark, path) : res;
+}
+
+static int _clone_source_valid(const char source[])
+{
+    // Sources are absolute paths inside the filesystem, and may not climb out of it
+    if (source[0] != '/')
+        return 0;
+
+    for (const char *name = source; name != NULL; name = strchr(name + 1, '/')) {
+        if (strncmp(name + 1, "..", 2) == 0 && (name[3] == '/' || name[3] == '\0'))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int _may_read(const struct stat *st)
+{
+    // The daemon can open every header record, so whoever asked for the clone must be allowed
+    // to read the source themselves. Calls made through libdeffs have no FUSE context to ask
+    if (mountpoint == NULL)
+        return 1;
+
+    struct fuse_context *context = fuse_get_context();
+    if (context == NULL || context->uid == 0)
+        return 1;
+
+    if (st->st_uid == context->uid)
+        return (st->st_mode & S_IRUSR) != 0;
+    if (st->st_gid == context->gid)
+        return (st->st_mode & S_IRGRP) != 0;
+
+    return (st->st_mode & S_IROTH) != 0;
+}
+
+static int _clone(int fd, const char source[])
+{
+    // The destination names the source's shards and key instead of whatever it held
+    char source_path[strlen(storepoint) + strlen(source) + 1];
+    snprintf(source_path, sizeof(source_path), "%s%s", storepoint, source);
+
+    int src_fd = open(source_path, O_RDWR);
+    if (src_fd == -1)
         return -errno;
 
-    return 0;
+    struct stat src_st, dst_st;
+    if (fstat(src_fd, &src_st) == -1 || fstat(fd, &dst_st) == -1) {
+        close(src_fd);
+        return -errno;
+    }
+
+    if (!S_ISREG(src_st.st_mode)) {
+        close(src_fd);
+        return -EINVAL;
+    }
+
+    if (!_may_read(&src_st)) {
+        close(src_fd);
+        return -EACCES;
+    }
+
+    // Cloning a file onto itself changes nothing
+    if (src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino) {
+        close(src_fd);
+        return 0;
+    }
+
+    struct deffs_header old_header;
+    int res       = header_read(fd, &old_header, NULL);
+    int had_shard = res == 0;
+    if (res == -ENODATA)
+        res = 0;
+
+    // The shards are retained for the destination before its old ones are let go, so a failed
+    // clone loses nothing and a destination already naming the source's shards keeps them
+    if (res == 0)
+        res = snapshot_share(src_fd, fd);
+    if (res == 0 && fstat(src_fd, &src_st) == -1)
+        res = -errno;
+    if (res == 0 && ftruncate(fd, src_st.st_size) == -1)
+        res = -errno;
+    if (res == 0 && had_shard)
+        res = reclaim_queue(&old_header);
+
+    close(src_fd);
+
+    return res;
+}
+
+int deffs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                unsigned int flags, void *data)
+{
+    (void)arg;
+
+    if (flags & FUSE_IOCTL_COMPAT)
+        return -ENOSYS;
+
+    switch ((unsigned int)cmd) {
+    case DEFFS_IOC_CLONE: {
+        if (path != NULL && snapshot_frozen(path))
+            return -EROFS;
+
+        // Cloning replaces the destination's contents, which needs a handle open for writing
+        if (_handle_mode(fi->fh) == O_RDONLY)
+            return -EBADF;
+
+        struct deffs_clone_args *args = data;
+        args->source[sizeof(args->source) - 1] = '\0';
+        if (!_clone_source_valid(args->source))
+            return -EINVAL;
+
+        // Leases are taken in name order, so two mounts cloning the same pair of files in
+        // opposite directions cannot each hold one lease and wait on the other
+        const char *first = path, *second = args->source;
+        if (path != NULL && strcmp(path, args->source) > 0) {
+            first  = args->source;
+            second = path;
+        }
+
+        attr_lease(first, LEASE_WRITE);
+        attr_lease(second, LEASE_WRITE);
+
+        scrub_pause();
+        int res = _clone(fi->fh, args->source);
+        scrub_resume();
+
+        reclaim_note_move();
+
+        // Sharing the source's shards rewrote its header record too
+        struct deffs_header header;
+        if (res == 0)
+            attr_index_fd(path, fi->fh, header_read(fi->fh, &header, NULL) == 0 ? header.size : 0);
+        if (res == 0)
+            attr_index(args->source, NULL);
+
+        // The file's contents changed without the kernel writing them
+        if (res == 0)
+            lease_uncache(path);
+        lease_end();
+
+        return res;
+    }
+
+    // Snapshots and directories can be asked too, since nothing changes
+    case DEFFS_IOC_SCRUB_STATS:
+        scrub_stats(data);
+        return 0;
+
+    case DEFFS_IOC_TIER_STATS:
+        tier_stats(data);
+        return 0;
+
+    case DEFFS_IOC_REPLICA_STATS:
+        replica_stats(data);
+        return 0;
+
+    case DEFFS_IOC_SET_DURABILITY:
+        if (path == NULL)
+            return -ENOENT;
+        if (snapshot_frozen(path))
+            return -EROFS;
+
+        return replica_set_level(path, *(int *)data);
+
+    case DEFFS_IOC_GET_DURABILITY:
+        if (path == NULL)
+            return -ENOENT;
+
+        *(int *)data = flags & FUSE_IOCTL_DIR ? replica_dir_level(path) : replica_level(path);
+        return 0;
+
+    case DEFFS_IOC_SET_CACHE_MODE:
+        if (path == NULL)
+            return -ENOENT;
+        if (snapshot_frozen(path))
+            return -EROFS;
+
+        return pagecache_set_mode(path, *(int *)data);
+
+    case DEFFS_IOC_GET_CACHE_MODE:
+        if (path == NULL)
+            return -ENOENT;
+
+        *(int *)data = flags & FUSE_IOCTL_DIR ? pagecache_dir_mode(path) : pagecache_mode(path);
+        return 0;
+
+    case DEFFS_IOC_SET_CIPHER:
+        if (path == NULL)
+            return -ENOENT;
+        if (snapshot_frozen(path))
+            return -EROFS;
+
+        return cipher_policy_set(path, *(int *)data);
+
+    case DEFFS_IOC_GET_CIPHER: {
+        if (path == NULL)
+            return -ENOENT;
+        if (flags & FUSE_IOCTL_DIR) {
+            *(int *)data = cipher_policy_dir(path);
+            return 0;
+        }
+
+        // A file that was never written takes its directory's cipher once it is
+        struct deffs_header header;
+        int res = header_read(fi->fh, &header, NULL);
+        if (res == 0)
+            *(int *)data = header_cipher(&header);
+        else if (res == -ENODATA)
+            *(int *)data = cipher_policy_file(path);
+
+        return res == -ENODATA ? 0 : res;
+    }
+
+    default:
+        return -ENOTTY;
+    }
 }
 
 #ifdef HAVE_UTIMENSAT
-int deffs_utimens(const char *path, const struct timespec ts[2])
+static int _utimens(const char *path, const struct timespec ts[2])
 {
     int res;
+
+    if (snapshot_frozen(path))
+        return -EROFS;
+
     // Copy path to non-constant copy for fopen
     char nonconst_path[strlen(storepoint) + strlen(path) + 1];
     strcpy(nonconst_path, path);
@@ -604,13 +1757,25 @@ int deffs_utimens(const char *path, const struct timespec ts[2])
     if (res == -1)
         return -errno;
 
+    attr_index(path, NULL);
+
     return 0;
 }
+
+int deffs_utimens(const char *path, const struct timespec ts[2])
+{
+    attr_lease(path, LEASE_WRITE);
+    int res = _utimens(path, ts);
+    lease_end();
+
+    return res;
+}
 #endif
 
 int deffs_release(const char *path, struct fuse_file_info *fi)
 {
     (void)path;
+    _note_handle(fi->fh, O_RDONLY);
     close(fi->fh);
 
     return 0;
@@ -620,7 +1785,8 @@ int deffs_releasedir(const char *path, struct fuse_file_info *fi)
 {
     struct deffs_dirp *d = get_dirp(fi);
     (void)path;
-    closedir(d->dp);
+    if (d->dp != NULL)
+        closedir(d->dp);
     free(d);
     return 0;
 }
@@ -0,0 +1,386 @@
+/*
+* FILENAME: scrub.c
+*
+* DESCRIPTION: Background scrubber. A thread walks every header record under the
+*              storepoint once per scrub_interval. For each file it checks the
+*              key shares against the file's sealed root, rebuilding and rewriting
+*              shares that are missing or wrong from the ones that still agree,
+*              and then reads the file's blocks back from their shards to check
+*              them against its block tree. Bad blocks and missing shards are
+*              counted and reported. Reads are limited to scrub_rate bytes per
+*              second, and the scrubber idles so that it holds the filesystem for
+*              no more than scrub_share percent of the time. The counters are
+*              read through the DEFFS_IOC_SCRUB_STATS ioctl. Each batch is
+*              checked under a read lease on the file, so that mounts sharing
+*              the store do not change it halfway through.
+*
+* USAGE: scrub_start();
+*
+*        scrub_pause();
+*        // change a header record, its block map or its shards
+*        scrub_resume();
+*
+*        scrub_stop();
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "scrub.h"
+
+long scrub_rate     = 8 * 1024 * 1024;
+long scrub_interval = 24 * 60 * 60;
+int scrub_share     = 10;
+
+// Held by the scrubber while it looks at a file, and by every change to one
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t scrub_thread;
+static int scrub_running;
+
+static struct deffs_scrub_stats stats;
+
+// File being scrubbed, carried from one batch of blocks to the next
+struct scrub_file {
+    const char *path;
+    int fd;
+    struct deffs_header header;
+    struct FileKey file_key;
+    // Hash the key was checked for, empty until it has been
+    char keyed[SHARD_FN_LEN + 1];
+    uint64_t next_block;
+};
+
+// What a candidate key is checked against
+struct scrub_check {
+    int fd;
+    const struct deffs_header *header;
+    const char *payload;
+};
+
+void scrub_pause(void)
+{
+    pthread_mutex_lock(&scrub_lock);
+}
+
+void scrub_resume(void)
+{
+    pthread_mutex_unlock(&scrub_lock);
+}
+
+void scrub_stats(struct deffs_scrub_stats *out)
+{
+    pthread_mutex_lock(&scrub_lock);
+    *out = stats;
+    pthread_mutex_unlock(&scrub_lock);
+}
+
+static double _elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void _throttle(const struct timespec *start, uint64_t bytes)
+{
+    // Wait long enough to stay under both the bandwidth budget and the time share
+    double busy    = _elapsed(start);
+    double seconds = scrub_share < 100 ? busy * (100 - scrub_share) / scrub_share : 0;
+
+    if (scrub_rate > 0 && (double)bytes / scrub_rate - busy > seconds)
+        seconds = (double)bytes / scrub_rate - busy;
+
+    if (seconds <= 0)
+        return;
+
+    struct timespec delay = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&delay, NULL);
+}
+
+static int _sealed(const unsigned char root[])
+{
+    for (int i = 0; i < FILE_KEY_TAG_LEN; i++) {
+        if (root[i] != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int _check_key(const struct FileKey *file_key, void *ctx)
+{
+    const struct scrub_check *check = ctx;
+
+    if (!(check->header->flags & HEADER_FLAG_INLINE))
+        return integrity_check_root(check->fd, file_key, check->header->root);
+
+    unsigned char tag[FILE_KEY_TAG_LEN];
+    file_key_tag(file_key, FILE_KEY_TAG_INLINE, check->header->nonce,
+                 (const unsigned char *)check->payload, check->header->payload_len, tag);
+
+    return CRYPTO_memcmp(tag, check->header->root, FILE_KEY_TAG_LEN) == 0 ? 0 : -EIO;
+}
+
+static int _scrub_key(struct scrub_file *file, const char payload[])
+{
+    struct scrub_check check = {file->fd, &file->header, payload};
+
+    int res = keystore_repair(file->header.hash, _check_key, &check);
+    if (res < 0) {
+        printf("Could not rebuild the key of %s\n", file->path);
+        stats.unrecoverable_keys++;
+        return res;
+    }
+
+    if (res > 0)
+        printf("Rewrote %d key shares of %s\n", res, file->path);
+    stats.repaired_shares += res;
+
+    res = keystore_load(file->header.hash, &file->file_key);
+    if (res == 0)
+        strcpy(file->keyed, file->header.hash);
+
+    return res;
+}
+
+static void _count_corrupt(struct scrub_file *file, uint64_t first_block, size_t n_blocks,
+                           const uint8_t states[], unsigned char (*tags)[FILE_KEY_TAG_LEN])
+{
+    // The batch as a whole did not match, so check its blocks one at a time
+    for (size_t i = 0; i < n_blocks; i++) {
+        if (states[i] != BLOCK_DATA && states[i] < BLOCK_BASE)
+            continue;
+
+        if (integrity_verify(file->fd, &file->file_key, first_block + i, 1, &tags[i],
+                             file->header.root) == -EIO) {
+            printf("Block %llu of %s failed verification\n",
+                   (unsigned long long)(first_block + i), file->path);
+            stats.corrupt_blocks++;
+        }
+    }
+}
+
+static int _scrub_blocks(struct scrub_file *file, char *ciphertext, size_t batch,
+                         uint64_t *bytes)
+{
+    // Returns 1 once the last block was checked
+    uint8_t states[batch];
+    unsigned char nonces[batch][FILE_KEY_NONCE_LEN];
+    unsigned char tags[batch][FILE_KEY_TAG_LEN];
+    unsigned char saved[batch][FILE_KEY_TAG_LEN];
+
+    uint64_t n_leaves;
+    int res = blockmap_leaves(file->fd, &n_leaves);
+    if (res != 0 || file->next_block >= n_leaves)
+        return 1;
+
+    uint64_t first_block = file->next_block;
+    size_t n_blocks      = n_leaves - first_block < batch ? n_leaves - first_block : batch;
+
+    res = blockmap_read(file->fd, first_block, n_blocks, states, nonces);
+    if (res != 0)
+        return 1;
+
+    for (size_t i = 0, j; i < n_blocks; i = j) {
+        for (j = i; j < n_blocks && states[j] == states[i]; j++)
+            ;
+
+        if (states[i] != BLOCK_DATA && states[i] < BLOCK_BASE) {
+            memset(tags[i], 0, (j - i) * FILE_KEY_TAG_LEN);
+            continue;
+        }
+
+        const char *hash = states[i] == BLOCK_DATA ? file->header.hash :
+                                                     file->header.bases[states[i] - BLOCK_BASE];
+        char *run        = ciphertext + i * DEFFS_BLOCK_SIZE;
+        size_t run_len   = (j - i) * DEFFS_BLOCK_SIZE;
+
+        ssize_t n = shard_read(hash, run, run_len, (first_block + i) * DEFFS_BLOCK_SIZE);
+        if (n == -ENOENT) {
+            printf("Shard %s of %s is missing\n", hash, file->path);
+            stats.missing_shards++;
+            return 1;
+        }
+        if (n < 0)
+            return 1;
+
+        // Tagged on this thread, the crypto workers belong to the foreground
+        memset(run + n, 0, run_len - n);
+        file_key_tag_many(&file->file_key, first_block + i, &nonces[i],
+                          (const unsigned char *)ciphertext + i * DEFFS_BLOCK_SIZE,
+                          DEFFS_BLOCK_SIZE, j - i, &tags[i]);
+        *bytes += run_len;
+    }
+
+    // Verification hashes the tags in place
+    memcpy(saved, tags, n_blocks * FILE_KEY_TAG_LEN);
+
+    res = integrity_verify(file->fd, &file->file_key, first_block, n_blocks, tags,
+                           file->header.root);
+    if (res == -EIO)
+        _count_corrupt(file, first_block, n_blocks, states, saved);
+
+    file->next_block += n_blocks;
+
+    return file->next_block >= n_leaves;
+}
+
+static int _scrub_batch(struct scrub_file *file, char *ciphertext, size_t batch, uint64_t *bytes)
+{
+    // Returns 1 once the file is done. Everything is read again each time, since the file may
+    // have changed while the scrubber was idle
+    struct stat st;
+    if (fstat(file->fd, &st) == -1 || st.st_nlink == 0)
+        return 1;
+
+    char payload[HEADER_INLINE_MAX];
+    if (header_read(file->fd, &file->header, payload) != 0)
+        return 1;
+
+    // Nothing is sealed under a key that never encrypted anything
+    if (!_sealed(file->header.root))
+        return 1;
+
+    if (strcmp(file->keyed, file->header.hash) != 0 && _scrub_key(file, payload) != 0)
+        return 1;
+
+    if (file->header.flags & HEADER_FLAG_INLINE) {
+        *bytes += file->header.payload_len;
+        return 1;
+    }
+
+    return _scrub_blocks(file, ciphertext, batch, bytes);
+}
+
+static void _scrub_file(const char path[], char *ciphertext, size_t batch)
+{
+    struct scrub_file file;
+    file.path       = path;
+    file.keyed[0]   = '\0';
+    file.next_block = 0;
+
+    file.fd = open(path, O_RDONLY);
+    if (file.fd == -1)
+        return;
+
+    int done = 0;
+    while (!done && scrub_running) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        uint64_t bytes = 0;
+
+        // Mounts sharing the store change the file under a write lease, which this waits out
+        attr_lease(path + strlen(storepoint), LEASE_READ);
+
+        pthread_mutex_lock(&scrub_lock);
+        done = _scrub_batch(&file, ciphertext, batch, &bytes);
+        stats.bytes += bytes;
+        stats.files += done;
+        pthread_mutex_unlock(&scrub_lock);
+
+        lease_end();
+
+        _throttle(&start, bytes);
+    }
+
+    close(file.fd);
+}
+
+static void _scrub_tree(const char dir[], char *ciphertext, size_t batch)
+{
+    DIR *dp = opendir(dir);
+    if (dp == NULL)
+        return;
+
+    struct dirent *entry;
+
+    while (scrub_running && (entry = readdir(dp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char path[strlen(dir) + strlen(entry->d_name) + 2];
+        sprintf(path, "%s/%s", dir, entry->d_name);
+
+        // The shardpoint lives in the storepoint, but holds no header records
+        char shard_dir[strlen(path) + 2];
+        sprintf(shard_dir, "%s/", path);
+        if (strcmp(shard_dir, shardpoint) == 0)
+            continue;
+
+        struct stat st;
+        if (lstat(path, &st) == -1)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+            _scrub_tree(path, ciphertext, batch);
+        else if (S_ISREG(st.st_mode))
+            _scrub_file(path, ciphertext, batch);
+    }
+
+    closedir(dp);
+}
+
+static void *_scrub_loop(void *arg)
+{
+    (void)arg;
+
+    size_t batch     = stream_window_size / DEFFS_BLOCK_SIZE < 256 ?
+                           stream_window_size / DEFFS_BLOCK_SIZE :
+                           256;
+    char *ciphertext = bufpool_get(batch * DEFFS_BLOCK_SIZE);
+    if (ciphertext == NULL)
+        return NULL;
+
+    while (scrub_running) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pthread_mutex_lock(&scrub_lock);
+        stats.files = 0;
+        stats.bytes = 0;
+        pthread_mutex_unlock(&scrub_lock);
+
+        _scrub_tree(storepoint, ciphertext, batch);
+
+        pthread_mutex_lock(&scrub_lock);
+        if (scrub_running) {
+            stats.passes++;
+            stats.last_files = stats.files;
+            stats.last_bytes = stats.bytes;
+        }
+        pthread_mutex_unlock(&scrub_lock);
+
+        // Passes start scrub_interval apart, checking now and then for an unmount
+        while (scrub_running && _elapsed(&start) < scrub_interval)
+            sleep(1);
+    }
+
+    bufpool_put(ciphertext, batch * DEFFS_BLOCK_SIZE);
+    bufpool_trim();
+
+    return NULL;
+}
+
+int scrub_start(void)
+{
+    if (scrub_interval <= 0)
+        return 0;
+
+    scrub_running = 1;
+    if (pthread_create(&scrub_thread, NULL, _scrub_loop, NULL) != 0) {
+        scrub_running = 0;
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+void scrub_stop(void)
+{
+    if (scrub_running) {
+        scrub_running = 0;
+        pthread_join(scrub_thread, NULL);
+    }
+}
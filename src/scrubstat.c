@@ -0,0 +1,86 @@
+/*
+* FILENAME: scrubstat.c
+*
+* DESCRIPTION: Command line tool that prints the progress and repair counters of
+*              the background scrubber of a DEFFS mount. The counters are read
+*              through an ioctl on any file or directory in the mount and cover
+*              the time since it was mounted.
+*
+* USAGE: cmake --build ./ --target DEFFS-scrubstat -- -j 6
+*        ./bin/DEFFS-scrubstat ~/deffs
+*
+* AUTHOR: Charles Averill
+*/
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scrubstat.h"
+
+const char *argp_program_version     = "DEFFS-scrubstat 0.0.2";
+const char *argp_program_bug_address = "charles.averill@utdallas.edu";
+static char doc[]                    = "Print the scrubber counters of a DEFFS mount";
+static char args_doc[]               = "PATH";
+
+static struct argp_option options[] = {{0}};
+
+static error_t parse_scrubstat_opt(int key, char *arg, struct argp_state *state)
+{
+    char **path = state->input;
+
+    switch (key) {
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 0)
+            argp_usage(state);
+        *path = arg;
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_usage(state);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static struct argp argp = {options, parse_scrubstat_opt, args_doc, doc, 0, 0, 0};
+
+int main(int argc, char *argv[])
+{
+    char *path;
+    argp_parse(&argp, argc, argv, 0, 0, &path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("Could not open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    struct deffs_scrub_stats stats;
+    if (ioctl(fd, DEFFS_IOC_SCRUB_STATS, &stats) == -1) {
+        printf("Could not read the scrubber counters of %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    close(fd);
+
+    printf("Passes completed:   %llu\n", (unsigned long long)stats.passes);
+    printf("This pass:          %llu files, %llu MiB\n", (unsigned long long)stats.files,
+           (unsigned long long)(stats.bytes >> 20));
+    printf("Last pass:          %llu files, %llu MiB\n", (unsigned long long)stats.last_files,
+           (unsigned long long)(stats.last_bytes >> 20));
+    printf("Corrupt blocks:     %llu\n", (unsigned long long)stats.corrupt_blocks);
+    printf("Missing shards:     %llu\n", (unsigned long long)stats.missing_shards);
+    printf("Repaired shares:    %llu\n", (unsigned long long)stats.repaired_shares);
+    printf("Unrecoverable keys: %llu\n", (unsigned long long)stats.unrecoverable_keys);
+
+    return 0;
+}
@@ -0,0 +1,1099 @@
+/*
+* FILENAME: segment.c
+*
+* DESCRIPTION: Optional log-structured shard store. Instead of one file per shard,
+*              shard payloads are appended to large segment files under
+*              <shardpoint>/segments/ and addressed by (segment, offset, length)
+*              through an in-memory index. Rewrites and unlinks only append, so
+*              a background thread compacts segments whose dead ratio passes
+*              segment_gc_ratio, copying the live records forward at no more
+*              than segment_gc_rate bytes per second. A patch appends only the
+*              bytes it writes, the index layers them over the shard's record,
+*              and compaction folds them back into a single record.
+*
+* USAGE: segment_store_enabled = 1;
+*        segment_store_open();
+*
+*        segment_write(hash, payload, payload_len);
+*        segment_patch(hash, patch, patch_len, offset);
+*        segment_read(hash, buf, segment_size(hash), 0);
+*        segment_unlink(hash);
+*
+*        segment_store_close();
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "segment.h"
+
+int segment_store_enabled = 0;
+off_t segment_max_size    = 64 * 1024 * 1024;
+double segment_gc_ratio   = 0.5;
+long segment_gc_rate      = 16 * 1024 * 1024;
+
+#define SEGMENT_INDEX_MIN_BUCKETS 1024
+#define SEGMENT_GC_INTERVAL 1 // seconds between compaction passes
+
+struct segment_info {
+    int fd;
+    uint64_t size;
+    uint64_t dead;
+};
+
+// A run of shard bytes that a patch record overrides
+struct segment_extent {
+    uint64_t start;
+    struct segment_location loc;
+};
+
+struct index_entry {
+    char hash[SHARD_FN_LEN];
+    uint32_t flags;
+    uint64_t seq;
+    uint32_t first_segment; // oldest segment that may still hold a version of this shard
+    struct segment_location loc;
+    struct segment_extent *extents; // sorted by start and never overlapping
+    size_t n_extents;
+    size_t max_extents;
+    struct index_entry *next;
+};
+
+// Patches found while scanning, applied in sequence order once every segment is scanned
+struct pending_patch {
+    char hash[SHARD_FN_LEN];
+    uint64_t seq;
+    uint64_t start;
+    struct segment_location loc;
+};
+
+struct patch_list {
+    struct pending_patch *patches;
+    size_t n_patches;
+    size_t max_patches;
+};
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct segment_info *segments;
+static uint32_t n_segments;
+static uint32_t active_segment;
+static uint64_t next_seq;
+
+static struct index_entry **index_buckets;
+static size_t index_n_buckets;
+static size_t index_count;
+
+static pthread_t gc_thread;
+static int gc_running;
+
+static uint64_t _record_size(uint64_t length)
+{
+    return sizeof(struct segment_record) + length;
+}
+
+static int _is_zero(const char *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+static void _segment_path(uint32_t segment, char obuf[], size_t len)
+{
+    snprintf(obuf, len, "%ssegments/%08u.seg", shardpoint, segment);
+}
+
+static struct index_entry *_index_find(const char hash[])
+{
+    struct index_entry *entry = index_buckets[hash_bucket(hash, index_n_buckets)];
+    while (entry != NULL && memcmp(entry->hash, hash, SHARD_FN_LEN) != 0)
+        entry = entry->next;
+
+    return entry;
+}
+
+static void _index_grow(void)
+{
+    size_t n_buckets               = index_n_buckets * 2;
+    struct index_entry **new_index = calloc(n_buckets, sizeof(struct index_entry *));
+    if (new_index == NULL)
+        return;
+
+    for (size_t i = 0; i < index_n_buckets; i++) {
+        struct index_entry *entry = index_buckets[i];
+        while (entry != NULL) {
+            struct index_entry *next = entry->next;
+            size_t bucket            = hash_bucket(entry->hash, n_buckets);
+            entry->next              = new_index[bucket];
+            new_index[bucket]        = entry;
+            entry                    = next;
+        }
+    }
+
+    free(index_buckets);
+    index_buckets   = new_index;
+    index_n_buckets = n_buckets;
+}
+
+static struct index_entry *_index_insert(const char hash[])
+{
+    if (index_count >= index_n_buckets)
+        _index_grow();
+
+    struct index_entry *entry = calloc(1, sizeof(struct index_entry));
+    if (entry == NULL)
+        return NULL;
+
+    size_t bucket = hash_bucket(hash, index_n_buckets);
+    memcpy(entry->hash, hash, SHARD_FN_LEN);
+    entry->next           = index_buckets[bucket];
+    index_buckets[bucket] = entry;
+    index_count++;
+
+    return entry;
+}
+
+static void _index_remove(const char hash[])
+{
+    struct index_entry **link = &index_buckets[hash_bucket(hash, index_n_buckets)];
+    while (*link != NULL && memcmp((*link)->hash, hash, SHARD_FN_LEN) != 0)
+        link = &(*link)->next;
+
+    if (*link != NULL) {
+        struct index_entry *entry = *link;
+        *link                     = entry->next;
+        free(entry->extents);
+        free(entry);
+        index_count--;
+    }
+}
+
+static int _segment_create(uint32_t segment)
+{
+    if (segment >= n_segments) {
+        struct segment_info *grown = realloc(segments, (segment + 1) * sizeof(struct segment_info));
+        if (grown == NULL)
+            return -ENOMEM;
+
+        for (uint32_t i = n_segments; i <= segment; i++) {
+            grown[i].fd   = -1;
+            grown[i].size = 0;
+            grown[i].dead = 0;
+        }
+
+        segments   = grown;
+        n_segments = segment + 1;
+    }
+
+    char path[strlen(shardpoint) + 32];
+    _segment_path(segment, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+        return -errno;
+
+    struct stat st;
+    fstat(fd, &st);
+
+    segments[segment].fd   = fd;
+    segments[segment].size = st.st_size;
+
+    return 0;
+}
+
+// Roll over to a new segment if a record of size bytes does not fit in the active one.
+// Must be called with store_lock held.
+static int _segment_make_room(size_t size)
+{
+    if (segments[active_segment].size > 0 &&
+        segments[active_segment].size + _record_size(size) > (uint64_t)segment_max_size) {
+        int res = _segment_create(n_segments);
+        if (res < 0)
+            return res;
+        active_segment = n_segments - 1;
+    }
+
+    return 0;
+}
+
+static void _record_init(struct segment_record *record, const char hash[], uint32_t flags,
+                         uint64_t seq, size_t size)
+{
+    memset(record, 0, sizeof(struct segment_record));
+    record->magic  = SEGMENT_MAGIC;
+    record->flags  = flags;
+    record->seq    = seq;
+    record->length = size;
+    memcpy(record->hash, hash, SHARD_FN_LEN);
+}
+
+// Append one record, whose payload is gathered from n_parts buffers, to the active segment,
+// rolling over to a new segment when full. Must be called with store_lock held.
+static int _segment_append(const char hash[], uint32_t flags, uint64_t seq,
+                           const struct iovec parts[], int n_parts, struct segment_location *loc)
+{
+    size_t size = 0;
+    for (int i = 0; i < n_parts; i++)
+        size += parts[i].iov_len;
+
+    int res = _segment_make_room(size);
+    if (res < 0)
+        return res;
+
+    struct segment_info *info = &segments[active_segment];
+
+    struct segment_record record;
+    _record_init(&record, hash, flags, seq, size);
+
+    struct iovec iov[n_parts + 1];
+    iov[0] = (struct iovec){&record, sizeof(record)};
+    for (int i = 0; i < n_parts; i++)
+        iov[i + 1] = parts[i];
+
+    ssize_t n = pwritev(info->fd, iov, n_parts + 1, info->size);
+    if (n != (ssize_t)_record_size(size))
+        return n == -1 ? -errno : -EIO;
+
+    loc->segment = active_segment;
+    loc->offset  = info->size + sizeof(record);
+    loc->length  = size;
+
+    info->size += _record_size(size);
+
+    return 0;
+}
+
+// Write a record header and leave room for its payload, which the caller streams in at
+// loc->offset. Payloads are written front to back, so a crash leaves a torn tail that the
+// next scan truncates. Must be called with store_lock held.
+static int _segment_reserve(const char hash[], uint32_t flags, uint64_t seq, size_t size,
+                            struct segment_location *loc)
+{
+    int res = _segment_make_room(size);
+    if (res < 0)
+        return res;
+
+    struct segment_info *info = &segments[active_segment];
+
+    struct segment_record record;
+    _record_init(&record, hash, flags, seq, size);
+
+    if (pwrite(info->fd, &record, sizeof(record), info->size) != sizeof(record))
+        return -EIO;
+
+    loc->segment = active_segment;
+    loc->offset  = info->size + sizeof(record);
+    loc->length  = size;
+
+    info->size += _record_size(size);
+
+    return 0;
+}
+
+// Drop a reserved record whose payload could not be written. Nothing can have been
+// appended after it while store_lock was held. Must be called with store_lock held.
+static void _segment_unreserve(struct segment_location *loc)
+{
+    struct segment_info *info = &segments[loc->segment];
+
+    info->size = loc->offset - sizeof(struct segment_record);
+    ftruncate(info->fd, info->size);
+}
+
+static uint64_t _extent_end(const struct segment_extent *extent)
+{
+    return extent->start + extent->loc.length;
+}
+
+static uint64_t _entry_length(const struct index_entry *entry)
+{
+    uint64_t length = entry->loc.length;
+    if (entry->n_extents > 0 && _extent_end(&entry->extents[entry->n_extents - 1]) > length)
+        length = _extent_end(&entry->extents[entry->n_extents - 1]);
+
+    return length;
+}
+
+// Index of the first extent that ends past offset
+static size_t _extent_first(const struct index_entry *entry, uint64_t offset)
+{
+    size_t lo = 0, hi = entry->n_extents;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (_extent_end(&entry->extents[mid]) > offset)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+// Layer the bytes of a patch over the extents already indexed. Must be called with store_lock
+// held.
+static int _extent_insert(struct index_entry *entry, uint64_t start, struct segment_location *loc)
+{
+    uint64_t end = start + loc->length;
+    size_t lo    = _extent_first(entry, start);
+    size_t hi    = lo;
+    while (hi < entry->n_extents && entry->extents[hi].start < end)
+        hi++;
+
+    // The extents it overlaps keep whatever sticks out on either side of it
+    struct segment_extent pieces[3];
+    size_t n_pieces = 0;
+    if (lo < hi && entry->extents[lo].start < start) {
+        pieces[n_pieces]              = entry->extents[lo];
+        pieces[n_pieces++].loc.length = start - entry->extents[lo].start;
+    }
+
+    pieces[n_pieces++] = (struct segment_extent){start, *loc};
+
+    if (lo < hi && _extent_end(&entry->extents[hi - 1]) > end) {
+        struct segment_extent right = entry->extents[hi - 1];
+        uint64_t cut                = end - right.start;
+        right.start                 = end;
+        right.loc.offset           += cut;
+        right.loc.length           -= cut;
+        pieces[n_pieces++]          = right;
+    }
+
+    size_t n_extents = entry->n_extents - (hi - lo) + n_pieces;
+    if (n_extents > entry->max_extents) {
+        size_t max_extents = entry->max_extents > 0 ? entry->max_extents * 2 : 4;
+        max_extents        = max_extents > n_extents ? max_extents : n_extents;
+
+        struct segment_extent *grown =
+            realloc(entry->extents, max_extents * sizeof(struct segment_extent));
+        if (grown == NULL)
+            return -ENOMEM;
+
+        entry->extents     = grown;
+        entry->max_extents = max_extents;
+    }
+
+    for (size_t i = lo; i < hi; i++) {
+        struct segment_extent *old = &entry->extents[i];
+        uint64_t from              = old->start > start ? old->start : start;
+        uint64_t to                = _extent_end(old) < end ? _extent_end(old) : end;
+        segments[old->loc.segment].dead += to - from;
+    }
+
+    memmove(&entry->extents[lo + n_pieces], &entry->extents[hi],
+            (entry->n_extents - hi) * sizeof(struct segment_extent));
+    memcpy(&entry->extents[lo], pieces, n_pieces * sizeof(struct segment_extent));
+    entry->n_extents = n_extents;
+
+    return 0;
+}
+
+// Forget an entry's patches, whose bytes are superseded. Must be called with store_lock held.
+static void _extents_drop(struct index_entry *entry)
+{
+    for (size_t i = 0; i < entry->n_extents; i++)
+        segments[entry->extents[i].loc.segment].dead += entry->extents[i].loc.length;
+
+    free(entry->extents);
+    entry->extents     = NULL;
+    entry->n_extents   = 0;
+    entry->max_extents = 0;
+}
+
+// Read a shard's bytes from its record with its patches on top. Must be called with store_lock
+// held.
+static ssize_t _entry_read(const struct index_entry *entry, char *buf, size_t size,
+                           uint64_t offset)
+{
+    uint64_t length = _entry_length(entry);
+    if (offset >= length)
+        return 0;
+    if (offset + size > length)
+        size = length - offset;
+
+    // Patches may reach past the record, which reads as zeros there
+    size_t from_record = offset < entry->loc.length ? entry->loc.length - offset : 0;
+    from_record        = from_record < size ? from_record : size;
+
+    if (from_record > 0 && pread(segments[entry->loc.segment].fd, buf, from_record,
+                                 entry->loc.offset + offset) != (ssize_t)from_record)
+        return -EIO;
+    memset(buf + from_record, 0, size - from_record);
+
+    for (size_t i = _extent_first(entry, offset);
+         i < entry->n_extents && entry->extents[i].start < offset + size; i++) {
+        const struct segment_extent *extent = &entry->extents[i];
+
+        uint64_t from = extent->start > offset ? extent->start : offset;
+        uint64_t to   = _extent_end(extent) < offset + size ? _extent_end(extent) : offset + size;
+
+        if (pread(segments[extent->loc.segment].fd, buf + (from - offset), to - from,
+                  extent->loc.offset + (from - extent->start)) != (ssize_t)(to - from))
+            return -EIO;
+    }
+
+    return size;
+}
+
+// Point the index at a newer version of a shard and account for the bytes it supersedes.
+// Must be called with store_lock held.
+static int _index_update(const char hash[], uint32_t flags, uint64_t seq,
+                         struct segment_location *loc)
+{
+    struct index_entry *entry = _index_find(hash);
+    if (entry == NULL) {
+        entry = _index_insert(hash);
+        if (entry == NULL)
+            return -ENOMEM;
+        entry->first_segment = loc->segment;
+    } else if (entry->seq > seq) {
+        // Scanning found an older version than the one already indexed
+        segments[loc->segment].dead += _record_size(loc->length);
+        if (loc->segment < entry->first_segment)
+            entry->first_segment = loc->segment;
+        return 0;
+    } else if (entry->flags == SEGMENT_RECORD_LIVE) {
+        segments[entry->loc.segment].dead += _record_size(entry->loc.length);
+        _extents_drop(entry);
+    }
+
+    if (loc->segment < entry->first_segment)
+        entry->first_segment = loc->segment;
+
+    entry->flags = flags;
+    entry->seq   = seq;
+    entry->loc   = *loc;
+
+    // Tombstones are only kept on disk so that older versions stay dead across scans
+    if (flags == SEGMENT_RECORD_TOMBSTONE)
+        segments[loc->segment].dead += _record_size(loc->length);
+
+    return 0;
+}
+
+// Layer a patch over the version of its shard it was written on top of. Must be called with
+// store_lock held.
+static int _index_patch(const char hash[], uint64_t seq, uint64_t start,
+                        struct segment_location *loc)
+{
+    struct index_entry *entry = _index_find(hash);
+    if (entry != NULL && loc->segment < entry->first_segment)
+        entry->first_segment = loc->segment;
+
+    // Only the patched bytes are read back, the record header and offset are dead from the start
+    uint64_t overhead = _record_size(sizeof(uint64_t));
+
+    if (entry == NULL || entry->flags != SEGMENT_RECORD_LIVE || entry->seq >= seq) {
+        // Scanning found a patch to a version that has since been replaced
+        segments[loc->segment].dead += overhead + loc->length;
+        return 0;
+    }
+
+    int res = _extent_insert(entry, start, loc);
+    if (res < 0)
+        return res;
+
+    segments[loc->segment].dead += overhead;
+    entry->seq                   = seq;
+
+    return 0;
+}
+
+static int _patch_list_add(struct patch_list *list, struct segment_record *record, uint64_t start,
+                           struct segment_location *loc)
+{
+    if (list->n_patches == list->max_patches) {
+        size_t max_patches = list->max_patches > 0 ? list->max_patches * 2 : 64;
+
+        struct pending_patch *grown =
+            realloc(list->patches, max_patches * sizeof(struct pending_patch));
+        if (grown == NULL)
+            return -ENOMEM;
+
+        list->patches     = grown;
+        list->max_patches = max_patches;
+    }
+
+    struct pending_patch *patch = &list->patches[list->n_patches++];
+    memcpy(patch->hash, record->hash, SHARD_FN_LEN);
+    patch->seq   = record->seq;
+    patch->start = start;
+    patch->loc   = *loc;
+
+    return 0;
+}
+
+static int _patch_seq_cmp(const void *a, const void *b)
+{
+    const struct pending_patch *x = a, *y = b;
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int _segment_scan(uint32_t segment, struct patch_list *patches)
+{
+    struct segment_info *info = &segments[segment];
+    uint64_t offset           = 0;
+
+    while (offset + sizeof(struct segment_record) <= info->size) {
+        struct segment_record record;
+        if (pread(info->fd, &record, sizeof(record), offset) != sizeof(record) ||
+            record.magic != SEGMENT_MAGIC || offset + _record_size(record.length) > info->size)
+            break;
+
+        struct segment_location loc = {segment, offset + sizeof(record), record.length};
+
+        int res;
+        if (record.flags == SEGMENT_RECORD_PATCH) {
+            uint64_t start;
+            if (record.length < sizeof(start) ||
+                pread(info->fd, &start, sizeof(start), loc.offset) != sizeof(start))
+                break;
+
+            loc.offset += sizeof(start);
+            loc.length -= sizeof(start);
+            res         = _patch_list_add(patches, &record, start, &loc);
+        } else {
+            res = _index_update(record.hash, record.flags, record.seq, &loc);
+        }
+        if (res < 0)
+            return res;
+
+        if (record.seq >= next_seq)
+            next_seq = record.seq + 1;
+
+        offset += _record_size(record.length);
+    }
+
+    // Anything past the last whole record is a torn append from a crash
+    if (offset < info->size) {
+        ftruncate(info->fd, offset);
+        info->size = offset;
+    }
+
+    return 0;
+}
+
+// A tombstone has to survive compaction while an older version of its shard may still be on disk
+static int _tombstone_needed(struct index_entry *entry, uint32_t segment)
+{
+    for (uint32_t i = entry->first_segment; i < segment; i++) {
+        if (segments[i].fd != -1)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Stream length bytes from src_fd into a reserved record. Must be called with store_lock held.
+static int _segment_copy(int src_fd, uint64_t src_offset, struct segment_location *loc)
+{
+    size_t window = stream_window_size;
+    char *buf     = bufpool_get(window);
+    if (buf == NULL) {
+        _segment_unreserve(loc);
+        return -ENOMEM;
+    }
+
+    int res = 0;
+    for (uint64_t pos = 0; res == 0 && pos < loc->length; pos += window) {
+        size_t len = loc->length - pos < window ? loc->length - pos : window;
+
+        if (pread(src_fd, buf, len, src_offset + pos) != (ssize_t)len) {
+            res = -EIO;
+            break;
+        }
+
+        // Keep holes in sparse records as holes, except for the window that ends the record
+        if (pos + len < loc->length && _is_zero(buf, len))
+            continue;
+
+        if (pwrite(segments[loc->segment].fd, buf, len, loc->offset + pos) != (ssize_t)len)
+            res = -EIO;
+    }
+
+    bufpool_put(buf, window);
+
+    if (res < 0)
+        _segment_unreserve(loc);
+
+    return res;
+}
+
+// Stream a shard's record and patches, resolved into one, into a reserved record. Must be
+// called with store_lock held.
+static int _segment_merge(struct index_entry *entry, struct segment_location *loc)
+{
+    size_t window = stream_window_size;
+    char *buf     = bufpool_get(window);
+    if (buf == NULL) {
+        _segment_unreserve(loc);
+        return -ENOMEM;
+    }
+
+    int res = 0;
+    for (uint64_t pos = 0; res == 0 && pos < loc->length; pos += window) {
+        size_t len = loc->length - pos < window ? loc->length - pos : window;
+
+        if (_entry_read(entry, buf, len, pos) != (ssize_t)len) {
+            res = -EIO;
+            break;
+        }
+
+        if (pos + len < loc->length && _is_zero(buf, len))
+            continue;
+
+        if (pwrite(segments[loc->segment].fd, buf, len, loc->offset + pos) != (ssize_t)len)
+            res = -EIO;
+    }
+
+    bufpool_put(buf, window);
+
+    if (res < 0)
+        _segment_unreserve(loc);
+
+    return res;
+}
+
+// Whether any patch of entry still reads from the patch record at payload_offset
+static int _patch_current(struct index_entry *entry, uint32_t segment, uint64_t payload_offset,
+                          uint64_t length)
+{
+    if (entry == NULL || entry->flags != SEGMENT_RECORD_LIVE)
+        return 0;
+
+    for (size_t i = 0; i < entry->n_extents; i++) {
+        struct segment_location *loc = &entry->extents[i].loc;
+        if (loc->segment == segment && loc->offset >= payload_offset &&
+            loc->offset < payload_offset + length)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void _sleep_for_bytes(uint64_t bytes)
+{
+    if (segment_gc_rate <= 0)
+        return;
+
+    double seconds        = (double)bytes / segment_gc_rate;
+    struct timespec delay = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&delay, NULL);
+}
+
+static void *_segment_gc_loop(void *arg)
+{
+    (void)arg;
+
+    while (gc_running) {
+        sleep(SEGMENT_GC_INTERVAL);
+
+        // Clean the oldest sealed segment over the threshold first, since that is
+        // what lets tombstones in newer segments be dropped
+        pthread_mutex_lock(&store_lock);
+        int victim = -1;
+        for (uint32_t i = 0; i < n_segments && victim == -1; i++) {
+            if (i == active_segment || segments[i].fd == -1 || segments[i].size == 0)
+                continue;
+
+            if ((double)segments[i].dead / segments[i].size >= segment_gc_ratio)
+                victim = i;
+        }
+        pthread_mutex_unlock(&store_lock);
+
+        if (victim >= 0)
+            segment_compact(victim);
+    }
+
+    return NULL;
+}
+
+int segment_store_open(void)
+{
+    char segment_dir[strlen(shardpoint) + strlen("segments") + 1];
+    strcpy(segment_dir, shardpoint);
+    strcat(segment_dir, "segments");
+
+    if (mkdir_if_not_exists(segment_dir, 0700) != 0 && errno != EEXIST)
+        return -errno;
+
+    index_n_buckets = SEGMENT_INDEX_MIN_BUCKETS;
+    index_buckets   = calloc(index_n_buckets, sizeof(struct index_entry *));
+    if (index_buckets == NULL)
+        return -ENOMEM;
+
+    // Rebuild the index from any segments left by a previous mount
+    DIR *dp = opendir(segment_dir);
+    if (dp == NULL)
+        return -errno;
+
+    struct dirent *entry;
+    uint32_t max_segment = 0;
+    int found            = 0;
+    while ((entry = readdir(dp)) != NULL) {
+        if (ends_with(entry->d_name, ".seg") != 1)
+            continue;
+
+        uint32_t segment = strtoul(entry->d_name, NULL, 10);
+        int res          = _segment_create(segment);
+        if (res < 0) {
+            closedir(dp);
+            return res;
+        }
+
+        if (!found || segment > max_segment)
+            max_segment = segment;
+        found = 1;
+    }
+    closedir(dp);
+
+    struct patch_list patches = {NULL, 0, 0};
+    for (uint32_t i = 0; i < n_segments; i++) {
+        if (segments[i].fd != -1) {
+            int res = _segment_scan(i, &patches);
+            if (res < 0) {
+                free(patches.patches);
+                return res;
+            }
+        }
+    }
+
+    // Patches only make sense on top of the version they were written over
+    qsort(patches.patches, patches.n_patches, sizeof(struct pending_patch), _patch_seq_cmp);
+    for (size_t i = 0; i < patches.n_patches; i++) {
+        struct pending_patch *patch = &patches.patches[i];
+
+        int res = _index_patch(patch->hash, patch->seq, patch->start, &patch->loc);
+        if (res < 0) {
+            free(patches.patches);
+            return res;
+        }
+    }
+    free(patches.patches);
+
+    // Always start appending to a fresh segment
+    int res = _segment_create(found ? max_segment + 1 : 0);
+    if (res < 0)
+        return res;
+    active_segment = n_segments - 1;
+
+    gc_running = 1;
+    if (pthread_create(&gc_thread, NULL, _segment_gc_loop, NULL) != 0) {
+        gc_running = 0;
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+void segment_store_close(void)
+{
+    if (gc_running) {
+        gc_running = 0;
+        pthread_join(gc_thread, NULL);
+    }
+
+    pthread_mutex_lock(&store_lock);
+
+    for (uint32_t i = 0; i < n_segments; i++) {
+        if (segments[i].fd != -1)
+            close(segments[i].fd);
+    }
+    free(segments);
+    segments   = NULL;
+    n_segments = 0;
+
+    for (size_t i = 0; i < index_n_buckets; i++) {
+        struct index_entry *entry = index_buckets[i];
+        while (entry != NULL) {
+            struct index_entry *next = entry->next;
+            free(entry->extents);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(index_buckets);
+    index_buckets   = NULL;
+    index_n_buckets = 0;
+    index_count     = 0;
+
+    pthread_mutex_unlock(&store_lock);
+}
+
+uint64_t segment_seq(void)
+{
+    pthread_mutex_lock(&store_lock);
+    uint64_t seq = next_seq;
+    pthread_mutex_unlock(&store_lock);
+
+    return seq;
+}
+
+int segment_list(uint64_t before, segment_list_fn fn, void *ctx)
+{
+    // Calls fn for every live shard last written before segment_seq returned before, with the
+    // store locked
+    int res = 0;
+
+    pthread_mutex_lock(&store_lock);
+
+    for (size_t i = 0; res == 0 && i < index_n_buckets; i++) {
+        for (struct index_entry *entry = index_buckets[i]; res == 0 && entry != NULL;
+             entry = entry->next) {
+            if (entry->flags != SEGMENT_RECORD_LIVE || entry->seq >= before)
+                continue;
+
+            char hash[SHARD_FN_LEN + 1];
+            memcpy(hash, entry->hash, SHARD_FN_LEN);
+            hash[SHARD_FN_LEN] = '\0';
+
+            res = fn(hash, ctx);
+        }
+    }
+
+    pthread_mutex_unlock(&store_lock);
+
+    return res;
+}
+
+ssize_t segment_size(const char hash[])
+{
+    ssize_t res;
+
+    pthread_mutex_lock(&store_lock);
+
+    struct index_entry *entry = _index_find(hash);
+    if (entry == NULL || entry->flags != SEGMENT_RECORD_LIVE)
+        res = -ENOENT;
+    else
+        res = _entry_length(entry);
+
+    pthread_mutex_unlock(&store_lock);
+
+    return res;
+}
+
+ssize_t segment_read(const char hash[], char *buf, size_t size, off_t offset)
+{
+    ssize_t res;
+
+    pthread_mutex_lock(&store_lock);
+
+    struct index_entry *entry = _index_find(hash);
+    if (entry == NULL || entry->flags != SEGMENT_RECORD_LIVE)
+        res = -ENOENT;
+    else
+        res = _entry_read(entry, buf, size, offset);
+
+    pthread_mutex_unlock(&store_lock);
+
+    return res;
+}
+
+int segment_write(const char hash[], const char *buf, size_t size)
+{
+    pthread_mutex_lock(&store_lock);
+
+    struct segment_location loc;
+    uint64_t seq         = next_seq++;
+    struct iovec payload = {(void *)buf, size};
+
+    int res = _segment_append(hash, SEGMENT_RECORD_LIVE, seq, &payload, 1, &loc);
+    if (res == 0)
+        res = _index_update(hash, SEGMENT_RECORD_LIVE, seq, &loc);
+
+    pthread_mutex_unlock(&store_lock);
+
+    return res;
+}
+
+int segment_patch(const char hash[], const char *buf, size_t size, off_t offset)
+{
+    pthread_mutex_lock(&store_lock);
+
+    // A shard patched before it was ever written starts out as an empty record
+    int res                   = 0;
+    struct index_entry *entry = _index_find(hash);
+    if (entry == NULL || entry->flags != SEGMENT_RECORD_LIVE) {
+        struct segment_location loc;
+        uint64_t seq = next_seq++;
+
+        res = _segment_append(hash, SEGMENT_RECORD_LIVE, seq, NULL, 0, &loc);
+        if (res == 0)
+            res = _index_update(hash, SEGMENT_RECORD_LIVE, seq, &loc);
+    }
+
+    // Records are immutable, so only the patched bytes are appended, after the offset they go
+    // to. The index reads them over the shard's record until compaction merges the two
+    if (res == 0 && size > 0) {
+        struct segment_location loc;
+        uint64_t seq         = next_seq++;
+        uint64_t start       = offset;
+        struct iovec parts[] = {{&start, sizeof(start)}, {(void *)buf, size}};
+
+        res = _segment_append(hash, SEGMENT_RECORD_PATCH, seq, parts, 2, &loc);
+        if (res == 0) {
+            struct segment_location bytes = {loc.segment, loc.offset + sizeof(start), size};
+
+            res = _index_patch(hash, seq, start, &bytes);
+            if (res < 0)
+                _segment_unreserve(&loc);
+        }
+    }
+
+    pthread_mutex_unlock(&store_lock);
+
+    return res;
+}
+
+int segment_unlink(const char hash[])
+{
+    pthread_mutex_lock(&store_lock);
+
+    struct index_entry *entry = _index_find(hash);
+    if (entry == NULL || entry->flags != SEGMENT_RECORD_LIVE) {
+        pthread_mutex_unlock(&store_lock);
+        return -ENOENT;
+    }
+
+    struct segment_location loc;
+    uint64_t seq = next_seq++;
+
+    int res = _segment_append(hash, SEGMENT_RECORD_TOMBSTONE, seq, NULL, 0, &loc);
+    if (res == 0)
+        res = _index_update(hash, SEGMENT_RECORD_TOMBSTONE, seq, &loc);
+
+    pthread_mutex_unlock(&store_lock);
+
+    return res;
+}
+
+static int _sync_segments(uint32_t first, uint32_t skip)
+{
+    // Flushes the segments from first to the active one, and the directory that names them,
+    // without holding the store lock while the disk catches up
+    pthread_mutex_lock(&store_lock);
+
+    int res    = 0;
+    uint32_t n = active_segment >= first ? active_segment - first + 1 : 0;
+    int fds[n];
+    for (uint32_t i = 0; i < n; i++) {
+        fds[i] = -1;
+        if (first + i != skip && segments[first + i].fd != -1 &&
+            (fds[i] = dup(segments[first + i].fd)) == -1)
+            res = -errno;
+    }
+
+    pthread_mutex_unlock(&store_lock);
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (fds[i] != -1 && fdatasync(fds[i]) == -1 && res == 0)
+            res = -errno;
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+
+    char dir[strlen(shardpoint) + 16];
+    sprintf(dir, "%ssegments", shardpoint);
+
+    return res == 0 ? sync_dir(dir) : res;
+}
+
+int segment_compact(uint32_t segment)
+{
+    pthread_mutex_lock(&store_lock);
+    if (segment >= n_segments || segment == active_segment || segments[segment].fd == -1) {
+        pthread_mutex_unlock(&store_lock);
+        return -EINVAL;
+    }
+
+    int fd              = segments[segment].fd;
+    uint64_t end        = segments[segment].size;
+    uint32_t first_copy = active_segment;
+    pthread_mutex_unlock(&store_lock);
+
+    uint64_t offset = 0;
+    while (offset + sizeof(struct segment_record) <= end) {
+        struct segment_record record;
+        if (pread(fd, &record, sizeof(record), offset) != sizeof(record) ||
+            record.magic != SEGMENT_MAGIC)
+            return -EIO;
+
+        uint64_t payload_offset = offset + sizeof(record);
+        uint64_t copied         = 0;
+
+        pthread_mutex_lock(&store_lock);
+
+        struct index_entry *entry = _index_find(record.hash);
+        int current;
+        if (record.flags == SEGMENT_RECORD_PATCH)
+            current = _patch_current(entry, segment, payload_offset, record.length);
+        else
+            current = entry != NULL && entry->loc.segment == segment &&
+                      entry->loc.offset == payload_offset;
+
+        if (current && entry->n_extents > 0) {
+            // Merge the shard's record and patches into one record, so that none of them is
+            // needed any more wherever they are
+            struct segment_location loc;
+            int res = _segment_reserve(record.hash, SEGMENT_RECORD_LIVE, entry->seq,
+                                       _entry_length(entry), &loc);
+            if (res == 0)
+                res = _segment_merge(entry, &loc);
+            if (res < 0) {
+                pthread_mutex_unlock(&store_lock);
+                return res;
+            }
+
+            segments[entry->loc.segment].dead += _record_size(entry->loc.length);
+            _extents_drop(entry);
+            entry->loc = loc;
+            copied     = _record_size(loc.length);
+        } else if (current &&
+                   (record.flags == SEGMENT_RECORD_LIVE || _tombstone_needed(entry, segment))) {
+            // Copy the payload forward one window at a time
+            struct segment_location loc;
+            int res = _segment_reserve(record.hash, record.flags, record.seq, record.length,
+                                       &loc);
+            if (res == 0)
+                res = _segment_copy(fd, payload_offset, &loc);
+            if (res < 0) {
+                pthread_mutex_unlock(&store_lock);
+                return res;
+            }
+
+            // The copy keeps its sequence number, so this only moves the entry
+            if (record.flags == SEGMENT_RECORD_TOMBSTONE)
+                segments[loc.segment].dead += _record_size(loc.length);
+            entry->loc = loc;
+            copied     = _record_size(record.length);
+        } else if (current) {
+            // Nothing older is left for this tombstone to shadow
+            _index_remove(record.hash);
+        }
+
+        pthread_mutex_unlock(&store_lock);
+
+        _sleep_for_bytes(copied);
+
+        offset = payload_offset + record.length;
+    }
+
+    // Every live record has moved, and the copies reach the disk before the segment goes
+    int res = _sync_segments(first_copy, segment);
+    if (res < 0)
+        return res;
+
+    pthread_mutex_lock(&store_lock);
+
+    char path[strlen(shardpoint) + 32];
+    _segment_path(segment, path, sizeof(path));
+    unlink(path);
+
+    close(segments[segment].fd);
+    segments[segment].fd   = -1;
+    segments[segment].size = 0;
+    segments[segment].dead = 0;
+
+    pthread_mutex_unlock(&store_lock);
+
+    return 0;
+}
@@ -9,7 +9,8 @@
 *        int num_required              = 3;
 *
 *        struct pair shares[num_shards];
-*        get_shares(secret, num_shards, num_required, shares);
+*        if (get_shares(secret, num_shards, num_required, shares) != 0)
+*            return;
 *
 *        for (int i = 0; i < num_shards; i++) {
 *            printf("X: %lld, Y: %lld\n", shares[i].a, shares[i].b);
@@ -19,6 +20,12 @@
 *
 *        printf("Secret: %lld\nRecovered Secret: %lld\n", secret, recovered_secret);
 *
+*        // Many secrets sharing one set of x coordinates
+*        unsigned long long int xs[num_shards], ys[num_shards * n_secrets];
+*        get_shares_batch(secrets, n_secrets, num_shards, num_required, xs, ys);
+*        get_secrets_batch(xs, ys, num_required, n_secrets, recovered);
+*        get_shares_at(xs, ys, num_required, n_secrets, lost_x, lost_ys);
+*
 * AUTHOR: Charles Averill
 */
 
@@ -26,15 +33,44 @@
 
 unsigned long long int _PRIME = 2305843009213693951; // 2 ^ 61 - 1
 
+// Lagrange weights for recently used sets of x coordinates, one table per thread
+struct lagrange_weights {
+    int k;
+    unsigned long long int xs[SHAMIR_MAX_SHARES];
+    unsigned long long int weights[SHAMIR_MAX_SHARES];
+};
+
+static __thread struct lagrange_weights weight_cache[SHAMIR_WEIGHT_CACHE_SIZE];
+static __thread int weight_cache_next;
+
+unsigned long long int _mulmod(unsigned long long int a, unsigned long long int b)
+{
+    // Both factors are below 2^61 - 1. Since 2^61 = 1 (mod p), the high bits of the 122-bit
+    // product fold onto the low 61 bits with a shift and an add instead of a division
+    unsigned __int128 product = (unsigned __int128)a * b;
+    unsigned long long int r  = ((unsigned long long int)product & _PRIME) +
+                                 (unsigned long long int)(product >> 61);
+    return r >= _PRIME ? r - _PRIME : r;
+}
+
+unsigned long long int _addmod(unsigned long long int a, unsigned long long int b)
+{
+    unsigned long long int r = a + b;
+    return r >= _PRIME ? r - _PRIME : r;
+}
+
+unsigned long long int _submod(unsigned long long int a, unsigned long long int b)
+{
+    return a >= b ? a - b : a + _PRIME - b;
+}
+
 unsigned long long int _get_y(unsigned long long int x, unsigned long long int coefficients[],
                               int n_coefficients)
 {
     unsigned long long int y = 0;
 
     for (int i = n_coefficients - 1; i >= 0; i--) {
-        y *= x;
-        y += coefficients[i];
-        y %= _PRIME;
+        y = _addmod(_mulmod(y, x), coefficients[i]);
     }
 
     return y;
@@ -42,101 +78,208 @@ unsigned long long int _get_y(unsigned long long int x, unsigned long long int c
 
 unsigned long long int _extended_gcd(unsigned long long int a, unsigned long long int b)
 {
-    unsigned long long int x      = 0;
-    unsigned long long int y      = 1;
-    unsigned long long int last_x = 1;
-    unsigned long long int last_y = 0;
+    // Returns the inverse of a modulo b. Coefficients go negative, so track them signed
+    __int128 x       = 0;
+    __int128 last_x  = 1;
+    __int128 modulus = b;
 
     while (b != 0) {
         // clang-format off
-        long long int quotient = a / b;
-        printf("%lld %lld %lld\n", a, b, quotient);
-        
+        unsigned long long int quotient = a / b;
+
         unsigned long long int temp = b;
         b = a % b;
         a = temp;
-        
-        temp = x;
-        x = last_x - quotient * x;
-        last_x = temp;
-        
-        temp = y;
-        y = last_y - quotient * y;
-        last_y = temp;
+
+        __int128 temp_x = x;
+        x = last_x - (__int128)quotient * x;
+        last_x = temp_x;
         // clang-format on
     }
 
-    return last_x;
+    last_x %= modulus;
+    if (last_x < 0)
+        last_x += modulus;
+
+    return (unsigned long long int)last_x;
 }
 
-unsigned long long int _divmod(unsigned long long int numerator, unsigned long long int denominator)
+int _compute_weights(const unsigned long long int xs[], int k, unsigned long long int x,
+                     unsigned long long int weights[])
 {
-    unsigned long long int inverse = _extended_gcd(denominator, _PRIME);
-    return inverse * numerator;
+    // f(x) = sum(y_i * w_i) with w_i = prod((x - x_j) / (x_i - x_j)) over j != i, which for the
+    // secret f(0) is prod(x_j / (x_j - x_i)). Weights depend only on the x coordinates, never on
+    // the shares themselves
+    for (int i = 0; i < k; i++) {
+        unsigned long long int numerator   = 1;
+        unsigned long long int denominator = 1;
+
+        for (int j = 0; j < k; j++) {
+            if (j == i)
+                continue;
+
+            unsigned long long int diff = _submod(xs[i], xs[j]);
+            if (diff == 0)
+                return -1;
+
+            numerator   = _mulmod(numerator, _submod(x, xs[j]));
+            denominator = _mulmod(denominator, diff);
+        }
+
+        weights[i] = _mulmod(numerator, _extended_gcd(denominator, _PRIME));
+    }
+
+    return 0;
 }
 
-unsigned long long int _product_of_inputs(unsigned long long int values[], int n_values)
+const unsigned long long int *_get_weights(const unsigned long long int xs[], int k,
+                                           unsigned long long int scratch[])
 {
-    unsigned long long int product = 1;
-    for (int i = 0; i < n_values; i++) {
-        product *= values[i];
+    if (k > SHAMIR_MAX_SHARES)
+        return _compute_weights(xs, k, 0, scratch) == 0 ? scratch : NULL;
+
+    for (int i = 0; i < SHAMIR_WEIGHT_CACHE_SIZE; i++) {
+        struct lagrange_weights *entry = &weight_cache[i];
+        if (entry->k == k && memcmp(entry->xs, xs, k * sizeof(xs[0])) == 0)
+            return entry->weights;
     }
-    return product;
+
+    struct lagrange_weights *entry = &weight_cache[weight_cache_next];
+    if (_compute_weights(xs, k, 0, entry->weights) != 0)
+        return NULL;
+
+    entry->k = k;
+    memcpy(entry->xs, xs, k * sizeof(xs[0]));
+    weight_cache_next = (weight_cache_next + 1) % SHAMIR_WEIGHT_CACHE_SIZE;
+
+    return entry->weights;
 }
 
-unsigned long long int _lagrange_interpolate(unsigned long long int x, struct pair points[], int k)
+static int _random_coefficients(unsigned long long int coefficients[], int n)
 {
-    unsigned long long int numerators[k];
-    unsigned long long int denominators[k];
+    // Coefficients that are not random would give the secret away, so a short read fails
+    size_t len = n * sizeof(coefficients[0]);
 
-    for (int i = 0; i < k; i++) {
-        unsigned long long int temp_numerators[k - 1];
-        unsigned long long int temp_denominators[k - 1];
+    for (size_t got = 0; got < len;) {
+        ssize_t res = getrandom((char *)coefficients + got, len - got, GRND_NONBLOCK);
+        if (res == -1 && errno != EINTR)
+            return -errno;
+        if (res > 0)
+            got += res;
+    }
+
+    return 0;
+}
+
+int get_shares_batch(const unsigned long long int secrets[], int n_secrets, int n_shares,
+                     int n_required, unsigned long long int xs[], unsigned long long int ys[])
+{
+    if (n_required < 1 || n_shares < n_required)
+        return -EINVAL;
+
+    for (int i = 0; i < n_shares; i++) {
+        xs[i] = i + 1;
+    }
+
+    // One random polynomial per secret, all evaluated at the same x coordinates
+    unsigned long long int coefficients[n_required];
+    for (int s = 0; s < n_secrets; s++) {
+        coefficients[0] = secrets[s] % _PRIME;
+
+        int res = _random_coefficients(coefficients + 1, n_required - 1);
+        if (res != 0)
+            return res;
 
-        for (int j = 0; j < k - 1; j++) {
-            int pop_j            = j < i ? j : j + 1;
-            temp_numerators[j]   = x - points[pop_j].a;
-            temp_denominators[j] = points[i].a - points[pop_j].a;
+        for (int i = 1; i < n_required; i++) {
+            coefficients[i] %= _PRIME - 1;
         }
 
-        numerators[i]   = _product_of_inputs(temp_numerators, k - 1);
-        denominators[i] = _product_of_inputs(temp_denominators, k - 1);
+        for (int i = 0; i < n_shares; i++) {
+            ys[i * n_secrets + s] = _get_y(xs[i], coefficients, n_required);
+        }
     }
 
-    unsigned long long int denominator = _product_of_inputs(denominators, k);
-    unsigned long long int numerator   = 0;
+    return 0;
+}
+
+int get_secrets_batch(const unsigned long long int xs[], const unsigned long long int ys[], int k,
+                      int n_secrets, unsigned long long int secrets[])
+{
+    unsigned long long int reduced_xs[k];
     for (int i = 0; i < k; i++) {
-        numerator += _divmod(numerators[i] * denominator * points[i].b % _PRIME, denominators[i]);
+        reduced_xs[i] = xs[i] % _PRIME;
+    }
+
+    unsigned long long int scratch[k];
+    const unsigned long long int *weights = _get_weights(reduced_xs, k, scratch);
+    if (weights == NULL)
+        return -1;
+
+    for (int s = 0; s < n_secrets; s++) {
+        unsigned long long int secret = 0;
+        for (int i = 0; i < k; i++) {
+            secret = _addmod(secret, _mulmod(ys[i * n_secrets + s] % _PRIME, weights[i]));
+        }
+        secrets[s] = secret;
     }
 
-    return (_divmod(numerator, denominator) + _PRIME) % _PRIME;
+    return 0;
 }
 
-void get_shares(unsigned long long int secret, int n_shares, int n_required, struct pair shares[])
+int get_shares_at(const unsigned long long int xs[], const unsigned long long int ys[], int k,
+                  int n_secrets, unsigned long long int x, unsigned long long int shares[])
 {
-    if (n_shares < n_required) {
-        printf("n_shares must be >= n_required\n");
-        exit(1);
+    // Evaluate the polynomials through k shares at another x, which rebuilds a lost share
+    // exactly as it was handed out
+    unsigned long long int reduced_xs[k];
+    for (int i = 0; i < k; i++) {
+        reduced_xs[i] = xs[i] % _PRIME;
     }
 
-    unsigned long long int coefficients[n_required];
-    coefficients[0] = secret;
-
-    unsigned long long int tmp_rand;
-    for (int i = 1; i < n_required; i++) {
-        getrandom(&tmp_rand, sizeof(unsigned long long int), GRND_NONBLOCK);
-        tmp_rand %= _PRIME - 1;
+    unsigned long long int weights[k];
+    if (_compute_weights(reduced_xs, k, x % _PRIME, weights) != 0)
+        return -1;
 
-        coefficients[i] = tmp_rand;
+    for (int s = 0; s < n_secrets; s++) {
+        unsigned long long int y = 0;
+        for (int i = 0; i < k; i++) {
+            y = _addmod(y, _mulmod(ys[i * n_secrets + s] % _PRIME, weights[i]));
+        }
+        shares[s] = y;
     }
 
-    for (int i = 1; i < n_shares + 1; i++) {
-        shares[i - 1].a = i;
-        shares[i - 1].b = _get_y(i, coefficients, n_required);
+    return 0;
+}
+
+int get_shares(unsigned long long int secret, int n_shares, int n_required, struct pair shares[])
+{
+    unsigned long long int xs[n_shares];
+    unsigned long long int ys[n_shares];
+
+    int res = get_shares_batch(&secret, 1, n_shares, n_required, xs, ys);
+    if (res != 0)
+        return res;
+
+    for (int i = 0; i < n_shares; i++) {
+        shares[i].a = xs[i];
+        shares[i].b = ys[i];
     }
+
+    return 0;
 }
 
 unsigned long long int get_secret(struct pair shares[], int n_shares)
 {
-    return _lagrange_interpolate(0, shares, n_shares);
+    unsigned long long int xs[n_shares];
+    unsigned long long int ys[n_shares];
+
+    for (int i = 0; i < n_shares; i++) {
+        xs[i] = shares[i].a;
+        ys[i] = shares[i].b;
+    }
+
+    unsigned long long int secret = 0;
+    get_secrets_batch(xs, ys, n_shares, 1, &secret);
+
+    return secret;
 }
@@ -0,0 +1,631 @@
+/*
+* FILENAME: shards.c
+*
+* DESCRIPTION: Placement of shard files under the shardpoint. Shards are spread
+*              over a hex-prefix fan-out hierarchy (ab/cd/<hash>.shard by default)
+*              so that no single directory has to hold millions of entries.
+*              Fan-out directories are created lazily when a shard is written.
+*              The shard_* I/O calls hide whether a shard is a file of its own or
+*              a record in the segment store. The layout is recorded in a
+*              superblock when a store is created, and mounts take it from there.
+*              Shards named by more than one header
+*              record, as after a snapshot, count their references in a small file
+*              under refs/. A shard without one has exactly one reference. Shard
+*              files are found on whichever tier they live on, and changed while
+*              holding their tier lock. Every change is also queued for the
+*              replica targets.
+*
+* USAGE: char shard_path[shard_path_len()];
+*        get_shard_path(hash, shard_path);
+*
+*        shard_write(hash, payload, payload_len);
+*        shard_pwrite(hash, patch, patch_len, offset);
+*        shard_read(hash, buf, shard_size(hash), 0);
+*
+*        shard_ref(hash);
+*        if (shard_unref(hash) == 0)
+*            shard_unlink(hash);
+*
+* AUTHOR: Charles Averill
+*/
+
+#define _GNU_SOURCE
+
+#include "shards.h"
+
+int shard_fanout_depth = 2;
+int shard_fanout_width = 2;
+int shard_fanout_given = 0;
+
+size_t fanout_path_len(const char base[], const char suffix[])
+{
+    // base + one "xx/" per level + hash + suffix + '\0'
+    return strlen(base) + shard_fanout_depth * (shard_fanout_width + 1) + SHARD_FN_LEN +
+           strlen(suffix) + 1;
+}
+
+void get_fanout_path(const char base[], const char hash[], const char suffix[], char obuf[])
+{
+    size_t len = strlen(base);
+
+    memcpy(obuf, base, len);
+
+    // One directory level per width-sized slice of the hash prefix
+    for (int level = 0; level < shard_fanout_depth; level++) {
+        memcpy(obuf + len, hash + level * shard_fanout_width, shard_fanout_width);
+        len += shard_fanout_width;
+        obuf[len++] = '/';
+    }
+
+    memcpy(obuf + len, hash, SHARD_FN_LEN);
+    len += SHARD_FN_LEN;
+    strcpy(obuf + len, suffix);
+}
+
+int make_fanout_dirs(const char base[], const char hash[])
+{
+    char dir_path[fanout_path_len(base, "")];
+    size_t len = strlen(base);
+
+    memcpy(dir_path, base, len);
+
+    for (int level = 0; level < shard_fanout_depth; level++) {
+        memcpy(dir_path + len, hash + level * shard_fanout_width, shard_fanout_width);
+        len += shard_fanout_width;
+        dir_path[len] = '\0';
+
+        if (mkdir_if_not_exists(dir_path, 0700) != 0 && errno != EEXIST)
+            return -errno;
+
+        dir_path[len++] = '/';
+    }
+
+    return 0;
+}
+
+static int _hex_name(const char name[], size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int _fanout_walk(const char dir[], int level, const char suffix[], fanout_walk_fn fn,
+                        void *ctx)
+{
+    DIR *dp = opendir(dir);
+    if (dp == NULL)
+        return errno == ENOENT ? 0 : -errno;
+
+    int res = 0;
+    struct dirent *entry;
+
+    while (res == 0 && (entry = readdir(dp)) != NULL) {
+        size_t len = strlen(entry->d_name);
+
+        char path[strlen(dir) + len + 2];
+        sprintf(path, "%s%s", dir, entry->d_name);
+
+        // Only hex-named directories of the right width lead to files, everything else that
+        // shares the base is skipped
+        if (level < shard_fanout_depth) {
+            if (len != (size_t)shard_fanout_width || !_hex_name(entry->d_name, len))
+                continue;
+
+            strcat(path, "/");
+            res = _fanout_walk(path, level + 1, suffix, fn, ctx);
+            continue;
+        }
+
+        if (len < SHARD_FN_LEN + strlen(suffix) || !_hex_name(entry->d_name, SHARD_FN_LEN) ||
+            ends_with(entry->d_name, suffix) != 1)
+            continue;
+
+        struct stat st;
+        if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode))
+            continue;
+
+        char hash[SHARD_FN_LEN + 1];
+        memcpy(hash, entry->d_name, SHARD_FN_LEN);
+        hash[SHARD_FN_LEN] = '\0';
+
+        res = fn(hash, &st, ctx);
+    }
+
+    closedir(dp);
+
+    return res;
+}
+
+int fanout_walk(const char base[], const char suffix[], fanout_walk_fn fn, void *ctx)
+{
+    // Calls fn for every file named <hash><anything><suffix> in the fan-out hierarchy under base
+    return _fanout_walk(base, 0, suffix, fn, ctx);
+}
+
+size_t shard_path_len(void)
+{
+    return fanout_path_len(shardpoint, ".shard");
+}
+
+void get_shard_path(const char hash[], char obuf[])
+{
+    get_fanout_path(shardpoint, hash, ".shard", obuf);
+}
+
+int make_shard_dirs(const char hash[])
+{
+    return make_fanout_dirs(shardpoint, hash);
+}
+
+int migrate_flat_shards(void)
+{
+    // Move every <hash>.shard sitting directly in the shardpoint into its fan-out directory
+    DIR *dp = opendir(shardpoint);
+    if (dp == NULL)
+        return -errno;
+
+    int migrated = 0;
+    struct dirent *entry;
+
+    while ((entry = readdir(dp)) != NULL) {
+        if (strlen(entry->d_name) != SHARD_FN_LEN + 6 || ends_with(entry->d_name, ".shard") != 1)
+            continue;
+
+        char old_path[strlen(shardpoint) + SHARD_FN_LEN + 7];
+        strcpy(old_path, shardpoint);
+        strcat(old_path, entry->d_name);
+
+        char new_path[shard_path_len()];
+        get_shard_path(entry->d_name, new_path);
+
+        int res = make_shard_dirs(entry->d_name);
+        if (res < 0 || rename(old_path, new_path) == -1) {
+            res = res < 0 ? res : -errno;
+            printf("Could not migrate shard %s\n", entry->d_name);
+            closedir(dp);
+            return res;
+        }
+
+        migrated++;
+    }
+
+    closedir(dp);
+
+    return migrated;
+}
+
+int shard_layout_read(int *depth, int *width)
+{
+    char path[strlen(shardpoint) + strlen(SHARD_SUPERBLOCK) + 1];
+    sprintf(path, "%s%s", shardpoint, SHARD_SUPERBLOCK);
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -errno;
+
+    char magic[sizeof(SHARD_SUPERBLOCK_MAGIC) + 1] = "";
+    int fields = fgets(magic, sizeof(magic), fp) != NULL ? 1 : 0;
+    fields += fscanf(fp, "fanout-depth %d\nfanout-width %d\n", depth, width);
+    fclose(fp);
+
+    if (fields != 3 || strcmp(magic, SHARD_SUPERBLOCK_MAGIC "\n") != 0 || *depth < 0 ||
+        *depth > SHARD_FANOUT_MAX_DEPTH || *width < 1 || *width > SHARD_FANOUT_MAX_WIDTH)
+        return -EIO;
+
+    return 0;
+}
+
+int shard_layout_write(int replace)
+{
+    // Records the current layout. Unless it replaces the record, it fails with -EEXIST when
+    // another process recorded one first
+    char path[strlen(shardpoint) + strlen(SHARD_SUPERBLOCK) + 32];
+    char tmp_path[sizeof(path)];
+    sprintf(path, "%s%s", shardpoint, SHARD_SUPERBLOCK);
+    sprintf(tmp_path, "%s.%d", path, getpid());
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL)
+        return -errno;
+
+    int res = 0;
+    if (fprintf(fp, "%s\nfanout-depth %d\nfanout-width %d\n", SHARD_SUPERBLOCK_MAGIC,
+                shard_fanout_depth, shard_fanout_width) < 0 ||
+        fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+        res = -errno;
+    if (fclose(fp) != 0 && res == 0)
+        res = -errno;
+
+    if (res == 0 && (replace ? rename(tmp_path, path) : link(tmp_path, path)) == -1)
+        res = -errno;
+
+    unlink(tmp_path);
+
+    return res == 0 ? sync_dir(shardpoint) : res;
+}
+
+int shard_layout_open(void)
+{
+    // A store is always read with the layout it was created with. Settings given for another
+    // are refused, and the ones not given are taken from the superblock
+    int depth, width;
+    int res = shard_layout_read(&depth, &width);
+
+    if (res == -ENOENT) {
+        res = shard_layout_write(0);
+        if (res != -EEXIST)
+            return res;
+
+        res = shard_layout_read(&depth, &width);
+    }
+
+    if (res < 0)
+        return res;
+
+    if (((shard_fanout_given & SHARD_GIVEN_DEPTH) && depth != shard_fanout_depth) ||
+        ((shard_fanout_given & SHARD_GIVEN_WIDTH) && width != shard_fanout_width))
+        return -EINVAL;
+
+    shard_fanout_depth = depth;
+    shard_fanout_width = width;
+
+    return 0;
+}
+
+ssize_t shard_size(const char hash[])
+{
+    if (segment_store_enabled)
+        return segment_size(hash);
+
+    struct stat st;
+    int res = tier_stat_shard(hash, &st);
+    if (res < 0)
+        return res;
+
+    return st.st_size;
+}
+
+ssize_t shard_read(const char hash[], char *buf, size_t size, off_t offset)
+{
+    // A shard the shardpoint has lost is read from a replica
+    if (segment_store_enabled) {
+        ssize_t res = segment_read(hash, buf, size, offset);
+
+        return res == -ENOENT ? replica_read(hash, buf, size, offset) : res;
+    }
+
+    int tier;
+    int fd = tier_open_shard(hash, O_RDONLY, &tier);
+    if (fd < 0)
+        return fd == -ENOENT ? replica_read(hash, buf, size, offset) : fd;
+
+    ssize_t res = pread(fd, buf, size, offset);
+    if (res == -1)
+        res = -errno;
+
+    close(fd);
+
+    if (res > 0)
+        tier_note_read(hash, tier, res);
+
+    return res;
+}
+
+static int _local_write(const char hash[], const char *buf, size_t size)
+{
+    if (segment_store_enabled)
+        return segment_write(hash, buf, size);
+
+    tier_lock(hash);
+
+    int tier;
+    int fd = tier_open_shard(hash, O_WRONLY | O_CREAT | O_TRUNC, &tier);
+    if (fd < 0) {
+        tier_unlock(hash);
+        return fd;
+    }
+
+    int res = 0;
+    if (write(fd, buf, size) != (ssize_t)size)
+        res = -EIO;
+
+    close(fd);
+    tier_note_write(hash, tier);
+    tier_unlock(hash);
+
+    return res;
+}
+
+int shard_write(const char hash[], const char *buf, size_t size)
+{
+    int res = _local_write(hash, buf, size);
+    if (res == 0)
+        replica_write(hash, buf, size);
+
+    return res;
+}
+
+static int _local_pwrite(const char hash[], const char *buf, size_t size, off_t offset)
+{
+    if (segment_store_enabled)
+        return segment_patch(hash, buf, size, offset);
+
+    // A shard on the capacity tier is patched where it is, and moves up once it is read often
+    tier_lock(hash);
+
+    int tier;
+    int fd = tier_open_shard(hash, O_WRONLY | O_CREAT, &tier);
+    if (fd < 0) {
+        tier_unlock(hash);
+        return fd;
+    }
+
+    int res = 0;
+    if (pwrite(fd, buf, size, offset) != (ssize_t)size)
+        res = -EIO;
+
+    close(fd);
+    tier_note_write(hash, tier);
+    tier_unlock(hash);
+
+    return res;
+}
+
+int shard_pwrite(const char hash[], const char *buf, size_t size, off_t offset)
+{
+    int res = _local_pwrite(hash, buf, size, offset);
+    if (res == 0)
+        replica_pwrite(hash, buf, size, offset);
+
+    return res;
+}
+
+static int _local_truncate(const char hash[], off_t size)
+{
+    // Segment records are immutable, the bytes past size die with the record's next version
+    if (segment_store_enabled)
+        return 0;
+
+    tier_lock(hash);
+
+    int tier;
+    int fd = tier_open_shard(hash, O_WRONLY, &tier);
+    if (fd < 0) {
+        tier_unlock(hash);
+        return fd == -ENOENT ? 0 : fd;
+    }
+
+    int res = ftruncate(fd, size) == -1 ? -errno : 0;
+
+    close(fd);
+    tier_unlock(hash);
+
+    return res;
+}
+
+int shard_truncate(const char hash[], off_t size)
+{
+    int res = _local_truncate(hash, size);
+    if (res == 0)
+        replica_truncate(hash, size);
+
+    return res;
+}
+
+static int _local_allocate(const char hash[], off_t offset, off_t len)
+{
+    // Segment records are written whole, so there is nothing to reserve ahead of time
+    if (segment_store_enabled)
+        return 0;
+
+    tier_lock(hash);
+
+    int tier;
+    int fd = tier_open_shard(hash, O_WRONLY | O_CREAT, &tier);
+    if (fd < 0) {
+        tier_unlock(hash);
+        return fd;
+    }
+
+    int res = 0;
+#ifdef HAVE_POSIX_FALLOCATE
+    // The shard grows to cover the reservation, so a later punch can release all of it.
+    // Filesystems that cannot preallocate still get a correct, if unreserved, shard
+    res = posix_fallocate(fd, offset, len);
+    res = res == EOPNOTSUPP || res == EINVAL ? 0 : -res;
+#endif
+
+    close(fd);
+    tier_note_write(hash, tier);
+    tier_unlock(hash);
+
+    return res;
+}
+
+int shard_allocate(const char hash[], off_t offset, off_t len)
+{
+    int res = _local_allocate(hash, offset, len);
+    if (res == 0)
+        replica_allocate(hash, offset, len);
+
+    return res;
+}
+
+static int _local_punch(const char hash[], off_t offset, off_t len)
+{
+    if (segment_store_enabled)
+        return 0;
+
+    tier_lock(hash);
+
+    int tier;
+    int fd = tier_open_shard(hash, O_WRONLY, &tier);
+    if (fd < 0) {
+        tier_unlock(hash);
+        return fd == -ENOENT ? 0 : fd;
+    }
+
+    int res = 0;
+#ifdef __linux__
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == -1 &&
+        errno != EOPNOTSUPP)
+        res = -errno;
+#endif
+
+    close(fd);
+    tier_unlock(hash);
+
+    return res;
+}
+
+int shard_punch(const char hash[], off_t offset, off_t len)
+{
+    int res = _local_punch(hash, offset, len);
+    if (res == 0)
+        replica_punch(hash, offset, len);
+
+    return res;
+}
+
+uint64_t shard_epoch(void)
+{
+    // Shards written from here on compare as newer than the value returned
+    if (segment_store_enabled)
+        return segment_seq();
+
+    return time(NULL);
+}
+
+struct shard_list_ctx {
+    uint64_t before;
+    shard_list_fn fn;
+    void *ctx;
+};
+
+static int _list_file(const char hash[], const struct stat *st, void *ctx)
+{
+    struct shard_list_ctx *list = ctx;
+
+    // File times are coarse, so a shard written in the same second as the epoch counts as newer
+    if ((uint64_t)st->st_mtime + 1 >= list->before)
+        return 0;
+
+    return list->fn(hash, list->ctx);
+}
+
+int shard_list(uint64_t before, shard_list_fn fn, void *ctx)
+{
+    // Calls fn for every shard last written before shard_epoch returned before
+    if (segment_store_enabled)
+        return segment_list(before, fn, ctx);
+
+    struct shard_list_ctx list = {before, fn, ctx};
+
+    int res = fanout_walk(shardpoint, ".shard", _list_file, &list);
+    if (res == 0 && tier_base(TIER_CAPACITY) != NULL)
+        res = fanout_walk(tier_base(TIER_CAPACITY), ".shard", _list_file, &list);
+
+    return res;
+}
+
+int shard_unlink(const char hash[])
+{
+    if (segment_store_enabled) {
+        int res = segment_unlink(hash);
+        if (res == 0 || res == -ENOENT)
+            replica_unlink(hash);
+
+        return res;
+    }
+
+    tier_lock(hash);
+    int res = tier_unlink_shard(hash);
+    tier_unlock(hash);
+
+    // Replicas may hold a shard the shardpoint has lost
+    if (res == 0 || res == -ENOENT)
+        replica_unlink(hash);
+
+    return res;
+}
+
+static void _refs_base(char obuf[])
+{
+    strcpy(obuf, shardpoint);
+    strcat(obuf, "refs/");
+}
+
+int shard_refs(const char hash[])
+{
+    char base[strlen(shardpoint) + sizeof("refs/")];
+    _refs_base(base);
+
+    char refs_path[fanout_path_len(base, ".refs")];
+    get_fanout_path(base, hash, ".refs", refs_path);
+
+    int fd = open(refs_path, O_RDONLY);
+    if (fd == -1)
+        return errno == ENOENT ? 1 : -errno;
+
+    uint32_t refs;
+    ssize_t n = pread(fd, &refs, sizeof(refs), 0);
+    close(fd);
+
+    return n == sizeof(refs) ? (int)refs : -EIO;
+}
+
+static int _set_refs(const char hash[], uint32_t refs)
+{
+    char base[strlen(shardpoint) + sizeof("refs/")];
+    _refs_base(base);
+
+    char refs_path[fanout_path_len(base, ".refs")];
+    get_fanout_path(base, hash, ".refs", refs_path);
+
+    // A single reference is the default and needs no file
+    if (refs <= 1)
+        return unlink(refs_path) == -1 && errno != ENOENT ? -errno : 0;
+
+    if (mkdir_if_not_exists(base, 0700) != 0 && errno != EEXIST)
+        return -errno;
+
+    int res = make_fanout_dirs(base, hash);
+    if (res < 0)
+        return res;
+
+    int fd = open(refs_path, O_WRONLY | O_CREAT, 0600);
+    if (fd == -1)
+        return -errno;
+
+    res = pwrite(fd, &refs, sizeof(refs), 0) == sizeof(refs) ? 0 : -EIO;
+    close(fd);
+
+    return res;
+}
+
+int shard_ref(const char hash[])
+{
+    int refs = shard_refs(hash);
+    if (refs < 0)
+        return refs;
+
+    return _set_refs(hash, refs + 1);
+}
+
+int shard_unref(const char hash[])
+{
+    // Returns the references left, the caller frees the shard once there are none
+    int refs = shard_refs(hash);
+    if (refs < 0)
+        return refs;
+
+    int res = _set_refs(hash, refs - 1);
+    if (res != 0)
+        return res;
+
+    return refs - 1;
+}
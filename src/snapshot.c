@@ -0,0 +1,313 @@
+/*
+* FILENAME: snapshot.c
+*
+* DESCRIPTION: Copy-on-write snapshots of directory subtrees. Making the
+*              directory <dir>/.snapshots/<name> copies the header record and
+*              block map of every file under <dir> into it, which takes time in
+*              proportion to the metadata only. The copies name the same shards,
+*              whose references are counted, and both sides are flagged as
+*              shared. The next change to a shared file moves it onto a new shard
+*              and keeps reading its unchanged blocks from the old one, so only
+*              blocks written after the snapshot take new storage. Snapshots are
+*              read-only, and removing one drops its references. Clones of single
+*              files share their shards the same way.
+*
+* USAGE: mkdir -p mountpoint/dir/.snapshots/monday
+*        cat mountpoint/dir/.snapshots/monday/file
+*        rmdir mountpoint/dir/.snapshots/monday
+*
+* AUTHOR: Charles Averill
+*/
+
+#include "snapshot.h"
+#include "reclaim.h"
+
+int snapshot_frozen(const char path[])
+{
+    // Everything below a snapshot is read-only
+    return strstr(path, "/" SNAPSHOT_DIR "/") != NULL;
+}
+
+int snapshot_pinned(const char path[])
+{
+    // A .snapshots directory stays where it is, or the snapshots in it would stop being frozen
+    const char *name = strrchr(path, '/');
+
+    return snapshot_frozen(path) || (name != NULL && strcmp(name + 1, SNAPSHOT_DIR) == 0);
+}
+
+int snapshot_root(const char path[])
+{
+    // Returns the length of <dir> if path is <dir>/.snapshots/<name>, or -1
+    const char *name = strrchr(path, '/');
+    size_t suffix    = strlen("/" SNAPSHOT_DIR);
+
+    if (name == NULL || name[1] == '\0' || (size_t)(name - path) < suffix ||
+        strncmp(name - suffix, "/" SNAPSHOT_DIR, suffix) != 0)
+        return -1;
+
+    // Snapshots are not taken of snapshots
+    size_t dir_len = name - suffix - path;
+    char dir[dir_len + 2];
+    memcpy(dir, path, dir_len);
+    strcpy(dir + dir_len, "/");
+
+    return snapshot_frozen(dir) ? -1 : (int)dir_len;
+}
+
+int snapshot_retain(const struct deffs_header *header)
+{
+    int res = shard_ref(header->hash);
+
+    for (uint32_t i = 0; res == 0 && i < header->n_bases; i++) {
+        res = shard_ref(header->bases[i]);
+    }
+
+    return res;
+}
+
+int snapshot_release_hash(const char hash[])
+{
+    int refs = shard_unref(hash);
+    if (refs != 0)
+        return refs < 0 ? refs : 0;
+
+    // That was the last header naming the shard. Inline files never had one
+    int res = keystore_remove(hash);
+    if (res == 0)
+        res = shard_unlink(hash);
+
+    return res == -ENOENT ? 0 : res;
+}
+
+int snapshot_release(const struct deffs_header *header)
+{
+    int res = snapshot_release_hash(header->hash);
+
+    for (uint32_t i = 0; res == 0 && i < header->n_bases; i++) {
+        res = snapshot_release_hash(header->bases[i]);
+    }
+
+    return res;
+}
+
+static int _copy_bytes(int src_fd, int dst_fd)
+{
+    size_t window = stream_window_size;
+    char *buf     = bufpool_get(window);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    int res = 0;
+    off_t pos = 0;
+    ssize_t n;
+
+    while ((n = pread(src_fd, buf, window, pos)) > 0) {
+        if (pwrite(dst_fd, buf, n, pos) != n) {
+            res = -EIO;
+            break;
+        }
+
+        pos += n;
+    }
+
+    if (n == -1)
+        res = -errno;
+
+    bufpool_put(buf, window);
+
+    return res;
+}
+
+int snapshot_share(int src_fd, int dst_fd)
+{
+    // Make the empty header file dst_fd name the same shards as src_fd
+    struct deffs_header header;
+    char payload[HEADER_INLINE_MAX];
+    int res    = header_read(src_fd, &header, payload);
+    int shared = res == 0;
+
+    // Files that were never written have nothing to share
+    if (res == -ENODATA)
+        res = 0;
+
+    // Flag the live file first, so its next change moves it off the shards the copy names
+    if (shared && !(header.flags & HEADER_FLAG_SHARED)) {
+        header.flags |= HEADER_FLAG_SHARED;
+        res = header_write(src_fd, &header, header.flags & HEADER_FLAG_INLINE ? payload : NULL);
+    }
+
+    // The header, any inline payload and the block map are copied as they are, shards are not
+    if (res == 0)
+        res = _copy_bytes(src_fd, dst_fd);
+    if (res == 0 && shared)
+        res = snapshot_retain(&header);
+
+    return res;
+}
+
+static int _copy_file(const char src[], const char dst[], const struct stat *st)
+{
+    int src_fd = open(src, O_RDWR);
+    if (src_fd == -1)
+        return -errno;
+
+    int res    = 0;
+    int dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL, st->st_mode & 07777);
+    if (dst_fd == -1)
+        res = -errno;
+
+    if (res == 0)
+        res = snapshot_share(src_fd, dst_fd);
+
+    if (res == 0) {
+#ifdef __APPLE__
+        struct timespec times[2] = {st->st_atimespec, st->st_mtimespec};
+#else
+        struct timespec times[2] = {st->st_atim, st->st_mtim};
+#endif
+        futimens(dst_fd, times);
+    }
+
+    if (dst_fd != -1)
+        close(dst_fd);
+    close(src_fd);
+
+    return res;
+}
+
+static int _copy_tree(const char src[], const char dst[])
+{
+    DIR *dp = opendir(src);
+    if (dp == NULL)
+        return -errno;
+
+    int res = 0;
+    struct dirent *entry;
+
+    while (res == 0 && (entry = readdir(dp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, SNAPSHOT_DIR) == 0)
+            continue;
+
+        char src_path[strlen(src) + strlen(entry->d_name) + 2];
+        char dst_path[strlen(dst) + strlen(entry->d_name) + 2];
+        sprintf(src_path, "%s/%s", src, entry->d_name);
+        sprintf(dst_path, "%s/%s", dst, entry->d_name);
+
+        // The shardpoint lives in the storepoint, but is not part of the tree
+        char shard_dir[strlen(src_path) + 2];
+        sprintf(shard_dir, "%s/", src_path);
+        if (strcmp(shard_dir, shardpoint) == 0)
+            continue;
+
+        struct stat st;
+        if (lstat(src_path, &st) == -1) {
+            res = -errno;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (mkdir(dst_path, st.st_mode & 07777) == -1)
+                res = -errno;
+            else
+                res = _copy_tree(src_path, dst_path);
+        } else if (S_ISREG(st.st_mode)) {
+            res = _copy_file(src_path, dst_path, &st);
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t n = readlink(src_path, target, sizeof(target) - 1);
+            if (n == -1) {
+                res = -errno;
+                continue;
+            }
+
+            target[n] = '\0';
+            if (symlink(target, dst_path) == -1)
+                res = -errno;
+        }
+    }
+
+    closedir(dp);
+
+    return res;
+}
+
+static int _remove_tree(const char path[])
+{
+    DIR *dp = opendir(path);
+    if (dp == NULL)
+        return -errno;
+
+    int res = 0;
+    struct dirent *entry;
+
+    while (res == 0 && (entry = readdir(dp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char child[strlen(path) + strlen(entry->d_name) + 2];
+        sprintf(child, "%s/%s", path, entry->d_name);
+
+        struct stat st;
+        if (lstat(child, &st) == -1) {
+            res = -errno;
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            res = _remove_tree(child);
+            continue;
+        }
+
+        struct deffs_header header;
+        int header_res = S_ISREG(st.st_mode) ? header_read_path(child, &header, NULL) : -ENODATA;
+
+        if (unlink(child) == -1)
+            res = -errno;
+        else if (header_res == 0)
+            res = reclaim_queue(&header);
+    }
+
+    closedir(dp);
+
+    if (res == 0 && rmdir(path) == -1)
+        res = -errno;
+
+    return res;
+}
+
+int snapshot_create(const char path[])
+{
+    int dir_len = snapshot_root(path);
+    if (dir_len < 0)
+        return -EINVAL;
+
+    char src[strlen(storepoint) + dir_len + 1];
+    sprintf(src, "%s%.*s", storepoint, dir_len, path);
+
+    char dst[strlen(storepoint) + strlen(path) + 1];
+    sprintf(dst, "%s%s", storepoint, path);
+
+    struct stat st;
+    if (stat(src, &st) == -1)
+        return -errno;
+
+    char snapshots[strlen(src) + strlen(SNAPSHOT_DIR) + 2];
+    sprintf(snapshots, "%s/%s", src, SNAPSHOT_DIR);
+
+    if (mkdir_if_not_exists(snapshots, 0755) != 0 && errno != EEXIST)
+        return -errno;
+    if (mkdir(dst, st.st_mode & 07777) == -1)
+        return -errno;
+
+    return _copy_tree(src, dst);
+}
+
+int snapshot_delete(const char path[])
+{
+    if (snapshot_root(path) < 0)
+        return -EINVAL;
+
+    char dst[strlen(storepoint) + strlen(path) + 1];
+    sprintf(dst, "%s%s", storepoint, path);
+
+    return _remove_tree(dst);
+}
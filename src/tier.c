@@ -0,0 +1,779 @@
+/*
+* FILENAME: tier.c
+*
+* DESCRIPTION: Placement of shard files over a fast and a capacity tier. The fast
+*              tier is the shardpoint and the capacity tier is capacity_tier, both
+*              laid out with the same fan-out. Shards are created, and rewritten
+*              whole, on the fast tier, and every read is counted against the tier
+*              that served it. A background thread passes over the fast tier every
+*              TIER_SCAN_INTERVAL seconds and moves shards that have not been used
+*              for tier_cold_age seconds, or the coldest ones while the fast tier
+*              holds more than tier_fast_size bytes, to the capacity tier. Shards
+*              read on TIER_PROMOTE_HITS separate seconds while on the capacity
+*              tier move back. A move copies the shard at no more than tier_rate
+*              bytes per second and switches over only if the shard did not change
+*              in the meantime. Changes to a shard hold its lock, which the switch
+*              takes as well. The counters are read through the
+*              DEFFS_IOC_TIER_STATS ioctl.
+*
+* USAGE: tier_start();
+*
+*        tier_lock(hash);
+*        int fd = tier_open_shard(hash, O_WRONLY | O_CREAT, &tier);
+*        // write to fd, close it
+*        tier_note_write(hash, tier);
+*        tier_unlock(hash);
+*
+*        tier_stop();
+*
+* AUTHOR: Charles Averill
+*/
+
+#define _GNU_SOURCE
+
+#include "tier.h"
+#include "shards.h"
+
+char *capacity_tier;
+long tier_fast_size = 0;
+long tier_cold_age  = 24 * 60 * 60;
+long tier_rate      = 16 * 1024 * 1024;
+
+// capacity_tier with a trailing slash, set once tiering has started
+static char *capacity_base;
+
+// Held while a shard is changed, and while a move switches it from one tier to the other
+static pthread_mutex_t shard_locks[TIER_LOCKS];
+static pthread_once_t shard_locks_once = PTHREAD_ONCE_INIT;
+
+// Guards the access table, the counters and the wakeups of the tier thread
+static pthread_mutex_t tier_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_cond        = PTHREAD_COND_INITIALIZER;
+
+// Recent accesses of a shard. hits counts the separate seconds it was read in, halved every pass
+struct tier_entry {
+    char hash[SHARD_FN_LEN + 1];
+    uint8_t tier;
+    uint32_t hits;
+    time_t last;
+};
+
+static struct tier_entry *table;
+static size_t table_capacity;
+static size_t table_count;
+
+static struct deffs_tier_stats stats;
+
+static pthread_t tier_thread;
+static int tier_running;
+static int promote_pending;
+
+// A shard considered for a move, copied out of the walk and the access table
+struct tier_candidate {
+    char hash[SHARD_FN_LEN + 1];
+    uint64_t bytes;
+    uint32_t hits;
+    time_t last;
+};
+
+struct tier_scan {
+    struct tier_candidate *candidates;
+    size_t n_candidates;
+    size_t capacity;
+    uint64_t used;
+};
+
+static int _enabled(void)
+{
+    return capacity_base != NULL;
+}
+
+static uint64_t _key(const char hash[])
+{
+    char prefix[17];
+    memcpy(prefix, hash, 16);
+    prefix[16] = '\0';
+
+    return strtoull(prefix, NULL, 16);
+}
+
+const char *tier_base(int tier)
+{
+    // Directory the fan-out of the tier starts in, NULL for a capacity tier that is not in use
+    return tier == TIER_FAST ? shardpoint : capacity_base;
+}
+
+void tier_lock(const char hash[])
+{
+    if (_enabled())
+        pthread_mutex_lock(&shard_locks[_key(hash) % TIER_LOCKS]);
+}
+
+void tier_unlock(const char hash[])
+{
+    if (_enabled())
+        pthread_mutex_unlock(&shard_locks[_key(hash) % TIER_LOCKS]);
+}
+
+static size_t _slot(const struct tier_entry entries[], size_t capacity, const char hash[])
+{
+    size_t i = _key(hash) & (capacity - 1);
+    while (entries[i].hash[0] != '\0' && memcmp(entries[i].hash, hash, SHARD_FN_LEN) != 0)
+        i = (i + 1) & (capacity - 1);
+
+    return i;
+}
+
+static struct tier_entry *_find(const char hash[])
+{
+    // Called with tier_table_lock held
+    if (table_capacity == 0)
+        return NULL;
+
+    struct tier_entry *entry = &table[_slot(table, table_capacity, hash)];
+
+    return entry->hash[0] != '\0' ? entry : NULL;
+}
+
+static int _rehash(size_t capacity, time_t drop_before)
+{
+    // Called with tier_table_lock held. Entries not read since the last pass and last used before
+    // drop_before are left out
+    struct tier_entry *entries = calloc(capacity, sizeof(struct tier_entry));
+    if (entries == NULL)
+        return -ENOMEM;
+
+    size_t count = 0;
+    for (size_t i = 0; i < table_capacity; i++) {
+        if (table[i].hash[0] == '\0' || (table[i].hits == 0 && table[i].last < drop_before))
+            continue;
+
+        entries[_slot(entries, capacity, table[i].hash)] = table[i];
+        count++;
+    }
+
+    free(table);
+    table          = entries;
+    table_capacity = capacity;
+    table_count    = count;
+
+    return 0;
+}
+
+static struct tier_entry *_track(const char hash[])
+{
+    // Called with tier_table_lock held. Returns NULL for a new shard once the table is full
+    struct tier_entry *entry = _find(hash);
+    if (entry != NULL)
+        return entry;
+
+    if (table_count >= TIER_TRACK_MAX)
+        return NULL;
+
+    if (2 * (table_count + 1) > table_capacity &&
+        _rehash(table_capacity > 0 ? table_capacity * 2 : 1024, 0) != 0)
+        return NULL;
+
+    entry = &table[_slot(table, table_capacity, hash)];
+    memcpy(entry->hash, hash, SHARD_FN_LEN);
+    entry->hash[SHARD_FN_LEN] = '\0';
+    entry->tier               = TIER_FAST;
+    entry->hits               = 0;
+    entry->last               = 0;
+    table_count++;
+
+    return entry;
+}
+
+static int _hint(const char hash[])
+{
+    // Tier the shard was last seen on, the fast tier for one that was not
+    pthread_mutex_lock(&tier_table_lock);
+    struct tier_entry *entry = _find(hash);
+    int tier                 = entry != NULL ? entry->tier : TIER_FAST;
+    pthread_mutex_unlock(&tier_table_lock);
+
+    return tier;
+}
+
+void tier_note_read(const char hash[], int tier, size_t bytes)
+{
+    if (!_enabled())
+        return;
+
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&tier_table_lock);
+
+    if (tier == TIER_FAST) {
+        stats.fast_reads++;
+        stats.fast_bytes += bytes;
+    } else {
+        stats.capacity_reads++;
+        stats.capacity_bytes += bytes;
+    }
+
+    // A file is read block by block, so reads within the same second count once
+    struct tier_entry *entry = _track(hash);
+    if (entry != NULL) {
+        if (entry->last != now && entry->hits < UINT32_MAX)
+            entry->hits++;
+        entry->tier = tier;
+        entry->last = now;
+
+        if (tier == TIER_CAPACITY && entry->hits >= TIER_PROMOTE_HITS) {
+            promote_pending = 1;
+            pthread_cond_signal(&tier_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&tier_table_lock);
+}
+
+void tier_note_write(const char hash[], int tier)
+{
+    if (!_enabled())
+        return;
+
+    pthread_mutex_lock(&tier_table_lock);
+
+    struct tier_entry *entry = _track(hash);
+    if (entry != NULL) {
+        entry->tier = tier;
+        entry->last = time(NULL);
+    }
+
+    pthread_mutex_unlock(&tier_table_lock);
+}
+
+static int _open_at(const char hash[], int tier, int flags)
+{
+    char path[fanout_path_len(tier_base(tier), ".shard")];
+    get_fanout_path(tier_base(tier), hash, ".shard", path);
+
+    // Fan-out directories are only created once a shard lands in them
+    if (flags & O_CREAT) {
+        int res = make_fanout_dirs(tier_base(tier), hash);
+        if (res < 0)
+            return res;
+    }
+
+    int fd = open(path, flags, 0600);
+
+    return fd == -1 ? -errno : fd;
+}
+
+static int _unlink_at(const char hash[], int tier)
+{
+    char path[fanout_path_len(tier_base(tier), ".shard")];
+    get_fanout_path(tier_base(tier), hash, ".shard", path);
+
+    return unlink(path) == -1 ? -errno : 0;
+}
+
+static int _find_shard(const char hash[], int flags, int *tier)
+{
+    int first = _hint(hash);
+
+    for (int i = 0; i < 2; i++) {
+        *tier  = i == 0 ? first : !first;
+        int fd = _open_at(hash, *tier, flags);
+        if (fd != -ENOENT)
+            return fd;
+    }
+
+    return -ENOENT;
+}
+
+int tier_open_shard(const char hash[], int flags, int *tier)
+{
+    // Returns a descriptor for the shard on the tier it lives on, or -errno. Callers that change
+    // the shard hold its lock
+    *tier = TIER_FAST;
+    if (!_enabled())
+        return _open_at(hash, TIER_FAST, flags);
+
+    // A shard written whole holds new data, so it starts over on the fast tier
+    if (flags & O_TRUNC) {
+        _unlink_at(hash, TIER_CAPACITY);
+        return _open_at(hash, TIER_FAST, flags);
+    }
+
+    int fd = _find_shard(hash, flags & ~O_CREAT, tier);
+    if (fd == -ENOENT && (flags & O_CREAT)) {
+        *tier = TIER_FAST;
+        return _open_at(hash, TIER_FAST, flags);
+    }
+
+    // Readers do not hold the lock, so they can look for a moving shard on each tier just
+    // before and just after it switches
+    if (fd == -ENOENT && (flags & O_ACCMODE) == O_RDONLY) {
+        tier_lock(hash);
+        fd = _find_shard(hash, flags, tier);
+        tier_unlock(hash);
+    }
+
+    return fd;
+}
+
+int tier_stat_shard(const char hash[], struct stat *st)
+{
+    int tier;
+    int fd = tier_open_shard(hash, O_RDONLY, &tier);
+    if (fd < 0)
+        return fd;
+
+    int res = fstat(fd, st) == -1 ? -errno : 0;
+    close(fd);
+
+    return res;
+}
+
+int tier_unlink_shard(const char hash[])
+{
+    // Called with the shard's lock held
+    int res = _unlink_at(hash, TIER_FAST);
+    if (!_enabled())
+        return res;
+
+    int capacity_res = _unlink_at(hash, TIER_CAPACITY);
+
+    return res == -ENOENT ? capacity_res : res;
+}
+
+void tier_stats(struct deffs_tier_stats *out)
+{
+    pthread_mutex_lock(&tier_table_lock);
+    *out = stats;
+    pthread_mutex_unlock(&tier_table_lock);
+}
+
+static void _throttle(const struct timespec *start, uint64_t bytes)
+{
+    if (tier_rate <= 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double busy    = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    double seconds = (double)bytes / tier_rate - busy;
+    if (seconds <= 0)
+        return;
+
+    struct timespec delay = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&delay, NULL);
+}
+
+static int _copy(int src, int dst, off_t size, char *buf, uint64_t *copied,
+                 const struct timespec *start)
+{
+    // Only data is copied, so the holes punched into a shard stay holes
+    off_t pos = 0;
+
+    while (pos < size) {
+        off_t end = size;
+#ifdef SEEK_DATA
+        off_t data = lseek(src, pos, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            break;
+        if (data != -1) {
+            pos = data;
+            end = lseek(src, data, SEEK_HOLE);
+            if (end == -1 || end > size)
+                end = size;
+        }
+#endif
+
+        while (pos < end) {
+            if (!tier_running)
+                return -EINTR;
+
+            size_t len = end - pos < TIER_COPY_CHUNK ? (size_t)(end - pos) : TIER_COPY_CHUNK;
+            ssize_t n  = pread(src, buf, len, pos);
+            if (n <= 0)
+                return n == 0 ? -EAGAIN : -errno;
+
+            if (pwrite(dst, buf, n, pos) != n)
+                return -EIO;
+
+            pos += n;
+            *copied += n;
+            _throttle(start, *copied);
+        }
+    }
+
+    return 0;
+}
+
+static int _changed(const struct stat *before, const struct stat *after)
+{
+    return before->st_ino != after->st_ino || before->st_size != after->st_size ||
+           before->st_mtim.tv_sec != after->st_mtim.tv_sec ||
+           before->st_mtim.tv_nsec != after->st_mtim.tv_nsec ||
+           before->st_ctim.tv_sec != after->st_ctim.tv_sec ||
+           before->st_ctim.tv_nsec != after->st_ctim.tv_nsec;
+}
+
+static int _move(const char hash[], int from, int to, char *buf, uint64_t *copied,
+                 const struct timespec *start)
+{
+    char from_path[fanout_path_len(tier_base(from), ".shard")];
+    get_fanout_path(tier_base(from), hash, ".shard", from_path);
+
+    char to_path[fanout_path_len(tier_base(to), ".shard")];
+    get_fanout_path(tier_base(to), hash, ".shard", to_path);
+
+    // The copy is not named like a shard until it is complete
+    char tmp_path[sizeof(to_path) + 4];
+    sprintf(tmp_path, "%s.tmp", to_path);
+
+    int src = open(from_path, O_RDONLY);
+    if (src == -1)
+        return -errno;
+
+    struct stat before;
+    int res = fstat(src, &before) == -1 ? -errno : make_fanout_dirs(tier_base(to), hash);
+
+    int dst = -1;
+    if (res == 0 && (dst = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+        res = -errno;
+
+    if (res == 0)
+        res = _copy(src, dst, before.st_size, buf, copied, start);
+    if (res == 0 && ftruncate(dst, before.st_size) == -1)
+        res = -errno;
+
+    // The times say how recently the shard was used, so they move with it
+    struct timespec times[2] = {before.st_atim, before.st_mtim};
+    if (res == 0 && (futimens(dst, times) == -1 || fsync(dst) == -1))
+        res = -errno;
+
+    if (dst != -1)
+        close(dst);
+
+    // Only a shard that is still the same one switches over, changes to it wait meanwhile
+    if (res == 0) {
+        tier_lock(hash);
+
+        struct stat after, linked;
+        if (fstat(src, &after) == -1 || stat(from_path, &linked) == -1 ||
+            _changed(&before, &after) || linked.st_ino != before.st_ino)
+            res = -EAGAIN;
+        else if (rename(tmp_path, to_path) == -1)
+            res = -errno;
+        else if (unlink(from_path) == -1) {
+            res = -errno;
+            unlink(to_path);
+        }
+
+        if (res == 0) {
+            pthread_mutex_lock(&tier_table_lock);
+
+            struct tier_entry *entry = _find(hash);
+            if (entry != NULL)
+                entry->tier = to;
+
+            uint64_t bytes = (uint64_t)before.st_blocks * 512;
+            if (to == TIER_FAST) {
+                stats.promoted++;
+                stats.promoted_bytes += bytes;
+                stats.fast_shards++;
+                stats.fast_used += bytes;
+            } else {
+                stats.demoted++;
+                stats.demoted_bytes += bytes;
+                stats.fast_shards -= stats.fast_shards > 0;
+                stats.fast_used -= bytes < stats.fast_used ? bytes : stats.fast_used;
+            }
+
+            pthread_mutex_unlock(&tier_table_lock);
+        }
+
+        tier_unlock(hash);
+    }
+
+    if (res != 0)
+        unlink(tmp_path);
+
+    close(src);
+
+    return res;
+}
+
+static int _collect(const char hash[], const struct stat *st, void *ctx)
+{
+    struct tier_scan *scan = ctx;
+
+    if (scan->n_candidates == scan->capacity) {
+        size_t capacity = scan->capacity > 0 ? scan->capacity * 2 : 1024;
+        struct tier_candidate *candidates =
+            realloc(scan->candidates, capacity * sizeof(*candidates));
+        if (candidates == NULL)
+            return -ENOMEM;
+
+        scan->candidates = candidates;
+        scan->capacity   = capacity;
+    }
+
+    struct tier_candidate *candidate = &scan->candidates[scan->n_candidates++];
+    memcpy(candidate->hash, hash, SHARD_FN_LEN + 1);
+    candidate->bytes = (uint64_t)st->st_blocks * 512;
+    candidate->hits  = 0;
+    candidate->last  = st->st_atime > st->st_mtime ? st->st_atime : st->st_mtime;
+
+    // Access times on disk may be coarse or off, what this mount saw is more recent
+    pthread_mutex_lock(&tier_table_lock);
+    struct tier_entry *entry = _find(hash);
+    if (entry != NULL) {
+        candidate->hits = entry->hits;
+        if (entry->last > candidate->last)
+            candidate->last = entry->last;
+    }
+    pthread_mutex_unlock(&tier_table_lock);
+
+    scan->used += candidate->bytes;
+
+    return tier_running ? 0 : -EINTR;
+}
+
+static int _colder(const void *a, const void *b)
+{
+    const struct tier_candidate *x = a, *y = b;
+
+    if (x->hits != y->hits)
+        return x->hits < y->hits ? -1 : 1;
+
+    return x->last < y->last ? -1 : x->last > y->last;
+}
+
+static int _hotter(const void *a, const void *b)
+{
+    return _colder(b, a);
+}
+
+static void _demote(char *buf)
+{
+    // Pass over the fast tier, moving cold shards down and the coldest while it is over budget
+    struct tier_scan scan = {NULL, 0, 0, 0};
+    if (fanout_walk(shardpoint, ".shard", _collect, &scan) != 0) {
+        free(scan.candidates);
+        return;
+    }
+
+    qsort(scan.candidates, scan.n_candidates, sizeof(struct tier_candidate), _colder);
+
+    pthread_mutex_lock(&tier_table_lock);
+    stats.fast_shards = scan.n_candidates;
+    stats.fast_used   = scan.used;
+    pthread_mutex_unlock(&tier_table_lock);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    time_t now      = time(NULL);
+    uint64_t used   = scan.used;
+    uint64_t copied = 0;
+
+    for (size_t i = 0; i < scan.n_candidates && tier_running; i++) {
+        struct tier_candidate *candidate = &scan.candidates[i];
+
+        // Shards used in the last pass stay on the fast tier even when it is over budget
+        int cold = now - candidate->last >= tier_cold_age;
+        int over = tier_fast_size > 0 && used > (uint64_t)tier_fast_size;
+        if (!cold && (!over || now - candidate->last < TIER_SCAN_INTERVAL))
+            continue;
+
+        if (_move(candidate->hash, TIER_FAST, TIER_CAPACITY, buf, &copied, &start) == 0)
+            used -= candidate->bytes;
+    }
+
+    free(scan.candidates);
+}
+
+static void _promote(char *buf)
+{
+    // Hot shards are copied out of the table first, since moving them takes the table lock
+    struct tier_scan scan = {NULL, 0, 0, 0};
+
+    pthread_mutex_lock(&tier_table_lock);
+    for (size_t i = 0; i < table_capacity; i++) {
+        struct tier_entry *entry = &table[i];
+        if (entry->hash[0] == '\0' || entry->tier != TIER_CAPACITY ||
+            entry->hits < TIER_PROMOTE_HITS)
+            continue;
+
+        if (scan.n_candidates == scan.capacity) {
+            size_t capacity = scan.capacity > 0 ? scan.capacity * 2 : 64;
+            struct tier_candidate *candidates =
+                realloc(scan.candidates, capacity * sizeof(*candidates));
+            if (candidates == NULL)
+                break;
+
+            scan.candidates = candidates;
+            scan.capacity   = capacity;
+        }
+
+        struct tier_candidate *candidate = &scan.candidates[scan.n_candidates++];
+        memcpy(candidate->hash, entry->hash, SHARD_FN_LEN + 1);
+        candidate->hits = entry->hits;
+        candidate->last = entry->last;
+    }
+    pthread_mutex_unlock(&tier_table_lock);
+
+    qsort(scan.candidates, scan.n_candidates, sizeof(struct tier_candidate), _hotter);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t copied = 0;
+
+    for (size_t i = 0; i < scan.n_candidates && tier_running; i++) {
+        char path[fanout_path_len(capacity_base, ".shard")];
+        get_fanout_path(capacity_base, scan.candidates[i].hash, ".shard", path);
+
+        struct stat st;
+        if (stat(path, &st) == -1)
+            continue;
+
+        // A full fast tier takes nothing back, or the next pass would only move it down again
+        pthread_mutex_lock(&tier_table_lock);
+        int fits = tier_fast_size <= 0 ||
+                   stats.fast_used + (uint64_t)st.st_blocks * 512 <= (uint64_t)tier_fast_size;
+        pthread_mutex_unlock(&tier_table_lock);
+
+        if (fits)
+            _move(scan.candidates[i].hash, TIER_CAPACITY, TIER_FAST, buf, &copied, &start);
+    }
+
+    free(scan.candidates);
+}
+
+static void _decay(void)
+{
+    // Reads count for less as they age, and shards not used for tier_cold_age are forgotten
+    pthread_mutex_lock(&tier_table_lock);
+
+    for (size_t i = 0; i < table_capacity; i++)
+        table[i].hits /= 2;
+
+    if (table_capacity > 0)
+        _rehash(table_capacity, time(NULL) - tier_cold_age);
+
+    pthread_mutex_unlock(&tier_table_lock);
+}
+
+static void *_tier_loop(void *arg)
+{
+    (void)arg;
+
+    char *buf = bufpool_get(TIER_COPY_CHUNK);
+    if (buf == NULL)
+        return NULL;
+
+    time_t last_pass = 0;
+
+    pthread_mutex_lock(&tier_table_lock);
+
+    while (tier_running) {
+        if (time(NULL) - last_pass >= TIER_SCAN_INTERVAL) {
+            pthread_mutex_unlock(&tier_table_lock);
+            _demote(buf);
+            _decay();
+            pthread_mutex_lock(&tier_table_lock);
+
+            last_pass = time(NULL);
+        }
+
+        // Reads that make a shard hot wake the thread, so that it moves up while still in use
+        if (promote_pending && tier_running) {
+            promote_pending = 0;
+
+            pthread_mutex_unlock(&tier_table_lock);
+            _promote(buf);
+            pthread_mutex_lock(&tier_table_lock);
+        }
+
+        if (tier_running && !promote_pending) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&tier_cond, &tier_table_lock, &deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&tier_table_lock);
+
+    bufpool_put(buf, TIER_COPY_CHUNK);
+    bufpool_trim();
+
+    return NULL;
+}
+
+static void _init_locks(void)
+{
+    // A process that opens one store after another keeps the same locks
+    for (int i = 0; i < TIER_LOCKS; i++)
+        pthread_mutex_init(&shard_locks[i], NULL);
+}
+
+int tier_start(void)
+{
+    if (capacity_tier == NULL)
+        return 0;
+
+    size_t len    = strlen(capacity_tier);
+    capacity_base = malloc(len + 2);
+    if (capacity_base == NULL)
+        return -ENOMEM;
+
+    strcpy(capacity_base, capacity_tier);
+    if (len == 0 || capacity_base[len - 1] != '/')
+        strcat(capacity_base, "/");
+
+    if (mkdir_if_not_exists(capacity_base, 0700) != 0 && errno != EEXIST) {
+        int res = -errno;
+        free(capacity_base);
+        capacity_base = NULL;
+        return res;
+    }
+
+    pthread_once(&shard_locks_once, _init_locks);
+
+    tier_running = 1;
+    if (pthread_create(&tier_thread, NULL, _tier_loop, NULL) != 0) {
+        tier_running = 0;
+        free(capacity_base);
+        capacity_base = NULL;
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+void tier_stop(void)
+{
+    if (tier_running) {
+        pthread_mutex_lock(&tier_table_lock);
+        tier_running = 0;
+        pthread_cond_signal(&tier_cond);
+        pthread_mutex_unlock(&tier_table_lock);
+
+        pthread_join(tier_thread, NULL);
+    }
+
+    // Nothing of this store's capacity tier is carried over to the next one opened
+    pthread_mutex_lock(&tier_table_lock);
+
+    free(table);
+    table           = NULL;
+    table_capacity  = 0;
+    table_count     = 0;
+    promote_pending = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    pthread_mutex_unlock(&tier_table_lock);
+
+    free(capacity_base);
+    capacity_base = NULL;
+}
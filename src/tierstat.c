@@ -0,0 +1,96 @@
+/*
+* FILENAME: tierstat.c
+*
+* DESCRIPTION: Command line tool that prints the read and migration counters of
+*              the storage tiers of a DEFFS mount, and the share of shard reads
+*              each tier served. The counters are read through an ioctl on any
+*              file or directory in the mount and cover the time since it was
+*              mounted.
+*
+* USAGE: cmake --build ./ --target DEFFS-tierstat -- -j 6
+*        ./bin/DEFFS-tierstat ~/deffs
+*
+* AUTHOR: Charles Averill
+*/
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tierstat.h"
+
+const char *argp_program_version     = "DEFFS-tierstat 0.0.2";
+const char *argp_program_bug_address = "charles.averill@utdallas.edu";
+static char doc[]                    = "Print the storage tier counters of a DEFFS mount";
+static char args_doc[]               = "PATH";
+
+static struct argp_option options[] = {{0}};
+
+static error_t parse_tierstat_opt(int key, char *arg, struct argp_state *state)
+{
+    char **path = state->input;
+
+    switch (key) {
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 0)
+            argp_usage(state);
+        *path = arg;
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_usage(state);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static struct argp argp = {options, parse_tierstat_opt, args_doc, doc, 0, 0, 0};
+
+static double _percent(uint64_t part, uint64_t whole)
+{
+    return whole > 0 ? 100.0 * part / whole : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *path;
+    argp_parse(&argp, argc, argv, 0, 0, &path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("Could not open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    struct deffs_tier_stats stats;
+    if (ioctl(fd, DEFFS_IOC_TIER_STATS, &stats) == -1) {
+        printf("Could not read the tier counters of %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    close(fd);
+
+    uint64_t reads = stats.fast_reads + stats.capacity_reads;
+
+    printf("Fast tier reads:     %llu (%.1f%%), %llu MiB\n", (unsigned long long)stats.fast_reads,
+           _percent(stats.fast_reads, reads), (unsigned long long)(stats.fast_bytes >> 20));
+    printf("Capacity tier reads: %llu (%.1f%%), %llu MiB\n",
+           (unsigned long long)stats.capacity_reads, _percent(stats.capacity_reads, reads),
+           (unsigned long long)(stats.capacity_bytes >> 20));
+    printf("Promoted:            %llu shards, %llu MiB\n", (unsigned long long)stats.promoted,
+           (unsigned long long)(stats.promoted_bytes >> 20));
+    printf("Demoted:             %llu shards, %llu MiB\n", (unsigned long long)stats.demoted,
+           (unsigned long long)(stats.demoted_bytes >> 20));
+    printf("Fast tier holds:     %llu shards, %llu MiB\n", (unsigned long long)stats.fast_shards,
+           (unsigned long long)(stats.fast_used >> 20));
+
+    return 0;
+}
@@ -10,31 +10,43 @@
 
 const char *deffs_path_prepend(const char originalPath[], char to_prepend[])
 {
-    // Prepend to_prepend to originalPath
+    // Prepend to_prepend to originalPath. The result lives in a per-thread
+    // buffer, so callers must copy it before calling this again
+    static __thread char newPath[PATH_MAX];
+
     char *pch;
     pch = strstr(originalPath, to_prepend);
     if (pch == NULL) {
-        char newPath[strlen(originalPath) + strlen(to_prepend)];
-        strcpy(newPath, to_prepend);
-        strcat(newPath, originalPath);
+        snprintf(newPath, sizeof(newPath), "%s%s", to_prepend, originalPath);
 
         originalPath = newPath;
     }
+
+    return originalPath;
 }
 
-void random_string(char output[], int length)
+int random_string(char output[], int length)
 {
-    // Fill output with random string of len length
+    // Fill output with random string of len length. Waits for the kernel's entropy pool, and
+    // fails rather than return characters that are not random
     char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-";
 
-    unsigned int tmp_rand;
+    unsigned char tmp_rand[length];
+
+    for (ssize_t got = 0, n; got < length; got += n) {
+        n = getrandom(tmp_rand + got, length - got, 0);
+        if (n == -1 && errno != EINTR)
+            return -errno;
+        n = n == -1 ? 0 : n;
+    }
 
     for (int i = 0; i < length; i++) {
-        getrandom(&tmp_rand, sizeof(unsigned int), GRND_NONBLOCK);
-        output[i] = charset[tmp_rand % (sizeof(charset) - 1)];
+        output[i] = charset[tmp_rand[i] % (sizeof(charset) - 1)];
     }
 
     output[length] = '\0';
+
+    return 0;
 }
 
 int mkdir_if_not_exists(char path[], mode_t mode)
@@ -44,6 +56,42 @@ int mkdir_if_not_exists(char path[], mode_t mode)
     ;
 }
 
+int sync_dir(const char path[])
+{
+    // Makes the names created, renamed or removed in a directory survive a crash
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return -errno;
+
+    int res = fsync(fd) == -1 ? -errno : 0;
+    close(fd);
+
+    return res;
+}
+
+size_t hash_bucket(const char hash[], size_t n_buckets)
+{
+    // Shard names are hex SHA-256 digests, so any prefix is already well mixed.
+    // n_buckets must be a power of two
+    char prefix[17];
+    memcpy(prefix, hash, 16);
+    prefix[16] = '\0';
+
+    return strtoull(prefix, NULL, 16) & (n_buckets - 1);
+}
+
+uint64_t path_hash(const char path[])
+{
+    // FNV-1a, for paths and other names that are not already digests
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
 int ends_with(const char str[], const char suffix[])
 {
     size_t str_len    = strlen(str);